@@ -0,0 +1,145 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ *
+ * Times reading a compressed file through libntfs-3g's decoder against ntfsrec's, on one thread and
+ * on a pool, and checks they read the same bytes. libntfs-3g only exposes its decoder through
+ * ntfs_attr_pread, so both sides are timed as whole reads, after a first pass has put the image in
+ * the page cache so that decoding is what's left to measure.
+ *
+ * Usage: lznt1_bench <image> <path of a compressed file> [runs] [read KB]
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_compressed.h"
+#include <unistd.h>
+
+struct bench_result {
+    double best;
+    unsigned int matched;
+};
+
+static double bench_clock(void) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Reads the whole attribute runs times, through reader if given or else the library, keeping the best time */
+static struct bench_result bench_read(ntfs_attr *data_attribute, struct ntfsrec_compressed *reader, unsigned int runs,
+                                      s64 request, unsigned char *buffer, const unsigned char *expected) {
+    struct bench_result result = { 0, NR_TRUE };
+    unsigned int run;
+    
+    for(run = 0; run < runs; ++run) {
+        double started = bench_clock(), elapsed;
+        s64 offset = 0, bytes_read;
+        
+        while(offset < data_attribute->data_size) {
+            if (reader != NULL)
+                bytes_read = ntfsrec_compressed_pread(reader, offset, request, &buffer[offset]);
+            else
+                bytes_read = ntfs_attr_pread(data_attribute, offset, request, &buffer[offset]);
+            
+            if (bytes_read <= 0) {
+                printf("Error: read failed at %lld\n", (long long)offset);
+                result.matched = NR_FALSE;
+                return result;
+            }
+            
+            offset += bytes_read;
+        }
+        
+        elapsed = bench_clock() - started;
+        
+        if (run == 0 || elapsed < result.best)
+            result.best = elapsed;
+        
+        if (expected != NULL && memcmp(buffer, expected, data_attribute->data_size) != 0)
+            result.matched = NR_FALSE;
+    }
+    
+    return result;
+}
+
+static void bench_report(const char *name, struct bench_result result, s64 size) {
+    printf("%-28s %9.1f ms %9.1f MB/s%s\n", name, result.best * 1000, size / result.best / 1e6,
+           result.matched ? "" : "  MISMATCH");
+}
+
+int main(int argc, char **argv) {
+    unsigned int runs = argc > 3 ? (unsigned int)atoi(argv[3]) : 5;
+    s64 request = (argc > 4 ? atoi(argv[4]) : 256) * 1024LL;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned char *expected, *buffer;
+    struct ntfsrec_decode_pool *pool;
+    struct ntfsrec_compressed *reader;
+    struct bench_result library, single, parallel;
+    ntfs_attr *data_attribute;
+    ntfs_volume *volume;
+    ntfs_inode *inode;
+    
+    if (argc < 3 || runs == 0 || request <= 0) {
+        puts("Usage: lznt1_bench <image> <path of a compressed file> [runs] [read KB]");
+        return 2;
+    }
+    
+    volume = ntfs_mount(argv[1], NTFS_MNT_RDONLY);
+    
+    if (volume == NULL) {
+        printf("Error: unable to mount %s\n", argv[1]);
+        return 1;
+    }
+    
+    inode = ntfs_pathname_to_inode(volume, NULL, argv[2]);
+    data_attribute = inode != NULL ? ntfs_attr_open(inode, AT_DATA, AT_UNNAMED, 0) : NULL;
+    
+    if (data_attribute == NULL || !NAttrCompressed(data_attribute)) {
+        printf("Error: %s isn't a compressed file on %s\n", argv[2], argv[1]);
+        return 1;
+    }
+    
+    expected = ntfsrec_allocate(data_attribute->data_size);
+    buffer = ntfsrec_allocate(data_attribute->data_size);
+    
+    /* The first pass fills the page cache and is the reference every other read is checked against */
+    if (!bench_read(data_attribute, NULL, 1, request, expected, NULL).matched)
+        return 1;
+    
+    library = bench_read(data_attribute, NULL, runs, request, buffer, expected);
+    
+    reader = ntfsrec_compressed_open(data_attribute, NULL);
+    
+    if (reader == NULL) {
+        printf("Error: ntfsrec can't decode %s itself\n", argv[2]);
+        return 1;
+    }
+    
+    single = bench_read(data_attribute, reader, runs, request, buffer, expected);
+    ntfsrec_compressed_close(reader);
+    
+    pool = online > 1 ? ntfsrec_decode_pool_create((unsigned int)online - 1) : NULL;
+    reader = ntfsrec_compressed_open(data_attribute, pool);
+    parallel = bench_read(data_attribute, reader, runs, request, buffer, expected);
+    ntfsrec_compressed_close(reader);
+    
+    if (pool != NULL)
+        ntfsrec_decode_pool_free(pool);
+    
+    printf("%s: %lld bytes, %lld on disk, %lld KB reads, best of %u\n", argv[2], (long long)data_attribute->data_size,
+           (long long)data_attribute->compressed_size, (long long)request / 1024, runs);
+    
+    bench_report("libntfs-3g", library, data_attribute->data_size);
+    bench_report("ntfsrec, 1 thread", single, data_attribute->data_size);
+    bench_report(online > 1 ? "ntfsrec, pool" : "ntfsrec, pool (1 CPU, none)", parallel, data_attribute->data_size);
+    
+    free(expected);
+    free(buffer);
+    ntfs_attr_close(data_attribute);
+    ntfs_inode_close(inode);
+    ntfs_umount(volume, FALSE);
+    
+    return single.matched && parallel.matched ? 0 : 1;
+}
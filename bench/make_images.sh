@@ -0,0 +1,137 @@
+#!/bin/sh
+#
+# ntfsrec - Recovery utility for damaged NTFS filesystems
+# Andrew Watts - 2015 <andrew@andrewwatts.info>
+#
+# Builds the synthetic NTFS images the benchmarks run against, or only the ones named. Needs mkntfs,
+# ntfs-3g, setfattr and the right to mount through FUSE (usually root). Images that already exist
+# are left alone, so delete one to rebuild it. Contents are generated deterministically, every
+# build copies the same bytes.
+#
+
+set -eu
+
+DIR=${1:?usage: make_images.sh <directory> [image...]}
+MNT="$DIR/mnt"
+
+shift
+ONLY="$*"
+
+mkdir -p "$DIR"
+
+unmount() {
+    umount "$MNT" 2>/dev/null || fusermount -u "$MNT"
+}
+
+# Writes files of the given sizes from "path size" lines on stdin in a single process
+write_files() {
+    awk '{
+        line = "ntfsrec benchmark data for " $1 "\n"
+        for(left = $2; left > 0; left -= length(line)) {
+            if (left < length(line))
+                line = substr(line, 1, left)
+            printf "%s", line > $1
+        }
+        printf "" > $1
+        close($1)
+    }'
+}
+
+# Many small files spread over 100 directories
+populate_small() {
+    awk 'BEGIN { for(d = 0; d < 100; d++) print "dir" d }' | xargs mkdir
+    awk 'BEGIN { for(d = 0; d < 100; d++) for(f = 0; f < 200; f++) print "dir" d "/file" f ".txt", (d * 200 + f) * 7919 % 16384 + 1 }' | write_files
+}
+
+# A few large files written a megabyte at a time in turn, so their extents interleave
+populate_fragmented() {
+    echo "chunk 1048576" | write_files
+    
+    for chunk in $(seq 1 128); do
+        for file in 0 1 2 3; do
+            cat chunk >> "fragmented$file.bin"
+        done
+    done
+    
+    rm chunk
+}
+
+# Files that are mostly holes with a little data at scattered offsets
+populate_sparse() {
+    echo "chunk 1048576" | write_files
+    
+    for file in 0 1 2 3; do
+        truncate -s 1G "sparse$file.bin"
+        
+        for offset in 0 100 333 700 1000; do
+            dd if=chunk of="sparse$file.bin" bs=1M seek=$((offset + file)) conv=notrunc 2>/dev/null
+        done
+    done
+    
+    rm chunk
+}
+
+# 64 levels of nested directories with a couple of files at each
+populate_deep() {
+    path=.
+    
+    for level in $(seq 0 63); do
+        path="$path/level$level"
+        mkdir "$path"
+        printf '%s 4096\n%s 100\n' "$path/a.txt" "$path/b.txt" | write_files
+    done
+}
+
+# One directory with a hundred thousand entries
+populate_bigdir() {
+    mkdir big
+    awk 'BEGIN { for(f = 0; f < 100000; f++) print "big/entry" f ".dat", f % 512 }' | write_files
+}
+
+# One directory marked compressed, so ntfs-3g stores what's written into it as LZNT1
+populate_compressed() {
+    mkdir packed
+    setfattr -h -n system.ntfs_attrib_be -v 0x00000810 packed
+    echo "packed/text.log 268435456" | write_files
+    awk 'BEGIN { srand(1); for(line = 0; line < 4000000; line++) printf "%08d %6d %08x\n", line, int(rand() * 1000000), int(rand() * 4294967296) }' > packed/numbers.log
+}
+
+# build <name> <size> [mount options]
+build() {
+    name=$1
+    image="$DIR/$name.img"
+    
+    case " ${ONLY:-$name} " in
+        *" $name "*) ;;
+        *) return 0 ;;
+    esac
+    
+    if [ -f "$image" ]; then
+        return 0
+    fi
+    
+    echo "Building $image"
+    
+    rm -f "$image.tmp"
+    truncate -s "$2" "$image.tmp"
+    mkntfs -F -f -q -L "$name" "$image.tmp"
+    
+    mkdir -p "$MNT"
+    ntfs-3g ${3:+-o "$3"} "$image.tmp" "$MNT"
+    
+    if ! (cd "$MNT" && "populate_$name"); then
+        unmount
+        echo "Error: unable to populate $image" >&2
+        exit 1
+    fi
+    
+    unmount
+    mv "$image.tmp" "$image"
+}
+
+build small 1G
+build fragmented 1G
+build sparse 8G
+build deep 64M
+build bigdir 1G
+build compressed 1G compression
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# ntfsrec - Recovery utility for damaged NTFS filesystems
+# Andrew Watts - 2015 <andrew@andrewwatts.info>
+#
+# Summarises a results file from run.sh, or compares two of them, using the fastest run of each
+# command. Copies also show the output written per second.
+#
+#   report.sh results-<commit>.jsonl [results-<other commit>.jsonl]
+#
+
+set -eu
+
+if [ $# -lt 1 ] || [ $# -gt 2 ]; then
+    echo "usage: report.sh <results> [<results to compare>]" >&2
+    exit 1
+fi
+
+awk '
+function field(line, name,    start) {
+    if (!match(line, "\"" name "\":(\"[^\"]*\"|[^,}]*)"))
+        return ""
+    
+    start = RSTART + length(name) + 3
+    line = substr(line, start, RLENGTH - length(name) - 3)
+    gsub(/"/, "", line)
+    return line
+}
+
+FNR == 1 {
+    ++file
+}
+
+{
+    key = field($0, "case") SUBSEP field($0, "step") SUBSEP field($0, "command")
+    ms = field($0, "ms") + 0
+    
+    if (!(key in order))
+        order[key] = ++keys
+    
+    name[order[key]] = key
+    
+    if ((file, key) in best && best[file, key] <= ms)
+        next
+    
+    best[file, key] = ms
+    ok[file, key] = field($0, "ok")
+    bytes[file, key] = field($0, "output_bytes")
+}
+
+function cell(file, key) {
+    if (!((file, key) in best))
+        return sprintf("%12s", "-")
+    
+    if (bytes[file, key] != "" && best[file, key] > 0)
+        return sprintf("%9.1f ms %7.1f MB/s", best[file, key], bytes[file, key] / best[file, key] / 1000)
+    
+    return sprintf("%9.1f ms%s", best[file, key], ok[file, key] == "true" ? "" : " (failed)")
+}
+
+END {
+    for(index_ = 1; index_ <= keys; ++index_) {
+        split(name[index_], part, SUBSEP)
+        line = sprintf("%-18s %3s %-6s %s", part[1], part[2], part[3], cell(1, name[index_]))
+        
+        if (file > 1) {
+            line = line "  ->  " cell(2, name[index_])
+            
+            if ((1, name[index_]) in best && (2, name[index_]) in best && best[1, name[index_]] > 0)
+                line = line sprintf("  %+6.1f%%", (best[2, name[index_]] - best[1, name[index_]]) * 100 / best[1, name[index_]])
+        }
+        
+        print line
+    }
+}' "$@"
@@ -0,0 +1,116 @@
+#!/bin/sh
+#
+# ntfsrec - Recovery utility for damaged NTFS filesystems
+# Andrew Watts - 2015 <andrew@andrewwatts.info>
+#
+# Runs every benchmark case against the synthetic images and appends one JSON line per command to
+# <work>/results-<commit>.jsonl. Each case is a separate ntfsrec process started with a cold page
+# cache when we're allowed to drop it. BENCH_RUNS sets the repetitions and BENCH_CASES a substring
+# the case names have to contain. Compare two result files with report.sh.
+#
+
+set -eu
+
+NTFSREC=${1:?usage: run.sh <ntfsrec binary> <work directory>}
+WORK=${2:?usage: run.sh <ntfsrec binary> <work directory>}
+RUNS=${BENCH_RUNS:-3}
+CASES=${BENCH_CASES:-}
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+mkdir -p "$WORK"
+WORK=$(cd "$WORK" && pwd)
+NTFSREC=$(cd "$(dirname "$NTFSREC")" && pwd)/$(basename "$NTFSREC")
+
+sh "$HERE/make_images.sh" "$WORK/images"
+
+COMMIT=$(git -C "$HERE" rev-parse --short HEAD 2>/dev/null || echo unknown)
+RESULTS="$WORK/results-$COMMIT.jsonl"
+OUT="$WORK/out"
+PLANS="$WORK/plans"
+
+: > "$RESULTS"
+mkdir -p "$PLANS"
+
+# Simulated damage for the fault cases: a bad sector every 8 MB and a slow region every 32 MB
+awk 'BEGIN { for(offset = 64; offset < 1024; offset += 8) printf "error %d 4096\n", offset * 1048576 + 12288 }' > "$PLANS/errors"
+awk 'BEGIN { for(offset = 64; offset < 1024; offset += 32) printf "delay %d 65536 50\n", offset * 1048576 }' > "$PLANS/slow"
+awk 'BEGIN { for(offset = 64; offset < 1024; offset += 8) printf "error %d 4096 2\n", offset * 1048576 + 12288 }' > "$PLANS/transient"
+
+cold=false
+
+drop_caches() {
+    sync
+    
+    if echo 3 > /proc/sys/vm/drop_caches 2>/dev/null; then
+        cold=true
+    fi
+}
+
+# bench <case> <image> <fault plan or -> <commands>
+bench() {
+    case "$1" in
+        *$CASES*) ;;
+        *) return 0 ;;
+    esac
+    
+    plan=
+    
+    if [ "$3" != "-" ]; then
+        plan="$PLANS/$3"
+    fi
+    
+    run=1
+    
+    while [ "$run" -le "$RUNS" ]; do
+        rm -rf "$OUT"
+        mkdir -p "$OUT"
+        drop_caches
+        
+        echo "$1 ($run/$RUNS)"
+        
+        (cd "$OUT" && "$NTFSREC" --json ${plan:+--faults "$plan"} -c "$4" "$WORK/images/$2.img") \
+            > "$WORK/last.jsonl" 2>> "$WORK/bench.log" || true
+        
+        # Copies also record how much they wrote, so the report can turn times into throughput
+        bytes=$(du -sb "$OUT" | cut -f1)
+        
+        awk -v prefix="\"commit\":\"$COMMIT\",\"case\":\"$1\",\"image\":\"$2\",\"run\":$run,\"cold\":$cold" -v bytes="$bytes" '{
+            extra = prefix ",\"step\":" NR
+            
+            if ($0 ~ /^\{"command":"(cp|cpz|tar)"/)
+                extra = extra ",\"output_bytes\":" bytes
+            
+            print "{" extra "," substr($0, 2)
+        }' "$WORK/last.jsonl" >> "$RESULTS"
+        
+        run=$((run + 1))
+    done
+}
+
+DEEP=$(awk 'BEGIN { for(level = 0; level < 64; level++) printf "level%d/", level }')
+
+bench ls-small        small      -         "ls -s none; ls; cd dir50; ls -s size"
+bench cp-small        small      -         "cp copy"
+bench cp-small-j4     small      -         "cp -j 4 copy"
+bench cp-small-e      small      -         "cp -e copy"
+bench cpz-small       small      -         "cpz -j 4 small.zip"
+bench tar-small       small      -         "tar small.tar"
+bench cp-fragmented   fragmented -         "cp copy"
+bench cp-fragmented-e fragmented -         "cp -e copy"
+bench tar-fragmented  fragmented -         "tar fragmented.tar"
+bench cp-sparse       sparse     -         "cp copy"
+bench cp-compressed   compressed -         "cp copy"
+bench cp-compressed-j4 compressed -        "cp -j 4 copy"
+bench tar-compressed  compressed -         "tar compressed.tar"
+bench cd-deep         deep       -         "cd $DEEP; ls; cd /; cd $DEEP"
+bench ls-bigdir       bigdir     -         "ls -s none big; ls big; ls -s time -n 100 big; cd big"
+bench cp-bigdir       bigdir     -         "cp copy"
+bench cp-errors       fragmented errors    "cp copy"
+bench cp-errors-map   fragmented errors    "cp -m copy.map -t 200 copy"
+bench cp-transient    fragmented transient "cp -m copy.map copy"
+bench cp-slow         fragmented slow      "cp copy"
+bench cp-slow-t       fragmented slow      "cp -t 20 copy"
+
+rm -rf "$OUT"
+
+echo "Results in $RESULTS"
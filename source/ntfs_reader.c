@@ -5,6 +5,8 @@
 
 #include "ntfsrec.h"
 #include "ntfs_reader.h"
+#include "ntfsrec_fault.h"
+#include "ntfsrec_cache.h"
 #include <sys/stat.h>
 
 enum ntfsrec_test_device_result {
@@ -28,7 +30,12 @@ int ntfsrec_reader_mount(struct ntfsrec_reader *reader, const char *device_name,
     if (options & NR_MOUNT_OPTION_EXCLUSIVE)
         mount_flags |= NTFS_MNT_EXCLUSIVE;
     
-    reader->mount.volume = ntfs_mount(device_name, NTFS_MNT_RDONLY);
+    if (reader->settings->cache != NULL)
+        reader->mount.volume = ntfsrec_cache_mount(reader->settings->cache, device_name, NTFS_MNT_RDONLY);
+    else if (reader->settings->faults != NULL)
+        reader->mount.volume = ntfsrec_fault_mount(reader->settings->faults, device_name, NTFS_MNT_RDONLY);
+    else
+        reader->mount.volume = ntfs_mount(device_name, NTFS_MNT_RDONLY);
     
     if (reader->mount.volume == NULL) {
         fprintf(reader->settings->log, "Error: unrecoverable fault during mount of %s\n", device_name);
@@ -38,9 +45,22 @@ int ntfsrec_reader_mount(struct ntfsrec_reader *reader, const char *device_name,
     }
     
     reader->mount.name = device_name;
+    reader->mount.options = options;
     return NR_TRUE;
 }
 
+int ntfsrec_reader_require_volume(struct ntfsrec_reader *reader) {
+    if (reader->mount.volume != NULL)
+        return NR_TRUE;
+    
+    if (reader->mount.name == NULL) {
+        fprintf(reader->settings->log, "Error: this needs the device but only an index was given.\n");
+        return NR_FALSE;
+    }
+    
+    return ntfsrec_reader_mount(reader, reader->mount.name, reader->mount.options);
+}
+
 void ntfsrec_reader_release(struct ntfsrec_reader *reader) {
     if (reader->mount.volume != NULL) {
         ntfs_umount(reader->mount.volume, FALSE);
@@ -55,35 +75,41 @@ int ntfsrec_reader_get_file_meta(struct ntfsrec_reader *reader, MFT_REF node_ref
     inode = ntfs_inode_open(reader->mount.volume, node_ref);
     
     if (inode != NULL) {
-        ntfs_attr_search_ctx *search_ctx;
-        
-        search_ctx = ntfs_attr_get_search_ctx(inode, NULL);
-        
-        if (search_ctx != NULL) {
-            if (ntfs_attr_lookup(AT_FILE_NAME, AT_UNNAMED, 0, 0, 0, NULL, 0, search_ctx) == 0) {
-                FILE_NAME_ATTR *filename_attr;
-                
-                filename_attr = (FILE_NAME_ATTR *)((char *)search_ctx->attr + le16_to_cpu(search_ctx->attr->value_offset));
-                
-                if (filename_attr != NULL) {
-                    meta->created = ntfs2timespec(filename_attr->creation_time);
-                    meta->modified = ntfs2timespec(filename_attr->last_data_change_time);
-                    meta->flags = filename_attr->file_attributes;
-                    
-                    result = NR_TRUE;
-                }
-            }
+        result = ntfsrec_reader_get_inode_meta(inode, is_dir, meta);
+        ntfs_inode_close(inode);
+    }
+    
+    return result;
+}
+
+int ntfsrec_reader_get_inode_meta(ntfs_inode *inode, int is_dir, struct ntfsrec_file_meta *meta) {
+    ntfs_attr_search_ctx *search_ctx;
+    int result = NR_FALSE;
+    
+    search_ctx = ntfs_attr_get_search_ctx(inode, NULL);
+    
+    if (search_ctx != NULL) {
+        if (ntfs_attr_lookup(AT_FILE_NAME, AT_UNNAMED, 0, 0, 0, NULL, 0, search_ctx) == 0) {
+            FILE_NAME_ATTR *filename_attr;
             
-            if (!is_dir && ntfs_attr_lookup(AT_DATA, AT_UNNAMED, 0, 0, 0, NULL, 0, search_ctx) == 0) {
-                meta->size = ntfs_get_attribute_value_length(search_ctx->attr);
+            filename_attr = (FILE_NAME_ATTR *)((char *)search_ctx->attr + le16_to_cpu(search_ctx->attr->value_offset));
+            
+            if (filename_attr != NULL) {
+                meta->created = ntfs2timespec(filename_attr->creation_time);
+                meta->modified = ntfs2timespec(filename_attr->last_data_change_time);
+                meta->flags = filename_attr->file_attributes;
                 
                 result = NR_TRUE;
             }
+        }
+        
+        if (!is_dir && ntfs_attr_lookup(AT_DATA, AT_UNNAMED, 0, 0, 0, NULL, 0, search_ctx) == 0) {
+            meta->size = ntfs_get_attribute_value_length(search_ctx->attr);
             
-            ntfs_attr_put_search_ctx(search_ctx);
+            result = NR_TRUE;
         }
-
-        ntfs_inode_close(inode);
+        
+        ntfs_attr_put_search_ctx(search_ctx);
     }
     
     return result;
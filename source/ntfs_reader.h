@@ -23,14 +23,19 @@ struct ntfsrec_reader {
     
     struct {
         const char *name;
+        unsigned int options;
         ntfs_volume *volume;
     } mount;
 };
 
 int ntfsrec_reader_mount(struct ntfsrec_reader *reader, const char *device_name, unsigned int options);
 
+/* Mounts the device named at startup if that was deferred, for sessions working from an index file */
+int ntfsrec_reader_require_volume(struct ntfsrec_reader *reader);
+
 void ntfsrec_reader_release(struct ntfsrec_reader *reader);
 
 int ntfsrec_reader_get_file_meta(struct ntfsrec_reader *reader, MFT_REF node_ref, int is_dir, struct ntfsrec_file_meta *meta);
+int ntfsrec_reader_get_inode_meta(ntfs_inode *inode, int is_dir, struct ntfsrec_file_meta *meta);
 
 #endif
\ No newline at end of file
@@ -6,14 +6,47 @@
 #include "ntfsrec.h"
 #include "ntfs_reader.h"
 #include "ntfsrec_command.h"
+#include "ntfsrec_mft.h"
+#include "ntfsrec_fault.h"
+#include "ntfsrec_cache.h"
 #include <locale.h>
+#include <unistd.h>
+
+#define NR_DEFAULT_CACHE_MB 64
 
 int main(int argc, char **argv) {
     struct ntfsrec_settings settings;
     struct ntfsrec_reader reader;
+    struct ntfsrec_mft_table *table = NULL;
+    const char *device = NULL, *index_path = NULL, *commands = NULL, *script_path = NULL, *fault_path = NULL;
+    unsigned int json = NR_FALSE, cache_size = NR_DEFAULT_CACHE_MB, failures;
+    FILE *script = NULL;
+    int argument;
+    
+    for(argument = 1; argument < argc; ++argument) {
+        if (strcmp(argv[argument], "-i") == 0 && argument + 1 < argc) {
+            index_path = argv[++argument];
+        } else if (strcmp(argv[argument], "-c") == 0 && argument + 1 < argc) {
+            commands = argv[++argument];
+        } else if (strcmp(argv[argument], "-f") == 0 && argument + 1 < argc) {
+            script_path = argv[++argument];
+        } else if (strcmp(argv[argument], "--faults") == 0 && argument + 1 < argc) {
+            fault_path = argv[++argument];
+        } else if (strcmp(argv[argument], "--cache") == 0 && argument + 1 < argc && sscanf(argv[argument + 1], "%u", &cache_size) == 1) {
+            ++argument;
+        } else if (strcmp(argv[argument], "--json") == 0) {
+            json = NR_TRUE;
+        } else if (device == NULL && argv[argument][0] != '-') {
+            device = argv[argument];
+        } else {
+            device = NULL;
+            index_path = NULL;
+            break;
+        }
+    }
 
-    if (argc != 2) {
-        printf("Usage: ntfsrec <device path>\n");
+    if (device == NULL && index_path == NULL) {
+        printf("Usage: ntfsrec [-i <index file>] [-c \"<command>; ...\" | -f <script>] [--json] [--cache <MB>] [--faults <plan>] <device path>\n");
         return 1;
     }
     
@@ -25,17 +58,85 @@ int main(int argc, char **argv) {
     settings.log = stdout;
     settings.verbose = 1;
     
-    reader.settings = &settings;
+    /* Results keep the real stdout to themselves, everything else printed goes to stderr instead */
+    if (json) {
+        int json_fd = dup(STDOUT_FILENO);
+        
+        if (json_fd == -1 || (settings.json = fdopen(json_fd, "w")) == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+            fprintf(stderr, "Error: unable to set up --json output: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    
+    /* An archive streamed to stdout has to be the only thing there, from the first message on */
+    settings.archive_fd = -1;
     
-    if (ntfsrec_reader_mount(&reader, argv[1], 0) == NR_FALSE)
-        return NR_FALSE;
+    if (!json && commands != NULL && ntfsrec_commands_stream_archive(commands)) {
+        settings.archive_fd = dup(STDOUT_FILENO);
+        
+        if (settings.archive_fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+            fprintf(stderr, "Error: unable to set stdout aside for the archive: %s\n", strerror(errno));
+            return 1;
+        }
+    }
     
-    if (settings.verbose)
-        printf("Opened NTFS volume %s\n", argv[1]);
+    if (script_path != NULL) {
+        script = strcmp(script_path, "-") == 0 ? stdin : fopen(script_path, "r");
+        
+        if (script == NULL) {
+            printf("Error: unable to open script %s: %s\n", script_path, strerror(errno));
+            return 1;
+        }
+    }
+    
+    /* Only used to benchmark and exercise the bad-sector paths against healthy images */
+    if (fault_path != NULL) {
+        settings.faults = ntfsrec_fault_load(fault_path, settings.log);
+        
+        if (settings.faults == NULL)
+            return 1;
+    }
+    
+    /* Browsing the same directories again shouldn't mean reading a failing disk again, 0 turns it off */
+    if (cache_size > 0)
+        settings.cache = ntfsrec_cache_create((size_t)cache_size << 20, settings.faults);
+    
+    reader.settings = &settings;
+    
+    if (index_path != NULL) {
+        /* Everything but file data comes from the index, so the device is only mounted once it's needed */
+        table = ntfsrec_mft_table_map(index_path, settings.log);
+        
+        if (table == NULL)
+            return 1;
+        
+        reader.mount.name = device;
+        
+        if (settings.verbose)
+            printf("Opened index %s\n", index_path);
+    } else {
+        if (ntfsrec_reader_mount(&reader, device, 0) == NR_FALSE)
+            return 1;
+        
+        if (settings.verbose)
+            printf("Opened NTFS volume %s\n", device);
+    }
 
-    ntfsrec_process_commands(&reader);
+    failures = ntfsrec_process_commands(&reader, table, commands, script);
     
     ntfsrec_reader_release(&reader);
+    
+    if (script != NULL && script != stdin)
+        fclose(script);
+    
+    if (settings.json != NULL)
+        fclose(settings.json);
+    
+    if (settings.cache != NULL)
+        ntfsrec_cache_free(settings.cache);
+    
+    if (settings.faults != NULL)
+        ntfsrec_fault_free(settings.faults);
         
-    return 0;
-}
\ No newline at end of file
+    return failures > 0 ? 1 : 0;
+}
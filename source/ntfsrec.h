@@ -23,8 +23,10 @@
 #define NR_FALSE 0
 #define NR_TRUE 1
 
+#ifndef __BYTE_ORDER
 #define __LITTLE_ENDIAN 1
 #define __BYTE_ORDER __LITTLE_ENDIAN
+#endif
 
 #include <ntfs-3g/types.h>
 #include <ntfs-3g/attrib.h>
@@ -32,9 +34,25 @@
 #include <ntfs-3g/inode.h>
 #include <ntfs-3g/dir.h>
 
+struct ntfsrec_fault_plan;
+struct ntfsrec_cache;
+
 struct ntfsrec_settings {
     unsigned int verbose;
     FILE *log;
+    
+    /* Receives one JSON line per command with --json, stdout then carries only messages */
+    FILE *json;
+    
+    /* Simulated bad or slow regions applied to every device read, NULL to read the device as is */
+    struct ntfsrec_fault_plan *faults;
+    
+    /* Block cache the volume is mounted through, NULL to read the device directly */
+    struct ntfsrec_cache *cache;
+    
+    /* The real stdout, set aside for tar - while stdout carries messages to stderr, -1 if it isn't */
+    int archive_fd;
+    unsigned int archive_streamed;
 };
 
 #endif
\ No newline at end of file
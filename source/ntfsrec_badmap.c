@@ -0,0 +1,578 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_command.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_copy.h"
+#include "ntfsrec_badmap.h"
+#include "ntfsrec_progress.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/*
+ * The journal is a text file with one record per line:
+ *
+ *   D <mref>                            the file finished its first pass
+ *   B <mref> <offset> <length> <path>   a range of the file's data couldn't be read
+ *   R <mref> <offset> <length>          a later pass recovered a range
+ *
+ * Opening a map replays the journal and rewrites it with only the surviving records.
+ */
+
+struct ntfsrec_badmap_region {
+    MFT_REF mref;
+    s64 offset;
+    s64 length;
+    size_t path;
+};
+
+struct ntfsrec_badmap {
+    FILE *journal;
+    pthread_mutex_t lock;
+    
+    /* Files completed by earlier runs, sorted for lookup */
+    MFT_REF *done;
+    size_t done_count;
+    size_t done_capacity;
+    
+    struct ntfsrec_badmap_region *regions;
+    size_t region_count;
+    size_t region_capacity;
+    
+    /* Set by compacting, and cleared by any region added since */
+    unsigned int sorted;
+    
+    char *paths;
+    size_t paths_length;
+    size_t paths_capacity;
+};
+
+struct ntfsrec_badmap_file {
+    MFT_REF mref;
+    ntfs_inode *inode;
+    ntfs_attr *data;
+    int fd;
+    
+    /* The output's time from the first pass, put back after writing so the file still reads as finished */
+    struct timespec modified;
+};
+
+static void ntfsrec_badmap_load(struct ntfsrec_badmap *map, FILE *file);
+static int ntfsrec_badmap_rewrite(struct ntfsrec_badmap *map, const char *file_name);
+static void ntfsrec_badmap_write_header(FILE *file);
+static void ntfsrec_badmap_compact(struct ntfsrec_badmap *map);
+static void ntfsrec_badmap_push(struct ntfsrec_badmap *map, MFT_REF mref, s64 offset, s64 length, size_t path);
+static size_t ntfsrec_badmap_add_path(struct ntfsrec_badmap *map, const char *path);
+static void ntfsrec_badmap_subtract(struct ntfsrec_badmap *map, MFT_REF mref, s64 offset, s64 length);
+static int ntfsrec_badmap_compare_mref(const void *left, const void *right);
+static int ntfsrec_badmap_compare_region(const void *left, const void *right);
+static int ntfsrec_badmap_file_open(struct ntfsrec_copy *state, struct ntfsrec_badmap_file *file, MFT_REF mref, const char *path);
+static void ntfsrec_badmap_file_close(struct ntfsrec_badmap_file *file);
+
+struct ntfsrec_badmap *ntfsrec_badmap_open(const char *file_name) {
+    struct ntfsrec_badmap *map = ntfsrec_allocate(sizeof *map);
+    FILE *existing;
+    
+    memset(map, 0, sizeof *map);
+    pthread_mutex_init(&map->lock, NULL);
+    
+    if (file_name == NULL)
+        return map;
+    
+    existing = fopen(file_name, "r");
+    
+    if (existing != NULL) {
+        ntfsrec_badmap_load(map, existing);
+        fclose(existing);
+        
+        if (ntfsrec_badmap_rewrite(map, file_name) == NR_FALSE) {
+            printf("Error: unable to rewrite bad-region map %s\n", file_name);
+            ntfsrec_badmap_close(map);
+            return NULL;
+        }
+    }
+    
+    map->journal = fopen(file_name, "a");
+    
+    if (map->journal == NULL) {
+        printf("Error: unable to open bad-region map %s\n", file_name);
+        ntfsrec_badmap_close(map);
+        return NULL;
+    }
+    
+    if (existing == NULL) {
+        ntfsrec_badmap_write_header(map->journal);
+        fflush(map->journal);
+    }
+    
+    return map;
+}
+
+void ntfsrec_badmap_close(struct ntfsrec_badmap *map) {
+    if (map->journal != NULL)
+        fclose(map->journal);
+    
+    pthread_mutex_destroy(&map->lock);
+    
+    free(map->done);
+    free(map->regions);
+    free(map->paths);
+    free(map);
+}
+
+int ntfsrec_badmap_is_done(struct ntfsrec_badmap *map, MFT_REF mref) {
+    return bsearch(&mref, map->done, map->done_count, sizeof *map->done, &ntfsrec_badmap_compare_mref) != NULL;
+}
+
+void ntfsrec_badmap_mark_done(struct ntfsrec_badmap *map, MFT_REF mref) {
+    if (map->journal == NULL)
+        return;
+    
+    pthread_mutex_lock(&map->lock);
+    
+    fprintf(map->journal, "D %016llx\n", (unsigned long long)mref);
+    fflush(map->journal);
+    
+    pthread_mutex_unlock(&map->lock);
+}
+
+void ntfsrec_badmap_add(struct ntfsrec_badmap *map, MFT_REF mref, s64 offset, s64 length, const char *path) {
+    pthread_mutex_lock(&map->lock);
+    
+    ntfsrec_badmap_push(map, mref, offset, length, ntfsrec_badmap_add_path(map, path));
+    
+    if (map->journal != NULL) {
+        fprintf(map->journal, "B %016llx 0x%llx 0x%llx %s\n", (unsigned long long)mref, (long long)offset, (long long)length, path);
+        fflush(map->journal);
+    }
+    
+    pthread_mutex_unlock(&map->lock);
+}
+
+void ntfsrec_badmap_regions(struct ntfsrec_badmap *map, MFT_REF mref, void *context, ntfsrec_badmap_visitor visitor) {
+    size_t low = 0, high;
+    
+    if (!map->sorted)
+        ntfsrec_badmap_compact(map);
+    
+    high = map->region_count;
+    
+    /* The first region of the file, or where it would be */
+    while(low < high) {
+        size_t middle = low + (high - low) / 2;
+        
+        if (map->regions[middle].mref < mref)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    
+    for(; low < map->region_count && map->regions[low].mref == mref; ++low)
+        visitor(context, map->regions[low].offset, map->regions[low].length);
+}
+
+size_t ntfsrec_badmap_pending(struct ntfsrec_badmap *map, s64 *bytes) {
+    size_t index, count = 0;
+    
+    *bytes = 0;
+    
+    for(index = 0; index < map->region_count; ++index) {
+        if (map->regions[index].length == 0)
+            continue;
+        
+        *bytes += map->regions[index].length;
+        count++;
+    }
+    
+    return count;
+}
+
+s64 ntfsrec_badmap_retry(struct ntfsrec_copy *state, struct ntfsrec_badmap *map, unsigned int block_size) {
+    struct ntfsrec_badmap_file file;
+    size_t index, count;
+    s64 recovered = 0;
+    unsigned int buffer_size = block_size > state->volume->mft_record_size ? block_size : state->volume->mft_record_size;
+    char *buffer = ntfsrec_allocate(buffer_size);
+    
+    file.inode = NULL;
+    file.data = NULL;
+    file.fd = -1;
+    file.mref = 0;
+    
+    /* Sorting by file and offset means every file is opened once and read front to back */
+    ntfsrec_badmap_compact(map);
+    count = map->region_count;
+    
+    for(index = 0; index < count; ++index) {
+        struct ntfsrec_badmap_region region = map->regions[index];
+        const char *path = &map->paths[region.path];
+        s64 position, end = region.offset + region.length, bad_start = -1, good_start = -1;
+        unsigned int step = block_size, mst = NR_FALSE;
+        
+        if (index == 0 || file.mref != region.mref) {
+            ntfsrec_badmap_file_close(&file);
+            ntfsrec_badmap_file_open(state, &file, region.mref, path);
+        }
+        
+        /* Regions of a file that can't be opened are kept for the next pass */
+        if (file.fd == -1)
+            continue;
+        
+        /* $MFT and $MFTMirr can only be read a whole record at a time for the fixups */
+        if (file.inode != NULL && file.inode->mft_no < 2) {
+            step = state->volume->mft_record_size;
+            mst = NR_TRUE;
+        }
+        
+        /* The region is rebuilt from whatever still fails at this block size */
+        map->regions[index].length = 0;
+        
+        for(position = region.offset; position <= end; position += step) {
+            s64 chunk = end - position < step ? end - position : step, bytes_read = -1;
+            
+            if (position < end) {
+                uint64_t started = ntfsrec_progress_clock();
+                
+                if (file.inode == NULL) {
+                    bytes_read = ntfs_pread(state->volume->dev, position, chunk, buffer);
+                } else if (mst) {
+                    if (ntfs_attr_mst_pread(file.data, position, 1, step, buffer) == 1)
+                        bytes_read = step;
+                } else {
+                    bytes_read = ntfs_attr_pread(file.data, position, chunk, buffer);
+                }
+                
+                ntfsrec_progress_read(state->progress, bytes_read, started);
+                
+                if (bytes_read > 0 && !(state->opt.zero_holes && ntfsrec_is_zero(buffer, bytes_read)) &&
+                    pwrite(file.fd, buffer, bytes_read, position) != bytes_read) {
+                    printf("Error: unable to write to output file %s\n", path);
+                    bytes_read = -1;
+                } else if (bytes_read > 0) {
+                    ntfsrec_progress_write(state->progress, bytes_read);
+                }
+            }
+            
+            /* Consecutive results are merged so the journal gets one line per run, not per block */
+            if (bad_start != -1 && (bytes_read >= 0 || position == end)) {
+                ntfsrec_badmap_push(map, region.mref, bad_start, position - bad_start, region.path);
+                bad_start = -1;
+            }
+            
+            if (good_start != -1 && (bytes_read < 0 || position == end)) {
+                if (map->journal != NULL)
+                    fprintf(map->journal, "R %016llx 0x%llx 0x%llx\n", (unsigned long long)region.mref, (long long)good_start, (long long)(position - good_start));
+                recovered += position - good_start;
+                good_start = -1;
+            }
+            
+            if (position == end)
+                break;
+            
+            if (bytes_read < 0 && bad_start == -1)
+                bad_start = position;
+            else if (bytes_read >= 0 && good_start == -1)
+                good_start = position;
+            
+            if (position + step > end)
+                position = end - step;
+        }
+        
+        if (map->journal != NULL)
+            fflush(map->journal);
+    }
+    
+    ntfsrec_badmap_file_close(&file);
+    ntfsrec_badmap_compact(map);
+    
+    free(buffer);
+    return recovered;
+}
+
+static void ntfsrec_badmap_load(struct ntfsrec_badmap *map, FILE *file) {
+    char *line = NULL;
+    size_t index, kept = 0, line_capacity = 0;
+    ssize_t length_of_line;
+    
+    /* Paths have no length limit, so lines are read whole however long they are */
+    while((length_of_line = getline(&line, &line_capacity, file)) != -1) {
+        unsigned long long mref, offset, length;
+        int consumed = 0;
+        
+        /* A line cut short by an interrupted run is ignored */
+        if (length_of_line == 0 || line[length_of_line - 1] != '\n')
+            continue;
+        
+        line[length_of_line - 1] = '\0';
+        
+        if (line[0] == 'D' && sscanf(line, "D %llx", &mref) == 1) {
+            if (map->done_count == map->done_capacity) {
+                map->done_capacity = map->done_capacity ? map->done_capacity * 2 : 4096;
+                map->done = ntfsrec_reallocate(map->done, map->done_capacity * sizeof *map->done);
+            }
+            
+            map->done[map->done_count++] = mref;
+        } else if (line[0] == 'B' && sscanf(line, "B %llx %llx %llx %n", &mref, &offset, &length, &consumed) == 3 && consumed > 0) {
+            ntfsrec_badmap_push(map, mref, offset, length, ntfsrec_badmap_add_path(map, &line[consumed]));
+        } else if (line[0] == 'R' && sscanf(line, "R %llx %llx %llx", &mref, &offset, &length) == 3) {
+            ntfsrec_badmap_subtract(map, mref, offset, length);
+        }
+    }
+    
+    free(line);
+    qsort(map->done, map->done_count, sizeof *map->done, &ntfsrec_badmap_compare_mref);
+    
+    /* Files that never finished are copied again from scratch, so their regions are stale */
+    for(index = 0; index < map->region_count; ++index) {
+        if (ntfsrec_badmap_is_done(map, map->regions[index].mref))
+            map->regions[kept++] = map->regions[index];
+    }
+    
+    map->region_count = kept;
+    ntfsrec_badmap_compact(map);
+}
+
+static int ntfsrec_badmap_rewrite(struct ntfsrec_badmap *map, const char *file_name) {
+    char *temporary_name = ntfsrec_allocate(strlen(file_name) + sizeof ".tmp");
+    FILE *file;
+    size_t index;
+    int result;
+    
+    sprintf(temporary_name, "%s.tmp", file_name);
+    file = fopen(temporary_name, "w");
+    
+    if (file == NULL) {
+        free(temporary_name);
+        return NR_FALSE;
+    }
+    
+    ntfsrec_badmap_write_header(file);
+    
+    for(index = 0; index < map->done_count; ++index) {
+        if (index == 0 || map->done[index] != map->done[index - 1])
+            fprintf(file, "D %016llx\n", (unsigned long long)map->done[index]);
+    }
+    
+    for(index = 0; index < map->region_count; ++index) {
+        const struct ntfsrec_badmap_region *region = &map->regions[index];
+        
+        fprintf(file, "B %016llx 0x%llx 0x%llx %s\n", (unsigned long long)region->mref, (long long)region->offset,
+                (long long)region->length, &map->paths[region->path]);
+    }
+    
+    result = ferror(file) == 0;
+    
+    if (fclose(file) != 0 || !result || rename(temporary_name, file_name) != 0) {
+        unlink(temporary_name);
+        result = NR_FALSE;
+    }
+    
+    free(temporary_name);
+    return result;
+}
+
+static void ntfsrec_badmap_write_header(FILE *file) {
+    fputs("# ntfsrec bad-region map\n"
+          "# D <mref>                            file copied\n"
+          "# B <mref> <offset> <length> <path>   unreadable data\n"
+          "# R <mref> <offset> <length>          data recovered by a retry pass\n", file);
+}
+
+static void ntfsrec_badmap_compact(struct ntfsrec_badmap *map) {
+    size_t index, kept = 0;
+    
+    qsort(map->regions, map->region_count, sizeof *map->regions, &ntfsrec_badmap_compare_region);
+    
+    for(index = 0; index < map->region_count; ++index) {
+        struct ntfsrec_badmap_region *region = &map->regions[index];
+        
+        if (region->length == 0)
+            continue;
+        
+        if (kept > 0) {
+            struct ntfsrec_badmap_region *last = &map->regions[kept - 1];
+            
+            if (last->mref == region->mref && last->offset + last->length >= region->offset) {
+                if (region->offset + region->length > last->offset + last->length)
+                    last->length = region->offset + region->length - last->offset;
+                
+                continue;
+            }
+        }
+        
+        map->regions[kept++] = *region;
+    }
+    
+    map->region_count = kept;
+    map->sorted = NR_TRUE;
+}
+
+static void ntfsrec_badmap_push(struct ntfsrec_badmap *map, MFT_REF mref, s64 offset, s64 length, size_t path) {
+    struct ntfsrec_badmap_region *region;
+    
+    if (length <= 0)
+        return;
+    
+    map->sorted = NR_FALSE;
+    
+    /* Reads fail in runs, so a region that continues the previous one just extends it */
+    if (map->region_count > 0) {
+        region = &map->regions[map->region_count - 1];
+        
+        if (region->mref == mref && region->offset + region->length == offset) {
+            region->length += length;
+            return;
+        }
+    }
+    
+    if (map->region_count == map->region_capacity) {
+        map->region_capacity = map->region_capacity ? map->region_capacity * 2 : 256;
+        map->regions = ntfsrec_reallocate(map->regions, map->region_capacity * sizeof *map->regions);
+    }
+    
+    region = &map->regions[map->region_count++];
+    region->mref = mref;
+    region->offset = offset;
+    region->length = length;
+    region->path = path;
+}
+
+static size_t ntfsrec_badmap_add_path(struct ntfsrec_badmap *map, const char *path) {
+    size_t length = strlen(path), offset;
+    
+    /* Failures within one file are recorded back to back and share its path */
+    if (map->region_count > 0) {
+        size_t last = map->regions[map->region_count - 1].path;
+        
+        if (strcmp(&map->paths[last], path) == 0)
+            return last;
+    }
+    
+    while(map->paths_capacity - map->paths_length < length + 1) {
+        map->paths_capacity = map->paths_capacity ? map->paths_capacity * 2 : 16384;
+        map->paths = ntfsrec_reallocate(map->paths, map->paths_capacity);
+    }
+    
+    offset = map->paths_length;
+    memcpy(&map->paths[offset], path, length + 1);
+    map->paths_length += length + 1;
+    
+    return offset;
+}
+
+static void ntfsrec_badmap_subtract(struct ntfsrec_badmap *map, MFT_REF mref, s64 offset, s64 length) {
+    const s64 end = offset + length;
+    size_t index, count = map->region_count;
+    
+    for(index = 0; index < count; ++index) {
+        struct ntfsrec_badmap_region *region = &map->regions[index];
+        s64 region_end = region->offset + region->length;
+        
+        if (region->mref != mref || region->length == 0 || region_end <= offset || region->offset >= end)
+            continue;
+        
+        if (region->offset < offset && region_end > end) {
+            size_t path = region->path;
+            
+            /* A recovered range in the middle splits the region in two */
+            region->length = offset - region->offset;
+            ntfsrec_badmap_push(map, mref, end, region_end - end, path);
+        } else if (region->offset < offset) {
+            region->length = offset - region->offset;
+        } else if (region_end > end) {
+            region->length = region_end - end;
+            region->offset = end;
+        } else {
+            region->length = 0;
+        }
+    }
+}
+
+static int ntfsrec_badmap_compare_mref(const void *left, const void *right) {
+    const MFT_REF a = *(const MFT_REF *)left, b = *(const MFT_REF *)right;
+    
+    if (a < b)
+        return -1;
+    
+    return a > b;
+}
+
+static int ntfsrec_badmap_compare_region(const void *left, const void *right) {
+    const struct ntfsrec_badmap_region *a = left, *b = right;
+    
+    if (a->mref != b->mref)
+        return a->mref < b->mref ? -1 : 1;
+    
+    if (a->offset != b->offset)
+        return a->offset < b->offset ? -1 : 1;
+    
+    return 0;
+}
+
+static int ntfsrec_badmap_file_open(struct ntfsrec_copy *state, struct ntfsrec_badmap_file *file, MFT_REF mref, const char *path) {
+    struct stat existing;
+    
+    file->mref = mref;
+    file->data = NULL;
+    file->fd = -1;
+    file->inode = NULL;
+    file->modified.tv_sec = 0;
+    file->modified.tv_nsec = UTIME_OMIT;
+    
+    /* An image is read straight from the device into the same place */
+    if (mref == NR_BADMAP_VOLUME) {
+        file->fd = ntfsrec_open_path(AT_FDCWD, path, O_WRONLY, 0);
+        
+        if (file->fd == -1)
+            printf("Error: unable to reopen %s for another pass\n", path);
+        
+        return file->fd != -1;
+    }
+    
+    file->inode = ntfs_inode_open(state->volume, mref);
+    
+    if (file->inode == NULL) {
+        printf("Error: unable to reopen %s for another pass\n", path);
+        return NR_FALSE;
+    }
+    
+    file->data = ntfs_attr_open(file->inode, AT_DATA, NULL, 0);
+    
+    if (file->data != NULL)
+        file->fd = ntfsrec_open_path(AT_FDCWD, path, O_WRONLY | O_CREAT, 0644);
+    
+    if (file->fd == -1) {
+        printf("Error: unable to reopen %s for another pass\n", path);
+        ntfsrec_badmap_file_close(file);
+        return NR_FALSE;
+    }
+    
+    if (fstat(file->fd, &existing) == 0)
+        file->modified = existing.st_mtim;
+    
+    return NR_TRUE;
+}
+
+static void ntfsrec_badmap_file_close(struct ntfsrec_badmap_file *file) {
+    if (file->fd != -1) {
+        struct timespec times[2] = { { 0, UTIME_OMIT }, file->modified };
+        
+        futimens(file->fd, times);
+        close(file->fd);
+    }
+    
+    if (file->data != NULL)
+        ntfs_attr_close(file->data);
+    
+    if (file->inode != NULL)
+        ntfs_inode_close(file->inode);
+    
+    file->fd = -1;
+    file->data = NULL;
+    file->inode = NULL;
+}
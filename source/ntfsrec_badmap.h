@@ -0,0 +1,40 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_BADMAP_H
+#define _NTFSREC_BADMAP_H
+
+struct ntfsrec_copy;
+struct ntfsrec_badmap;
+
+/* Stands in for a file's reference in regions of the volume itself, whose offsets are device bytes */
+#define NR_BADMAP_VOLUME ((MFT_REF)~0ULL)
+
+/*
+ * A bad-region map records which files finished copying and which byte ranges of them couldn't
+ * be read. It's kept as an append-only text journal so an interrupted copy loses at most a line.
+ * Without a file name the map is only kept in memory, as a list of regions to try again at the end.
+ */
+struct ntfsrec_badmap *ntfsrec_badmap_open(const char *file_name);
+void ntfsrec_badmap_close(struct ntfsrec_badmap *map);
+
+/* Returns NR_TRUE if the file finished copying in an earlier run */
+int ntfsrec_badmap_is_done(struct ntfsrec_badmap *map, MFT_REF mref);
+void ntfsrec_badmap_mark_done(struct ntfsrec_badmap *map, MFT_REF mref);
+
+/* Records length bytes at offset of the file's data, written to path, as unreadable */
+void ntfsrec_badmap_add(struct ntfsrec_badmap *map, MFT_REF mref, s64 offset, s64 length, const char *path);
+
+/* Called with each range of a file that's still unreadable, in offset order */
+typedef void (*ntfsrec_badmap_visitor)(void *context, s64 offset, s64 length);
+void ntfsrec_badmap_regions(struct ntfsrec_badmap *map, MFT_REF mref, void *context, ntfsrec_badmap_visitor visitor);
+
+/* Returns the number of unreadable regions, and their total size in bytes */
+size_t ntfsrec_badmap_pending(struct ntfsrec_badmap *map, s64 *bytes);
+
+/* Re-reads every unreadable region block_size bytes at a time, returns the number of bytes recovered */
+s64 ntfsrec_badmap_retry(struct ntfsrec_copy *state, struct ntfsrec_badmap *map, unsigned int block_size);
+
+#endif
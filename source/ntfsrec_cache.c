@@ -0,0 +1,550 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_fault.h"
+#include "ntfsrec_cache.h"
+#include <ntfs-3g/device.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * Like the fault layer, the device is the library's unix device with read and pread wrapped, and
+ * the operations table sits at the start of the cache so the wrappers can find it from dev->d_ops.
+ *
+ * Blocks live in a segmented LRU: new blocks start on probation and move to the protected list when
+ * they're read again, so a long file copy passing through can only push out other blocks on
+ * probation, not the MFT records and index blocks being browsed.
+ */
+
+#define NR_CACHE_BLOCK_BITS 12
+#define NR_CACHE_BLOCK_SIZE (1 << NR_CACHE_BLOCK_BITS)
+
+/* Reads bigger than this are file data, which goes straight to the device */
+#define NR_CACHE_BYPASS_SIZE (256 * 1024)
+
+/* Read-ahead, in blocks, starts at the minimum on the second sequential miss and doubles from there */
+#define NR_CACHE_MIN_READ_AHEAD 4
+#define NR_CACHE_MAX_READ_AHEAD 64
+
+/* Percentage of the cache the protected list may take */
+#define NR_CACHE_PROTECTED_SHARE 80
+
+enum ntfsrec_cache_segment {
+    NR_CACHE_PROBATION = 0,
+    NR_CACHE_PROTECTED,
+    NR_CACHE_FAILED
+};
+
+struct ntfsrec_cache_block {
+    s64 number;
+    enum ntfsrec_cache_segment segment;
+    
+    /* Set until a block brought in by read-ahead is first asked for */
+    unsigned int read_ahead;
+    
+    struct ntfsrec_cache_block *hash_next;
+    struct ntfsrec_cache_block *prev;
+    struct ntfsrec_cache_block *next;
+    char *data;
+};
+
+struct ntfsrec_cache_list {
+    struct ntfsrec_cache_block *head;
+    struct ntfsrec_cache_block *tail;
+    size_t count;
+};
+
+struct ntfsrec_cache {
+    struct ntfs_device_operations ops;
+    struct ntfsrec_fault_plan *faults;
+    
+    pthread_mutex_t lock;
+    struct ntfsrec_cache_block **buckets;
+    size_t bucket_mask;
+    
+    /* Indexed by segment */
+    struct ntfsrec_cache_list lists[3];
+    size_t capacity;
+    unsigned int retry;
+    
+    /* Block after the end of the last read, and how far ahead sequential misses currently read */
+    s64 next_block;
+    unsigned int window;
+    
+    struct ntfsrec_cache_stats stats;
+};
+
+static s64 ntfsrec_cache_read(struct ntfs_device *dev, void *buffer, s64 count);
+static s64 ntfsrec_cache_pread(struct ntfs_device *dev, void *buffer, s64 count, s64 offset);
+static s64 ntfsrec_cache_lower_pread(struct ntfsrec_cache *cache, struct ntfs_device *dev, void *buffer, s64 count, s64 offset);
+static s64 ntfsrec_cache_fill(struct ntfsrec_cache *cache, struct ntfs_device *dev, s64 number, s64 missing, s64 ahead, char *data);
+static s64 ntfsrec_cache_copy(s64 number, const char *data, s64 length, char *buffer, s64 count, s64 offset);
+
+static struct ntfsrec_cache_block *ntfsrec_cache_lookup(struct ntfsrec_cache *cache, s64 number);
+static int ntfsrec_cache_is_missing(struct ntfsrec_cache *cache, s64 number);
+static s64 ntfsrec_cache_first_failed(struct ntfsrec_cache *cache, s64 number, s64 last);
+static void ntfsrec_cache_insert(struct ntfsrec_cache *cache, s64 number, const char *data, unsigned int read_ahead);
+static void ntfsrec_cache_mark_failed(struct ntfsrec_cache *cache, s64 number);
+static void ntfsrec_cache_touch(struct ntfsrec_cache *cache, struct ntfsrec_cache_block *block);
+static void ntfsrec_cache_remove(struct ntfsrec_cache *cache, struct ntfsrec_cache_block *block);
+static void ntfsrec_cache_push(struct ntfsrec_cache *cache, struct ntfsrec_cache_block *block, enum ntfsrec_cache_segment segment);
+static void ntfsrec_cache_unlink(struct ntfsrec_cache *cache, struct ntfsrec_cache_block *block);
+
+struct ntfsrec_cache *ntfsrec_cache_create(size_t bytes, struct ntfsrec_fault_plan *faults) {
+    struct ntfsrec_cache *cache;
+    size_t buckets = 1;
+    
+    cache = ntfsrec_allocate(sizeof *cache);
+    memset(cache, 0, sizeof *cache);
+    
+    cache->ops = ntfs_device_unix_io_ops;
+    cache->ops.read = &ntfsrec_cache_read;
+    cache->ops.pread = &ntfsrec_cache_pread;
+    cache->faults = faults;
+    
+    cache->capacity = bytes >> NR_CACHE_BLOCK_BITS;
+    
+    if (cache->capacity == 0)
+        cache->capacity = 1;
+    
+    while(buckets < cache->capacity * 2)
+        buckets <<= 1;
+    
+    cache->buckets = ntfsrec_allocate(buckets * sizeof *cache->buckets);
+    memset(cache->buckets, 0, buckets * sizeof *cache->buckets);
+    cache->bucket_mask = buckets - 1;
+    cache->next_block = -1;
+    
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void ntfsrec_cache_free(struct ntfsrec_cache *cache) {
+    ntfsrec_cache_drop(cache);
+    
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+ntfs_volume *ntfsrec_cache_mount(struct ntfsrec_cache *cache, const char *device_name, unsigned long flags) {
+    struct ntfs_device *dev;
+    ntfs_volume *volume;
+    
+    dev = ntfs_device_alloc(device_name, 0, &cache->ops, NULL);
+    
+    if (dev == NULL)
+        return NULL;
+    
+    /* A mounted volume frees its device when unmounted, a failed mount leaves that to us */
+    volume = ntfs_device_mount(dev, flags);
+    
+    if (volume == NULL)
+        ntfs_device_free(dev);
+    
+    return volume;
+}
+
+void ntfsrec_cache_drop(struct ntfsrec_cache *cache) {
+    unsigned int segment;
+    
+    pthread_mutex_lock(&cache->lock);
+    
+    for(segment = NR_CACHE_PROBATION; segment <= NR_CACHE_FAILED; ++segment) {
+        while(cache->lists[segment].head != NULL)
+            ntfsrec_cache_remove(cache, cache->lists[segment].head);
+    }
+    
+    cache->next_block = -1;
+    cache->window = 0;
+    
+    pthread_mutex_unlock(&cache->lock);
+}
+
+size_t ntfsrec_cache_forget_failures(struct ntfsrec_cache *cache) {
+    size_t count;
+    
+    pthread_mutex_lock(&cache->lock);
+    
+    count = cache->lists[NR_CACHE_FAILED].count;
+    
+    while(cache->lists[NR_CACHE_FAILED].head != NULL)
+        ntfsrec_cache_remove(cache, cache->lists[NR_CACHE_FAILED].head);
+    
+    pthread_mutex_unlock(&cache->lock);
+    return count;
+}
+
+void ntfsrec_cache_set_retry(struct ntfsrec_cache *cache, unsigned int enabled) {
+    pthread_mutex_lock(&cache->lock);
+    cache->retry = enabled;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void ntfsrec_cache_get_stats(struct ntfsrec_cache *cache, struct ntfsrec_cache_stats *stats) {
+    pthread_mutex_lock(&cache->lock);
+    
+    *stats = cache->stats;
+    stats->blocks = cache->lists[NR_CACHE_PROBATION].count + cache->lists[NR_CACHE_PROTECTED].count;
+    stats->failed_blocks = cache->lists[NR_CACHE_FAILED].count;
+    stats->capacity = cache->capacity;
+    
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static s64 ntfsrec_cache_read(struct ntfs_device *dev, void *buffer, s64 count) {
+    s64 position = ntfs_device_unix_io_ops.seek(dev, 0, SEEK_CUR), bytes_read;
+    
+    if (position < 0)
+        return -1;
+    
+    bytes_read = ntfsrec_cache_pread(dev, buffer, count, position);
+    
+    if (bytes_read > 0 && ntfs_device_unix_io_ops.seek(dev, position + bytes_read, SEEK_SET) < 0)
+        return -1;
+    
+    return bytes_read;
+}
+
+static s64 ntfsrec_cache_pread(struct ntfs_device *dev, void *buffer, s64 count, s64 offset) {
+    struct ntfsrec_cache *cache = (struct ntfsrec_cache *)dev->d_ops;
+    s64 number, last, copied = 0;
+    unsigned int sequential, failed = NR_FALSE;
+    
+    if (count <= 0 || offset < 0)
+        return ntfsrec_cache_lower_pread(cache, dev, buffer, count, offset);
+    
+    number = offset >> NR_CACHE_BLOCK_BITS;
+    last = (offset + count - 1) >> NR_CACHE_BLOCK_BITS;
+    
+    /* Bypassing the cache still avoids the blocks known to be bad, the read stops short of the first one */
+    if (count > NR_CACHE_BYPASS_SIZE) {
+        s64 failed_block = last + 1;
+        
+        __atomic_fetch_add(&cache->stats.bypassed, 1, __ATOMIC_RELAXED);
+        
+        pthread_mutex_lock(&cache->lock);
+        
+        if (!cache->retry)
+            failed_block = ntfsrec_cache_first_failed(cache, number, last);
+        
+        if (failed_block <= last)
+            cache->stats.failed_hits++;
+        
+        pthread_mutex_unlock(&cache->lock);
+        
+        if (failed_block == number) {
+            errno = EIO;
+            return -1;
+        }
+        
+        if (failed_block <= last)
+            count = (failed_block << NR_CACHE_BLOCK_BITS) - offset;
+        
+        return ntfsrec_cache_lower_pread(cache, dev, buffer, count, offset);
+    }
+    
+    pthread_mutex_lock(&cache->lock);
+    
+    /* A read carrying on from the last one, possibly from inside the block it ended in, is sequential */
+    sequential = number == cache->next_block || number + 1 == cache->next_block;
+    cache->next_block = last + 1;
+    
+    if (!sequential)
+        cache->window = 0;
+    
+    while(number <= last && !failed) {
+        struct ntfsrec_cache_block *block = ntfsrec_cache_lookup(cache, number);
+        s64 missing = 1, ahead = 0, filled, index;
+        char *data;
+        
+        if (block != NULL && block->segment != NR_CACHE_FAILED) {
+            cache->stats.hits++;
+            
+            if (block->read_ahead) {
+                cache->stats.read_ahead_hits++;
+                block->read_ahead = NR_FALSE;
+            }
+            
+            ntfsrec_cache_touch(cache, block);
+            copied += ntfsrec_cache_copy(number, block->data, NR_CACHE_BLOCK_SIZE, buffer, count, offset);
+            ++number;
+            continue;
+        }
+        
+        if (block != NULL && !cache->retry) {
+            cache->stats.failed_hits++;
+            failed = NR_TRUE;
+            break;
+        }
+        
+        /* Everything missing up to the next cached block is read in one go */
+        while(number + missing <= last && ntfsrec_cache_is_missing(cache, number + missing))
+            ++missing;
+        
+        if (number + missing > last && sequential) {
+            if (cache->window == 0)
+                cache->window = NR_CACHE_MIN_READ_AHEAD;
+            else if (cache->window < NR_CACHE_MAX_READ_AHEAD)
+                cache->window *= 2;
+            
+            while(ahead < cache->window && ntfsrec_cache_lookup(cache, number + missing + ahead) == NULL)
+                ++ahead;
+        }
+        
+        cache->stats.misses += missing;
+        cache->stats.read_ahead += ahead;
+        
+        pthread_mutex_unlock(&cache->lock);
+        
+        data = ntfsrec_allocate((missing + ahead) << NR_CACHE_BLOCK_BITS);
+        filled = ntfsrec_cache_fill(cache, dev, number, missing, ahead, data);
+        
+        pthread_mutex_lock(&cache->lock);
+        
+        if (filled < 0) {
+            failed = NR_TRUE;
+            filled = -filled - 1;
+        }
+        
+        for(index = 0; index < (filled >> NR_CACHE_BLOCK_BITS); ++index)
+            ntfsrec_cache_insert(cache, number + index, &data[index << NR_CACHE_BLOCK_BITS], index >= missing);
+        
+        if (failed)
+            ntfsrec_cache_mark_failed(cache, number + (filled >> NR_CACHE_BLOCK_BITS));
+        
+        copied += ntfsrec_cache_copy(number, data, filled, buffer, count, offset);
+        free(data);
+        
+        /* A short read that wasn't a failure is the end of the device */
+        if (filled < missing << NR_CACHE_BLOCK_BITS)
+            break;
+        
+        number += missing;
+    }
+    
+    pthread_mutex_unlock(&cache->lock);
+    
+    if (copied == 0 && failed) {
+        errno = EIO;
+        return -1;
+    }
+    
+    return copied;
+}
+
+static s64 ntfsrec_cache_lower_pread(struct ntfsrec_cache *cache, struct ntfs_device *dev, void *buffer, s64 count, s64 offset) {
+    if (cache->faults != NULL)
+        return ntfsrec_fault_device_pread(cache->faults, dev, buffer, count, offset);
+    
+    return ntfs_device_unix_io_ops.pread(dev, buffer, count, offset);
+}
+
+/*
+ * Reads missing blocks plus ahead more from block number into data. Returns how many bytes were read,
+ * or if a block failed, -1 less the bytes read before it. A failed read of several blocks is retried
+ * block by block so only the bad ones are remembered as bad, and read-ahead is never retried.
+ */
+static s64 ntfsrec_cache_fill(struct ntfsrec_cache *cache, struct ntfs_device *dev, s64 number, s64 missing, s64 ahead, char *data) {
+    s64 filled, index;
+    
+    filled = ntfsrec_cache_lower_pread(cache, dev, data, (missing + ahead) << NR_CACHE_BLOCK_BITS, number << NR_CACHE_BLOCK_BITS);
+    
+    if (filled >= 0)
+        return filled;
+    
+    if (missing + ahead == 1)
+        return -1;
+    
+    filled = 0;
+    
+    for(index = 0; index < missing; ++index) {
+        s64 bytes_read = ntfsrec_cache_lower_pread(cache, dev, &data[filled], NR_CACHE_BLOCK_SIZE, (number + index) << NR_CACHE_BLOCK_BITS);
+        
+        if (bytes_read < 0)
+            return -filled - 1;
+        
+        filled += bytes_read;
+        
+        if (bytes_read < NR_CACHE_BLOCK_SIZE)
+            break;
+    }
+    
+    return filled;
+}
+
+/* Copies the part of the request that falls in length bytes of data read from block number */
+static s64 ntfsrec_cache_copy(s64 number, const char *data, s64 length, char *buffer, s64 count, s64 offset) {
+    s64 start = number << NR_CACHE_BLOCK_BITS, from, to;
+    
+    from = offset > start ? offset : start;
+    to = offset + count < start + length ? offset + count : start + length;
+    
+    if (to <= from)
+        return 0;
+    
+    memcpy(&buffer[from - offset], &data[from - start], to - from);
+    return to - from;
+}
+
+static struct ntfsrec_cache_block *ntfsrec_cache_lookup(struct ntfsrec_cache *cache, s64 number) {
+    struct ntfsrec_cache_block *block = cache->buckets[number & cache->bucket_mask];
+    
+    while(block != NULL && block->number != number)
+        block = block->hash_next;
+    
+    return block;
+}
+
+static int ntfsrec_cache_is_missing(struct ntfsrec_cache *cache, s64 number) {
+    struct ntfsrec_cache_block *block = ntfsrec_cache_lookup(cache, number);
+    
+    return block == NULL || (block->segment == NR_CACHE_FAILED && cache->retry);
+}
+
+/* Returns the first block from number to last that failed before, or last + 1 if none did */
+static s64 ntfsrec_cache_first_failed(struct ntfsrec_cache *cache, s64 number, s64 last) {
+    const struct ntfsrec_cache_block *block;
+    s64 first = last + 1;
+    
+    /* Whichever is shorter, the failed list or the range, is the one walked */
+    if ((s64)cache->lists[NR_CACHE_FAILED].count < last - number + 1) {
+        for(block = cache->lists[NR_CACHE_FAILED].head; block != NULL; block = block->next) {
+            if (block->number >= number && block->number < first)
+                first = block->number;
+        }
+        
+        return first;
+    }
+    
+    for(; number <= last; ++number) {
+        block = ntfsrec_cache_lookup(cache, number);
+        
+        if (block != NULL && block->segment == NR_CACHE_FAILED)
+            return number;
+    }
+    
+    return first;
+}
+
+static void ntfsrec_cache_insert(struct ntfsrec_cache *cache, s64 number, const char *data, unsigned int read_ahead) {
+    struct ntfsrec_cache_block *block = ntfsrec_cache_lookup(cache, number), **bucket;
+    
+    /* Another thread may have read it meanwhile, a block that failed before has now been read */
+    if (block != NULL) {
+        if (block->segment != NR_CACHE_FAILED)
+            return;
+        
+        ntfsrec_cache_remove(cache, block);
+    }
+    
+    if (cache->lists[NR_CACHE_PROBATION].count + cache->lists[NR_CACHE_PROTECTED].count < cache->capacity) {
+        block = ntfsrec_allocate(sizeof *block);
+        block->data = ntfsrec_allocate(NR_CACHE_BLOCK_SIZE);
+    } else {
+        struct ntfsrec_cache_block **slot;
+        
+        block = cache->lists[NR_CACHE_PROBATION].tail;
+        
+        if (block == NULL)
+            block = cache->lists[NR_CACHE_PROTECTED].tail;
+        
+        ntfsrec_cache_unlink(cache, block);
+        
+        for(slot = &cache->buckets[block->number & cache->bucket_mask]; *slot != block; slot = &(*slot)->hash_next);
+        *slot = block->hash_next;
+        
+        cache->stats.evictions++;
+    }
+    
+    memcpy(block->data, data, NR_CACHE_BLOCK_SIZE);
+    block->number = number;
+    block->read_ahead = read_ahead;
+    
+    bucket = &cache->buckets[number & cache->bucket_mask];
+    block->hash_next = *bucket;
+    *bucket = block;
+    
+    ntfsrec_cache_push(cache, block, NR_CACHE_PROBATION);
+}
+
+static void ntfsrec_cache_mark_failed(struct ntfsrec_cache *cache, s64 number) {
+    struct ntfsrec_cache_block *block = ntfsrec_cache_lookup(cache, number), **bucket;
+    
+    if (block != NULL)
+        return;
+    
+    block = ntfsrec_allocate(sizeof *block);
+    block->data = NULL;
+    block->number = number;
+    block->read_ahead = NR_FALSE;
+    
+    bucket = &cache->buckets[number & cache->bucket_mask];
+    block->hash_next = *bucket;
+    *bucket = block;
+    
+    ntfsrec_cache_push(cache, block, NR_CACHE_FAILED);
+}
+
+static void ntfsrec_cache_touch(struct ntfsrec_cache *cache, struct ntfsrec_cache_block *block) {
+    struct ntfsrec_cache_list *protected_list = &cache->lists[NR_CACHE_PROTECTED];
+    
+    ntfsrec_cache_unlink(cache, block);
+    ntfsrec_cache_push(cache, block, NR_CACHE_PROTECTED);
+    
+    /* The least recently used protected block gets another chance on probation */
+    if (protected_list->count * 100 > cache->capacity * NR_CACHE_PROTECTED_SHARE) {
+        struct ntfsrec_cache_block *demoted = protected_list->tail;
+        
+        ntfsrec_cache_unlink(cache, demoted);
+        ntfsrec_cache_push(cache, demoted, NR_CACHE_PROBATION);
+    }
+}
+
+static void ntfsrec_cache_remove(struct ntfsrec_cache *cache, struct ntfsrec_cache_block *block) {
+    struct ntfsrec_cache_block **slot;
+    
+    ntfsrec_cache_unlink(cache, block);
+    
+    for(slot = &cache->buckets[block->number & cache->bucket_mask]; *slot != block; slot = &(*slot)->hash_next);
+    *slot = block->hash_next;
+    
+    free(block->data);
+    free(block);
+}
+
+static void ntfsrec_cache_push(struct ntfsrec_cache *cache, struct ntfsrec_cache_block *block, enum ntfsrec_cache_segment segment) {
+    struct ntfsrec_cache_list *list = &cache->lists[segment];
+    
+    block->segment = segment;
+    block->prev = NULL;
+    block->next = list->head;
+    
+    if (list->head != NULL)
+        list->head->prev = block;
+    else
+        list->tail = block;
+    
+    list->head = block;
+    list->count++;
+}
+
+static void ntfsrec_cache_unlink(struct ntfsrec_cache *cache, struct ntfsrec_cache_block *block) {
+    struct ntfsrec_cache_list *list = &cache->lists[block->segment];
+    
+    if (block->prev != NULL)
+        block->prev->next = block->next;
+    else
+        list->head = block->next;
+    
+    if (block->next != NULL)
+        block->next->prev = block->prev;
+    else
+        list->tail = block->prev;
+    
+    list->count--;
+}
@@ -0,0 +1,51 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_CACHE_H
+#define _NTFSREC_CACHE_H
+
+struct ntfsrec_cache;
+struct ntfsrec_fault_plan;
+
+struct ntfsrec_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t read_ahead;
+    uint64_t read_ahead_hits;
+    uint64_t bypassed;
+    uint64_t evictions;
+    uint64_t failed_hits;
+    
+    size_t blocks;
+    size_t failed_blocks;
+    size_t capacity;
+};
+
+/*
+ * A block cache between libntfs-3g and the device, so metadata that's read again and again costs
+ * RAM instead of another trip to a failing disk. Blocks that fail to read are remembered and fail
+ * straight away afterwards, unless retries are turned on. Reads go through faults when given.
+ */
+struct ntfsrec_cache *ntfsrec_cache_create(size_t bytes, struct ntfsrec_fault_plan *faults);
+void ntfsrec_cache_free(struct ntfsrec_cache *cache);
+
+/*
+ * Mounts device_name through the cache, which must outlive the volume. Every volume mounted through
+ * one cache has to be of the same device, as the copy workers' are, since blocks are shared by offset.
+ */
+ntfs_volume *ntfsrec_cache_mount(struct ntfsrec_cache *cache, const char *device_name, unsigned long flags);
+
+/* Empties the cache, including the blocks known to have failed */
+void ntfsrec_cache_drop(struct ntfsrec_cache *cache);
+
+/* Forgets which blocks failed so they're read again, returns how many there were */
+size_t ntfsrec_cache_forget_failures(struct ntfsrec_cache *cache);
+
+/* While enabled, blocks that failed before are read from the device again instead of failing */
+void ntfsrec_cache_set_retry(struct ntfsrec_cache *cache, unsigned int enabled);
+
+void ntfsrec_cache_get_stats(struct ntfsrec_cache *cache, struct ntfsrec_cache_stats *stats);
+
+#endif
@@ -7,37 +7,57 @@
 #include "ntfs_reader.h"
 #include "ntfsrec_command.h"
 #include "ntfsrec_utility.h"
+#include "ntfsrec_mft.h"
+#include "ntfsrec_cache.h"
+#include "ntfsrec_trigram.h"
+#include "ntfsrec_filter.h"
 #include <unistd.h>
 
 static int ntfsrec_split_string_destroy(char *string, char **next, char delimiter);
 static void ntfsrec_remove_newline(char *string);
+static int ntfsrec_next_command(char *line, const char **commands, FILE *script);
 
 static void ntfsrec_dispatch_command(struct ntfsrec_command_processor *state, char *command, char *arguments);
-extern void ntfsrec_command_ls(struct ntfsrec_command_processor *state, char *arguments);
-extern void ntfsrec_command_cd(struct ntfsrec_command_processor *state, char *arguments);
-extern void ntfsrec_command_cp(struct ntfsrec_command_processor *state, char *arguments);
-extern void ntfsrec_command_cpz(struct ntfsrec_command_processor *state, char *arguments);
-static void ntfsrec_command_info(struct ntfsrec_command_processor *state, char *arguments);
-static void ntfsrec_command_pwd(struct ntfsrec_command_processor *state, char *arguments);
-static void ntfsrec_command_quit(struct ntfsrec_command_processor *state, char *arguments);
+extern int ntfsrec_command_ls(struct ntfsrec_command_processor *state, char *arguments);
+extern int ntfsrec_command_cd(struct ntfsrec_command_processor *state, char *arguments);
+extern int ntfsrec_command_cp(struct ntfsrec_command_processor *state, char *arguments);
+extern int ntfsrec_command_cpz(struct ntfsrec_command_processor *state, char *arguments);
+extern int ntfsrec_command_tar(struct ntfsrec_command_processor *state, char *arguments);
+extern int ntfsrec_command_image(struct ntfsrec_command_processor *state, char *arguments);
+extern int ntfsrec_command_scan(struct ntfsrec_command_processor *state, char *arguments);
+extern int ntfsrec_command_index(struct ntfsrec_command_processor *state, char *arguments);
+extern int ntfsrec_command_du(struct ntfsrec_command_processor *state, char *arguments);
+extern int ntfsrec_command_find(struct ntfsrec_command_processor *state, char *arguments);
+static int ntfsrec_command_info(struct ntfsrec_command_processor *state, char *arguments);
+static int ntfsrec_command_cache(struct ntfsrec_command_processor *state, char *arguments);
+static int ntfsrec_command_pwd(struct ntfsrec_command_processor *state, char *arguments);
+static int ntfsrec_command_quit(struct ntfsrec_command_processor *state, char *arguments);
 
 
 static const struct ntfsrec_command_handler {
     const char *name;
     const char *help;
-    void (*handler)(struct ntfsrec_command_processor *state, char *arguments);
+    int (*handler)(struct ntfsrec_command_processor *state, char *arguments);
 } command_handlers[] = {
-    { "ls",   "Lists files and folders in a directory",    &ntfsrec_command_ls   },
-    { "cd",   "Changes the current directory to <folder>", &ntfsrec_command_cd   },
-    { "cp",   "Copies files from cwd to host <dest>",      &ntfsrec_command_cp   },
-    { "cpz",  "Copies files from cwd to <dest> zip file",  &ntfsrec_command_cpz  },
-    { "info", "Displays information about the volume",     &ntfsrec_command_info },
-    { "pwd",  "Prints the host working directory",         &ntfsrec_command_pwd  },
-    { "quit", "Exits the application.",                    &ntfsrec_command_quit },
-    { NULL,   NULL,                                        NULL                  }
+    { "ls",    "Lists files and folders in a directory",    &ntfsrec_command_ls    },
+    { "cd",    "Changes the current directory to <folder>", &ntfsrec_command_cd    },
+    { "cp",    "Copies files from cwd to host <dest>",      &ntfsrec_command_cp    },
+    { "cpz",   "Streams files from cwd to a <dest> zip",    &ntfsrec_command_cpz   },
+    { "tar",   "Streams files from cwd to a <dest> tar",    &ntfsrec_command_tar   },
+    { "image", "Images the used clusters to a <dest> file", &ntfsrec_command_image },
+    { "scan",  "Reads $MFT directly into a file table",     &ntfsrec_command_scan  },
+    { "index", "Saves the file table with: build <file>",   &ntfsrec_command_index },
+    { "du",    "Totals files and sizes under each folder",  &ntfsrec_command_du    },
+    { "find",  "Finds names by substring or glob pattern",  &ntfsrec_command_find  },
+    { "info",  "Displays information about the volume",     &ntfsrec_command_info  },
+    { "cache", "Shows cache counters, or does: retry|drop", &ntfsrec_command_cache },
+    { "pwd",   "Prints the host working directory",         &ntfsrec_command_pwd   },
+    { "quit",  "Exits the application.",                    &ntfsrec_command_quit  },
+    { NULL,    NULL,                                        NULL                   }
 };
 
-void ntfsrec_process_commands(struct ntfsrec_reader *reader) {
+unsigned int ntfsrec_process_commands(struct ntfsrec_reader *reader, struct ntfsrec_mft_table *table,
+                                      const char *commands, FILE *script) {
     struct ntfsrec_command_processor state;
     char line[MAX_LINE_LENGTH];
     
@@ -46,19 +66,29 @@ void ntfsrec_process_commands(struct ntfsrec_reader *reader) {
     
     state.reader = reader;
     state.running = 1;
+    state.table = table;
+    state.offline = table != NULL;
     
     ntfsrec_command_cd(&state, "/");
     
     while(state.running) {
         char *command = line, *arguments;
         
-        printf("%s> ", state.cwd);
+        if (commands == NULL && script == NULL)
+            printf("%s> ", state.cwd);
         
-        if (fgets(line, MAX_LINE_LENGTH, stdin) == NULL)
+        if (ntfsrec_next_command(line, &commands, script) == NR_FALSE)
             break;
         
         ntfsrec_remove_newline(line);
         
+        while(*command == ' ' || *command == '\t')
+            ++command;
+        
+        /* Scripts can carry comments */
+        if (*command == '#')
+            continue;
+        
         if (ntfsrec_split_string_destroy(command, &arguments, ' ') == NR_FALSE)
             continue;
         
@@ -67,6 +97,63 @@ void ntfsrec_process_commands(struct ntfsrec_reader *reader) {
     
     if (state.cwd_inode != NULL)
         ntfs_inode_close(state.cwd_inode);
+    
+    if (state.names != NULL)
+        ntfsrec_trigram_free(state.names);
+    
+    if (state.table != NULL)
+        ntfsrec_mft_table_free(state.table);
+    
+    ntfsrec_selection_free(state.selection);
+    
+    return state.failures;
+}
+
+int ntfsrec_commands_stream_archive(const char *commands) {
+    while(*commands != '\0') {
+        const char *end = strchr(commands, ';'), *last;
+        
+        if (end == NULL)
+            end = commands + strlen(commands);
+        
+        while(commands < end && (*commands == ' ' || *commands == '\t'))
+            ++commands;
+        
+        /* tar takes the archive as its last argument */
+        for(last = end; last > commands && last[-1] == ' '; --last);
+        
+        if (end - commands > 4 && strncmp(commands, "tar ", 4) == 0 && last - commands >= 2 && last[-1] == '-' && last[-2] == ' ')
+            return NR_TRUE;
+        
+        commands = *end == ';' ? end + 1 : end;
+    }
+    
+    return NR_FALSE;
+}
+
+static int ntfsrec_next_command(char *line, const char **commands, FILE *script) {
+    const char *end;
+    size_t length;
+    
+    if (*commands == NULL)
+        return fgets(line, MAX_LINE_LENGTH, script != NULL ? script : stdin) != NULL;
+    
+    if (**commands == '\0')
+        return NR_FALSE;
+    
+    end = strchr(*commands, ';');
+    length = end != NULL ? (size_t)(end - *commands) : strlen(*commands);
+    
+    if (length >= MAX_LINE_LENGTH) {
+        printf("Error: command %.32s... is longer than %d characters\n", *commands, MAX_LINE_LENGTH - 1);
+        return NR_FALSE;
+    }
+    
+    memcpy(line, *commands, length);
+    line[length] = '\0';
+    
+    *commands = end != NULL ? end + 1 : *commands + length;
+    return NR_TRUE;
 }
 
 static int ntfsrec_split_string_destroy(char *string, char **next, char delimiter) {
@@ -97,44 +184,174 @@ static void ntfsrec_remove_newline(char *string) {
 
 static void ntfsrec_dispatch_command(struct ntfsrec_command_processor *state, char *command, char *arguments) {
     const struct ntfsrec_command_handler *handler;
+    FILE *json = state->reader->settings->json;
+    char *result_text = NULL;
+    size_t result_length = 0;
+    struct timespec start, end;
+    int result = NR_FALSE;
     
     for(handler = command_handlers; handler->name != NULL; ++handler) {
-        if (strcmp(handler->name, command) == 0) {
-            handler->handler(state, arguments);
-            
-            return;
+        if (strcmp(handler->name, command) == 0)
+            break;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    if (handler->name != NULL) {
+        if (json != NULL)
+            state->result = open_memstream(&result_text, &result_length);
+        
+        result = handler->handler(state, arguments);
+        
+        if (state->result != NULL) {
+            fclose(state->result);
+            state->result = NULL;
         }
+    } else {
+        printf("Unrecognised command: %s\n", command);
     }
     
-    printf("Unrecognised command: %s\n", command);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    if (result == NR_FALSE)
+        state->failures++;
+    
+    /* The elapsed time lets the benchmarks time each command of a batch separately */
+    if (json != NULL) {
+        fputs("{\"command\":", json);
+        ntfsrec_json_string(json, command);
+        fprintf(json, ",\"ok\":%s,\"ms\":%.3f", result ? "true" : "false",
+                (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+        
+        if (result_length > 0)
+            fprintf(json, ",\"result\":%s", result_text);
+        
+        fputs("}\n", json);
+        fflush(json);
+    }
+    
+    free(result_text);
 }
 
-static void ntfsrec_command_info(struct ntfsrec_command_processor *state, char *arguments) {
-    NR_UNUSED(state);
+static int ntfsrec_command_info(struct ntfsrec_command_processor *state, char *arguments) {
+    ntfs_volume *volume = state->reader->mount.volume;
+    
     NR_UNUSED(arguments);
+    
+    if (state->reader->mount.name != NULL)
+        printf("Device:\t\t%s\n", state->reader->mount.name);
+    
+    if (volume != NULL) {
+        char size_text[8];
+        
+        ntfsrec_utility_format_size(size_text, sizeof size_text, volume->nr_clusters << volume->cluster_size_bits);
+        
+        printf("Volume name:\t%s\nNTFS version:\t%u.%u\nSize:\t\t%s (%lld clusters)\n"
+               "Cluster size:\t%u\nSector size:\t%u\nMFT record:\t%u\n",
+               volume->vol_name != NULL ? volume->vol_name : "", volume->major_ver, volume->minor_ver, size_text,
+               (long long)volume->nr_clusters, volume->cluster_size, volume->sector_size, volume->mft_record_size);
+    } else {
+        puts("Volume:\t\tnot mounted, browsing from the index");
+    }
+    
+    if (state->table != NULL)
+        printf("File table:\t%llu records\n", (unsigned long long)state->table->count);
+    
+    if (state->result != NULL) {
+        fprintf(state->result, "{\"offline\":%s", state->offline ? "true" : "false");
+        
+        if (state->reader->mount.name != NULL) {
+            fputs(",\"device\":", state->result);
+            ntfsrec_json_string(state->result, state->reader->mount.name);
+        }
+        
+        if (volume != NULL) {
+            fputs(",\"volume_name\":", state->result);
+            ntfsrec_json_string(state->result, volume->vol_name != NULL ? volume->vol_name : "");
+            fprintf(state->result, ",\"version\":\"%u.%u\",\"size\":%lld,\"clusters\":%lld,\"cluster_size\":%u,"
+                    "\"sector_size\":%u,\"mft_record_size\":%u", volume->major_ver, volume->minor_ver,
+                    (long long)(volume->nr_clusters << volume->cluster_size_bits), (long long)volume->nr_clusters,
+                    volume->cluster_size, volume->sector_size, volume->mft_record_size);
+        }
+        
+        if (state->table != NULL)
+            fprintf(state->result, ",\"records\":%llu", (unsigned long long)state->table->count);
+        
+        fputc('}', state->result);
+    }
+    
+    return NR_TRUE;
 }
 
-static void ntfsrec_command_pwd(struct ntfsrec_command_processor *state, char *arguments) {
+static int ntfsrec_command_cache(struct ntfsrec_command_processor *state, char *arguments) {
+    struct ntfsrec_cache *cache = state->reader->settings->cache;
+    struct ntfsrec_cache_stats stats;
+    char *action = ntfsrec_next_argument(&arguments);
+    uint64_t lookups;
+    
+    if (cache == NULL) {
+        puts("Error: the device cache is turned off");
+        return NR_FALSE;
+    }
+    
+    if (action != NULL && strcmp(action, "retry") == 0) {
+        printf("Forgot %lu failed blocks, they'll be read from the device again\n", (unsigned long)ntfsrec_cache_forget_failures(cache));
+    } else if (action != NULL && strcmp(action, "drop") == 0) {
+        ntfsrec_cache_drop(cache);
+        puts("Emptied the device cache");
+    } else if (action != NULL) {
+        printf("Error: unknown cache action %s, expected retry or drop\n", action);
+        return NR_FALSE;
+    }
+    
+    ntfsrec_cache_get_stats(cache, &stats);
+    lookups = stats.hits + stats.misses;
+    
+    printf("Blocks:\t\t%lu of %lu\nHits:\t\t%llu (%.1f%%)\nMisses:\t\t%llu\nRead ahead:\t%llu (%llu used)\n"
+           "Bypassed:\t%llu\nEvictions:\t%llu\nFailed blocks:\t%lu (%llu reads refused)\n",
+           (unsigned long)stats.blocks, (unsigned long)stats.capacity, (unsigned long long)stats.hits,
+           lookups > 0 ? stats.hits * 100.0 / lookups : 0.0, (unsigned long long)stats.misses,
+           (unsigned long long)stats.read_ahead, (unsigned long long)stats.read_ahead_hits,
+           (unsigned long long)stats.bypassed, (unsigned long long)stats.evictions,
+           (unsigned long)stats.failed_blocks, (unsigned long long)stats.failed_hits);
+    
+    if (state->result != NULL) {
+        fprintf(state->result, "{\"blocks\":%lu,\"capacity\":%lu,\"hits\":%llu,\"misses\":%llu,\"read_ahead\":%llu,"
+                "\"read_ahead_hits\":%llu,\"bypassed\":%llu,\"evictions\":%llu,\"failed_blocks\":%lu,\"failed_hits\":%llu}",
+                (unsigned long)stats.blocks, (unsigned long)stats.capacity, (unsigned long long)stats.hits,
+                (unsigned long long)stats.misses, (unsigned long long)stats.read_ahead,
+                (unsigned long long)stats.read_ahead_hits, (unsigned long long)stats.bypassed,
+                (unsigned long long)stats.evictions, (unsigned long)stats.failed_blocks,
+                (unsigned long long)stats.failed_hits);
+    }
+    
+    return NR_TRUE;
+}
+
+static int ntfsrec_command_pwd(struct ntfsrec_command_processor *state, char *arguments) {
     char * cwd;
     
-    NR_UNUSED(state);
     NR_UNUSED(arguments);
     
     cwd = getcwd(NULL, 0);
     
     if (cwd == NULL) {
         puts("Error: unable to get current working directory");
-        return;
+        return NR_FALSE;
     }
     
     printf("Host path is: %s\n", cwd);
     
+    if (state->result != NULL)
+        ntfsrec_json_string(state->result, cwd);
+    
     free(cwd);
-    return;
+    return NR_TRUE;
 }
 
-static void ntfsrec_command_quit(struct ntfsrec_command_processor *state, char *arguments) {
+static int ntfsrec_command_quit(struct ntfsrec_command_processor *state, char *arguments) {
     NR_UNUSED(arguments);
     
     state->running = 0;
+    return NR_TRUE;
 }
\ No newline at end of file
@@ -13,10 +13,42 @@ struct ntfsrec_command_processor {
     
     ntfs_inode *cwd_inode;
     
+    /* File table from the last scan of $MFT or the index given at startup, NULL until either exists */
+    struct ntfsrec_mft_table *table;
+    
+    /* Set when browsing from an index file, cwd_record then replaces cwd_inode */
+    unsigned int offline;
+    uint64_t cwd_record;
+    
+    /* Name index over the table, built by the first find and dropped along with the table */
+    struct ntfsrec_trigram_index *names;
+    
+    /* What the last find matched, for --selected */
+    struct ntfsrec_selection *selection;
+    
+    /* Set with --json while a command runs, handlers with a result write it here as a single JSON value */
+    FILE *result;
+    
     unsigned int running;
+    unsigned int failures;
     char cwd[MAX_PATH_LENGTH];
 };
 
-void ntfsrec_process_commands(struct ntfsrec_reader *reader);
+/*
+ * Takes ownership of table, which switches the session to offline browsing when given. Commands are
+ * read from the ';' separated list in commands, else from script, else from a prompt on stdin.
+ * Returns how many commands failed.
+ */
+unsigned int ntfsrec_process_commands(struct ntfsrec_reader *reader, struct ntfsrec_mft_table *table,
+                                      const char *commands, FILE *script);
+
+/* Returns NR_TRUE if any command in the ';' separated list streams a tar archive to stdout */
+int ntfsrec_commands_stream_archive(const char *commands);
+
+/* Scans $MFT into a file table unless the session has one already, returns NR_FALSE if it still has none */
+int ntfsrec_command_require_table(struct ntfsrec_command_processor *state);
+
+/* Mounts the device for a session browsing an index, refusing one the index wasn't built from */
+int ntfsrec_command_require_volume(struct ntfsrec_command_processor *state);
 
 #endif
\ No newline at end of file
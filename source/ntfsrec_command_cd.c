@@ -7,25 +7,43 @@
 #include "ntfs_reader.h"
 #include "ntfsrec_command.h"
 #include "ntfsrec_utility.h"
-#include <zip.h>
+#include "ntfsrec_mft.h"
 
 static void ntfsrec_check_trailing_slash(char *string);
 
-void ntfsrec_command_cd(struct ntfsrec_command_processor *state, char *arguments) {
+int ntfsrec_command_cd(struct ntfsrec_command_processor *state, char *arguments) {
     char cwd_buffer[MAX_PATH_LENGTH];
     ntfs_inode *inode;
     
     if (*arguments == '\0') {
         puts("Usage: cd <directory>");
         
-        return;
+        return NR_FALSE;
     }
     
     ntfsrec_check_trailing_slash(arguments);
     
     if (ntfsrec_calculate_path(cwd_buffer, MAX_PATH_LENGTH, state->cwd, arguments) == NR_FALSE) {
         printf("Error: invalid path arugment %s\n", arguments);
-        return;
+        return NR_FALSE;
+    }
+    
+    if (state->offline) {
+        uint64_t record;
+        
+        if (ntfsrec_mft_table_lookup(state->table, cwd_buffer, &record) == NR_FALSE) {
+            printf("Error: can't find path %s\n", cwd_buffer);
+            return NR_FALSE;
+        }
+        
+        if ((state->table->flags[record] & NR_MFT_DIRECTORY) == 0) {
+            printf("Error: %s isn't a directory.\n", cwd_buffer);
+            return NR_FALSE;
+        }
+        
+        strncpy(state->cwd, cwd_buffer, MAX_PATH_LENGTH);
+        state->cwd_record = record;
+        return NR_TRUE;
     }
     
     inode = ntfs_pathname_to_inode(state->reader->mount.volume, NULL, cwd_buffer);
@@ -33,7 +51,7 @@ void ntfsrec_command_cd(struct ntfsrec_command_processor *state, char *arguments
     if (inode == NULL) {
         printf("Error: can't find path %s\n", cwd_buffer);
         
-        return;
+        return NR_FALSE;
     }
     
     if (inode->mrec->flags & MFT_RECORD_IS_DIRECTORY) {
@@ -42,13 +60,14 @@ void ntfsrec_command_cd(struct ntfsrec_command_processor *state, char *arguments
         printf("Error: %s isn't a directory.\n", cwd_buffer);
         ntfs_inode_close(inode);
         
-        return;
+        return NR_FALSE;
     }
     
     if (state->cwd_inode != NULL)
         ntfs_inode_close(state->cwd_inode);
     
     state->cwd_inode = inode;
+    return NR_TRUE;
 }
 
 static void ntfsrec_check_trailing_slash(char *string) {
@@ -7,125 +7,1168 @@
 #include "ntfs_reader.h"
 #include "ntfsrec_command.h"
 #include "ntfsrec_utility.h"
+#include "ntfsrec_workqueue.h"
+#include "ntfsrec_copy.h"
+#include "ntfsrec_mft.h"
+#include "ntfsrec_badmap.h"
+#include "ntfsrec_writer.h"
+#include "ntfsrec_zip.h"
+#include "ntfsrec_tar.h"
+#include "ntfsrec_progress.h"
+#include "ntfsrec_index.h"
+#include "ntfsrec_cache.h"
+#include "ntfsrec_manifest.h"
+#include "ntfsrec_filter.h"
+#include "ntfsrec_compressed.h"
+#include <pthread.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 
-#define NR_FILE_BUFFER_SIZE 8096
+#define NR_FILE_BUFFER_SIZE (256 * 1024)
+#define NR_FILE_QUEUE_DEPTH 4
 #define NR_FILE_MAX_RETRIES 4
+#define NR_COPY_MAX_WORKERS 64
+#define NR_COPY_FIRST_RETRY_BLOCK 4096
+#define NR_COPY_MIN_SKIP (64 * 1024)
+#define NR_COPY_MAX_SKIP (64 * 1024 * 1024)
+#define NR_ZIP_DEFAULT_LEVEL 6
+#define NR_COPY_STATUS_AUTO (~0U)
+#define NR_COPY_MAX_DEPTH 512
+#define NR_COPY_PATH_CAPACITY 1024
+#define NR_IMAGE_BUFFER_SIZE (4 * 1024 * 1024)
 
-struct ntfsrec_copy {
+struct ntfsrec_copy_item {
+    MFT_REF mref;
+    unsigned int is_dir;
+    
+    /* path holds the full destination, the entry's own name starts at name_offset */
+    size_t name_offset;
+    char path[];
+};
+
+struct ntfsrec_copy_worker {
+    pthread_t thread;
+    struct ntfsrec_reader reader;
+    struct ntfsrec_copy copy;
+};
+
+/* Where the output path and directory stood before entering a directory, restored on leaving it */
+struct ntfsrec_copy_level {
+    size_t path_length;
+    size_t directory_length;
+    int directory_fd;
+};
+
+/* Totals for the ETA, summed from the file table or the directory indexes before copying */
+struct ntfsrec_copy_total {
     ntfs_volume *volume;
-    const char *output_name;
+    const struct ntfsrec_filter *filter;
+    uint64_t directory;
+    unsigned int depth;
+    
+    uint64_t bytes;
+    uint64_t files;
+};
+
+static int ntfsrec_recurse_directory(struct ntfsrec_copy* state, ntfs_inode* folder_node, const char* name);
+static int ntfsrec_copy_table_directory(struct ntfsrec_copy *state, const struct ntfsrec_mft_table *table,
+                                        uint64_t directory, const char *name);
+static int ntfsrec_enter_directory(struct ntfsrec_copy *state, const char *name, const struct ntfsrec_file_meta *meta, struct ntfsrec_copy_level *parent);
+static void ntfsrec_leave_directory(struct ntfsrec_copy *state, const struct ntfsrec_copy_level *parent);
+static int ntfsrec_copy_index_visitor(struct ntfsrec_copy *state, MFT_REF mref, const FILE_NAME_ATTR *file_name);
+static int ntfsrec_cpz_directory_visitor(struct ntfsrec_copy *state, const ntfschar *name,
+                                         const int name_len, const int name_type, const s64 pos,
+                                         const MFT_REF mref, const unsigned dt_type);
+static int ntfsrec_copy_entry(struct ntfsrec_copy *state, const char *local_name, MFT_REF mref, unsigned int is_dir);
+
+static void ntfsrec_path_append(struct ntfsrec_copy *state, const char *text, size_t length);
+static void ntfsrec_path_truncate(struct ntfsrec_copy *state, size_t length);
+static int ntfsrec_emit_file(struct ntfsrec_copy *state, ntfs_inode *inode, const char *name);
+static int ntfsrec_copy_filter_inode(struct ntfsrec_copy *state, ntfs_inode *inode, const char *name);
+static int ntfsrec_copy_table_match(const struct ntfsrec_mft_table *table, uint64_t record, const struct ntfsrec_filter *filter);
+static int ntfsrec_emit_resident(struct ntfsrec_copy *state, ntfs_inode *inode, MFT_REF mref, const struct ntfsrec_file_meta *meta);
+static s64 ntfsrec_resume_offset(struct ntfsrec_copy *state, ntfs_inode *inode, s64 data_size, const struct ntfsrec_file_meta *meta);
+static s64 ntfsrec_hash_existing(struct ntfsrec_copy *state, struct ntfsrec_file_hash *hash, int fd, s64 length);
+static int ntfsrec_archive_file(struct ntfsrec_copy *state, ntfs_inode *inode, ntfs_attr *data_attribute);
+static s64 ntfsrec_next_data_run(ntfs_attr *data_attribute, u8 cluster_bits, runlist_element **run, s64 *offset);
+static s64 ntfsrec_skip_ahead(struct ntfsrec_copy *state, MFT_REF mref, s64 offset, s64 limit, unsigned int *deferred);
+
+static void ntfsrec_copy_init(struct ntfsrec_copy *copy_state, struct ntfsrec_command_processor *state, const char *output_name);
+static int ntfsrec_copy_report(struct ntfsrec_command_processor *state, struct ntfsrec_copy *copy_state);
+static void ntfsrec_copy_abort(struct ntfsrec_command_processor *state, struct ntfsrec_copy *copy_state);
+static int ntfsrec_copy_parse_status(char **arguments, unsigned int *interval);
+static void ntfsrec_copy_show_status(struct ntfsrec_command_processor *state, struct ntfsrec_copy *copy_state,
+                                     unsigned int interval, const struct ntfsrec_copy_total *known);
+static void ntfsrec_copy_table_total(const struct ntfsrec_mft_table *table, uint64_t directory, struct ntfsrec_copy_total *total);
+static int ntfsrec_copy_index_total(struct ntfsrec_copy_total *total, MFT_REF mref, const FILE_NAME_ATTR *file_name);
+static int ntfsrec_copy_parallel(struct ntfsrec_copy *copy_state, struct ntfsrec_command_processor *state,
+                                 unsigned int workers, const char *dest_path);
+static void *ntfsrec_copy_worker_main(void *argument);
+static void ntfsrec_copy_retry_passes(struct ntfsrec_copy *copy_state, unsigned int passes);
+static void ntfsrec_queue_entry(struct ntfsrec_copy *state, MFT_REF mref, unsigned int is_dir, const char *name);
+
+int ntfsrec_command_cp(struct ntfsrec_command_processor *state, char *arguments) {
+    struct ntfsrec_copy copy_state;
+    char *dest_path;
+    unsigned int workers = 1, disk_order = NR_FALSE, zero_holes = NR_FALSE, incremental = NR_FALSE, passes = ~0U, deadline = 0;
+    unsigned int buffer_size = NR_FILE_BUFFER_SIZE, depth = NR_FILE_QUEUE_DEPTH, status = NR_COPY_STATUS_AUTO;
+    unsigned int algorithms = ntfsrec_manifest_default_algorithms();
+    const char *map_name = NULL, *manifest_name = NULL;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    struct ntfsrec_filter filter;
+    
+    ntfsrec_filter_init(&filter);
+    
+    while(*arguments == '-') {
+        char *option = ntfsrec_next_argument(&arguments);
+        
+        if (strcmp(option, "-j") == 0) {
+            char *count = ntfsrec_next_argument(&arguments);
+            
+            if (count == NULL || sscanf(count, "%u", &workers) != 1 || workers == 0 || workers > NR_COPY_MAX_WORKERS) {
+                printf("Error: -j expects a worker count between 1 and %u\n", NR_COPY_MAX_WORKERS);
+                return NR_FALSE;
+            }
+        } else if (strcmp(option, "-e") == 0) {
+            disk_order = NR_TRUE;
+        } else if (strcmp(option, "-z") == 0) {
+            zero_holes = NR_TRUE;
+        } else if (strcmp(option, "-u") == 0) {
+            incremental = NR_TRUE;
+        } else if (strcmp(option, "-m") == 0) {
+            map_name = ntfsrec_next_argument(&arguments);
+            
+            if (map_name == NULL) {
+                puts("Error: -m expects the name of a bad-region map file");
+                return NR_FALSE;
+            }
+        } else if (strcmp(option, "-t") == 0) {
+            char *milliseconds = ntfsrec_next_argument(&arguments);
+            
+            if (milliseconds == NULL || sscanf(milliseconds, "%u", &deadline) != 1 || deadline == 0) {
+                puts("Error: -t expects a read deadline in milliseconds");
+                return NR_FALSE;
+            }
+        } else if (strcmp(option, "-b") == 0) {
+            char *kilobytes = ntfsrec_next_argument(&arguments);
+            
+            if (kilobytes == NULL || sscanf(kilobytes, "%u", &buffer_size) != 1 || buffer_size < 4 || buffer_size > 65536) {
+                puts("Error: -b expects a buffer size between 4 and 65536 KB");
+                return NR_FALSE;
+            }
+            
+            buffer_size *= 1024;
+        } else if (strcmp(option, "-q") == 0) {
+            char *count = ntfsrec_next_argument(&arguments);
+            
+            if (count == NULL || sscanf(count, "%u", &depth) != 1 || depth == 1 || depth > 256) {
+                puts("Error: -q expects a queue depth between 2 and 256, or 0 to write synchronously");
+                return NR_FALSE;
+            }
+        } else if (strcmp(option, "-p") == 0) {
+            char *count = ntfsrec_next_argument(&arguments);
+            
+            if (count == NULL || sscanf(count, "%u", &passes) != 1) {
+                puts("Error: -p expects the number of retry passes");
+                return NR_FALSE;
+            }
+        } else if (strcmp(option, "-P") == 0) {
+            if (ntfsrec_copy_parse_status(&arguments, &status) == NR_FALSE)
+                return NR_FALSE;
+        } else if (strcmp(option, "-M") == 0) {
+            manifest_name = ntfsrec_next_argument(&arguments);
+            
+            if (manifest_name == NULL) {
+                puts("Error: -M expects the name of a manifest file");
+                return NR_FALSE;
+            }
+        } else if (strcmp(option, "-H") == 0) {
+            char *list = ntfsrec_next_argument(&arguments);
+            
+            if (list == NULL || ntfsrec_manifest_parse_algorithms(list, &algorithms) == NR_FALSE) {
+                puts("Error: -H expects hashes for the manifest, xxh3, sha256 or xxh3,sha256");
+                return NR_FALSE;
+            }
+        } else if (ntfsrec_filter_is_option(option)) {
+            if (ntfsrec_filter_parse(&filter, option, &arguments) == NR_FALSE)
+                return NR_FALSE;
+        } else {
+            printf("Error: unknown option %s\nUsage: cp [-j workers | -e] [-u] [-z] [-b KB] [-q depth] [-t ms] [-m map] [-p passes] [-M manifest [-H hashes]] [-P seconds] "
+                   NR_FILTER_USAGE " [dest]\n", option);
+            return NR_FALSE;
+        }
+        
+        while(*arguments == ' ')
+            ++arguments;
+    }
+    
+    if (ntfsrec_filter_bind(&filter, state->selection) == NR_FALSE)
+        return NR_FALSE;
+    
+    if (disk_order && workers > 1) {
+        puts("Error: -e reads the whole volume in one sweep and can't be combined with -j");
+        return NR_FALSE;
+    }
+    
+    if (disk_order && manifest_name != NULL) {
+        puts("Error: -e reads files out of order, so they can't be hashed on the way for -M");
+        return NR_FALSE;
+    }
+    
+    /* An offline session only needs the device for file data */
+    if (ntfsrec_command_require_volume(state) == NR_FALSE)
+        return NR_FALSE;
+    
+    ntfsrec_copy_init(&copy_state, state, arguments);
+    
+    copy_state.opt.zero_holes = zero_holes;
+    copy_state.opt.deadline = deadline;
+    copy_state.opt.buffer_size = buffer_size;
+    copy_state.opt.incremental = incremental;
+    copy_state.filter = ntfsrec_filter_active(&filter) ? &filter : NULL;
+    
+    /* Up to depth queued writes and the one being read may not have reached the disk when a run was cut short */
+    copy_state.opt.resume_margin = (s64)buffer_size * (depth + 1);
+    
+    /*
+     * With a map the first pass skips bad areas straight away and later passes come back for them.
+     * A deadline needs the same deferred list, which is only kept in memory when no map was given.
+     */
+    if (map_name != NULL || deadline > 0) {
+        copy_state.map = ntfsrec_badmap_open(map_name);
+        
+        if (copy_state.map == NULL) {
+            ntfsrec_copy_abort(state, &copy_state);
+            return NR_FALSE;
+        }
+        
+        copy_state.opt.retries = 0;
+    }
+    
+    if (manifest_name != NULL) {
+        copy_state.manifest = ntfsrec_manifest_open(manifest_name, algorithms);
+        
+        if (copy_state.manifest == NULL) {
+            if (copy_state.map != NULL)
+                ntfsrec_badmap_close(copy_state.map);
+            
+            ntfsrec_copy_abort(state, &copy_state);
+            return NR_FALSE;
+        }
+    }
+    
+    /*
+     * The reading thread decodes a share of each batch too, so one fewer thread keeps every core busy.
+     * Its threads only start with the first compressed file, so plain copies never run them.
+     */
+    if (online > 1)
+        copy_state.decoder = ntfsrec_decode_pool_create((unsigned int)online - 1);
+    
+    ntfsrec_copy_show_status(state, &copy_state, status, NULL);
+    
+    dest_path = ntfsrec_allocate(strlen(arguments) + 3);
+    
+    if (strlen(arguments) != 0)
+        sprintf(dest_path, "./%s", arguments);
+    else
+        strcpy(dest_path, ".");
+    
+    /* Without a second volume to read from the copy goes ahead on the command's own */
+    if (workers > 1 && ntfsrec_copy_parallel(&copy_state, state, workers, dest_path) == NR_TRUE) {
+        /* The workers have copied everything */
+    } else {
+        copy_state.file_buffer = ntfsrec_allocate(buffer_size);
+        
+        /* A single reader leaves the output disk idle between reads unless writes are queued */
+        if (depth > 0)
+            copy_state.writer = ntfsrec_writer_create(buffer_size, depth);
+        
+        if (disk_order)
+            copy_state.plan = ntfsrec_extent_plan_create();
+        
+        if (state->offline)
+            ntfsrec_copy_table_directory(&copy_state, state->table, state->cwd_record, dest_path);
+        else
+            ntfsrec_recurse_directory(&copy_state, state->cwd_inode, dest_path);
+        
+        if (copy_state.plan != NULL) {
+            ntfsrec_extent_plan_execute(&copy_state);
+            ntfsrec_extent_plan_destroy(copy_state.plan);
+        }
+        
+        /* Retry passes write into the same files, so everything queued has to land first */
+        if (copy_state.writer != NULL) {
+            copy_state.stats.errors += ntfsrec_writer_errors(copy_state.writer);
+            ntfsrec_writer_destroy(copy_state.writer);
+            copy_state.writer = NULL;
+        }
+        
+        free(copy_state.file_buffer);
+    }
+    
+    free(dest_path);
+    
+    if (copy_state.decoder != NULL) {
+        ntfsrec_decode_pool_free(copy_state.decoder);
+        copy_state.decoder = NULL;
+    }
+    
+    if (copy_state.map != NULL) {
+        ntfsrec_copy_retry_passes(&copy_state, passes);
+        
+        if (copy_state.manifest != NULL)
+            ntfsrec_manifest_settle(copy_state.manifest, copy_state.map);
+        
+        ntfsrec_badmap_close(copy_state.map);
+    }
+    
+    if (copy_state.manifest != NULL)
+        ntfsrec_manifest_close(copy_state.manifest);
+    
+    return ntfsrec_copy_report(state, &copy_state);
+}
+
+int ntfsrec_command_cpz(struct ntfsrec_command_processor *state, char *arguments) {
+    struct ntfsrec_copy copy_state;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int threads = online > 0 ? (unsigned int)online : 1, status = NR_COPY_STATUS_AUTO;
+    int level = NR_ZIP_DEFAULT_LEVEL;
+    struct ntfsrec_filter filter;
+    
+    ntfsrec_filter_init(&filter);
+    
+    while(*arguments == '-') {
+        char *option = ntfsrec_next_argument(&arguments);
+        
+        if (strcmp(option, "-j") == 0) {
+            char *count = ntfsrec_next_argument(&arguments);
+            
+            if (count == NULL || sscanf(count, "%u", &threads) != 1 || threads == 0 || threads > NR_COPY_MAX_WORKERS) {
+                printf("Error: -j expects a thread count between 1 and %u\n", NR_COPY_MAX_WORKERS);
+                return NR_FALSE;
+            }
+        } else if (strcmp(option, "-l") == 0) {
+            char *value = ntfsrec_next_argument(&arguments);
+            
+            if (value == NULL || sscanf(value, "%d", &level) != 1 || level < 0 || level > 9) {
+                puts("Error: -l expects a compression level between 0 and 9");
+                return NR_FALSE;
+            }
+        } else if (strcmp(option, "-P") == 0) {
+            if (ntfsrec_copy_parse_status(&arguments, &status) == NR_FALSE)
+                return NR_FALSE;
+        } else if (ntfsrec_filter_is_option(option)) {
+            if (ntfsrec_filter_parse(&filter, option, &arguments) == NR_FALSE)
+                return NR_FALSE;
+        } else {
+            printf("Error: unknown option %s\nUsage: cpz [-j threads] [-l level] [-P seconds] " NR_FILTER_USAGE " <archive>\n", option);
+            return NR_FALSE;
+        }
+        
+        while(*arguments == ' ')
+            ++arguments;
+    }
+    
+    if (strlen(arguments) == 0) {
+        puts("Usage: cpz [-j threads] [-l level] [-P seconds] " NR_FILTER_USAGE " <archive>");
+        return NR_FALSE;
+    }
+    
+    if (ntfsrec_filter_bind(&filter, state->selection) == NR_FALSE)
+        return NR_FALSE;
+    
+    if (ntfsrec_command_require_volume(state) == NR_FALSE)
+        return NR_FALSE;
+    
+    ntfsrec_copy_init(&copy_state, state, arguments);
+    
+    copy_state.zip = ntfsrec_zip_create(arguments, threads, level);
+    copy_state.filter = ntfsrec_filter_active(&filter) ? &filter : NULL;
+    
+    if (copy_state.zip == NULL) {
+        ntfsrec_copy_abort(state, &copy_state);
+        return NR_FALSE;
+    }
+    
+    ntfsrec_copy_show_status(state, &copy_state, status, NULL);
+    copy_state.file_buffer = ntfsrec_allocate(copy_state.opt.buffer_size);
+    
+    /* The archive is written as the tree is walked, names are stored relative to cwd */
+    if (state->offline)
+        ntfsrec_copy_table_directory(&copy_state, state->table, state->cwd_record, ".");
+    else
+        ntfsrec_recurse_directory(&copy_state, state->cwd_inode, ".");
+    
+    free(copy_state.file_buffer);
+    
+    if (ntfsrec_zip_close(copy_state.zip) == NR_FALSE) {
+        printf("Error: the archive %s is incomplete\n", arguments);
+        copy_state.stats.errors++;
+    }
+    
+    return ntfsrec_copy_report(state, &copy_state);
+}
+
+int ntfsrec_command_tar(struct ntfsrec_command_processor *state, char *arguments) {
+    struct ntfsrec_copy copy_state;
+    int output_fd, complete;
+    unsigned int status = NR_COPY_STATUS_AUTO;
+    struct ntfsrec_filter filter;
+    
+    ntfsrec_filter_init(&filter);
+    
+    while(*arguments == '-' && arguments[1] != '\0') {
+        char *option = ntfsrec_next_argument(&arguments);
+        
+        if (strcmp(option, "-P") == 0) {
+            if (ntfsrec_copy_parse_status(&arguments, &status) == NR_FALSE)
+                return NR_FALSE;
+        } else if (ntfsrec_filter_is_option(option)) {
+            if (ntfsrec_filter_parse(&filter, option, &arguments) == NR_FALSE)
+                return NR_FALSE;
+        } else {
+            printf("Error: unknown option %s\nUsage: tar [-P seconds] " NR_FILTER_USAGE " <archive|->\n", option);
+            return NR_FALSE;
+        }
+        
+        while(*arguments == ' ')
+            ++arguments;
+    }
+    
+    if (strlen(arguments) == 0) {
+        puts("Usage: tar [-P seconds] " NR_FILTER_USAGE " <archive|->");
+        return NR_FALSE;
+    }
+    
+    if (ntfsrec_filter_bind(&filter, state->selection) == NR_FALSE)
+        return NR_FALSE;
+    
+    if (ntfsrec_command_require_volume(state) == NR_FALSE)
+        return NR_FALSE;
+    
+    /*
+     * Streaming to stdout keeps our own messages on stderr for the rest of the session, the report
+     * included. With -c that started before the first message, otherwise it starts here, before
+     * anything still buffered is flushed.
+     */
+    if (strcmp(arguments, "-") == 0 && state->reader->settings->json != NULL) {
+        puts("Error: with --json stdout carries the results, so the archive can't be streamed there");
+        return NR_FALSE;
+    } else if (strcmp(arguments, "-") == 0 && state->reader->settings->archive_streamed) {
+        puts("Error: an archive has already been streamed to stdout");
+        return NR_FALSE;
+    } else if (strcmp(arguments, "-") == 0) {
+        output_fd = state->reader->settings->archive_fd;
+        
+        if (output_fd == -1) {
+            output_fd = dup(STDOUT_FILENO);
+            
+            if (output_fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+                printf("Error: unable to redirect output: %s\n", strerror(errno));
+                
+                if (output_fd != -1)
+                    close(output_fd);
+                
+                return NR_FALSE;
+            }
+        }
+        
+        state->reader->settings->archive_fd = -1;
+        state->reader->settings->archive_streamed = NR_TRUE;
+    } else {
+        output_fd = open(arguments, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        
+        if (output_fd == -1) {
+            printf("Error: unable to create %s: %s\n", arguments, strerror(errno));
+            return NR_FALSE;
+        }
+    }
+    
+    ntfsrec_copy_init(&copy_state, state, arguments);
+    
+    copy_state.tar = ntfsrec_tar_open(output_fd);
+    copy_state.filter = ntfsrec_filter_active(&filter) ? &filter : NULL;
+    
+    /* Splicing reads the device behind the library's back, so it's left out when faults are simulated */
+    if (state->reader->settings->faults == NULL)
+        copy_state.device_fd = open(state->reader->mount.name, O_RDONLY);
+    
+    ntfsrec_copy_show_status(state, &copy_state, status, NULL);
+    copy_state.file_buffer = ntfsrec_allocate(copy_state.opt.buffer_size);
+    
+    if (state->offline)
+        ntfsrec_copy_table_directory(&copy_state, state->table, state->cwd_record, ".");
+    else
+        ntfsrec_recurse_directory(&copy_state, state->cwd_inode, ".");
+    
+    free(copy_state.file_buffer);
+    
+    if (copy_state.device_fd != -1)
+        close(copy_state.device_fd);
+    
+    complete = ntfsrec_tar_close(copy_state.tar);
+    ntfsrec_progress_stop(copy_state.progress);
+    
+    /* Closing the real stdout lets whatever reads the archive see its end straight away */
+    close(output_fd);
+    
+    if (!complete) {
+        printf("Error: the archive %s is incomplete\n", arguments);
+        copy_state.stats.errors++;
+    }
+    
+    return ntfsrec_copy_report(state, &copy_state);
+}
+
+int ntfsrec_command_image(struct ntfsrec_command_processor *state, char *arguments) {
+    struct ntfsrec_copy copy_state;
+    struct ntfsrec_copy_total total;
+    struct ntfsrec_image_plan *plan;
+    unsigned int zero_holes = NR_FALSE, passes = ~0U, deadline = 0, buffer_size = NR_IMAGE_BUFFER_SIZE, status = NR_COPY_STATUS_AUTO;
+    const char *map_name = NULL;
+    int output_fd;
+    
+    while(*arguments == '-') {
+        char *option = ntfsrec_next_argument(&arguments);
+        
+        if (strcmp(option, "-z") == 0) {
+            zero_holes = NR_TRUE;
+        } else if (strcmp(option, "-m") == 0) {
+            map_name = ntfsrec_next_argument(&arguments);
+            
+            if (map_name == NULL) {
+                puts("Error: -m expects the name of a bad-region map file");
+                return NR_FALSE;
+            }
+        } else if (strcmp(option, "-t") == 0) {
+            char *milliseconds = ntfsrec_next_argument(&arguments);
+            
+            if (milliseconds == NULL || sscanf(milliseconds, "%u", &deadline) != 1 || deadline == 0) {
+                puts("Error: -t expects a read deadline in milliseconds");
+                return NR_FALSE;
+            }
+        } else if (strcmp(option, "-b") == 0) {
+            char *kilobytes = ntfsrec_next_argument(&arguments);
+            
+            if (kilobytes == NULL || sscanf(kilobytes, "%u", &buffer_size) != 1 || buffer_size < 64 || buffer_size > 65536) {
+                puts("Error: -b expects a batch size between 64 and 65536 KB");
+                return NR_FALSE;
+            }
+            
+            buffer_size *= 1024;
+        } else if (strcmp(option, "-p") == 0) {
+            char *count = ntfsrec_next_argument(&arguments);
+            
+            if (count == NULL || sscanf(count, "%u", &passes) != 1) {
+                puts("Error: -p expects the number of retry passes");
+                return NR_FALSE;
+            }
+        } else if (strcmp(option, "-P") == 0) {
+            if (ntfsrec_copy_parse_status(&arguments, &status) == NR_FALSE)
+                return NR_FALSE;
+        } else {
+            printf("Error: unknown option %s\nUsage: image [-z] [-b KB] [-t ms] [-m map] [-p passes] [-P seconds] <dest>\n", option);
+            return NR_FALSE;
+        }
+        
+        while(*arguments == ' ')
+            ++arguments;
+    }
+    
+    if (strlen(arguments) == 0) {
+        puts("Usage: image [-z] [-b KB] [-t ms] [-m map] [-p passes] [-P seconds] <dest>");
+        return NR_FALSE;
+    }
+    
+    if (ntfsrec_command_require_volume(state) == NR_FALSE)
+        return NR_FALSE;
+    
+    /* A resumed image keeps what earlier runs copied */
+    output_fd = open(arguments, O_WRONLY | O_CREAT | (map_name == NULL ? O_TRUNC : 0), 0644);
+    
+    if (output_fd == -1) {
+        printf("Error: unable to create %s: %s\n", arguments, strerror(errno));
+        return NR_FALSE;
+    }
+    
+    ntfsrec_copy_init(&copy_state, state, arguments);
+    
+    copy_state.opt.zero_holes = zero_holes;
+    copy_state.opt.deadline = deadline;
+    copy_state.opt.buffer_size = buffer_size > copy_state.volume->cluster_size ? buffer_size : copy_state.volume->cluster_size;
+    
+    /* The first pass never retries on the spot, whatever fails is narrowed down by the retry passes */
+    copy_state.map = ntfsrec_badmap_open(map_name);
+    copy_state.opt.retries = 0;
+    
+    if (copy_state.map == NULL) {
+        ntfsrec_copy_abort(state, &copy_state);
+        close(output_fd);
+        return NR_FALSE;
+    }
+    
+    if (ntfsrec_badmap_is_done(copy_state.map, NR_BADMAP_VOLUME)) {
+        puts("The first pass finished in an earlier run, going straight to the retry passes");
+    } else {
+        plan = ntfsrec_image_plan_create(&copy_state, state->reader->mount.name);
+        
+        memset(&total, 0, sizeof total);
+        total.bytes = ntfsrec_image_plan_bytes(plan, copy_state.volume);
+        
+        printf("Imaging %lld of %lld bytes in use to %s\n", (long long)total.bytes,
+               (long long)(copy_state.volume->nr_clusters << copy_state.volume->cluster_size_bits), arguments);
+        
+        ntfsrec_copy_show_status(state, &copy_state, status, &total);
+        copy_state.file_buffer = ntfsrec_allocate(copy_state.opt.buffer_size);
+        
+        ntfsrec_image_plan_execute(&copy_state, plan, output_fd, arguments);
+        ntfsrec_badmap_mark_done(copy_state.map, NR_BADMAP_VOLUME);
+        
+        free(copy_state.file_buffer);
+        ntfsrec_image_plan_destroy(plan);
+    }
+    
+    close(output_fd);
+    
+    ntfsrec_copy_retry_passes(&copy_state, passes);
+    ntfsrec_badmap_close(copy_state.map);
+    
+    return ntfsrec_copy_report(state, &copy_state);
+}
+
+static void ntfsrec_copy_init(struct ntfsrec_copy *copy_state, struct ntfsrec_command_processor *state, const char *output_name) {
+    copy_state->volume = state->reader->mount.volume;
+    copy_state->output_name = output_name;
+    copy_state->queue = NULL;
+    copy_state->worker = 0;
+    copy_state->plan = NULL;
+    copy_state->map = NULL;
+    copy_state->writer = NULL;
+    copy_state->zip = NULL;
+    copy_state->tar = NULL;
+    copy_state->device_fd = -1;
+    copy_state->stats.files = 0;
+    copy_state->stats.dirs = 0;
+    copy_state->stats.errors = 0;
+    copy_state->stats.retries = 0;
+    copy_state->stats.skipped = 0;
+    copy_state->stats.excluded = 0;
+    copy_state->progress = ntfsrec_progress_create();
+    copy_state->manifest = NULL;
+    copy_state->filter = NULL;
+    copy_state->decoder = NULL;
+    copy_state->opt.retries = NR_FILE_MAX_RETRIES;
+    copy_state->opt.zero_holes = NR_FALSE;
+    copy_state->opt.deadline = 0;
+    copy_state->opt.buffer_size = NR_FILE_BUFFER_SIZE;
+    copy_state->opt.quiet = NR_FALSE;
+    copy_state->opt.incremental = NR_FALSE;
+    copy_state->opt.resume_margin = 0;
+    copy_state->skip = 0;
+    
+    copy_state->directory_fd = AT_FDCWD;
+    copy_state->directory_length = 0;
+    copy_state->path = ntfsrec_allocate(NR_COPY_PATH_CAPACITY);
+    copy_state->path_capacity = NR_COPY_PATH_CAPACITY;
+    ntfsrec_path_truncate(copy_state, 0);
+    
+    /* Copies retry bad areas themselves, so blocks that failed while browsing get another go */
+    if (state->reader->settings->cache != NULL)
+        ntfsrec_cache_set_retry(state->reader->settings->cache, NR_TRUE);
+}
+
+static int ntfsrec_copy_report(struct ntfsrec_command_processor *state, struct ntfsrec_copy *copy_state) {
+    ntfsrec_progress_stop(copy_state->progress);
+    
+    printf("Done.\nFiles:\t%u\nDirectories:\t%u\nErrors:\t%u\n", copy_state->stats.files, copy_state->stats.dirs, copy_state->stats.errors);
+    
+    if (copy_state->stats.skipped > 0)
+        printf("Skipped:\t%u (copied by an earlier run)\n", copy_state->stats.skipped);
+    
+    if (copy_state->stats.excluded > 0)
+        printf("Excluded:\t%u (left out by the filters)\n", copy_state->stats.excluded);
+    
+    if (state->result != NULL) {
+        fprintf(state->result, "{\"files\":%u,\"directories\":%u,\"errors\":%u,\"retries\":%u,\"skipped\":%u,\"excluded\":%u,\"progress\":",
+                copy_state->stats.files, copy_state->stats.dirs, copy_state->stats.errors,
+                copy_state->stats.retries, copy_state->stats.skipped, copy_state->stats.excluded);
+        ntfsrec_progress_json(copy_state->progress, state->result);
+        fputc('}', state->result);
+    }
+    
+    ntfsrec_copy_abort(state, copy_state);
+    
+    /* Anything that couldn't be read or written fails the command, so scripts can tell */
+    return copy_state->stats.errors == 0;
+}
+
+/* Releases what copy_init set up, for the end of a copy or one that couldn't start */
+static void ntfsrec_copy_abort(struct ntfsrec_command_processor *state, struct ntfsrec_copy *copy_state) {
+    ntfsrec_progress_destroy(copy_state->progress);
+    copy_state->progress = NULL;
+    
+    free(copy_state->path);
+    copy_state->path = NULL;
+    
+    if (state->reader->settings->cache != NULL)
+        ntfsrec_cache_set_retry(state->reader->settings->cache, NR_FALSE);
+}
+
+static int ntfsrec_copy_parse_status(char **arguments, unsigned int *interval) {
+    char *seconds = ntfsrec_next_argument(arguments);
+    
+    if (seconds == NULL || sscanf(seconds, "%u", interval) != 1) {
+        puts("Error: -P expects the seconds between status lines, or 0 for none");
+        return NR_FALSE;
+    }
+    
+    return NR_TRUE;
+}
+
+static void ntfsrec_copy_show_status(struct ntfsrec_command_processor *state, struct ntfsrec_copy *copy_state,
+                                     unsigned int interval, const struct ntfsrec_copy_total *known) {
+    unsigned int json = state->reader->settings->json != NULL;
+    struct ntfsrec_copy_total total;
+    uint64_t record;
+    
+    /* Unless asked for, the status line is only shown to someone watching a terminal */
+    if (interval == NR_COPY_STATUS_AUTO)
+        interval = !json && isatty(STDOUT_FILENO) ? 1 : 0;
+    
+    if (interval == 0)
+        return;
+    
+    memset(&total, 0, sizeof total);
+    total.filter = copy_state->filter;
+    
+    if (known != NULL) {
+        total = *known;
+    } else if (state->offline) {
+        ntfsrec_copy_table_total(state->table, state->cwd_record, &total);
+    } else if (state->table != NULL && ntfsrec_mft_table_lookup(state->table, state->cwd, &record) == NR_TRUE) {
+        ntfsrec_copy_table_total(state->table, record, &total);
+    } else {
+        /* Without a table the sizes come from the directory indexes, which is quick but may lag a little */
+        total.volume = copy_state->volume;
+        total.directory = state->cwd_inode->mft_no;
+        
+        ntfsrec_index_walk(state->cwd_inode, &total, (ntfsrec_index_visitor)ntfsrec_copy_index_total);
+    }
+    
+    ntfsrec_progress_set_total(copy_state->progress, total.bytes, total.files);
+    
+    copy_state->opt.quiet = !json && isatty(STDOUT_FILENO);
+    ntfsrec_progress_display(copy_state->progress, stdout, interval * 1000, json);
+}
+
+static void ntfsrec_copy_table_total(const struct ntfsrec_mft_table *table, uint64_t directory, struct ntfsrec_copy_total *total) {
+    uint64_t index;
+    
+    if (total->depth++ < NR_COPY_MAX_DEPTH) {
+        for(index = table->child_start[directory]; index < table->child_start[directory + 1]; ++index) {
+            uint64_t record = table->children[index];
+            
+            if (table->flags[record] & NR_MFT_DIRECTORY) {
+                if (ntfsrec_filter_walks(total->filter, record))
+                    ntfsrec_copy_table_total(table, record, total);
+            } else if (total->filter == NULL || ntfsrec_copy_table_match(table, record, total->filter)) {
+                total->bytes += table->size[record];
+                total->files++;
+            }
+        }
+    }
+    
+    total->depth--;
+}
+
+static int ntfsrec_copy_index_total(struct ntfsrec_copy_total *total, MFT_REF mref, const FILE_NAME_ATTR *file_name) {
+    uint64_t parent = total->directory;
+    ntfs_inode *inode;
+    
+    /* Short names duplicate a long one, and the root lists itself */
+    if ((file_name->file_name_type & FILE_NAME_WIN32_AND_DOS) == FILE_NAME_DOS || MREF(mref) == parent)
+        return 0;
+    
+    if ((le32_to_cpu(file_name->file_attributes) & FILE_ATTR_I30_INDEX_PRESENT) == 0) {
+        if (total->filter != NULL) {
+            char name[NR_NAME_LENGTH];
+            
+            if (ntfsrec_utf16_to_utf8(name, sizeof name, (const ntfschar *)(file_name + 1), file_name->file_name_length) < 0 ||
+                ntfsrec_filter_match_index(total->filter, MREF(mref), name, file_name) == NR_FALSE)
+                return 0;
+        }
+        
+        total->bytes += sle64_to_cpu(file_name->data_size);
+        total->files++;
+        return 0;
+    }
+    
+    if (total->depth >= NR_COPY_MAX_DEPTH || !ntfsrec_filter_walks(total->filter, MREF(mref)) ||
+        (inode = ntfs_inode_open(total->volume, mref)) == NULL)
+        return 0;
+    
+    total->directory = inode->mft_no;
+    total->depth++;
+    
+    ntfsrec_index_walk(inode, total, (ntfsrec_index_visitor)ntfsrec_copy_index_total);
+    
+    total->depth--;
+    total->directory = parent;
+    
+    ntfs_inode_close(inode);
+    return 0;
+}
 
-    struct {
-        unsigned int files;
-        unsigned int dirs;
-        unsigned int errors;
-        unsigned int retries;
-    } stats;
+static void ntfsrec_copy_retry_passes(struct ntfsrec_copy *copy_state, unsigned int passes) {
+    unsigned int block_size = NR_COPY_FIRST_RETRY_BLOCK, pass;
+    size_t regions;
+    s64 bytes;
+    
+    /* Each pass halves the read size so the good sectors around a bad one are picked up last */
+    for(pass = 0; pass < passes; ++pass) {
+        regions = ntfsrec_badmap_pending(copy_state->map, &bytes);
+        
+        if (regions == 0)
+            break;
+        
+        printf("Retry pass %u: %lu regions, %lld bytes, reading %u bytes at a time\n", pass + 1,
+               (unsigned long)regions, (long long)bytes, block_size);
+        
+        printf("Recovered %lld bytes\n", (long long)ntfsrec_badmap_retry(copy_state, copy_state->map, block_size));
+        
+        if (block_size <= copy_state->volume->sector_size)
+            break;
+        
+        block_size /= 2;
+    }
+    
+    regions = ntfsrec_badmap_pending(copy_state->map, &bytes);
+    
+    if (regions > 0)
+        printf("Unreadable:\t%lu regions, %lld bytes\n", (unsigned long)regions, (long long)bytes);
+}
+
+static int ntfsrec_copy_parallel(struct ntfsrec_copy *copy_state, struct ntfsrec_command_processor *state,
+                                 unsigned int workers, const char *dest_path) {
+    struct ntfsrec_copy_worker *pool;
+    ntfs_inode *root = state->cwd_inode;
+    unsigned int index, mounted, started;
+    
+    pool = ntfsrec_allocate(workers * sizeof *pool);
+    memset(pool, 0, workers * sizeof *pool);
+    
+    /* libntfs-3g isn't thread safe, so every worker gets a volume and inodes of its own */
+    for(mounted = 0; mounted < workers; ++mounted) {
+        struct ntfsrec_copy_worker *worker = &pool[mounted];
+        
+        worker->reader.settings = state->reader->settings;
+        
+        if (ntfsrec_reader_mount(&worker->reader, state->reader->mount.name, state->reader->mount.options) == NR_FALSE) {
+            printf("Warning: unable to open the volume for worker %u, continuing with %u\n", mounted, mounted);
+            break;
+        }
+    }
+    
+    if (mounted == 0) {
+        free(pool);
+        return NR_FALSE;
+    }
+    
+    copy_state->queue = ntfsrec_workqueue_create(mounted);
+    
+    for(index = 0; index < mounted; ++index) {
+        struct ntfsrec_copy_worker *worker = &pool[index];
+        
+        worker->copy = *copy_state;
+        worker->copy.volume = worker->reader.mount.volume;
+        worker->copy.worker = index;
+        worker->copy.file_buffer = ntfsrec_allocate(copy_state->opt.buffer_size);
+        worker->copy.path = ntfsrec_allocate(NR_COPY_PATH_CAPACITY);
+        worker->copy.path_capacity = NR_COPY_PATH_CAPACITY;
+    }
+    
+    ntfsrec_path_truncate(copy_state, 0);
+    
+    /* Offline the whole tree is known up front, so it's queued before the workers start */
+    if (state->offline)
+        ntfsrec_copy_table_directory(copy_state, state->table, state->cwd_record, dest_path);
+    else
+        ntfsrec_queue_entry(copy_state, MK_MREF(root->mft_no, le16_to_cpu(root->mrec->sequence_number)), NR_TRUE, dest_path);
+    
+    for(started = 1; started < mounted; ++started) {
+        if (pthread_create(&pool[started].thread, NULL, &ntfsrec_copy_worker_main, &pool[started]) != 0) {
+            printf("Warning: unable to start worker %u\n", started);
+            break;
+        }
+    }
+    
+    /* The command's thread is worker 0, so the queue drains even if no other thread started */
+    ntfsrec_copy_worker_main(&pool[0]);
+    
+    for(index = 0; index < mounted; ++index) {
+        struct ntfsrec_copy_worker *worker = &pool[index];
+        
+        if (index > 0 && index < started)
+            pthread_join(worker->thread, NULL);
+        
+        copy_state->stats.files += worker->copy.stats.files;
+        copy_state->stats.dirs += worker->copy.stats.dirs;
+        copy_state->stats.errors += worker->copy.stats.errors;
+        copy_state->stats.retries += worker->copy.stats.retries;
+        copy_state->stats.skipped += worker->copy.stats.skipped;
+        copy_state->stats.excluded += worker->copy.stats.excluded;
+        
+        free(worker->copy.file_buffer);
+        free(worker->copy.path);
+        ntfsrec_reader_release(&worker->reader);
+    }
+    
+    ntfsrec_workqueue_destroy(copy_state->queue);
+    copy_state->queue = NULL;
+    
+    free(pool);
+    return NR_TRUE;
+}
+
+static void *ntfsrec_copy_worker_main(void *argument) {
+    struct ntfsrec_copy_worker *worker = argument;
+    struct ntfsrec_copy *state = &worker->copy;
+    struct ntfsrec_copy_item *item;
+    
+    while((item = ntfsrec_workqueue_pop(state->queue, state->worker)) != NULL) {
+        const char *name = &item->path[item->name_offset];
+        ntfs_inode *inode;
+        
+        /* Both copy functions append the entry's name to the parent path themselves, and a short one is opened by its full path */
+        ntfsrec_path_truncate(state, 0);
+        ntfsrec_path_append(state, item->path, item->name_offset);
+        state->directory_fd = AT_FDCWD;
+        state->directory_length = 0;
+        
+        /* Past what the kernel takes in one path the parent is opened first, so names stay relative to it */
+        if (item->name_offset + NR_NAME_LENGTH >= PATH_MAX) {
+            int directory_fd = ntfsrec_open_path(AT_FDCWD, state->path, O_RDONLY | O_DIRECTORY, 0);
+            
+            if (directory_fd != -1) {
+                state->directory_fd = directory_fd;
+                state->directory_length = item->name_offset;
+            }
+        }
+        
+        inode = ntfs_inode_open(state->volume, item->mref);
+        
+        if (inode != NULL) {
+            if (item->is_dir)
+                ntfsrec_recurse_directory(state, inode, name);
+            else
+                ntfsrec_emit_file(state, inode, name);
+            
+            ntfs_inode_close(inode);
+        } else {
+            printf("Error: couldn't open %s %s\n", item->is_dir ? "folder" : "file", item->path);
+            state->stats.errors++;
+        }
+        
+        if (state->directory_fd != AT_FDCWD) {
+            close(state->directory_fd);
+            state->directory_fd = AT_FDCWD;
+        }
+        
+        free(item);
+        ntfsrec_workqueue_complete(state->queue);
+    }
+    
+    return NULL;
+}
+
+static void ntfsrec_queue_entry(struct ntfsrec_copy *state, MFT_REF mref, unsigned int is_dir, const char *name) {
+    struct ntfsrec_copy_item *item;
+    size_t parent_length = state->path_length;
+    size_t name_length = strlen(name);
+    
+    item = ntfsrec_allocate(sizeof *item + parent_length + name_length + 1);
+    
+    item->mref = mref;
+    item->is_dir = is_dir;
+    item->name_offset = parent_length;
+    
+    memcpy(item->path, state->path, parent_length);
+    memcpy(&item->path[parent_length], name, name_length + 1);
+    
+    ntfsrec_workqueue_push(state->queue, state->worker, item);
+}
+
+static int ntfsrec_recurse_directory(struct ntfsrec_copy *state, ntfs_inode *folder_node, const char *name) {
+    struct ntfsrec_copy_level parent;
+    struct ntfsrec_file_meta meta;
+    s64 position = 0;
+    
+    meta.size = 0;
+    meta.flags = folder_node->flags;
+    meta.created = ntfs2timespec(folder_node->creation_time);
+    meta.modified = ntfs2timespec(folder_node->last_data_change_time);
+    
+    if (ntfsrec_enter_directory(state, name, &meta, &parent) == NR_FALSE)
+        return NR_FALSE;
+    
+    /*
+     * With filters the index entries are walked instead, so the files they leave out are never opened.
+     * A damaged index falls back to readdir, which may go over entries the walk already handled.
+     */
+    if (state->filter != NULL && ntfsrec_index_walk(folder_node, state, (ntfsrec_index_visitor)ntfsrec_copy_index_visitor) == NR_TRUE) {
+        /* Every entry has been through ntfsrec_copy_entry */
+    } else if (ntfs_readdir(folder_node, &position, state, (ntfs_filldir_t)ntfsrec_cpz_directory_visitor) != 0) {
+        printf("Error: unable to traverse directory %s\n", state->path);
+        state->stats.errors++;
+    }
+    
+    ntfsrec_leave_directory(state, &parent);
+    return NR_TRUE;
+}
+
+static int ntfsrec_copy_table_directory(struct ntfsrec_copy *state, const struct ntfsrec_mft_table *table,
+                                        uint64_t directory, const char *name) {
+    struct ntfsrec_copy_level parent;
+    struct ntfsrec_file_meta meta;
+    uint64_t index;
+    
+    meta.size = 0;
+    meta.flags = table->attributes[directory];
+    meta.created = ntfs2timespec(table->created[directory]);
+    meta.modified = ntfs2timespec(table->modified[directory]);
+    
+    if (ntfsrec_enter_directory(state, name, &meta, &parent) == NR_FALSE)
+        return NR_FALSE;
+    
+    for(index = table->child_start[directory]; index < table->child_start[directory + 1]; ++index) {
+        uint64_t record = table->children[index];
+        const char *child_name = &table->names[table->name_offset[record]];
+        MFT_REF mref = MK_MREF(record, table->sequence[record]);
+        ntfs_inode *inode;
+        
+        if (table->flags[record] & NR_MFT_DIRECTORY) {
+            if (ntfsrec_filter_walks(state->filter, record))
+                ntfsrec_copy_table_directory(state, table, record, child_name);
+            
+            continue;
+        }
+        
+        if (state->filter != NULL && ntfsrec_copy_table_match(table, record, state->filter) == NR_FALSE) {
+            state->stats.excluded++;
+            continue;
+        }
+        
+        if (state->queue != NULL) {
+            ntfsrec_queue_entry(state, mref, NR_FALSE, child_name);
+            continue;
+        }
+        
+        inode = ntfs_inode_open(state->volume, mref);
+        
+        if (inode != NULL) {
+            ntfsrec_emit_file(state, inode, child_name);
+            ntfs_inode_close(inode);
+        } else {
+            printf("Error: couldn't open file %s\n", child_name);
+            state->stats.errors++;
+        }
+    }
     
-    struct {
-        unsigned int retries;
-    } opt;
+    ntfsrec_leave_directory(state, &parent);
+    return NR_TRUE;
+}
+
+static int ntfsrec_enter_directory(struct ntfsrec_copy *state, const char *name, const struct ntfsrec_file_meta *meta, struct ntfsrec_copy_level *parent) {
+    const char *relative;
+    int directory_fd;
     
-    char *file_buffer;
+    parent->path_length = state->path_length;
+    parent->directory_length = state->directory_length;
+    parent->directory_fd = state->directory_fd;
     
-    char *current_path_end;
-    char path[MAX_PATH_LENGTH];
-};
-
-static int ntfsrec_recurse_directory(struct ntfsrec_copy* state, ntfs_inode* folder_node, const char* name);
-static int ntfsrec_cpz_directory_visitor(struct ntfsrec_copy *state, const ntfschar *name,
-                                         const int name_len, const int name_type, const s64 pos,
-                                         const MFT_REF mref, const unsigned dt_type);
-
-static int ntfsrec_append_filename(struct ntfsrec_copy *state, const char *path, char **old_end);
-static int ntfsrec_emit_file(struct ntfsrec_copy *state, ntfs_inode *inode, const char *name);
-
-void ntfsrec_command_cp(struct ntfsrec_command_processor *state, char *arguments) {
-    char dest_path[128];
-    struct ntfsrec_copy copy_state;
+    ntfsrec_path_append(state, name, strlen(name));
+    ntfsrec_path_append(state, "/", 1);
     
-    if (strlen(arguments) != 0) {
-        if ((size_t)snprintf(dest_path, sizeof dest_path, "./%s", arguments) >= sizeof dest_path) {
-            printf("Error: path %s is too long\n", arguments);
-            return;
-        }
-    } else {
-        strcpy(dest_path, ".");
+    /* Archive entries are named relative to the starting directory, which itself isn't stored */
+    if (state->zip != NULL || state->tar != NULL) {
+        if (strcmp(state->path, "./") == 0)
+            return NR_TRUE;
+        
+        if (state->zip != NULL)
+            ntfsrec_zip_add_directory(state->zip, &state->path[2], meta->modified.tv_sec);
+        else
+            ntfsrec_tar_add_directory(state->tar, &state->path[2], meta);
+        
+        return NR_TRUE;
     }
     
-    memset(copy_state.path, 0, sizeof copy_state.path);
+    /* Resumed and incremental runs walk into directories made by the earlier run, opening one that's a file fails */
+    relative = &state->path[state->directory_length];
+    directory_fd = -1;
     
-    copy_state.volume = state->reader->mount.volume;
-    copy_state.output_name = arguments;
-    copy_state.stats.files = 0;
-    copy_state.stats.dirs = 0;
-    copy_state.stats.errors = 0;
-    copy_state.stats.retries = 0;
-    copy_state.opt.retries = NR_FILE_MAX_RETRIES;
+    if (mkdirat(state->directory_fd, relative, 0755) == 0 || errno == EEXIST)
+        directory_fd = openat(state->directory_fd, relative, O_RDONLY | O_DIRECTORY);
     
-    copy_state.file_buffer = ntfsrec_allocate(NR_FILE_BUFFER_SIZE);
-    
-    copy_state.current_path_end = copy_state.path;
+    if (directory_fd != -1) {
+        /* Everything below is created relative to this directory, so the kernel never walks the full path again */
+        state->directory_fd = directory_fd;
+        state->directory_length = state->path_length;
+    } else if (errno != EMFILE && errno != ENFILE) {
+        printf("Error: unable to create directory %s\n", state->path);
+        state->stats.errors++;
+        ntfsrec_path_truncate(state, parent->path_length);
+        return NR_FALSE;
+    }
     
-    ntfsrec_recurse_directory(&copy_state, state->cwd_inode, dest_path);
+    /* Out of descriptors, names below carry on relative to the parent's directory instead */
     
-    printf("Done.\nFiles:\t%u\nDirectories:\t%u\nErrors:\t%u\n", copy_state.stats.files, copy_state.stats.dirs, copy_state.stats.errors);
+    if (!state->opt.quiet)
+        printf("Adding directory %s\n", state->path);
     
-    free(copy_state.file_buffer);
-    return;
+    return NR_TRUE;
 }
 
-void ntfsrec_command_cpz(struct ntfsrec_command_processor *state, char *arguments) {
-    NR_UNUSED(state);
-    NR_UNUSED(arguments);
+static void ntfsrec_leave_directory(struct ntfsrec_copy *state, const struct ntfsrec_copy_level *parent) {
+    state->stats.dirs++;
+    
+    if (state->directory_fd != parent->directory_fd)
+        close(state->directory_fd);
     
-    puts("This command isn't implemented.");
-    return;
+    state->directory_fd = parent->directory_fd;
+    state->directory_length = parent->directory_length;
+    ntfsrec_path_truncate(state, parent->path_length);
 }
 
-static int ntfsrec_recurse_directory(struct ntfsrec_copy *state, ntfs_inode *folder_node, const char *name) {
-    char *old_path_end;
-    int name_length;
-    s64 position = 0;
-    const int max_length = MAX_PATH_LENGTH - (state->current_path_end - state->path);
-    
-    old_path_end = state->current_path_end;
-    name_length = snprintf(state->current_path_end, max_length, "%s/", name);
-    
-    if (name_length >= max_length) {
-        printf("Error: path %s exceeded the maximum allowable lenth.\n", state->path);
-        *old_path_end = '\0';
-        return NR_FALSE;
-    }
+static int ntfsrec_copy_index_visitor(struct ntfsrec_copy *state, MFT_REF mref, const FILE_NAME_ATTR *file_name) {
+    const unsigned int is_dir = (le32_to_cpu(file_name->file_attributes) & FILE_ATTR_I30_INDEX_PRESENT) != 0;
+    char name[NR_NAME_LENGTH];
     
-    state->current_path_end = &state->current_path_end[name_length];
+    if ((file_name->file_name_type & FILE_NAME_WIN32_AND_DOS) == FILE_NAME_DOS)
+        return 0;
     
-    if (mkdir(state->path, 0755) != 0) {
-        printf("Error: unable to create directory %s\n", state->path);
-        
-        *old_path_end = '\0';
-        state->current_path_end = old_path_end;
-        return NR_FALSE;
+    /* Converted once here, the filter and the copy both use it */
+    if (ntfsrec_utf16_to_utf8(name, sizeof name, (const ntfschar *)(file_name + 1), file_name->file_name_length) < 0) {
+        puts("Error: this filename is too long to convert.");
+        state->stats.errors++;
+        return 0;
     }
     
-    printf("Adding directory %s\n", state->path);
+    if (is_dir && !ntfsrec_filter_walks(state->filter, MREF(mref)))
+        return 0;
     
-    if (ntfs_readdir(folder_node, &position, state, (ntfs_filldir_t)ntfsrec_cpz_directory_visitor) != 0) {
-        printf("Error: unable to traverse directory %s\n", state->path);
+    if (!is_dir && ntfsrec_filter_match_index(state->filter, MREF(mref), name, file_name) == NR_FALSE) {
+        state->stats.excluded++;
+        return 0;
     }
     
-    state->stats.dirs++;
-    *old_path_end = '\0';
-    state->current_path_end = old_path_end;
-    return NR_TRUE;
+    return ntfsrec_copy_entry(state, name, mref, is_dir);
 }
 
 static int ntfsrec_cpz_directory_visitor(struct ntfsrec_copy *state, const ntfschar *name, const int name_len, const int name_type, const s64 pos, const MFT_REF mref, const unsigned dt_type) {
-    char *local_name = NULL;
-    ntfs_inode *inode;
+    char local_name[NR_NAME_LENGTH];
     
     NR_UNUSED(pos);
     
@@ -133,18 +1176,29 @@ static int ntfsrec_cpz_directory_visitor(struct ntfsrec_copy *state, const ntfsc
         return 0;
     }
     
-    if (ntfs_ucstombs(name, name_len, &local_name, MAX_PATH_LENGTH) < 0) {
-        puts("Error: this filename can't be represented in your locale.");
+    /* Converted on the stack, an NTFS name has a fixed maximum length where a path doesn't */
+    if (ntfsrec_utf16_to_utf8(local_name, sizeof local_name, name, name_len) < 0) {
+        puts("Error: this filename is too long to convert.");
+        state->stats.errors++;
         return 0;
     }
     
-    if (dt_type & NTFS_DT_DIR) {
+    return ntfsrec_copy_entry(state, local_name, mref, (dt_type & NTFS_DT_DIR) != 0);
+}
+
+static int ntfsrec_copy_entry(struct ntfsrec_copy *state, const char *local_name, MFT_REF mref, unsigned int is_dir) {
+    ntfs_inode *inode;
+    
+    if (is_dir) {
         ntfs_inode *dir_inode;
         
         if (strcmp(local_name, ".") == 0 || strcmp(local_name, "..") == 0 ||
             strcmp(local_name, "./") == 0 || strcmp(local_name, "../") == 0) {
-            free(local_name);
-            
+            return 0;
+        }
+        
+        if (state->queue != NULL) {
+            ntfsrec_queue_entry(state, mref, NR_TRUE, local_name);
             return 0;
         }
         
@@ -152,14 +1206,18 @@ static int ntfsrec_cpz_directory_visitor(struct ntfsrec_copy *state, const ntfsc
         
         if (dir_inode == NULL) {
             printf("Error: couldn't open folder %s\n", local_name);
-            free(local_name);
+            state->stats.errors++;
             return 0;
         }
         
         ntfsrec_recurse_directory(state, dir_inode, local_name);
         
         ntfs_inode_close(dir_inode);
-        free(local_name);
+        return 0;
+    }
+    
+    if (state->queue != NULL) {
+        ntfsrec_queue_entry(state, mref, NR_FALSE, local_name);
         return 0;
     }
     
@@ -170,78 +1228,198 @@ static int ntfsrec_cpz_directory_visitor(struct ntfsrec_copy *state, const ntfsc
         ntfs_inode_close(inode);
     } else {
         printf("Error: couldn't open file %s\n", local_name);
+        state->stats.errors++;
     }
     
-    free(local_name);
-    
     return 0;
 }
 
 
-static int ntfsrec_append_filename(struct ntfsrec_copy *state, const char *path, char **old_end) {
-    int remaining_size = MAX_PATH_LENGTH - (state->current_path_end - state->path);
-    int added_length;
-    
-    *old_end = state->current_path_end;
-    
-    added_length = snprintf(state->current_path_end, remaining_size, "%s", path);
-    
-    if (added_length >= remaining_size) {
-        *state->current_path_end = '\0';
-        return NR_FALSE;
+/* The path is a stack that only ever grows, so a deep tree costs a few reallocations and no more */
+static void ntfsrec_path_append(struct ntfsrec_copy *state, const char *text, size_t length) {
+    if (state->path_length + length >= state->path_capacity) {
+        while(state->path_length + length >= state->path_capacity)
+            state->path_capacity *= 2;
+        
+        state->path = ntfsrec_reallocate(state->path, state->path_capacity);
     }
     
-    state->current_path_end += added_length;
-    return NR_TRUE;
+    memcpy(&state->path[state->path_length], text, length);
+    state->path_length += length;
+    state->path[state->path_length] = '\0';
+}
+
+static void ntfsrec_path_truncate(struct ntfsrec_copy *state, size_t length) {
+    state->path_length = length;
+    state->path[length] = '\0';
 }
 
 static int ntfsrec_emit_file(struct ntfsrec_copy *state, ntfs_inode *inode, const char *name) {
+    const MFT_REF mref = MK_MREF(inode->mft_no, le16_to_cpu(inode->mrec->sequence_number));
+    const size_t old_length = state->path_length;
+    struct ntfsrec_file_meta meta;
+    const struct timespec *modified = NULL;
     ntfs_attr *data_attribute;
-    char *old_path_end;
+    s64 resume = 0;
+    
+    if (state->map != NULL && ntfsrec_badmap_is_done(state->map, mref)) {
+        state->stats.skipped++;
+        ntfsrec_progress_skip(state->progress);
+        return NR_TRUE;
+    }
+    
+    if (state->filter != NULL && ntfsrec_copy_filter_inode(state, inode, name) == NR_FALSE) {
+        state->stats.excluded++;
+        return NR_TRUE;
+    }
     
+    ntfsrec_path_append(state, name, strlen(name));
     
-    if (ntfsrec_append_filename(state, name, &old_path_end) == NR_FALSE) {
-        printf("Error: path %s and filename %s are too long.\n", state->path, name);
-        return NR_FALSE;
+    /* Copies carry the NTFS modification time, which an incremental run takes as the sign that a file is complete */
+    if (ntfsrec_reader_get_inode_meta(inode, NR_FALSE, &meta) == NR_TRUE)
+        modified = &meta.modified;
+    
+    if (state->zip == NULL && state->tar == NULL && ntfsrec_emit_resident(state, inode, mref, modified != NULL ? &meta : NULL) == NR_TRUE) {
+        ntfsrec_path_truncate(state, old_length);
+        return NR_TRUE;
     }
     
     data_attribute = ntfs_attr_open(inode, AT_DATA, NULL, 0);
-
-    if (data_attribute != NULL) {
+    
+    if (data_attribute != NULL && state->opt.incremental && modified != NULL && state->zip == NULL && state->tar == NULL)
+        resume = ntfsrec_resume_offset(state, inode, data_attribute->data_size, &meta);
+    
+    if (resume < 0) {
+        state->stats.skipped++;
+        ntfsrec_progress_skip(state->progress);
+        ntfs_attr_close(data_attribute);
+    } else if (data_attribute != NULL && state->plan != NULL && resume == 0 &&
+               ntfsrec_extent_plan_add(state, data_attribute, modified) == NR_TRUE) {
+        ntfs_attr_close(data_attribute);
+    } else if (data_attribute != NULL && (state->zip != NULL || state->tar != NULL)) {
+        if (ntfsrec_archive_file(state, inode, data_attribute) == NR_TRUE) {
+            state->stats.files++;
+            ntfsrec_progress_file(state->progress);
+        }
+        
+        ntfs_attr_close(data_attribute);
+    } else if (data_attribute != NULL) {
         int output_fd;
-        unsigned int block_size = 0, retries = 0;
-        s64 offset = 0;
+        unsigned int block_size = 0, retries = 0, sparse = NR_FALSE;
+        struct ntfsrec_writer_file *output_file = NULL;
+        struct ntfsrec_compressed *compressed = NULL;
+        struct ntfsrec_file_hash *hash = NULL;
+        runlist_element *run = NULL;
+        char *buffer = state->file_buffer;
+        s64 offset = resume, narrow_until = 0;
+        unsigned int failed = NR_FALSE, deferred = NR_FALSE, lost = NR_FALSE;
         
-        output_fd = open(state->path, O_WRONLY | O_CREAT);
+        /* A resumed file is read back for its hashes, since the earlier run's didn't survive */
+        if (resume > 0)
+            output_fd = openat(state->directory_fd, &state->path[state->directory_length], state->manifest != NULL ? O_RDWR : O_WRONLY);
+        else
+            output_fd = openat(state->directory_fd, &state->path[state->directory_length], O_WRONLY | O_CREAT | O_TRUNC, 0644);
         
         if (output_fd != -1) {
             if (inode->mft_no < 2) {
                 block_size = state->volume->mft_record_size;
+            } else if (NAttrNonResident(data_attribute) && !NAttrCompressed(data_attribute) && !NAttrEncrypted(data_attribute)) {
+                /* Compressed runlists use holes for compression so only plain data can be skipped */
+                if (ntfs_attr_map_whole_runlist(data_attribute) == 0) {
+                    sparse = NR_TRUE;
+                    run = data_attribute->rl;
+                }
+            } else if (NAttrCompressed(data_attribute)) {
+                compressed = ntfsrec_compressed_open(data_attribute, state->decoder);
+            }
+            
+            /* With a writer the buffer is handed off after each read and the next read starts straight away */
+            if (state->writer != NULL) {
+                output_file = ntfsrec_writer_open(state->writer, output_fd, state->path, state->map, mref);
+                buffer = NULL;
             }
             
+            if (state->manifest != NULL) {
+                hash = ntfsrec_manifest_begin(state->manifest);
+                
+                /* The copy carries on from however much of the earlier part could be read back and hashed */
+                if (resume > 0)
+                    offset = ntfsrec_hash_existing(state, hash, output_fd, resume);
+            }
+            
+            if (resume > 0 && !state->opt.quiet)
+                printf("Resuming %s at %lld\n", state->path, (long long)offset);
+            
             for(;;) {
-                s64 bytes_read = 0;
+                s64 bytes_read = 0, request = state->opt.buffer_size;
+                uint64_t started = ntfsrec_progress_clock();
+                unsigned int slow;
+                
+                if (offset < narrow_until)
+                    request = NR_COPY_FIRST_RETRY_BLOCK;
+                
+                if (sparse) {
+                    s64 available = ntfsrec_next_data_run(data_attribute, state->volume->cluster_size_bits, &run, &offset);
+                    
+                    if (available == 0)
+                        break;
+                    
+                    if (available < request)
+                        request = available;
+                }
+                
+                if (buffer == NULL)
+                    buffer = ntfsrec_writer_get_buffer(state->writer);
                 
                 if (block_size > 0) {
-                    bytes_read = ntfs_attr_mst_pread(data_attribute, offset, 1, block_size, state->file_buffer);
+                    bytes_read = ntfs_attr_mst_pread(data_attribute, offset, 1, block_size, buffer);
                     bytes_read *= block_size;
+                } else if (compressed != NULL) {
+                    bytes_read = ntfsrec_compressed_pread(compressed, offset, request, buffer);
                 } else {
-                    bytes_read = ntfs_attr_pread(data_attribute, offset, NR_FILE_BUFFER_SIZE, state->file_buffer);
+                    bytes_read = ntfs_attr_pread(data_attribute, offset, request, buffer);
+                }
+                
+                ntfsrec_progress_read(state->progress, bytes_read, started);
+                slow = state->opt.deadline > 0 && (ntfsrec_progress_clock() - started) / 1000 > state->opt.deadline;
+                
+                if (bytes_read < 0 && state->opt.deadline > 0) {
+                    state->stats.errors++;
+                    offset = ntfsrec_skip_ahead(state, mref, offset, data_attribute->initialized_size, &deferred);
+                    continue;
                 }
                 
-                if (bytes_read == -1) {
-                    unsigned int actual_size = block_size > 0 ? block_size : NR_FILE_BUFFER_SIZE;
+                if (bytes_read < 0) {
+                    unsigned int actual_size = block_size > 0 ? block_size : request;
                     
                     if (retries++ < state->opt.retries) {
                         state->stats.retries++;
+                        ntfsrec_progress_retry(state->progress);
+                        continue;
+                    }
+                    
+                    /* A large read fails as a whole, so it's repeated in small blocks to only lose the bad ones */
+                    if (block_size == 0 && state->map == NULL && request > NR_COPY_FIRST_RETRY_BLOCK) {
+                        narrow_until = offset + request;
+                        retries = 0;
                         continue;
                     }
                     
                     state->stats.errors++;
                     printf("Error: failed %u times to read %s, skipping %d bytes\n", retries, name, actual_size);
                     
-                    lseek(output_fd, actual_size, SEEK_CUR);
+                    /* A range the retry passes will come back to is only listed once they're done */
+                    if (state->map != NULL) {
+                        ntfsrec_badmap_add(state->map, mref, offset, actual_size, state->path);
+                        deferred = NR_TRUE;
+                    } else {
+                        lost = NR_TRUE;
+                        
+                        if (state->manifest != NULL)
+                            ntfsrec_manifest_zeroed(state->manifest, offset, actual_size, state->path);
+                    }
                     
+                    retries = 0;
                     offset += actual_size;
                     continue;
                 }
@@ -250,32 +1428,463 @@ static int ntfsrec_emit_file(struct ntfsrec_copy *state, ntfs_inode *inode, cons
                     break;
                 }
                 
-                if (write(output_fd, state->file_buffer, bytes_read) < 0) {
+                /* Hashed before the buffer can go to the writer, which owns it from then on */
+                if (hash != NULL)
+                    ntfsrec_file_hash_update(hash, offset, buffer, bytes_read);
+                
+                if (state->opt.zero_holes && ntfsrec_is_zero(buffer, bytes_read)) {
+                    /* Nothing to write, the buffer is reused for the next read */
+                } else if (output_file != NULL) {
+                    /* Counted as written once queued, the writer reports its own failures at the end */
+                    ntfsrec_writer_write(state->writer, output_file, buffer, bytes_read, offset);
+                    ntfsrec_progress_write(state->progress, bytes_read);
+                    buffer = NULL;
+                } else if (pwrite(output_fd, buffer, bytes_read, offset) < 0) {
                     printf("Error: unable to write to output file %s\n", state->path);
                     
                     if (retries++ < state->opt.retries) {
                         state->stats.retries++;
+                        ntfsrec_progress_retry(state->progress);
                         continue;
                     }
                     
+                    failed = NR_TRUE;
                     break;
+                } else {
+                    ntfsrec_progress_write(state->progress, bytes_read);
                 }
                 
                 retries = 0;
                 offset += bytes_read;
+                
+                /* A slow read still delivered its data, but the area around it is likely failing too */
+                if (slow)
+                    offset = ntfsrec_skip_ahead(state, mref, offset, data_attribute->initialized_size, &deferred);
+                else
+                    state->skip = 0;
             }
             
-            close(output_fd);
+            if (hash != NULL && deferred)
+                ntfsrec_manifest_defer(state->manifest, hash, data_attribute->data_size, mref, state->path);
+            else if (hash != NULL)
+                ntfsrec_manifest_finish(state->manifest, hash, data_attribute->data_size, state->path);
+            
+            if (compressed != NULL)
+                ntfsrec_compressed_close(compressed);
+            
+            /* The time tells an incremental run the file is complete, so one with any data missing goes without */
+            if (lost || deferred)
+                modified = NULL;
+            
+            if (output_file != NULL) {
+                if (buffer != NULL)
+                    ntfsrec_writer_put_buffer(state->writer, buffer);
+                
+                ntfsrec_writer_close(state->writer, output_file, data_attribute->data_size, modified);
+            } else {
+                /* Skipped holes, zero blocks and unreadable ranges stay unallocated in the output */
+                if (ftruncate(output_fd, data_attribute->data_size) != 0) {
+                    printf("Error: unable to set the size of output file %s\n", state->path);
+                    failed = NR_TRUE;
+                }
+                
+                if (!failed && modified != NULL) {
+                    struct timespec times[2] = { { 0, UTIME_OMIT }, *modified };
+                    
+                    futimens(output_fd, times);
+                }
+                
+                close(output_fd);
+                
+                /* A file that couldn't be written is left for the next run to redo */
+                if (state->map != NULL && !failed)
+                    ntfsrec_badmap_mark_done(state->map, mref);
+            }
+        } else {
+            printf("Error: unable to create output file %s: %s\n", state->path, strerror(errno));
+            failed = NR_TRUE;
+        }
+        
+        if (failed) {
+            state->stats.errors++;
+        } else {
+            state->stats.files++;
+            ntfsrec_progress_file(state->progress);
         }
         
-        state->stats.files++;
         ntfs_attr_close(data_attribute);
     } else {
         printf("Error: can't access the data for %s\n", name);
+        state->stats.errors++;
     }
+    
+    ntfsrec_path_truncate(state, old_length);
+    return NR_TRUE;
+}
 
-    *old_path_end = '\0';
-    state->current_path_end = old_path_end;
+
+/*
+ * Copies a file whose data is resident straight from its MFT record, which is in memory already, so
+ * there's no attribute to open and nothing to read. With a writer the file is also created on its
+ * thread. Returns NR_FALSE, having done nothing, for data that has to go the usual way.
+ */
+static int ntfsrec_emit_resident(struct ntfsrec_copy *state, ntfs_inode *inode, MFT_REF mref, const struct ntfsrec_file_meta *meta) {
+    const struct timespec *modified = meta != NULL ? &meta->modified : NULL;
+    ntfs_attr_search_ctx *search_ctx;
+    const ATTR_RECORD *attribute;
+    const char *value;
+    s64 length, written;
+    
+    search_ctx = ntfs_attr_get_search_ctx(inode, NULL);
+    
+    if (search_ctx == NULL)
+        return NR_FALSE;
+    
+    if (ntfs_attr_lookup(AT_DATA, AT_UNNAMED, 0, 0, 0, NULL, 0, search_ctx) != 0) {
+        ntfs_attr_put_search_ctx(search_ctx);
+        return NR_FALSE;
+    }
+    
+    attribute = search_ctx->attr;
+    length = le32_to_cpu(attribute->value_length);
+    
+    /* Encrypted data needs the library, and a value running past its attribute is left to its checks */
+    if (attribute->non_resident || (attribute->flags & (ATTR_IS_ENCRYPTED | ATTR_COMPRESSION_MASK)) ||
+        le16_to_cpu(attribute->value_offset) + length > le32_to_cpu(attribute->length) ||
+        (state->writer != NULL && (size_t)length > ntfsrec_writer_buffer_size(state->writer))) {
+        ntfs_attr_put_search_ctx(search_ctx);
+        return NR_FALSE;
+    }
+    
+    value = (const char *)attribute + le16_to_cpu(attribute->value_offset);
+    
+    if (state->opt.incremental && meta != NULL && ntfsrec_resume_offset(state, inode, length, meta) < 0) {
+        state->stats.skipped++;
+        ntfsrec_progress_skip(state->progress);
+        ntfs_attr_put_search_ctx(search_ctx);
+        return NR_TRUE;
+    }
+    
+    ntfsrec_progress_read(state->progress, length, ntfsrec_progress_clock());
+    
+    if (state->manifest != NULL) {
+        struct ntfsrec_file_hash *hash = ntfsrec_manifest_begin(state->manifest);
+        
+        ntfsrec_file_hash_update(hash, 0, value, length);
+        ntfsrec_manifest_finish(state->manifest, hash, length, state->path);
+    }
+    
+    written = state->opt.zero_holes && ntfsrec_is_zero(value, length) ? 0 : length;
+    
+    if (state->writer != NULL) {
+        struct ntfsrec_writer_file *output_file = ntfsrec_writer_create_file(state->writer, state->directory_fd, state->path,
+                                                                               state->directory_length, state->map, mref);
+        
+        if (written > 0) {
+            char *buffer = ntfsrec_writer_get_buffer(state->writer);
+            
+            memcpy(buffer, value, written);
+            ntfsrec_writer_write(state->writer, output_file, buffer, written, 0);
+        }
+        
+        ntfsrec_writer_close(state->writer, output_file, length, modified);
+    } else {
+        int output_fd = openat(state->directory_fd, &state->path[state->directory_length], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        
+        if (output_fd == -1 || (written > 0 && pwrite(output_fd, value, written, 0) != written) ||
+            (written < length && ftruncate(output_fd, length) != 0)) {
+            printf("Error: unable to write to output file %s\n", state->path);
+            state->stats.errors++;
+            
+            if (output_fd != -1)
+                close(output_fd);
+            
+            ntfs_attr_put_search_ctx(search_ctx);
+            return NR_TRUE;
+        }
+        
+        if (modified != NULL) {
+            struct timespec times[2] = { { 0, UTIME_OMIT }, *modified };
+            
+            futimens(output_fd, times);
+        }
+        
+        close(output_fd);
+        
+        if (state->map != NULL)
+            ntfsrec_badmap_mark_done(state->map, mref);
+    }
+    
+    ntfsrec_progress_write(state->progress, written);
+    ntfsrec_progress_file(state->progress);
+    state->stats.files++;
+    
+    ntfs_attr_put_search_ctx(search_ctx);
     return NR_TRUE;
 }
 
+/*
+ * Tests a file against the filters by its own record, which has been read but whose data hasn't been touched.
+ * Entries from an index were tested already, this catches sizes that were stale there and the readdir path.
+ */
+static int ntfsrec_copy_filter_inode(struct ntfsrec_copy *state, ntfs_inode *inode, const char *name) {
+    struct ntfsrec_file_meta meta;
+    
+    if (!ntfsrec_filter_needs_meta(state->filter))
+        return ntfsrec_filter_match(state->filter, inode->mft_no, name, NULL);
+    
+    memset(&meta, 0, sizeof meta);
+    ntfsrec_reader_get_inode_meta(inode, NR_FALSE, &meta);
+    
+    /* $STANDARD_INFORMATION holds the current times and attributes, the record's $FILE_NAME copy can lag */
+    meta.flags = inode->flags;
+    meta.created = ntfs2timespec(inode->creation_time);
+    meta.modified = ntfs2timespec(inode->last_data_change_time);
+    
+    return ntfsrec_filter_match(state->filter, inode->mft_no, name, &meta);
+}
+
+static int ntfsrec_copy_table_match(const struct ntfsrec_mft_table *table, uint64_t record, const struct ntfsrec_filter *filter) {
+    struct ntfsrec_file_meta meta;
+    
+    meta.size = table->size[record];
+    meta.flags = table->attributes[record];
+    meta.created = ntfs2timespec(table->created[record]);
+    meta.modified = ntfs2timespec(table->modified[record]);
+    
+    return ntfsrec_filter_match(filter, record, &table->names[table->name_offset[record]], &meta);
+}
+
+/*
+ * Looks at what an earlier run left at the output path. Returns -1 if the file is complete, as its size and
+ * modification time match, otherwise the offset to carry on copying from.
+ */
+static s64 ntfsrec_resume_offset(struct ntfsrec_copy *state, ntfs_inode *inode, s64 data_size, const struct ntfsrec_file_meta *meta) {
+    struct stat existing;
+    s64 offset;
+    
+    if (fstatat(state->directory_fd, &state->path[state->directory_length], &existing, 0) != 0 || !S_ISREG(existing.st_mode))
+        return 0;
+    
+    /* Only whole seconds are compared, as some destinations keep coarser times than NTFS */
+    if (existing.st_size == data_size && existing.st_mtim.tv_sec == meta->modified.tv_sec)
+        return -1;
+    
+    /* A disk order copy sizes its files up front, so only a short file tells how far the copy got */
+    if (existing.st_size >= data_size || inode->mft_no < 2)
+        return 0;
+    
+    offset = existing.st_size - state->opt.resume_margin;
+    
+    if (offset <= 0)
+        return 0;
+    
+    return offset & ~((s64)state->volume->cluster_size - 1);
+}
+
+/* Feeds the first length bytes already in the output to hash, returns how many could be read */
+static s64 ntfsrec_hash_existing(struct ntfsrec_copy *state, struct ntfsrec_file_hash *hash, int fd, s64 length) {
+    s64 offset = 0;
+    
+    while(offset < length) {
+        s64 request = length - offset < state->opt.buffer_size ? length - offset : state->opt.buffer_size;
+        ssize_t bytes_read = pread(fd, state->file_buffer, request, offset);
+        
+        if (bytes_read <= 0)
+            break;
+        
+        ntfsrec_file_hash_update(hash, offset, state->file_buffer, bytes_read);
+        offset += bytes_read;
+    }
+    
+    return offset;
+}
+
+static s64 ntfsrec_next_data_run(ntfs_attr *data_attribute, u8 cluster_bits, runlist_element **run, s64 *offset) {
+    runlist_element *current = *run;
+    
+    for(; current->length != 0; ++current) {
+        s64 run_end = (current->vcn + current->length) << cluster_bits;
+        
+        if (*offset >= data_attribute->initialized_size)
+            break;
+        
+        if (run_end <= *offset)
+            continue;
+        
+        /* Sparse runs are never read, the output is simply moved past them */
+        if (current->lcn == LCN_HOLE) {
+            *offset = run_end;
+            continue;
+        }
+        
+        *run = current;
+        
+        if (run_end > data_attribute->initialized_size)
+            run_end = data_attribute->initialized_size;
+        
+        return run_end - *offset;
+    }
+    
+    /* The tail past the initialized size reads as zeros and is left as a hole */
+    *run = current;
+    *offset = data_attribute->data_size;
+    return 0;
+}
+
+s64 ntfsrec_copy_backoff(struct ntfsrec_copy *state) {
+    if (state->skip == 0)
+        state->skip = NR_COPY_MIN_SKIP;
+    else if (state->skip < NR_COPY_MAX_SKIP)
+        state->skip *= 2;
+    
+    return state->skip;
+}
+
+static s64 ntfsrec_skip_ahead(struct ntfsrec_copy *state, MFT_REF mref, s64 offset, s64 limit, unsigned int *deferred) {
+    s64 end = offset + ntfsrec_copy_backoff(state);
+    
+    if (end > limit)
+        end = limit;
+    
+    /* Everything jumped over is tried again once the rest of the copy is done */
+    if (end > offset) {
+        printf("Warning: slow or failed read in %s, deferring %lld bytes at %lld\n", state->path, (long long)(end - offset), (long long)offset);
+        ntfsrec_badmap_add(state->map, mref, offset, end - offset, state->path);
+        *deferred = NR_TRUE;
+    }
+    
+    return end > offset ? end : offset + state->opt.buffer_size;
+}
+
+static int ntfsrec_archive_file(struct ntfsrec_copy *state, ntfs_inode *inode, ntfs_attr *data_attribute) {
+    const unsigned int block_size = inode->mft_no < 2 ? state->volume->mft_record_size : 0;
+    const u8 cluster_bits = state->volume->cluster_size_bits;
+    struct ntfsrec_compressed *compressed = NULL;
+    runlist_element *run = NULL;
+    unsigned int retries = 0, failed = NR_FALSE;
+    uint64_t started;
+    s64 offset = 0;
+    
+    if (state->zip != NULL) {
+        if (ntfsrec_zip_begin_file(state->zip, &state->path[2], ntfs2timespec(inode->last_data_change_time).tv_sec) == NR_FALSE) {
+            state->stats.errors++;
+            return NR_FALSE;
+        }
+    } else {
+        struct ntfsrec_file_meta meta;
+        
+        memset(&meta, 0, sizeof meta);
+        ntfsrec_reader_get_inode_meta(inode, NR_FALSE, &meta);
+        meta.size = data_attribute->data_size;
+        
+        if (ntfsrec_tar_begin_file(state->tar, &state->path[2], &meta) == NR_FALSE) {
+            state->stats.errors++;
+            return NR_FALSE;
+        }
+        
+        /* Plain allocated data can go from the device to the archive without being copied through us */
+        if (state->device_fd != -1 && block_size == 0 && NAttrNonResident(data_attribute) &&
+            !NAttrCompressed(data_attribute) && !NAttrEncrypted(data_attribute) &&
+            ntfs_attr_map_whole_runlist(data_attribute) == 0)
+            run = data_attribute->rl;
+    }
+    
+    if (block_size == 0 && NAttrCompressed(data_attribute))
+        compressed = ntfsrec_compressed_open(data_attribute, state->decoder);
+    
+    /* Holes and the uninitialized tail are read back as zeros by the library */
+    while(offset < data_attribute->data_size) {
+        s64 request = data_attribute->data_size - offset, bytes_read;
+        
+        if (run != NULL) {
+            s64 start = offset, available, moved;
+            
+            available = ntfsrec_next_data_run(data_attribute, cluster_bits, &run, &offset);
+            
+            if (offset > start) {
+                if (ntfsrec_tar_write_zeros(state->tar, offset - start) == NR_FALSE) {
+                    failed = NR_TRUE;
+                    break;
+                }
+                
+                ntfsrec_progress_write(state->progress, offset - start);
+            }
+            
+            if (available == 0)
+                break;
+            
+            started = ntfsrec_progress_clock();
+            moved = ntfsrec_tar_splice(state->tar, state->device_fd,
+                                       (run->lcn << cluster_bits) + offset - (run->vcn << cluster_bits), available);
+            offset += moved;
+            
+            if (moved > 0) {
+                ntfsrec_progress_read(state->progress, moved, started);
+                ntfsrec_progress_write(state->progress, moved);
+            }
+            
+            if (moved == available)
+                continue;
+            
+            /* Whatever couldn't be spliced is read through the library, which retries and reports it */
+            request = available - moved;
+        }
+        
+        if (request > state->opt.buffer_size)
+            request = state->opt.buffer_size;
+        
+        started = ntfsrec_progress_clock();
+        
+        if (block_size > 0) {
+            bytes_read = ntfs_attr_mst_pread(data_attribute, offset, 1, block_size, state->file_buffer);
+            bytes_read = bytes_read == 1 ? (s64)block_size : -1;
+        } else if (compressed != NULL) {
+            bytes_read = ntfsrec_compressed_pread(compressed, offset, request, state->file_buffer);
+        } else {
+            bytes_read = ntfs_attr_pread(data_attribute, offset, request, state->file_buffer);
+        }
+        
+        ntfsrec_progress_read(state->progress, bytes_read, started);
+        
+        if (bytes_read <= 0) {
+            if (bytes_read < 0 && retries++ < state->opt.retries) {
+                state->stats.retries++;
+                ntfsrec_progress_retry(state->progress);
+                continue;
+            }
+            
+            /* An archive can't leave a gap, so whatever couldn't be read is stored as zeros */
+            bytes_read = block_size > 0 ? block_size : request;
+            
+            state->stats.errors++;
+            printf("Error: failed %u times to read %s, storing %lld zero bytes\n", retries, state->path, (long long)bytes_read);
+            
+            memset(state->file_buffer, 0, bytes_read);
+        }
+        
+        retries = 0;
+        
+        if ((state->zip != NULL && ntfsrec_zip_write(state->zip, state->file_buffer, bytes_read) == NR_FALSE) ||
+            (state->tar != NULL && ntfsrec_tar_write(state->tar, state->file_buffer, bytes_read) == NR_FALSE)) {
+            failed = NR_TRUE;
+            break;
+        }
+        
+        ntfsrec_progress_write(state->progress, bytes_read);
+        offset += bytes_read;
+    }
+    
+    if (compressed != NULL)
+        ntfsrec_compressed_close(compressed);
+    
+    if (state->zip != NULL)
+        failed |= ntfsrec_zip_end_file(state->zip) == NR_FALSE;
+    else
+        failed |= ntfsrec_tar_end_file(state->tar) == NR_FALSE;
+    
+    if (failed)
+        state->stats.errors++;
+    
+    return !failed;
+}
@@ -0,0 +1,459 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfs_reader.h"
+#include "ntfsrec_command.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_mft.h"
+#include "ntfsrec_index.h"
+#include "ntfsrec_workqueue.h"
+#include <pthread.h>
+#include <unistd.h>
+
+#define NR_DU_MAX_WORKERS 64
+/* Directories nested deeper than this are counted but not walked, a damaged index can loop back on itself */
+#define NR_DU_MAX_DEPTH 512
+
+#define NR_DU_ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+
+struct ntfsrec_du_total {
+    uint64_t files;
+    uint64_t directories;
+    int64_t size;
+    int64_t allocated;
+};
+
+/*
+ * A directory being totalled. Its worker adds the files it lists, and each child adds its subtree once
+ * it's done; whichever finishes last passes the total on to the parent. Only the nodes that will be
+ * printed are kept afterwards.
+ */
+struct ntfsrec_du_node {
+    struct ntfsrec_du_node *parent;
+    /* Record number from the file table, MFT_REF when walking the indexes */
+    uint64_t reference;
+    unsigned int depth;
+    char *name;
+    
+    struct ntfsrec_du_total total;
+    
+    /* One for the node's own listing plus one for each child not yet finished */
+    uint64_t outstanding;
+    
+    /* Children that will be printed, filled in by the node's worker alone */
+    struct ntfsrec_du_node **children;
+    size_t child_count;
+    size_t child_capacity;
+};
+
+struct ntfsrec_du {
+    struct ntfsrec_workqueue *queue;
+    /* Set when totalling from the file table, else each worker reads the $I30 indexes through its own volume */
+    const struct ntfsrec_mft_table *table;
+    unsigned int max_depth;
+    
+    /* Directories whose index couldn't be read, or that were nested too deep to walk */
+    uint64_t unreadable;
+};
+
+struct ntfsrec_du_worker {
+    struct ntfsrec_du *du;
+    unsigned int index;
+    pthread_t thread;
+    
+    /* Worker 0 runs on the command's own thread and volume */
+    struct ntfsrec_reader reader;
+    ntfs_volume *volume;
+    
+    /* What the index visitor is filling in */
+    struct ntfsrec_du_node *node;
+    struct ntfsrec_du_total listed;
+};
+
+static void *ntfsrec_du_worker_main(void *argument);
+static void ntfsrec_du_list_table(struct ntfsrec_du_worker *worker, struct ntfsrec_du_node *node);
+static void ntfsrec_du_list_index(struct ntfsrec_du_worker *worker, struct ntfsrec_du_node *node);
+static int ntfsrec_du_index_visitor(struct ntfsrec_du_worker *worker, MFT_REF mref, const FILE_NAME_ATTR *file_name);
+static void ntfsrec_du_add_child(struct ntfsrec_du_worker *worker, struct ntfsrec_du_node *parent, uint64_t reference, const char *name, size_t name_length);
+static void ntfsrec_du_finish(struct ntfsrec_du *du, struct ntfsrec_du_node *node);
+static struct ntfsrec_du_node *ntfsrec_du_node_create(struct ntfsrec_du_node *parent, uint64_t reference, const char *name, size_t name_length);
+static void ntfsrec_du_node_free(struct ntfsrec_du_node *node);
+static int ntfsrec_du_compare(const void *left, const void *right);
+static void ntfsrec_du_print(struct ntfsrec_command_processor *state, struct ntfsrec_du_node *node, char **path, size_t *capacity, size_t length, unsigned int *first);
+static int ntfsrec_du_resolve(struct ntfsrec_command_processor *state, const char *path, char *resolved, uint64_t *reference);
+
+int ntfsrec_command_du(struct ntfsrec_command_processor *state, char *arguments) {
+    struct ntfsrec_du du;
+    struct ntfsrec_du_worker *pool;
+    struct ntfsrec_du_node *root;
+    char resolved[MAX_PATH_LENGTH];
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int workers = online > 0 ? (unsigned int)online : 1, mounted, started, index, first = NR_TRUE;
+    uint64_t reference;
+    size_t capacity = MAX_PATH_LENGTH, length;
+    char *path;
+    
+    memset(&du, 0, sizeof du);
+    du.max_depth = 1;
+    
+    while(*arguments == '-') {
+        char *option = ntfsrec_next_argument(&arguments);
+        char *value = ntfsrec_next_argument(&arguments);
+        
+        if (strcmp(option, "-j") == 0) {
+            if (value == NULL || sscanf(value, "%u", &workers) != 1 || workers == 0 || workers > NR_DU_MAX_WORKERS) {
+                printf("Error: -j expects a thread count between 1 and %u\n", NR_DU_MAX_WORKERS);
+                return NR_FALSE;
+            }
+        } else if (strcmp(option, "--depth") == 0 || strcmp(option, "-d") == 0) {
+            if (value == NULL || sscanf(value, "%u", &du.max_depth) != 1) {
+                printf("Error: %s expects a number of levels to print\n", option);
+                return NR_FALSE;
+            }
+        } else {
+            printf("Error: unknown option %s\nUsage: du [-j threads] [--depth levels] [path]\n", option);
+            return NR_FALSE;
+        }
+        
+        while(*arguments == ' ')
+            ++arguments;
+    }
+    
+    if (workers > NR_DU_MAX_WORKERS)
+        workers = NR_DU_MAX_WORKERS;
+    
+    du.table = state->table;
+    
+    if (ntfsrec_du_resolve(state, arguments, resolved, &reference) == NR_FALSE)
+        return NR_FALSE;
+    
+    pool = ntfsrec_allocate(workers * sizeof *pool);
+    memset(pool, 0, workers * sizeof *pool);
+    
+    /* libntfs-3g isn't thread safe, so walking the indexes takes a volume per worker like cp -j does */
+    for(mounted = 0; mounted < workers; ++mounted) {
+        struct ntfsrec_du_worker *worker = &pool[mounted];
+        
+        worker->du = &du;
+        worker->index = mounted;
+        worker->volume = state->reader->mount.volume;
+        
+        if (du.table != NULL || mounted == 0)
+            continue;
+        
+        worker->reader.settings = state->reader->settings;
+        
+        if (ntfsrec_reader_mount(&worker->reader, state->reader->mount.name, state->reader->mount.options) == NR_FALSE) {
+            printf("Warning: unable to open the volume for worker %u, continuing with %u\n", mounted, mounted);
+            break;
+        }
+        
+        worker->volume = worker->reader.mount.volume;
+    }
+    
+    du.queue = ntfsrec_workqueue_create(mounted);
+    
+    root = ntfsrec_du_node_create(NULL, reference, resolved, strlen(resolved));
+    ntfsrec_workqueue_push(du.queue, 0, root);
+    
+    for(started = 1; started < mounted; ++started) {
+        if (pthread_create(&pool[started].thread, NULL, &ntfsrec_du_worker_main, &pool[started]) != 0) {
+            printf("Warning: unable to start worker %u\n", started);
+            break;
+        }
+    }
+    
+    /* The command's thread is worker 0, so the queue drains even if no other thread started */
+    ntfsrec_du_worker_main(&pool[0]);
+    
+    for(index = 1; index < mounted; ++index) {
+        if (index < started)
+            pthread_join(pool[index].thread, NULL);
+        
+        if (pool[index].reader.mount.volume != NULL)
+            ntfsrec_reader_release(&pool[index].reader);
+    }
+    
+    ntfsrec_workqueue_destroy(du.queue);
+    free(pool);
+    
+    /* Paths start from the directory as it was given, without its trailing slash */
+    length = strlen(resolved);
+    
+    while(length > 1 && resolved[length - 1] == '/')
+        --length;
+    
+    path = ntfsrec_allocate(capacity);
+    memcpy(path, resolved, length);
+    path[length] = '\0';
+    
+    if (state->result != NULL)
+        fputs("{\"directories\":[", state->result);
+    
+    ntfsrec_du_print(state, root, &path, &capacity, length, &first);
+    
+    if (state->result != NULL)
+        fprintf(state->result, "],\"unreadable\":%llu}", (unsigned long long)du.unreadable);
+    
+    if (du.unreadable > 0)
+        printf("Warning: %llu directories couldn't be read and are left out of the totals\n", (unsigned long long)du.unreadable);
+    
+    free(path);
+    ntfsrec_du_node_free(root);
+    
+    return NR_TRUE;
+}
+
+static void *ntfsrec_du_worker_main(void *argument) {
+    struct ntfsrec_du_worker *worker = argument;
+    struct ntfsrec_du *du = worker->du;
+    struct ntfsrec_du_node *node;
+    
+    while((node = ntfsrec_workqueue_pop(du->queue, worker->index)) != NULL) {
+        if (node->depth >= NR_DU_MAX_DEPTH)
+            NR_DU_ADD(du->unreadable, 1);
+        else if (du->table != NULL)
+            ntfsrec_du_list_table(worker, node);
+        else
+            ntfsrec_du_list_index(worker, node);
+        
+        ntfsrec_du_finish(du, node);
+        ntfsrec_workqueue_complete(du->queue);
+    }
+    
+    return NULL;
+}
+
+/* The table has every directory's entries together, so a listing is a walk over two arrays */
+static void ntfsrec_du_list_table(struct ntfsrec_du_worker *worker, struct ntfsrec_du_node *node) {
+    const struct ntfsrec_mft_table *table = worker->du->table;
+    struct ntfsrec_du_total listed;
+    uint64_t index;
+    
+    memset(&listed, 0, sizeof listed);
+    
+    for(index = table->child_start[node->reference]; index < table->child_start[node->reference + 1]; ++index) {
+        uint64_t record = table->children[index];
+        
+        if (table->flags[record] & NR_MFT_DIRECTORY) {
+            const char *name = &table->names[table->name_offset[record]];
+            
+            listed.directories++;
+            ntfsrec_du_add_child(worker, node, record, name, strlen(name));
+        } else {
+            listed.files++;
+            listed.size += table->size[record];
+            listed.allocated += table->allocated_size[record];
+        }
+    }
+    
+    NR_DU_ADD(node->total.files, listed.files);
+    NR_DU_ADD(node->total.directories, listed.directories);
+    NR_DU_ADD(node->total.size, listed.size);
+    NR_DU_ADD(node->total.allocated, listed.allocated);
+}
+
+/* Sizes come from the index's copy of each $FILE_NAME, which can lag behind the file's own record */
+static void ntfsrec_du_list_index(struct ntfsrec_du_worker *worker, struct ntfsrec_du_node *node) {
+    ntfs_inode *inode = ntfs_inode_open(worker->volume, node->reference);
+    
+    memset(&worker->listed, 0, sizeof worker->listed);
+    worker->node = node;
+    
+    if (inode == NULL || ntfsrec_index_walk(inode, worker, (ntfsrec_index_visitor)ntfsrec_du_index_visitor) == NR_FALSE)
+        NR_DU_ADD(worker->du->unreadable, 1);
+    
+    if (inode != NULL)
+        ntfs_inode_close(inode);
+    
+    NR_DU_ADD(node->total.files, worker->listed.files);
+    NR_DU_ADD(node->total.directories, worker->listed.directories);
+    NR_DU_ADD(node->total.size, worker->listed.size);
+    NR_DU_ADD(node->total.allocated, worker->listed.allocated);
+}
+
+static int ntfsrec_du_index_visitor(struct ntfsrec_du_worker *worker, MFT_REF mref, const FILE_NAME_ATTR *file_name) {
+    struct ntfsrec_du_node *node = worker->node;
+    
+    /* Short names duplicate a long one, and the root lists itself */
+    if ((file_name->file_name_type & FILE_NAME_WIN32_AND_DOS) == FILE_NAME_DOS || MREF(mref) == MREF(node->reference))
+        return 0;
+    
+    if (le32_to_cpu(file_name->file_attributes) & FILE_ATTR_I30_INDEX_PRESENT) {
+        char name[NR_NAME_LENGTH];
+        int length = 0;
+        
+        /* Only the directories that will be printed need their names */
+        if (node->depth < worker->du->max_depth &&
+            (length = ntfsrec_utf16_to_utf8(name, sizeof name, (const ntfschar *)(file_name + 1), file_name->file_name_length)) < 0)
+            length = 0;
+        
+        worker->listed.directories++;
+        ntfsrec_du_add_child(worker, node, mref, name, length);
+        return 0;
+    }
+    
+    worker->listed.files++;
+    worker->listed.size += sle64_to_cpu(file_name->data_size);
+    worker->listed.allocated += sle64_to_cpu(file_name->allocated_size);
+    return 0;
+}
+
+static void ntfsrec_du_add_child(struct ntfsrec_du_worker *worker, struct ntfsrec_du_node *parent, uint64_t reference, const char *name, size_t name_length) {
+    struct ntfsrec_du_node *child = ntfsrec_du_node_create(parent, reference, name, parent->depth < worker->du->max_depth ? name_length : 0);
+    
+    if (parent->depth < worker->du->max_depth) {
+        if (parent->child_count == parent->child_capacity) {
+            parent->child_capacity = parent->child_capacity ? parent->child_capacity * 2 : 16;
+            parent->children = ntfsrec_reallocate(parent->children, parent->child_capacity * sizeof *parent->children);
+        }
+        
+        parent->children[parent->child_count++] = child;
+    }
+    
+    __atomic_fetch_add(&parent->outstanding, 1, __ATOMIC_RELAXED);
+    ntfsrec_workqueue_push(worker->du->queue, worker->index, child);
+}
+
+/* Drops the node's own claim, and carries each subtree that completes up into its parent */
+static void ntfsrec_du_finish(struct ntfsrec_du *du, struct ntfsrec_du_node *node) {
+    while(node->parent != NULL && __atomic_sub_fetch(&node->outstanding, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct ntfsrec_du_node *parent = node->parent;
+        
+        NR_DU_ADD(parent->total.files, node->total.files);
+        NR_DU_ADD(parent->total.directories, node->total.directories);
+        NR_DU_ADD(parent->total.size, node->total.size);
+        NR_DU_ADD(parent->total.allocated, node->total.allocated);
+        
+        if (node->depth > du->max_depth)
+            ntfsrec_du_node_free(node);
+        
+        node = parent;
+    }
+}
+
+static struct ntfsrec_du_node *ntfsrec_du_node_create(struct ntfsrec_du_node *parent, uint64_t reference, const char *name, size_t name_length) {
+    struct ntfsrec_du_node *node = ntfsrec_allocate(sizeof *node);
+    
+    memset(node, 0, sizeof *node);
+    
+    node->parent = parent;
+    node->reference = reference;
+    node->depth = parent != NULL ? parent->depth + 1 : 0;
+    node->outstanding = 1;
+    
+    node->name = ntfsrec_allocate(name_length + 1);
+    memcpy(node->name, name, name_length);
+    node->name[name_length] = '\0';
+    
+    return node;
+}
+
+static void ntfsrec_du_node_free(struct ntfsrec_du_node *node) {
+    size_t index;
+    
+    for(index = 0; index < node->child_count; ++index)
+        ntfsrec_du_node_free(node->children[index]);
+    
+    free(node->children);
+    free(node->name);
+    free(node);
+}
+
+static int ntfsrec_du_compare(const void *left, const void *right) {
+    return strcmp((*(struct ntfsrec_du_node * const *)left)->name, (*(struct ntfsrec_du_node * const *)right)->name);
+}
+
+/* Prints subdirectories before the directory that holds them, as du does */
+static void ntfsrec_du_print(struct ntfsrec_command_processor *state, struct ntfsrec_du_node *node, char **path, size_t *capacity, size_t length, unsigned int *first) {
+    char size_text[8], allocated_text[8];
+    size_t index;
+    
+    qsort(node->children, node->child_count, sizeof *node->children, &ntfsrec_du_compare);
+    
+    for(index = 0; index < node->child_count; ++index) {
+        struct ntfsrec_du_node *child = node->children[index];
+        size_t name_length = strlen(child->name), child_length = length + (length > 1) + name_length;
+        
+        if (child_length >= *capacity) {
+            while(child_length >= *capacity)
+                *capacity *= 2;
+            
+            *path = ntfsrec_reallocate(*path, *capacity);
+        }
+        
+        if (length > 1)
+            (*path)[length] = '/';
+        
+        memcpy(&(*path)[child_length - name_length], child->name, name_length);
+        (*path)[child_length] = '\0';
+        
+        ntfsrec_du_print(state, child, path, capacity, child_length, first);
+    }
+    
+    (*path)[length] = '\0';
+    
+    ntfsrec_utility_format_size(size_text, sizeof size_text, node->total.size);
+    ntfsrec_utility_format_size(allocated_text, sizeof allocated_text, node->total.allocated);
+    
+    printf("%s\t%s\t%llu\t%s\n", size_text, allocated_text, (unsigned long long)node->total.files, *path);
+    
+    if (state->result != NULL) {
+        if (*first == NR_FALSE)
+            fputc(',', state->result);
+        
+        fputs("{\"path\":", state->result);
+        ntfsrec_json_string(state->result, *path);
+        fprintf(state->result, ",\"files\":%llu,\"directories\":%llu,\"size\":%lld,\"allocated\":%lld}",
+                (unsigned long long)node->total.files, (unsigned long long)node->total.directories,
+                (long long)node->total.size, (long long)node->total.allocated);
+        
+        *first = NR_FALSE;
+    }
+}
+
+/* Finds the directory to total, a record number with a file table and an MFT_REF without */
+static int ntfsrec_du_resolve(struct ntfsrec_command_processor *state, const char *path, char *resolved, uint64_t *reference) {
+    ntfs_inode *inode;
+    
+    if (ntfsrec_calculate_path(resolved, MAX_PATH_LENGTH, state->cwd, path) == NR_FALSE) {
+        printf("Error: specified path %s is longer than the maximum allowed.\n", path);
+        return NR_FALSE;
+    }
+    
+    if (state->table != NULL) {
+        if (*path == '\0' && state->offline) {
+            *reference = state->cwd_record;
+        } else if (ntfsrec_mft_table_lookup(state->table, resolved, reference) == NR_FALSE) {
+            printf("Error: unable to find %s\n", resolved);
+            return NR_FALSE;
+        }
+        
+        if ((state->table->flags[*reference] & NR_MFT_DIRECTORY) == 0) {
+            printf("Error: %s isn't a directory.\n", resolved);
+            return NR_FALSE;
+        }
+        
+        return NR_TRUE;
+    }
+    
+    inode = ntfs_pathname_to_inode(state->reader->mount.volume, NULL, resolved);
+    
+    if (inode == NULL) {
+        printf("Error: unable to find %s\n", resolved);
+        return NR_FALSE;
+    }
+    
+    if ((inode->mrec->flags & MFT_RECORD_IS_DIRECTORY) == 0) {
+        printf("Error: %s isn't a directory.\n", resolved);
+        ntfs_inode_close(inode);
+        return NR_FALSE;
+    }
+    
+    *reference = MK_MREF(inode->mft_no, le16_to_cpu(inode->mrec->sequence_number));
+    ntfs_inode_close(inode);
+    return NR_TRUE;
+}
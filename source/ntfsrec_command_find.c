@@ -0,0 +1,213 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfs_reader.h"
+#include "ntfsrec_command.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_mft.h"
+#include "ntfsrec_filter.h"
+#include "ntfsrec_trigram.h"
+
+#define NR_FIND_PATH_LENGTH 4096
+
+struct ntfsrec_find {
+    struct ntfsrec_command_processor *state;
+    const struct ntfsrec_mft_table *table;
+    struct ntfsrec_selection *selection;
+    
+    uint64_t matches;
+    /* How many matches are printed, 0 for all of them */
+    uint64_t limit;
+    
+    /* Folders whose contents are still to be selected */
+    uint64_t *pending;
+    size_t pending_capacity;
+};
+
+static int ntfsrec_find_visitor(struct ntfsrec_find *find, uint64_t record);
+static void ntfsrec_find_select(struct ntfsrec_find *find, uint64_t record);
+static void ntfsrec_find_mark(uint8_t *bits, uint64_t record);
+static size_t ntfsrec_find_push(struct ntfsrec_find *find, size_t pending, uint64_t directory);
+
+int ntfsrec_command_find(struct ntfsrec_command_processor *state, char *arguments) {
+    struct ntfsrec_find find;
+    struct timespec start, end;
+    uint64_t checked;
+    double elapsed;
+    
+    memset(&find, 0, sizeof find);
+    find.state = state;
+    
+    while(*arguments == '-') {
+        char *option = ntfsrec_next_argument(&arguments);
+        char *value = ntfsrec_next_argument(&arguments);
+        unsigned long long limit;
+        
+        if (strcmp(option, "-n") != 0) {
+            printf("Error: unknown option %s\nUsage: find [-n count] <pattern>\n", option);
+            return NR_FALSE;
+        }
+        
+        if (value == NULL || sscanf(value, "%llu", &limit) != 1) {
+            puts("Error: -n expects a number of matches to print");
+            return NR_FALSE;
+        }
+        
+        find.limit = limit;
+        
+        while(*arguments == ' ')
+            ++arguments;
+    }
+    
+    if (*arguments == '\0') {
+        puts("Usage: find [-n count] <pattern>\nA pattern with * ? or [ is a glob over the whole name, anything else is a substring");
+        return NR_FALSE;
+    }
+    
+    if (ntfsrec_command_require_table(state) == NR_FALSE)
+        return NR_FALSE;
+    
+    /* The index is built once and kept until the table is replaced */
+    if (state->names == NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        state->names = ntfsrec_trigram_build(state->table);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        
+        printf("Indexed %llu names in %.2fs\n", (unsigned long long)ntfsrec_trigram_names(state->names),
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
+    
+    find.table = state->table;
+    find.selection = ntfsrec_allocate(sizeof *find.selection);
+    find.selection->count = state->table->count;
+    find.selection->selected = ntfsrec_allocate(find.selection->count / 8 + 1);
+    find.selection->on_the_way = ntfsrec_allocate(find.selection->count / 8 + 1);
+    memset(find.selection->selected, 0, find.selection->count / 8 + 1);
+    memset(find.selection->on_the_way, 0, find.selection->count / 8 + 1);
+    
+    if (state->result != NULL)
+        fputs("{\"entries\":[", state->result);
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    checked = ntfsrec_trigram_search(state->names, arguments, &find, (ntfsrec_trigram_visitor)ntfsrec_find_visitor);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    elapsed = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    
+    if (state->result != NULL) {
+        fprintf(state->result, "],\"matches\":%llu,\"checked\":%llu,\"ms\":%.3f}",
+                (unsigned long long)find.matches, (unsigned long long)checked, elapsed);
+    }
+    
+    if (find.limit > 0 && find.matches > find.limit)
+        printf("Showing %llu of %llu matches\n", (unsigned long long)find.limit, (unsigned long long)find.matches);
+    
+    printf("%llu matches, %llu names checked in %.1fms\n", (unsigned long long)find.matches, (unsigned long long)checked, elapsed);
+    
+    /* Every find replaces the selection, even one that matched nothing */
+    ntfsrec_selection_free(state->selection);
+    state->selection = find.selection;
+    
+    if (find.matches > 0)
+        puts("Selected them for --selected, which cp, cpz, tar and ls take");
+    
+    free(find.pending);
+    return NR_TRUE;
+}
+
+static int ntfsrec_find_visitor(struct ntfsrec_find *find, uint64_t record) {
+    const struct ntfsrec_mft_table *table = find->table;
+    const unsigned int is_dir = (table->flags[record] & NR_MFT_DIRECTORY) != 0;
+    char path[NR_FIND_PATH_LENGTH];
+    
+    ntfsrec_find_select(find, record);
+    
+    if (find->limit > 0 && find->matches >= find->limit) {
+        find->matches++;
+        return 0;
+    }
+    
+    if (ntfsrec_mft_table_path(table, record, path, sizeof path) == NR_FALSE && path[0] == '\0')
+        snprintf(path, sizeof path, "(path too long)/%s", &table->names[table->name_offset[record]]);
+    
+    if (is_dir) {
+        printf("--\t%s/\n", path);
+    } else {
+        char size_text[8];
+        
+        ntfsrec_utility_format_size(size_text, sizeof size_text, table->size[record]);
+        printf("%s\t%s\n", size_text, path);
+    }
+    
+    if (find->state->result != NULL) {
+        if (find->matches > 0)
+            fputc(',', find->state->result);
+        
+        fputs("{\"path\":", find->state->result);
+        ntfsrec_json_string(find->state->result, path);
+        fprintf(find->state->result, ",\"record\":%llu,\"directory\":%s,\"size\":%lld}", (unsigned long long)record,
+                is_dir ? "true" : "false", is_dir ? 0LL : (long long)table->size[record]);
+    }
+    
+    find->matches++;
+    return 0;
+}
+
+/* Marks the record, everything under it if it's a folder, and the folders on the way to it */
+static void ntfsrec_find_select(struct ntfsrec_find *find, uint64_t record) {
+    const struct ntfsrec_mft_table *table = find->table;
+    struct ntfsrec_selection *selection = find->selection;
+    size_t pending = 0;
+    uint64_t index;
+    
+    if (ntfsrec_selection_has(selection, record))
+        return;
+    
+    ntfsrec_find_mark(selection->selected, record);
+    
+    if (table->flags[record] & NR_MFT_DIRECTORY)
+        pending = ntfsrec_find_push(find, pending, record);
+    
+    while(pending > 0) {
+        uint64_t directory = find->pending[--pending];
+        
+        for(index = table->child_start[directory]; index < table->child_start[directory + 1]; ++index) {
+            uint64_t child = table->children[index];
+            
+            if (ntfsrec_selection_has(selection, child))
+                continue;
+            
+            ntfsrec_find_mark(selection->selected, child);
+            
+            if (table->flags[child] & NR_MFT_DIRECTORY)
+                pending = ntfsrec_find_push(find, pending, child);
+        }
+    }
+    
+    /* A folder already marked has had the ones above it marked too, and the marks stop a damaged chain looping */
+    while(record != NR_MFT_ROOT_RECORD) {
+        record = MREF(table->parent[record]);
+        
+        if (record >= table->count || (table->flags[record] & NR_MFT_DIRECTORY) == 0 || ntfsrec_selection_leads(selection, record))
+            break;
+        
+        ntfsrec_find_mark(selection->on_the_way, record);
+    }
+}
+
+static void ntfsrec_find_mark(uint8_t *bits, uint64_t record) {
+    bits[record / 8] |= 1 << (record % 8);
+}
+
+static size_t ntfsrec_find_push(struct ntfsrec_find *find, size_t pending, uint64_t directory) {
+    if (pending == find->pending_capacity) {
+        find->pending_capacity = find->pending_capacity ? find->pending_capacity * 2 : 256;
+        find->pending = ntfsrec_reallocate(find->pending, find->pending_capacity * sizeof *find->pending);
+    }
+    
+    find->pending[pending] = directory;
+    return pending + 1;
+}
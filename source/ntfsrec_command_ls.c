@@ -7,82 +7,426 @@
 #include "ntfs_reader.h"
 #include "ntfsrec_command.h"
 #include "ntfsrec_utility.h"
+#include "ntfsrec_mft.h"
+#include "ntfsrec_index.h"
+#include "ntfsrec_filter.h"
+#include <strings.h>
 
-static int ntfsrec_ls_directory_visitor(struct ntfsrec_command_processor *state, const ntfschar *name,
+enum ntfsrec_ls_sort {
+    NR_LS_SORT_NAME = 0,
+    NR_LS_SORT_SIZE,
+    NR_LS_SORT_TIME,
+    NR_LS_SORT_NONE
+};
+
+struct ntfsrec_ls_entry {
+    uint64_t record;
+    size_t name_offset;
+    unsigned int is_dir;
+    struct ntfsrec_file_meta meta;
+};
+
+struct ntfsrec_ls_listing {
+    struct ntfsrec_command_processor *state;
+    
+    struct ntfsrec_ls_entry *entries;
+    size_t count;
+    size_t capacity;
+    
+    char *names;
+    size_t names_length;
+    size_t names_capacity;
+    
+    struct {
+        enum ntfsrec_ls_sort sort;
+        unsigned int reverse;
+        unsigned int verify;
+        size_t offset;
+        size_t limit;
+    } opt;
+    
+    /* With any filter only the files it selects are listed, directories are left out */
+    struct ntfsrec_filter filter;
+    
+    /* Entries whose index copy looked stale and were read from their own record */
+    size_t refreshed;
+};
+
+static int ntfsrec_ls_parse_options(struct ntfsrec_ls_listing *listing, char **arguments);
+static int ntfsrec_ls_collect(struct ntfsrec_ls_listing *listing, const char *path);
+static int ntfsrec_ls_collect_table(struct ntfsrec_ls_listing *listing, const char *path);
+static int ntfsrec_ls_index_visitor(struct ntfsrec_ls_listing *listing, MFT_REF mref, const FILE_NAME_ATTR *file_name);
+static int ntfsrec_ls_directory_visitor(struct ntfsrec_ls_listing *listing, const ntfschar *name,
                                         const int name_len, const int name_type, const s64 pos,
                                         const MFT_REF mref, const unsigned dt_type);
+static int ntfsrec_ls_looks_stale(const FILE_NAME_ATTR *file_name, unsigned int is_dir);
+static struct ntfsrec_ls_entry *ntfsrec_ls_add(struct ntfsrec_ls_listing *listing, const char *name, size_t name_length);
+static void ntfsrec_ls_apply_filter(struct ntfsrec_ls_listing *listing);
+static int ntfsrec_ls_compare(const void *left, const void *right, void *context);
+static void ntfsrec_ls_print(const char *name, int is_dir, const struct ntfsrec_file_meta *meta);
+static void ntfsrec_ls_print_json(FILE *output, const char *name, int is_dir, const struct ntfsrec_file_meta *meta);
 
-void ntfsrec_command_ls(struct ntfsrec_command_processor *state, char *arguments) {
-    s64 position = 0;
+int ntfsrec_command_ls(struct ntfsrec_command_processor *state, char *arguments) {
+    struct ntfsrec_ls_listing listing;
+    size_t index, end;
+    int result;
     
-    if (*arguments == '\0') {
-        ntfs_readdir(state->cwd_inode, &position, state, (ntfs_filldir_t)ntfsrec_ls_directory_visitor);
-    } else {
-        char new_path[MAX_PATH_LENGTH];
+    memset(&listing, 0, sizeof listing);
+    listing.state = state;
+    ntfsrec_filter_init(&listing.filter);
+    
+    if (ntfsrec_ls_parse_options(&listing, &arguments) == NR_FALSE ||
+        ntfsrec_filter_bind(&listing.filter, state->selection) == NR_FALSE)
+        return NR_FALSE;
+    
+    result = ntfsrec_ls_collect(&listing, arguments);
+    
+    if (result == NR_TRUE) {
+        if (listing.opt.sort != NR_LS_SORT_NONE)
+            qsort_r(listing.entries, listing.count, sizeof *listing.entries, &ntfsrec_ls_compare, &listing);
+        
+        end = listing.opt.limit > 0 && listing.opt.offset + listing.opt.limit < listing.count ?
+              listing.opt.offset + listing.opt.limit : listing.count;
+        
+        if (state->result != NULL)
+            fprintf(state->result, "{\"total\":%lu,\"entries\":[", (unsigned long)listing.count);
+        
+        for(index = listing.opt.offset; index < end; ++index) {
+            const struct ntfsrec_ls_entry *entry = &listing.entries[index];
+            
+            if (state->result == NULL) {
+                ntfsrec_ls_print(&listing.names[entry->name_offset], entry->is_dir, &entry->meta);
+                continue;
+            }
+            
+            if (index > listing.opt.offset)
+                fputc(',', state->result);
+            
+            ntfsrec_ls_print_json(state->result, &listing.names[entry->name_offset], entry->is_dir, &entry->meta);
+        }
+        
+        if (state->result != NULL)
+            fputs("]}", state->result);
+        
+        if (listing.opt.offset > 0 || end < listing.count) {
+            printf("Showing %lu-%lu of %lu entries\n", (unsigned long)(listing.opt.offset < end ? listing.opt.offset + 1 : end),
+                   (unsigned long)end, (unsigned long)listing.count);
+        }
+        
+        if (listing.refreshed > 0)
+            printf("Read %lu stale entries from their MFT records\n", (unsigned long)listing.refreshed);
+    }
+    
+    free(listing.entries);
+    free(listing.names);
+    
+    return result;
+}
+
+static int ntfsrec_ls_parse_options(struct ntfsrec_ls_listing *listing, char **arguments) {
+    while(**arguments == '-') {
+        char *option = ntfsrec_next_argument(arguments);
+        char *value = NULL;
+        
+        if (strcmp(option, "-s") == 0 || strcmp(option, "-n") == 0 || strcmp(option, "-o") == 0) {
+            value = ntfsrec_next_argument(arguments);
+            
+            if (value == NULL) {
+                printf("Error: %s expects a value\n", option);
+                return NR_FALSE;
+            }
+        }
         
-        if (ntfsrec_calculate_path(new_path, sizeof new_path, state->cwd, arguments) < MAX_PATH_LENGTH) {
-            ntfs_inode *inode = ntfs_pathname_to_inode(state->reader->mount.volume, NULL, new_path);
-
-            if (inode != NULL) {
-                
-                if (inode->mrec->flags & MFT_RECORD_IS_DIRECTORY) {
-                    printf("Listing %s\n", new_path);
-                    ntfs_readdir(inode, &position, state, (ntfs_filldir_t)ntfsrec_ls_directory_visitor);
-                } else {
-                    printf("Error: listing of individual files (%s) is currently unsupported\n", new_path);
-                }
-                
-                ntfs_inode_close(inode);
+        if (strcmp(option, "-s") == 0) {
+            if (strcmp(value, "name") == 0) {
+                listing->opt.sort = NR_LS_SORT_NAME;
+            } else if (strcmp(value, "size") == 0) {
+                listing->opt.sort = NR_LS_SORT_SIZE;
+            } else if (strcmp(value, "time") == 0) {
+                listing->opt.sort = NR_LS_SORT_TIME;
+            } else if (strcmp(value, "none") == 0) {
+                listing->opt.sort = NR_LS_SORT_NONE;
             } else {
-                printf("Error: unable to find %s\n", new_path);
+                printf("Error: unknown sort order %s, expected name, size, time or none\n", value);
+                return NR_FALSE;
+            }
+        } else if (strcmp(option, "-n") == 0) {
+            unsigned long limit;
+            
+            if (sscanf(value, "%lu", &limit) != 1) {
+                printf("Error: -n expects a number of entries\n");
+                return NR_FALSE;
             }
             
+            listing->opt.limit = limit;
+        } else if (strcmp(option, "-o") == 0) {
+            unsigned long offset;
+            
+            if (sscanf(value, "%lu", &offset) != 1) {
+                printf("Error: -o expects a number of entries to skip\n");
+                return NR_FALSE;
+            }
+            
+            listing->opt.offset = offset;
+        } else if (strcmp(option, "-r") == 0) {
+            listing->opt.reverse = NR_TRUE;
+        } else if (strcmp(option, "-v") == 0) {
+            listing->opt.verify = NR_TRUE;
+        } else if (ntfsrec_filter_is_option(option)) {
+            if (ntfsrec_filter_parse(&listing->filter, option, arguments) == NR_FALSE)
+                return NR_FALSE;
         } else {
-            printf("Error: specified path %s is longer than the maximum allowed.\n", arguments);
+            printf("Error: unknown option %s\nUsage: ls [-s name|size|time|none] [-r] [-n count] [-o offset] [-v] " NR_FILTER_USAGE " [path]\n", option);
+            return NR_FALSE;
         }
+        
+        while(**arguments == ' ')
+            ++*arguments;
     }
+    
+    return NR_TRUE;
 }
 
-static int ntfsrec_ls_directory_visitor(struct ntfsrec_command_processor *state, const ntfschar *name, const int name_len, const int name_type, const s64 pos, const MFT_REF mref, const unsigned dt_type) {
-    char createtime_text[32], modtime_text[32];
-    struct ntfsrec_file_meta meta;
-    char *converted_name = NULL;
-    struct tm *local;
+static int ntfsrec_ls_collect(struct ntfsrec_ls_listing *listing, const char *path) {
+    struct ntfsrec_command_processor *state = listing->state;
+    ntfs_inode *inode = state->cwd_inode;
+    s64 position = 0;
+    
+    if (state->offline)
+        return ntfsrec_ls_collect_table(listing, path);
+    
+    if (*path != '\0') {
+        char new_path[MAX_PATH_LENGTH];
+        
+        if (ntfsrec_calculate_path(new_path, sizeof new_path, state->cwd, path) == NR_FALSE) {
+            printf("Error: specified path %s is longer than the maximum allowed.\n", path);
+            return NR_FALSE;
+        }
+        
+        inode = ntfs_pathname_to_inode(state->reader->mount.volume, NULL, new_path);
+        
+        if (inode == NULL) {
+            printf("Error: unable to find %s\n", new_path);
+            return NR_FALSE;
+        }
+        
+        if ((inode->mrec->flags & MFT_RECORD_IS_DIRECTORY) == 0) {
+            printf("Error: listing of individual files (%s) is currently unsupported\n", new_path);
+            ntfs_inode_close(inode);
+            return NR_FALSE;
+        }
+        
+        printf("Listing %s\n", new_path);
+    }
+    
+    /* The index entries already carry times and sizes, the slow path opens every entry's record instead */
+    if (ntfsrec_index_walk(inode, listing, (ntfsrec_index_visitor)ntfsrec_ls_index_visitor) == NR_FALSE) {
+        printf("Warning: the directory index is damaged, reading each entry's record instead\n");
+        
+        listing->count = 0;
+        listing->names_length = 0;
+        
+        ntfs_readdir(inode, &position, listing, (ntfs_filldir_t)ntfsrec_ls_directory_visitor);
+    }
+    
+    if (inode != state->cwd_inode)
+        ntfs_inode_close(inode);
+    
+    return NR_TRUE;
+}
+
+static int ntfsrec_ls_collect_table(struct ntfsrec_ls_listing *listing, const char *path) {
+    struct ntfsrec_command_processor *state = listing->state;
+    const struct ntfsrec_mft_table *table = state->table;
+    uint64_t directory = state->cwd_record, index;
+    
+    if (*path != '\0') {
+        char new_path[MAX_PATH_LENGTH];
+        
+        if (ntfsrec_calculate_path(new_path, sizeof new_path, state->cwd, path) == NR_FALSE) {
+            printf("Error: specified path %s is longer than the maximum allowed.\n", path);
+            return NR_FALSE;
+        }
+        
+        if (ntfsrec_mft_table_lookup(table, new_path, &directory) == NR_FALSE) {
+            printf("Error: unable to find %s\n", new_path);
+            return NR_FALSE;
+        }
+        
+        if ((table->flags[directory] & NR_MFT_DIRECTORY) == 0) {
+            printf("Error: listing of individual files (%s) is currently unsupported\n", new_path);
+            return NR_FALSE;
+        }
+        
+        printf("Listing %s\n", new_path);
+    }
+    
+    for(index = table->child_start[directory]; index < table->child_start[directory + 1]; ++index) {
+        uint64_t record = table->children[index];
+        const char *name = &table->names[table->name_offset[record]];
+        struct ntfsrec_ls_entry *entry = ntfsrec_ls_add(listing, name, strlen(name));
+        
+        entry->record = record;
+        entry->is_dir = (table->flags[record] & NR_MFT_DIRECTORY) != 0;
+        entry->meta.size = table->size[record];
+        entry->meta.flags = table->attributes[record];
+        entry->meta.created = ntfs2timespec(table->created[record]);
+        entry->meta.modified = ntfs2timespec(table->modified[record]);
+        
+        ntfsrec_ls_apply_filter(listing);
+    }
+    
+    return NR_TRUE;
+}
+
+static int ntfsrec_ls_index_visitor(struct ntfsrec_ls_listing *listing, MFT_REF mref, const FILE_NAME_ATTR *file_name) {
+    char converted_name[NR_NAME_LENGTH];
+    struct ntfsrec_ls_entry *entry;
+    int length;
+    
+    if (file_name->file_name_type == FILE_NAME_DOS)
+        return 0;
+    
+    length = ntfsrec_utf16_to_utf8(converted_name, sizeof converted_name, (const ntfschar *)(file_name + 1), file_name->file_name_length);
+    
+    if (length < 0)
+        return 0;
+    
+    entry = ntfsrec_ls_add(listing, converted_name, length);
+    
+    entry->record = MREF(mref);
+    entry->is_dir = (le32_to_cpu(file_name->file_attributes) & FILE_ATTR_I30_INDEX_PRESENT) != 0;
+    entry->meta.size = sle64_to_cpu(file_name->data_size);
+    entry->meta.flags = file_name->file_attributes;
+    entry->meta.created = ntfs2timespec(file_name->creation_time);
+    entry->meta.modified = ntfs2timespec(file_name->last_data_change_time);
+    
+    if (listing->opt.verify && ntfsrec_ls_looks_stale(file_name, entry->is_dir)) {
+        if (ntfsrec_reader_get_file_meta(listing->state->reader, mref, entry->is_dir, &entry->meta) == NR_TRUE)
+            listing->refreshed++;
+    }
+    
+    ntfsrec_ls_apply_filter(listing);
+    return 0;
+}
+
+static int ntfsrec_ls_directory_visitor(struct ntfsrec_ls_listing *listing, const ntfschar *name, const int name_len, const int name_type, const s64 pos, const MFT_REF mref, const unsigned dt_type) {
+    char converted_name[NR_NAME_LENGTH];
+    struct ntfsrec_ls_entry *entry;
+    int length;
     
     NR_UNUSED(pos);
     NR_UNUSED(name_type);
-    NR_UNUSED(mref);
     
     if ((name_type & FILE_NAME_WIN32_AND_DOS) == FILE_NAME_DOS) {
         return 0;
     }
     
-    if (ntfs_ucstombs(name, name_len, &converted_name, MAX_PATH_LENGTH) < 0) {
-        puts("Error: this filename can't be represented in your locale.");
+    length = ntfsrec_utf16_to_utf8(converted_name, sizeof converted_name, name, name_len);
+    
+    if (length < 0) {
+        puts("Error: this filename is too long to convert.");
         return 0;
     }
     
-    memset(&meta, 0, sizeof meta);
+    entry = ntfsrec_ls_add(listing, converted_name, length);
+    entry->record = MREF(mref);
+    entry->is_dir = dt_type == NTFS_DT_DIR;
+    
+    ntfsrec_reader_get_file_meta(listing->state->reader, mref, dt_type == NTFS_DT_DIR, &entry->meta);
+    ntfsrec_ls_apply_filter(listing);
+    
+    return 0;
+}
+
+static int ntfsrec_ls_looks_stale(const FILE_NAME_ATTR *file_name, unsigned int is_dir) {
+    /* Windows only refreshes the index copy on some operations, files that grew often still show zero */
+    if (is_dir)
+        return NR_FALSE;
+    
+    return sle64_to_cpu(file_name->data_size) == 0 || sle64_to_cpu(file_name->data_size) > sle64_to_cpu(file_name->allocated_size);
+}
+
+static struct ntfsrec_ls_entry *ntfsrec_ls_add(struct ntfsrec_ls_listing *listing, const char *name, size_t name_length) {
+    struct ntfsrec_ls_entry *entry;
+    
+    if (listing->count == listing->capacity) {
+        listing->capacity = listing->capacity ? listing->capacity * 2 : 256;
+        listing->entries = ntfsrec_reallocate(listing->entries, listing->capacity * sizeof *listing->entries);
+    }
+    
+    while(listing->names_capacity - listing->names_length < name_length + 1) {
+        listing->names_capacity = listing->names_capacity ? listing->names_capacity * 2 : 16384;
+        listing->names = ntfsrec_reallocate(listing->names, listing->names_capacity);
+    }
+    
+    entry = &listing->entries[listing->count++];
+    memset(entry, 0, sizeof *entry);
+    
+    entry->name_offset = listing->names_length;
+    memcpy(&listing->names[listing->names_length], name, name_length);
+    listing->names[listing->names_length + name_length] = '\0';
+    listing->names_length += name_length + 1;
     
-    ntfsrec_reader_get_file_meta(state->reader, mref, dt_type == NTFS_DT_DIR, &meta);
+    return entry;
+}
+
+/* Takes the entry just added back out if the filters don't select it */
+static void ntfsrec_ls_apply_filter(struct ntfsrec_ls_listing *listing) {
+    const struct ntfsrec_ls_entry *entry = &listing->entries[listing->count - 1];
     
-    local = localtime(&meta.modified.tv_sec);
+    if (!ntfsrec_filter_active(&listing->filter))
+        return;
+    
+    if (entry->is_dir || ntfsrec_filter_match(&listing->filter, entry->record, &listing->names[entry->name_offset], &entry->meta) == NR_FALSE) {
+        listing->names_length = entry->name_offset;
+        listing->count--;
+    }
+}
+
+static int ntfsrec_ls_compare(const void *left, const void *right, void *context) {
+    const struct ntfsrec_ls_listing *listing = context;
+    const struct ntfsrec_ls_entry *a = left, *b = right;
+    int result = 0;
+    
+    /* Size and time put the largest and newest first, like ls -S and ls -t */
+    if (listing->opt.sort == NR_LS_SORT_SIZE && a->meta.size != b->meta.size) {
+        result = a->meta.size > b->meta.size ? -1 : 1;
+    } else if (listing->opt.sort == NR_LS_SORT_TIME && a->meta.modified.tv_sec != b->meta.modified.tv_sec) {
+        result = a->meta.modified.tv_sec > b->meta.modified.tv_sec ? -1 : 1;
+    } else {
+        result = strcasecmp(&listing->names[a->name_offset], &listing->names[b->name_offset]);
+    }
+    
+    return listing->opt.reverse ? -result : result;
+}
+
+static void ntfsrec_ls_print(const char *name, int is_dir, const struct ntfsrec_file_meta *meta) {
+    char createtime_text[32], modtime_text[32];
+    struct tm *local;
+    
+    local = localtime(&meta->modified.tv_sec);
     strftime(modtime_text, sizeof modtime_text, "%D %R", local);
     
-    local = localtime(&meta.created.tv_sec);
+    local = localtime(&meta->created.tv_sec);
     strftime(createtime_text, sizeof createtime_text, "%D %R", local);
     
-    if (dt_type == NTFS_DT_DIR) {
-        printf("%s\t%s\t--\t%s/\n", createtime_text, modtime_text, converted_name);
+    if (is_dir) {
+        printf("%s\t%s\t--\t%s/\n", createtime_text, modtime_text, name);
     } else {
         char size_text[8];
         
-        ntfsrec_utility_format_size(size_text, sizeof size_text, meta.size);
+        ntfsrec_utility_format_size(size_text, sizeof size_text, meta->size);
         
-        printf("%s\t%s\t%s\t%s/\n", createtime_text, modtime_text, size_text, converted_name);
+        printf("%s\t%s\t%s\t%s/\n", createtime_text, modtime_text, size_text, name);
     }
+}
+
+static void ntfsrec_ls_print_json(FILE *output, const char *name, int is_dir, const struct ntfsrec_file_meta *meta) {
+    fputs("{\"name\":", output);
+    ntfsrec_json_string(output, name);
     
-    free(converted_name);
-    
-    return 0;
-}
\ No newline at end of file
+    fprintf(output, ",\"directory\":%s,\"size\":%lld,\"created\":%lld,\"modified\":%lld,\"attributes\":%u}",
+            is_dir ? "true" : "false", is_dir ? 0LL : (long long)meta->size, (long long)meta->created.tv_sec,
+            (long long)meta->modified.tv_sec, (unsigned int)le32_to_cpu(meta->flags));
+}
@@ -0,0 +1,147 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfs_reader.h"
+#include "ntfsrec_command.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_mft.h"
+#include "ntfsrec_trigram.h"
+
+static void ntfsrec_scan_list(const struct ntfsrec_mft_table *table);
+
+int ntfsrec_command_scan(struct ntfsrec_command_processor *state, char *arguments) {
+    struct timespec start, end;
+    unsigned int list = NR_FALSE;
+    char *option;
+    
+    while((option = ntfsrec_next_argument(&arguments)) != NULL) {
+        if (strcmp(option, "-l") == 0) {
+            list = NR_TRUE;
+        } else {
+            printf("Error: unknown option %s\nUsage: scan [-l]\n", option);
+            return NR_FALSE;
+        }
+    }
+    
+    if (ntfsrec_command_require_volume(state) == NR_FALSE)
+        return NR_FALSE;
+    
+    if (state->names != NULL) {
+        ntfsrec_trigram_free(state->names);
+        state->names = NULL;
+    }
+    
+    if (state->table != NULL) {
+        ntfsrec_mft_table_free(state->table);
+        state->table = NULL;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    state->table = ntfsrec_mft_scan(state->reader->mount.volume, stdout);
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    if (state->table == NULL)
+        return NR_FALSE;
+    
+    printf("Scan took %.2fs\n", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    
+    if (state->result != NULL) {
+        fprintf(state->result, "{\"records\":%llu,\"seconds\":%.2f}", (unsigned long long)state->table->count,
+                (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
+    
+    if (list)
+        ntfsrec_scan_list(state->table);
+    
+    return NR_TRUE;
+}
+
+int ntfsrec_command_index(struct ntfsrec_command_processor *state, char *arguments) {
+    char *action = ntfsrec_next_argument(&arguments);
+    
+    while(*arguments == ' ')
+        ++arguments;
+    
+    if (action == NULL || strcmp(action, "build") != 0 || *arguments == '\0') {
+        puts("Usage: index build <file>");
+        return NR_FALSE;
+    }
+    
+    if (ntfsrec_command_require_table(state) == NR_FALSE)
+        return NR_FALSE;
+    
+    if (ntfsrec_mft_table_save(state->table, arguments, stdout) == NR_FALSE)
+        return NR_FALSE;
+    
+    printf("Wrote index of %llu records to %s\n", (unsigned long long)state->table->count, arguments);
+    
+    if (state->result != NULL) {
+        fprintf(state->result, "{\"records\":%llu,\"file\":", (unsigned long long)state->table->count);
+        ntfsrec_json_string(state->result, arguments);
+        fputc('}', state->result);
+    }
+    
+    return NR_TRUE;
+}
+
+int ntfsrec_command_require_table(struct ntfsrec_command_processor *state) {
+    FILE *result = state->result;
+    
+    if (state->table != NULL)
+        return NR_TRUE;
+    
+    /* The scan's own result would end up inside the caller's */
+    state->result = NULL;
+    ntfsrec_command_scan(state, "");
+    state->result = result;
+    
+    return state->table != NULL;
+}
+
+int ntfsrec_command_require_volume(struct ntfsrec_command_processor *state) {
+    struct ntfsrec_reader *reader = state->reader;
+    
+    if (reader->mount.volume != NULL)
+        return NR_TRUE;
+    
+    if (ntfsrec_reader_require_volume(reader) == NR_FALSE)
+        return NR_FALSE;
+    
+    /* Files are opened by the record numbers in the index, which on another volume belong to other files */
+    if (state->offline && state->table != NULL && ntfsrec_mft_table_matches(state->table, reader->mount.volume) == NR_FALSE) {
+        fprintf(reader->settings->log, "Error: the index wasn't built from %s\n", reader->mount.name);
+        ntfsrec_reader_release(reader);
+        return NR_FALSE;
+    }
+    
+    return NR_TRUE;
+}
+
+static void ntfsrec_scan_list(const struct ntfsrec_mft_table *table) {
+    char path[MAX_PATH_LENGTH];
+    uint64_t record;
+    
+    for(record = 0; record < table->count; ++record) {
+        if ((table->flags[record] & NR_MFT_IN_USE) == 0)
+            continue;
+        
+        if (ntfsrec_mft_table_path(table, record, path, sizeof path) == NR_FALSE && path[0] == '\0') {
+            printf("%llu\t--\t(path too long)\n", (unsigned long long)record);
+            continue;
+        }
+        
+        if (table->flags[record] & NR_MFT_DIRECTORY) {
+            printf("%llu\t--\t%s/\n", (unsigned long long)record, path);
+        } else {
+            char size_text[8];
+            
+            ntfsrec_utility_format_size(size_text, sizeof size_text, table->size[record]);
+            printf("%llu\t%s\t%s\n", (unsigned long long)record, size_text, path);
+        }
+    }
+}
@@ -0,0 +1,474 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_lznt1.h"
+#include "ntfsrec_compressed.h"
+#include <ntfs-3g/device.h>
+#include <pthread.h>
+
+/*
+ * A compression unit is a fixed number of clusters, 16 on any volume that can compress. Its runlist
+ * says how it's stored: all of its clusters allocated means the data is stored as is, none means it
+ * reads as zeros, and some followed by a hole means those clusters hold LZNT1 data.
+ *
+ * libntfs-3g decodes a unit for every read that touches it, so the small reads of a copy decode the
+ * same unit over and over on one core. Here a batch of units is read in whole, decoded once across
+ * the pool, and reads are served from it in order.
+ */
+
+#define NR_COMPRESSED_BATCH_UNITS 16
+
+enum ntfsrec_unit_kind {
+    NR_UNIT_SPARSE,
+    NR_UNIT_STORED,
+    NR_UNIT_COMPRESSED
+};
+
+struct ntfsrec_compressed_unit {
+    unsigned char *input;
+    size_t input_length;
+    
+    /* Decoded data, either the input itself for a stored unit or the output buffer */
+    unsigned char *output;
+    const unsigned char *data;
+    size_t length;
+    
+    unsigned int kind;
+    unsigned int failed;
+};
+
+struct ntfsrec_decode_batch {
+    struct ntfsrec_compressed_unit *units;
+    unsigned int count;
+    unsigned int next;
+    unsigned int remaining;
+    struct ntfsrec_decode_batch *next_batch;
+};
+
+struct ntfsrec_decode_pool {
+    pthread_t *threads;
+    unsigned int thread_count;
+    
+    /* Threads are started by the first compressed attribute opened, plain copies never need them */
+    unsigned int thread_limit;
+    unsigned int started;
+    
+    /* Batches with units nobody has taken yet, oldest first */
+    struct ntfsrec_decode_batch *batches;
+    
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t finished;
+    unsigned int stop;
+};
+
+/* Consecutive clusters waiting to be read in one go, covering units first_unit to last_unit */
+struct ntfsrec_compressed_read {
+    s64 position;
+    s64 length;
+    unsigned char *destination;
+    unsigned int first_unit;
+    unsigned int last_unit;
+};
+
+struct ntfsrec_compressed {
+    ntfs_attr *attribute;
+    struct ntfsrec_decode_pool *pool;
+    struct ntfs_device *device;
+    u8 cluster_bits;
+    u8 unit_bits;
+    s64 unit_clusters;
+    s64 unit_total;
+    
+    /* Where the runlist was last looked at, units are almost always asked for in order */
+    runlist_element *run;
+    
+    /* The loaded batch is units first to first + count - 1, count is 0 while none is */
+    struct ntfsrec_compressed_unit units[NR_COMPRESSED_BATCH_UNITS];
+    unsigned int capacity;
+    unsigned int count;
+    s64 first;
+    
+    unsigned char *input;
+    unsigned char *output;
+};
+
+static void ntfsrec_decode_pool_start(struct ntfsrec_decode_pool *pool);
+static void *ntfsrec_decode_pool_main(void *argument);
+static void ntfsrec_decode_pool_run(struct ntfsrec_decode_pool *pool, struct ntfsrec_compressed_unit *units, unsigned int count);
+static struct ntfsrec_compressed_unit *ntfsrec_decode_pool_take(struct ntfsrec_decode_pool *pool, struct ntfsrec_decode_batch *batch);
+static void ntfsrec_compressed_decode(struct ntfsrec_compressed_unit *unit);
+static void ntfsrec_compressed_load(struct ntfsrec_compressed *reader, s64 first);
+static runlist_element *ntfsrec_compressed_find(struct ntfsrec_compressed *reader, VCN vcn);
+static void ntfsrec_compressed_queue(struct ntfsrec_compressed *reader, struct ntfsrec_compressed_read *read,
+                                     LCN lcn, s64 clusters, unsigned char *destination, unsigned int unit);
+static void ntfsrec_compressed_flush(struct ntfsrec_compressed *reader, struct ntfsrec_compressed_read *read);
+
+struct ntfsrec_decode_pool *ntfsrec_decode_pool_create(unsigned int threads) {
+    struct ntfsrec_decode_pool *pool;
+    
+    if (threads == 0)
+        return NULL;
+    
+    pool = ntfsrec_allocate(sizeof *pool);
+    memset(pool, 0, sizeof *pool);
+    
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    
+    pool->threads = ntfsrec_allocate(threads * sizeof *pool->threads);
+    pool->thread_limit = threads;
+    
+    return pool;
+}
+
+void ntfsrec_decode_pool_free(struct ntfsrec_decode_pool *pool) {
+    unsigned int index;
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = NR_TRUE;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    
+    for(index = 0; index < pool->thread_count; ++index)
+        pthread_join(pool->threads[index], NULL);
+    
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    
+    free(pool->threads);
+    free(pool);
+}
+
+struct ntfsrec_compressed *ntfsrec_compressed_open(ntfs_attr *data_attribute, struct ntfsrec_decode_pool *pool) {
+    struct ntfsrec_compressed *reader;
+    ntfs_volume *volume = data_attribute->ni->vol;
+    size_t unit_size = data_attribute->compression_block_size;
+    unsigned int index;
+    
+    /* Volumes with clusters over 4 KB can't compress, libntfs-3g deals with whatever claims otherwise */
+    if (!NAttrNonResident(data_attribute) || !NAttrCompressed(data_attribute) || NAttrEncrypted(data_attribute) ||
+        data_attribute->compression_block_clusters == 0 || unit_size != (size_t)data_attribute->compression_block_clusters << volume->cluster_size_bits ||
+        data_attribute->data_size == 0 || ntfs_attr_map_whole_runlist(data_attribute) != 0)
+        return NULL;
+    
+    reader = ntfsrec_allocate(sizeof *reader);
+    memset(reader, 0, sizeof *reader);
+    
+    if (pool != NULL)
+        ntfsrec_decode_pool_start(pool);
+    
+    reader->attribute = data_attribute;
+    reader->pool = pool;
+    reader->device = volume->dev;
+    reader->cluster_bits = volume->cluster_size_bits;
+    reader->unit_bits = data_attribute->compression_block_size_bits;
+    reader->unit_clusters = data_attribute->compression_block_clusters;
+    reader->unit_total = (data_attribute->data_size + unit_size - 1) >> reader->unit_bits;
+    
+    /* Small files only get as many units as they have */
+    reader->capacity = reader->unit_total < NR_COMPRESSED_BATCH_UNITS ? (unsigned int)reader->unit_total : NR_COMPRESSED_BATCH_UNITS;
+    reader->input = ntfsrec_allocate(reader->capacity * unit_size);
+    reader->output = ntfsrec_allocate(reader->capacity * unit_size);
+    
+    for(index = 0; index < reader->capacity; ++index) {
+        reader->units[index].output = &reader->output[index * unit_size];
+        reader->units[index].length = unit_size;
+    }
+    
+    return reader;
+}
+
+void ntfsrec_compressed_close(struct ntfsrec_compressed *reader) {
+    free(reader->input);
+    free(reader->output);
+    free(reader);
+}
+
+s64 ntfsrec_compressed_pread(struct ntfsrec_compressed *reader, s64 offset, s64 count, void *buffer) {
+    const ntfs_attr *attribute = reader->attribute;
+    unsigned char *out = buffer;
+    s64 unit_index, done = 0;
+    
+    if (offset < 0 || count < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    if (offset >= attribute->data_size)
+        return 0;
+    
+    if (count > attribute->data_size - offset)
+        count = attribute->data_size - offset;
+    
+    unit_index = offset >> reader->unit_bits;
+    
+    if (reader->count == 0 || unit_index < reader->first || unit_index >= reader->first + reader->count)
+        ntfsrec_compressed_load(reader, unit_index);
+    
+    while(done < count && unit_index < reader->first + reader->count) {
+        const struct ntfsrec_compressed_unit *unit = &reader->units[unit_index - reader->first];
+        s64 within = (offset + done) & ((1LL << reader->unit_bits) - 1);
+        s64 length = ((s64)1 << reader->unit_bits) - within;
+        
+        if (unit->failed) {
+            if (done > 0)
+                break;
+            
+            /* The batch is dropped so reading here again goes back to the device */
+            reader->count = 0;
+            errno = EIO;
+            return -1;
+        }
+        
+        if (length > count - done)
+            length = count - done;
+        
+        memcpy(&out[done], &unit->data[within], length);
+        done += length;
+        ++unit_index;
+    }
+    
+    /* Like ntfs_attr_pread, anything past the initialized size reads as zeros */
+    if (offset + done > attribute->initialized_size) {
+        s64 start = attribute->initialized_size > offset ? attribute->initialized_size - offset : 0;
+        
+        memset(&out[start], 0, done - start);
+    }
+    
+    return done;
+}
+
+static void ntfsrec_compressed_load(struct ntfsrec_compressed *reader, s64 first) {
+    struct ntfsrec_compressed_read read;
+    unsigned char *input = reader->input;
+    unsigned int index;
+    
+    memset(&read, 0, sizeof read);
+    
+    reader->first = first;
+    reader->count = reader->unit_total - first < reader->capacity ? (unsigned int)(reader->unit_total - first) : reader->capacity;
+    
+    for(index = 0; index < reader->count; ++index) {
+        struct ntfsrec_compressed_unit *unit = &reader->units[index];
+        VCN vcn = (first + index) * reader->unit_clusters, end = vcn + reader->unit_clusters;
+        s64 allocated = 0;
+        
+        unit->input = input;
+        unit->failed = NR_FALSE;
+        
+        /* Inputs are packed back to back, so units that follow each other on disk are read together */
+        while(vcn < end) {
+            runlist_element *run = ntfsrec_compressed_find(reader, vcn);
+            s64 length;
+            
+            if (run == NULL || run->lcn < LCN_HOLE) {
+                unit->failed = NR_TRUE;
+                break;
+            }
+            
+            length = (run->vcn + run->length < end ? run->vcn + run->length : end) - vcn;
+            
+            if (run->lcn >= 0) {
+                ntfsrec_compressed_queue(reader, &read, run->lcn + (vcn - run->vcn), length, input, index);
+                input += length << reader->cluster_bits;
+                allocated += length;
+            }
+            
+            vcn += length;
+        }
+        
+        unit->input_length = input - unit->input;
+        
+        if (allocated == 0)
+            unit->kind = NR_UNIT_SPARSE;
+        else if (allocated == reader->unit_clusters)
+            unit->kind = NR_UNIT_STORED;
+        else
+            unit->kind = NR_UNIT_COMPRESSED;
+    }
+    
+    ntfsrec_compressed_flush(reader, &read);
+    
+    if (reader->pool != NULL && reader->count > 1) {
+        ntfsrec_decode_pool_run(reader->pool, reader->units, reader->count);
+    } else {
+        for(index = 0; index < reader->count; ++index)
+            ntfsrec_compressed_decode(&reader->units[index]);
+    }
+}
+
+static runlist_element *ntfsrec_compressed_find(struct ntfsrec_compressed *reader, VCN vcn) {
+    runlist_element *run = reader->run;
+    
+    if (run == NULL || vcn < run->vcn)
+        run = reader->attribute->rl;
+    
+    while(run->length > 0 && vcn >= run->vcn + run->length)
+        ++run;
+    
+    reader->run = run;
+    return run->length > 0 && vcn >= run->vcn ? run : NULL;
+}
+
+static void ntfsrec_compressed_queue(struct ntfsrec_compressed *reader, struct ntfsrec_compressed_read *read,
+                                     LCN lcn, s64 clusters, unsigned char *destination, unsigned int unit) {
+    s64 position = lcn << reader->cluster_bits, length = clusters << reader->cluster_bits;
+    
+    if (read->length > 0 && read->position + read->length == position && read->destination + read->length == destination) {
+        read->length += length;
+        read->last_unit = unit;
+        return;
+    }
+    
+    ntfsrec_compressed_flush(reader, read);
+    
+    read->position = position;
+    read->length = length;
+    read->destination = destination;
+    read->first_unit = unit;
+    read->last_unit = unit;
+}
+
+static void ntfsrec_compressed_flush(struct ntfsrec_compressed *reader, struct ntfsrec_compressed_read *read) {
+    unsigned int index;
+    
+    if (read->length == 0 || ntfs_pread(reader->device, read->position, read->length, read->destination) == read->length) {
+        read->length = 0;
+        return;
+    }
+    
+    /* Read again a unit at a time, so one bad unit doesn't take the others in the same read with it */
+    for(index = read->first_unit; index <= read->last_unit; ++index) {
+        struct ntfsrec_compressed_unit *unit = &reader->units[index];
+        unsigned char *start = index == read->first_unit ? read->destination : unit->input;
+        unsigned char *end = index == read->last_unit ? read->destination + read->length : reader->units[index + 1].input;
+        
+        if (ntfs_pread(reader->device, read->position + (start - read->destination), end - start, start) != end - start)
+            unit->failed = NR_TRUE;
+    }
+    
+    read->length = 0;
+}
+
+static void ntfsrec_compressed_decode(struct ntfsrec_compressed_unit *unit) {
+    if (unit->failed)
+        return;
+    
+    if (unit->kind == NR_UNIT_STORED) {
+        unit->data = unit->input;
+    } else if (unit->kind == NR_UNIT_SPARSE) {
+        memset(unit->output, 0, unit->length);
+        unit->data = unit->output;
+    } else {
+        unit->failed = !ntfsrec_lznt1_decompress(unit->input, unit->input_length, unit->output, unit->length);
+        unit->data = unit->output;
+    }
+}
+
+/* Readers on other threads can open at the same time, so only the first one starts the threads */
+static void ntfsrec_decode_pool_start(struct ntfsrec_decode_pool *pool) {
+    unsigned int index;
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    if (!pool->started) {
+        pool->started = NR_TRUE;
+        
+        for(index = 0; index < pool->thread_limit; ++index) {
+            if (pthread_create(&pool->threads[index], NULL, &ntfsrec_decode_pool_main, pool) != 0)
+                break;
+        }
+        
+        /* With no threads at all the reader decodes every unit of a batch itself */
+        pool->thread_count = index;
+    }
+    
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Decodes a batch across the pool, with the caller taking units as well until none are left */
+static void ntfsrec_decode_pool_run(struct ntfsrec_decode_pool *pool, struct ntfsrec_compressed_unit *units, unsigned int count) {
+    struct ntfsrec_decode_batch batch, **link;
+    
+    batch.units = units;
+    batch.count = count;
+    batch.next = 0;
+    batch.remaining = count;
+    batch.next_batch = NULL;
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    for(link = &pool->batches; *link != NULL; link = &(*link)->next_batch);
+    
+    *link = &batch;
+    pthread_cond_broadcast(&pool->work);
+    
+    while(batch.next < batch.count) {
+        struct ntfsrec_compressed_unit *unit = ntfsrec_decode_pool_take(pool, &batch);
+        
+        pthread_mutex_unlock(&pool->lock);
+        ntfsrec_compressed_decode(unit);
+        pthread_mutex_lock(&pool->lock);
+        
+        batch.remaining--;
+    }
+    
+    while(batch.remaining > 0)
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Takes the next unit of batch, which leaves the list with its last one; the lock must be held */
+static struct ntfsrec_compressed_unit *ntfsrec_decode_pool_take(struct ntfsrec_decode_pool *pool, struct ntfsrec_decode_batch *batch) {
+    struct ntfsrec_compressed_unit *unit = &batch->units[batch->next++];
+    
+    if (batch->next == batch->count) {
+        struct ntfsrec_decode_batch **link = &pool->batches;
+        
+        while(*link != batch)
+            link = &(*link)->next_batch;
+        
+        *link = batch->next_batch;
+    }
+    
+    return unit;
+}
+
+static void *ntfsrec_decode_pool_main(void *argument) {
+    struct ntfsrec_decode_pool *pool = argument;
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    for(;;) {
+        struct ntfsrec_decode_batch *batch;
+        struct ntfsrec_compressed_unit *unit;
+        
+        while(pool->batches == NULL && !pool->stop)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        
+        if (pool->batches == NULL)
+            break;
+        
+        batch = pool->batches;
+        unit = ntfsrec_decode_pool_take(pool, batch);
+        
+        pthread_mutex_unlock(&pool->lock);
+        ntfsrec_compressed_decode(unit);
+        pthread_mutex_lock(&pool->lock);
+        
+        /* The batch lives on its reader's stack, it's not touched again once the reader can go */
+        if (--batch->remaining == 0)
+            pthread_cond_broadcast(&pool->finished);
+    }
+    
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
@@ -0,0 +1,34 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_COMPRESSED_H
+#define _NTFSREC_COMPRESSED_H
+
+struct ntfsrec_decode_pool;
+struct ntfsrec_compressed;
+
+/*
+ * Threads that decode compression units for any number of readers at once, each waiting on its own
+ * batch and decoding part of it itself. The threads are only started once a compressed attribute is
+ * opened on the pool. Returns NULL for no threads.
+ */
+struct ntfsrec_decode_pool *ntfsrec_decode_pool_create(unsigned int threads);
+void ntfsrec_decode_pool_free(struct ntfsrec_decode_pool *pool);
+
+/*
+ * Reads a compressed attribute in place of ntfs_attr_pread. Whole compression units are read from
+ * the device a batch at a time, in as few reads as their clusters allow, and decoded on pool, or by
+ * the caller when it's NULL. Returns NULL for attributes libntfs-3g has to read itself.
+ */
+struct ntfsrec_compressed *ntfsrec_compressed_open(ntfs_attr *data_attribute, struct ntfsrec_decode_pool *pool);
+void ntfsrec_compressed_close(struct ntfsrec_compressed *reader);
+
+/*
+ * Reads count bytes at offset, or fewer where a batch ends. Fails with EIO at a unit that couldn't be
+ * read or decoded, and reading there again tries that unit afresh.
+ */
+s64 ntfsrec_compressed_pread(struct ntfsrec_compressed *reader, s64 offset, s64 count, void *buffer);
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_COPY_H
+#define _NTFSREC_COPY_H
+
+struct ntfsrec_extent_plan;
+struct ntfsrec_badmap;
+struct ntfsrec_writer;
+struct ntfsrec_zip;
+struct ntfsrec_tar;
+struct ntfsrec_progress;
+struct ntfsrec_image_plan;
+struct ntfsrec_manifest;
+struct ntfsrec_filter;
+struct ntfsrec_decode_pool;
+
+struct ntfsrec_copy {
+    ntfs_volume *volume;
+    const char *output_name;
+    
+    /* Set when running as one of several workers; entries are queued instead of copied inline */
+    struct ntfsrec_workqueue *queue;
+    unsigned int worker;
+    
+    /* Set when copying in on-disk order; file data is collected here and read after the traversal */
+    struct ntfsrec_extent_plan *plan;
+    
+    /* Set when unreadable data is recorded for later passes instead of retried on the spot */
+    struct ntfsrec_badmap *map;
+    
+    /* Set when output writes are queued to a writer thread instead of made inline */
+    struct ntfsrec_writer *writer;
+    
+    /* Set when files are streamed into an archive instead of the host filesystem */
+    struct ntfsrec_zip *zip;
+    struct ntfsrec_tar *tar;
+    
+    /* The volume's device opened again for splicing file data straight into a tar stream, -1 if unused */
+    int device_fd;
+    
+    struct {
+        unsigned int files;
+        unsigned int dirs;
+        unsigned int errors;
+        unsigned int retries;
+        unsigned int skipped;
+        unsigned int excluded;
+    } stats;
+    
+    /* Bytes, files and read latencies as they happen, shared by every worker while stats are summed at the end */
+    struct ntfsrec_progress *progress;
+    
+    /* Set when every copied file's hashes are recorded, shared by every worker */
+    struct ntfsrec_manifest *manifest;
+    
+    /* Set when only some files are copied, they're tested before their data is opened */
+    const struct ntfsrec_filter *filter;
+    
+    /* Threads that decode compressed files, shared by every worker; NULL decodes them on the reading thread */
+    struct ntfsrec_decode_pool *decoder;
+    
+    struct {
+        unsigned int retries;
+        /* Leave all-zero blocks of allocated data as holes in the output */
+        unsigned int zero_holes;
+        /* Milliseconds a read may take before the copy skips ahead, 0 to never skip */
+        unsigned int deadline;
+        /* Bytes requested by each read */
+        unsigned int buffer_size;
+        /* Leaves out the per-directory messages, which would scroll a status line away */
+        unsigned int quiet;
+        /* Skip files an earlier run finished and carry on with the ones it left partly written */
+        unsigned int incremental;
+        /* Bytes before the end of a partly written file that are copied again, for writes that may not have landed */
+        s64 resume_margin;
+    } opt;
+    
+    /* Distance of the last skip after a slow or failed read, 0 while reads are fast */
+    s64 skip;
+    
+    char *file_buffer;
+    
+    /* The output path of the entry being copied, growing and shrinking with the traversal */
+    char *path;
+    size_t path_length;
+    size_t path_capacity;
+    
+    /* Output directory new entries are created in, with the length of path it stands for; AT_FDCWD and 0 for the full path */
+    int directory_fd;
+    size_t directory_length;
+};
+
+/* Returns how many bytes to skip after a slow or failed read, doubling for each one in a row */
+s64 ntfsrec_copy_backoff(struct ntfsrec_copy *state);
+
+struct ntfsrec_extent_plan *ntfsrec_extent_plan_create(void);
+void ntfsrec_extent_plan_destroy(struct ntfsrec_extent_plan *plan);
+
+/*
+ * Creates the output file at the copy's current path and records its extents, returns NR_FALSE if the data must
+ * be copied inline. The file gets the modification time given, if any, once the plan has been executed.
+ */
+int ntfsrec_extent_plan_add(struct ntfsrec_copy *state, ntfs_attr *data_attribute, const struct timespec *modified);
+
+/* Reads every recorded extent in LCN order and writes it to its file */
+void ntfsrec_extent_plan_execute(struct ntfsrec_copy *state);
+
+/* Reads $Bitmap into the set of clusters an image of the volume needs: those allocated, plus the metadata a mount reads */
+struct ntfsrec_image_plan *ntfsrec_image_plan_create(struct ntfsrec_copy *state, const char *device_name);
+void ntfsrec_image_plan_destroy(struct ntfsrec_image_plan *plan);
+s64 ntfsrec_image_plan_bytes(const struct ntfsrec_image_plan *plan, const ntfs_volume *volume);
+
+/* Copies the planned clusters to the same offsets of a sparse image in fd, unreadable areas go to state->map */
+void ntfsrec_image_plan_execute(struct ntfsrec_copy *state, struct ntfsrec_image_plan *plan, int fd, const char *path);
+
+#endif
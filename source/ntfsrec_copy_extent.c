@@ -0,0 +1,398 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_command.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_copy.h"
+#include "ntfsrec_badmap.h"
+#include "ntfsrec_progress.h"
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#define NR_EXTENT_BUFFER_SIZE (4 * 1024 * 1024)
+#define NR_EXTENT_OPEN_FILES 256
+
+struct ntfsrec_extent_file {
+    MFT_REF mref;
+    char *path;
+    int fd;
+    s64 initialized_size;
+    
+    /* Set on the file after the plan has run, unless any of it failed to be read or written */
+    struct timespec modified;
+    unsigned int failed;
+};
+
+struct ntfsrec_extent {
+    LCN lcn;
+    VCN vcn;
+    s64 length;
+    size_t file;
+};
+
+struct ntfsrec_extent_plan {
+    struct ntfsrec_extent_file *files;
+    size_t file_count;
+    size_t file_capacity;
+    
+    struct ntfsrec_extent *extents;
+    size_t extent_count;
+    size_t extent_capacity;
+    
+    /* Output descriptors are recycled oldest first to stay under the process limit */
+    size_t open_files[NR_EXTENT_OPEN_FILES];
+    size_t open_count;
+    size_t open_next;
+};
+
+static int ntfsrec_extent_compare(const void *left, const void *right);
+static void ntfsrec_extent_write(struct ntfsrec_copy *state, const struct ntfsrec_extent *extent,
+                                 s64 extent_offset, const char *data, s64 length);
+static int ntfsrec_extent_file_open(struct ntfsrec_extent_plan *plan, size_t file);
+static void ntfsrec_extent_lost(struct ntfsrec_copy *state, const struct ntfsrec_extent *extent,
+                                s64 extent_offset, s64 clusters);
+static s64 ntfsrec_extent_read(struct ntfsrec_copy *state, LCN lcn, s64 length, char *buffer);
+static LCN ntfsrec_extent_deadline(struct ntfsrec_copy *state, uint64_t started, int success, LCN next, LCN skip_until);
+
+struct ntfsrec_extent_plan *ntfsrec_extent_plan_create(void) {
+    struct ntfsrec_extent_plan *plan = ntfsrec_allocate(sizeof *plan);
+    
+    memset(plan, 0, sizeof *plan);
+    
+    return plan;
+}
+
+void ntfsrec_extent_plan_destroy(struct ntfsrec_extent_plan *plan) {
+    size_t index;
+    
+    for(index = 0; index < plan->file_count; ++index) {
+        if (plan->files[index].fd != -1)
+            close(plan->files[index].fd);
+        
+        free(plan->files[index].path);
+    }
+    
+    free(plan->files);
+    free(plan->extents);
+    free(plan);
+}
+
+int ntfsrec_extent_plan_add(struct ntfsrec_copy *state, ntfs_attr *data_attribute, const struct timespec *modified) {
+    struct ntfsrec_extent_plan *plan = state->plan;
+    const char *path = state->path;
+    struct ntfsrec_extent_file *file;
+    runlist_element *run;
+    const u8 cluster_bits = state->volume->cluster_size_bits;
+    int output_fd;
+    
+    /* Resident, compressed and encrypted data has to be decoded by the library */
+    if (!NAttrNonResident(data_attribute) || NAttrCompressed(data_attribute) || NAttrEncrypted(data_attribute))
+        return NR_FALSE;
+    
+    /* $MFT and $MFTMirr need their fixups applied on read */
+    if (data_attribute->ni->mft_no < 2)
+        return NR_FALSE;
+    
+    if (ntfs_attr_map_whole_runlist(data_attribute) != 0) {
+        printf("Error: unable to map the runlist of %s, copying it in directory order\n", path);
+        return NR_FALSE;
+    }
+    
+    output_fd = openat(state->directory_fd, &path[state->directory_length], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    if (output_fd == -1) {
+        printf("Error: unable to create output file %s\n", path);
+        state->stats.errors++;
+        return NR_TRUE;
+    }
+    
+    /* Holes and the uninitialized tail are never read so the file is sized up front */
+    if (ftruncate(output_fd, data_attribute->data_size) != 0) {
+        printf("Error: unable to set the size of output file %s\n", path);
+        state->stats.errors++;
+    }
+    
+    close(output_fd);
+    
+    if (plan->file_count == plan->file_capacity) {
+        plan->file_capacity = plan->file_capacity ? plan->file_capacity * 2 : 1024;
+        plan->files = ntfsrec_reallocate(plan->files, plan->file_capacity * sizeof *plan->files);
+    }
+    
+    file = &plan->files[plan->file_count];
+    file->path = ntfsrec_allocate(strlen(path) + 1);
+    file->mref = MK_MREF(data_attribute->ni->mft_no, le16_to_cpu(data_attribute->ni->mrec->sequence_number));
+    file->fd = -1;
+    file->initialized_size = data_attribute->initialized_size;
+    file->modified.tv_sec = 0;
+    file->modified.tv_nsec = UTIME_OMIT;
+    file->failed = NR_FALSE;
+    strcpy(file->path, path);
+    
+    if (modified != NULL)
+        file->modified = *modified;
+    
+    for(run = data_attribute->rl; run != NULL && run->length != 0; ++run) {
+        struct ntfsrec_extent *extent;
+        
+        if (run->lcn < 0 || (run->vcn << cluster_bits) >= file->initialized_size)
+            continue;
+        
+        if (plan->extent_count == plan->extent_capacity) {
+            plan->extent_capacity = plan->extent_capacity ? plan->extent_capacity * 2 : 4096;
+            plan->extents = ntfsrec_reallocate(plan->extents, plan->extent_capacity * sizeof *plan->extents);
+        }
+        
+        extent = &plan->extents[plan->extent_count++];
+        extent->lcn = run->lcn;
+        extent->vcn = run->vcn;
+        extent->length = run->length;
+        extent->file = plan->file_count;
+    }
+    
+    plan->file_count++;
+    state->stats.files++;
+    ntfsrec_progress_file(state->progress);
+    return NR_TRUE;
+}
+
+void ntfsrec_extent_plan_execute(struct ntfsrec_copy *state) {
+    struct ntfsrec_extent_plan *plan = state->plan;
+    const u8 cluster_bits = state->volume->cluster_size_bits;
+    const s64 buffer_clusters = NR_EXTENT_BUFFER_SIZE >> cluster_bits;
+    char *buffer;
+    size_t first = 0, index;
+    LCN skip_until = 0;
+    
+    printf("Reading %lu extents from %lu files in disk order\n", (unsigned long)plan->extent_count, (unsigned long)plan->file_count);
+    
+    qsort(plan->extents, plan->extent_count, sizeof *plan->extents, &ntfsrec_extent_compare);
+    
+    buffer = ntfsrec_allocate(NR_EXTENT_BUFFER_SIZE);
+    
+    while(first < plan->extent_count) {
+        const struct ntfsrec_extent *extent = &plan->extents[first];
+        size_t last = first;
+        s64 clusters = extent->length;
+        uint64_t started;
+        int success;
+        
+        if (clusters > buffer_clusters) {
+            s64 offset;
+            
+            /* Large extents are streamed through the buffer in pieces */
+            for(offset = 0; offset < extent->length; offset += buffer_clusters) {
+                s64 chunk = extent->length - offset < buffer_clusters ? extent->length - offset : buffer_clusters;
+                uint64_t started = ntfsrec_monotonic_ms();
+                int success = NR_FALSE;
+                
+                if (extent->lcn + offset < skip_until) {
+                    ntfsrec_extent_lost(state, extent, offset, chunk);
+                    continue;
+                }
+                
+                if (ntfsrec_extent_read(state, extent->lcn + offset, chunk, buffer) == NR_TRUE) {
+                    ntfsrec_extent_write(state, extent, offset, buffer, chunk << cluster_bits);
+                    success = NR_TRUE;
+                } else {
+                    ntfsrec_extent_lost(state, extent, offset, chunk);
+                }
+                
+                skip_until = ntfsrec_extent_deadline(state, started, success, extent->lcn + offset + chunk, skip_until);
+            }
+            
+            ++first;
+            continue;
+        }
+        
+        /* Extents inside the area skipped after a slow read are deferred to the retry passes */
+        if (extent->lcn < skip_until) {
+            ntfsrec_extent_lost(state, extent, 0, extent->length);
+            ++first;
+            continue;
+        }
+        
+        /* Extents that sit next to each other on disk are read together */
+        while(last + 1 < plan->extent_count) {
+            const struct ntfsrec_extent *next = &plan->extents[last + 1];
+            
+            if (next->lcn != plan->extents[last].lcn + plan->extents[last].length || clusters + next->length > buffer_clusters)
+                break;
+            
+            clusters += next->length;
+            ++last;
+        }
+        
+        started = ntfsrec_monotonic_ms();
+        success = ntfsrec_extent_read(state, extent->lcn, clusters, buffer);
+        
+        if (success == NR_TRUE) {
+            for(index = first; index <= last; ++index) {
+                const struct ntfsrec_extent *member = &plan->extents[index];
+                
+                ntfsrec_extent_write(state, member, 0, &buffer[(member->lcn - extent->lcn) << cluster_bits], member->length << cluster_bits);
+            }
+        } else {
+            for(index = first; index <= last; ++index)
+                ntfsrec_extent_lost(state, &plan->extents[index], 0, plan->extents[index].length);
+        }
+        
+        skip_until = ntfsrec_extent_deadline(state, started, success, extent->lcn + clusters, skip_until);
+        
+        first = last + 1;
+    }
+    
+    /* Files only count as copied once every extent has been attempted */
+    for(index = 0; index < plan->file_count; ++index) {
+        struct ntfsrec_extent_file *file = &plan->files[index];
+        
+        if (state->map != NULL)
+            ntfsrec_badmap_mark_done(state->map, file->mref);
+        
+        if (!file->failed && file->modified.tv_nsec != UTIME_OMIT) {
+            struct timespec times[2] = { { 0, UTIME_OMIT }, file->modified };
+            
+            /* Stamped through a descriptor, since the full path may be longer than the kernel takes */
+            if (ntfsrec_extent_file_open(plan, index) == NR_FALSE || futimens(file->fd, times) != 0) {
+                printf("Error: unable to set the modification time of output file %s\n", file->path);
+                state->stats.errors++;
+            }
+        }
+    }
+    
+    free(buffer);
+}
+
+static int ntfsrec_extent_compare(const void *left, const void *right) {
+    const struct ntfsrec_extent *a = left, *b = right;
+    
+    if (a->lcn < b->lcn)
+        return -1;
+    
+    return a->lcn > b->lcn;
+}
+
+static s64 ntfsrec_extent_read(struct ntfsrec_copy *state, LCN lcn, s64 length, char *buffer) {
+    const u8 cluster_bits = state->volume->cluster_size_bits;
+    unsigned int retries = 0;
+    
+    for(;;) {
+        uint64_t started = ntfsrec_progress_clock();
+        s64 bytes_read = ntfs_pread(state->volume->dev, lcn << cluster_bits, length << cluster_bits, buffer);
+        
+        ntfsrec_progress_read(state->progress, bytes_read == (length << cluster_bits) ? bytes_read : -1, started);
+        
+        if (bytes_read == (length << cluster_bits))
+            return NR_TRUE;
+        
+        if (retries++ < state->opt.retries) {
+            state->stats.retries++;
+            ntfsrec_progress_retry(state->progress);
+            continue;
+        }
+        
+        state->stats.errors++;
+        printf("Error: failed %u times to read clusters %lld-%lld, leaving them zeroed\n", retries, (long long)lcn, (long long)(lcn + length - 1));
+        
+        return NR_FALSE;
+    }
+}
+
+static LCN ntfsrec_extent_deadline(struct ntfsrec_copy *state, uint64_t started, int success, LCN next, LCN skip_until) {
+    if (state->opt.deadline == 0)
+        return skip_until;
+    
+    if (success && ntfsrec_monotonic_ms() - started <= state->opt.deadline) {
+        state->skip = 0;
+        return skip_until;
+    }
+    
+    printf("Warning: slow or failed read at cluster %lld, skipping ahead\n", (long long)next);
+    
+    /* Clusters are skipped in volume order, whichever files they belong to */
+    return next + (ntfsrec_copy_backoff(state) >> state->volume->cluster_size_bits);
+}
+
+static void ntfsrec_extent_lost(struct ntfsrec_copy *state, const struct ntfsrec_extent *extent,
+                                s64 extent_offset, s64 clusters) {
+    struct ntfsrec_extent_file *file = &state->plan->files[extent->file];
+    s64 position = (extent->vcn + extent_offset) << state->volume->cluster_size_bits;
+    s64 length = clusters << state->volume->cluster_size_bits;
+    
+    if (position >= file->initialized_size)
+        return;
+    
+    /* Deferred or not, the file is missing data for now, which the time would hide from an incremental run */
+    file->failed = NR_TRUE;
+    
+    if (state->map == NULL)
+        return;
+    
+    if (position + length > file->initialized_size)
+        length = file->initialized_size - position;
+    
+    ntfsrec_badmap_add(state->map, file->mref, position, length, file->path);
+}
+
+static void ntfsrec_extent_write(struct ntfsrec_copy *state, const struct ntfsrec_extent *extent,
+                                 s64 extent_offset, const char *data, s64 length) {
+    struct ntfsrec_extent_file *file = &state->plan->files[extent->file];
+    s64 position = (extent->vcn + extent_offset) << state->volume->cluster_size_bits;
+    
+    /* Anything past the initialized size reads as zero and is already covered by the file size */
+    if (position >= file->initialized_size)
+        return;
+    
+    if (position + length > file->initialized_size)
+        length = file->initialized_size - position;
+    
+    if (state->opt.zero_holes && ntfsrec_is_zero(data, length))
+        return;
+    
+    if (ntfsrec_extent_file_open(state->plan, extent->file) == NR_FALSE) {
+        printf("Error: unable to open output file %s\n", file->path);
+        state->stats.errors++;
+        file->failed = NR_TRUE;
+        return;
+    }
+    
+    if (pwrite(file->fd, data, length, position) != length) {
+        printf("Error: unable to write to output file %s\n", file->path);
+        state->stats.errors++;
+        file->failed = NR_TRUE;
+        return;
+    }
+    
+    ntfsrec_progress_write(state->progress, length);
+}
+
+static int ntfsrec_extent_file_open(struct ntfsrec_extent_plan *plan, size_t file) {
+    struct ntfsrec_extent_file *entry = &plan->files[file];
+    
+    if (entry->fd != -1)
+        return NR_TRUE;
+    
+    if (plan->open_count == NR_EXTENT_OPEN_FILES) {
+        struct ntfsrec_extent_file *oldest = &plan->files[plan->open_files[plan->open_next]];
+        
+        close(oldest->fd);
+        oldest->fd = -1;
+        plan->open_count--;
+    }
+    
+    /* The directory it was created in has long been left, so it's found again from the top */
+    entry->fd = ntfsrec_open_path(AT_FDCWD, entry->path, O_WRONLY, 0);
+    
+    if (entry->fd == -1)
+        return NR_FALSE;
+    
+    plan->open_files[plan->open_next] = file;
+    plan->open_next = (plan->open_next + 1) % NR_EXTENT_OPEN_FILES;
+    plan->open_count++;
+    
+    return NR_TRUE;
+}
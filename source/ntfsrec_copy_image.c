@@ -0,0 +1,285 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_command.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_copy.h"
+#include "ntfsrec_badmap.h"
+#include "ntfsrec_progress.h"
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Free runs shorter than this are read along with the allocated clusters around them rather than sought over */
+#define NR_IMAGE_MAX_GAP (256 * 1024)
+
+#define NR_IMAGE_BITMAP_CHUNK (1024 * 1024)
+
+struct ntfsrec_image_plan {
+    /* One bit per cluster to copy, $Bitmap's allocation plus the metadata a mount reads */
+    uint64_t *clusters;
+    s64 cluster_count;
+    s64 marked;
+    
+    /* End of the last cluster, and the size of the device, whose tail holds the backup boot sector */
+    s64 volume_end;
+    s64 device_size;
+};
+
+static void ntfsrec_image_read_bitmap(struct ntfsrec_copy *state, struct ntfsrec_image_plan *plan);
+static void ntfsrec_image_mark_attribute(struct ntfsrec_image_plan *plan, ntfs_attr *attribute);
+static void ntfsrec_image_mark_file(struct ntfsrec_copy *state, struct ntfsrec_image_plan *plan, MFT_REF mref);
+static void ntfsrec_image_mark(struct ntfsrec_image_plan *plan, LCN lcn, s64 length);
+static LCN ntfsrec_image_find(const struct ntfsrec_image_plan *plan, LCN lcn, unsigned int marked);
+static s64 ntfsrec_image_tail(const struct ntfsrec_image_plan *plan, const ntfs_volume *volume);
+static void ntfsrec_image_copy(struct ntfsrec_copy *state, int fd, const char *path, s64 offset, s64 length, s64 *skip_until);
+
+struct ntfsrec_image_plan *ntfsrec_image_plan_create(struct ntfsrec_copy *state, const char *device_name) {
+    struct ntfsrec_image_plan *plan = ntfsrec_allocate(sizeof *plan);
+    size_t words, index;
+    int fd;
+    
+    memset(plan, 0, sizeof *plan);
+    
+    plan->cluster_count = state->volume->nr_clusters;
+    plan->volume_end = plan->cluster_count << state->volume->cluster_size_bits;
+    plan->device_size = plan->volume_end + state->volume->sector_size;
+    
+    fd = open(device_name, O_RDONLY);
+    
+    if (fd != -1) {
+        off_t end = lseek(fd, 0, SEEK_END);
+        
+        if (end > plan->volume_end)
+            plan->device_size = end;
+        
+        close(fd);
+    }
+    
+    words = (plan->cluster_count + 63) / 64;
+    plan->clusters = ntfsrec_allocate(words * sizeof *plan->clusters);
+    memset(plan->clusters, 0, words * sizeof *plan->clusters);
+    
+    ntfsrec_image_read_bitmap(state, plan);
+    
+    /* $Bitmap may be damaged itself, so what a mount needs is copied whatever it says */
+    ntfsrec_image_mark(plan, 0, 1);
+    ntfsrec_image_mark_attribute(plan, state->volume->mft_na);
+    ntfsrec_image_mark_attribute(plan, state->volume->mftmirr_na);
+    ntfsrec_image_mark_attribute(plan, state->volume->lcnbmp_na);
+    ntfsrec_image_mark_file(state, plan, FILE_LogFile);
+    ntfsrec_image_mark_file(state, plan, FILE_Boot);
+    
+    for(index = 0; index < words; ++index)
+        plan->marked += __builtin_popcountll(plan->clusters[index]);
+    
+    return plan;
+}
+
+void ntfsrec_image_plan_destroy(struct ntfsrec_image_plan *plan) {
+    free(plan->clusters);
+    free(plan);
+}
+
+s64 ntfsrec_image_plan_bytes(const struct ntfsrec_image_plan *plan, const ntfs_volume *volume) {
+    return (plan->marked << volume->cluster_size_bits) + ntfsrec_image_tail(plan, volume);
+}
+
+void ntfsrec_image_plan_execute(struct ntfsrec_copy *state, struct ntfsrec_image_plan *plan, int fd, const char *path) {
+    const u8 cluster_bits = state->volume->cluster_size_bits;
+    const s64 batch = state->opt.buffer_size >> cluster_bits, max_gap = NR_IMAGE_MAX_GAP >> cluster_bits;
+    s64 tail = ntfsrec_image_tail(plan, state->volume), skip_until = 0;
+    LCN lcn = 0;
+    
+    /* Unread parts of the image stay holes, and the size lets the image be mounted like the device */
+    if (ftruncate(fd, plan->device_size) != 0) {
+        printf("Error: unable to size the image %s: %s\n", path, strerror(errno));
+        state->stats.errors++;
+        return;
+    }
+    
+    for(;;) {
+        LCN end;
+        
+        lcn = ntfsrec_image_find(plan, lcn, NR_TRUE);
+        
+        if (lcn >= plan->cluster_count)
+            break;
+        
+        /* Batches run through short free gaps so the disk keeps streaming instead of seeking */
+        end = ntfsrec_image_find(plan, lcn, NR_FALSE);
+        
+        while(end - lcn < batch) {
+            LCN next = ntfsrec_image_find(plan, end, NR_TRUE);
+            
+            if (next >= plan->cluster_count || next - end > max_gap || next - lcn >= batch)
+                break;
+            
+            end = ntfsrec_image_find(plan, next, NR_FALSE);
+        }
+        
+        if (end - lcn > batch)
+            end = lcn + batch;
+        
+        ntfsrec_image_copy(state, fd, path, lcn << cluster_bits, (end - lcn) << cluster_bits, &skip_until);
+        lcn = end;
+    }
+    
+    if (tail > 0)
+        ntfsrec_image_copy(state, fd, path, plan->volume_end, tail, &skip_until);
+}
+
+/* The backup boot sector follows the volume's last sector, which is within a cluster of the end of the last cluster */
+static s64 ntfsrec_image_tail(const struct ntfsrec_image_plan *plan, const ntfs_volume *volume) {
+    s64 tail = plan->device_size - plan->volume_end;
+    
+    return tail < volume->cluster_size ? tail : volume->cluster_size;
+}
+
+static void ntfsrec_image_read_bitmap(struct ntfsrec_copy *state, struct ntfsrec_image_plan *plan) {
+    s64 bytes = (plan->cluster_count + 7) / 8, offset;
+    unsigned char *chunk = ntfsrec_allocate(NR_IMAGE_BITMAP_CHUNK);
+    
+    for(offset = 0; offset < bytes; offset += NR_IMAGE_BITMAP_CHUNK) {
+        s64 length = bytes - offset < NR_IMAGE_BITMAP_CHUNK ? bytes - offset : NR_IMAGE_BITMAP_CHUNK, index;
+        
+        /* Allocation that can't be read is copied, since it may well be in use */
+        if (ntfs_attr_pread(state->volume->lcnbmp_na, offset, length, chunk) != length) {
+            printf("Warning: unable to read $Bitmap at %lld, copying clusters %lld-%lld regardless\n",
+                   (long long)offset, (long long)(offset * 8), (long long)((offset + length) * 8 - 1));
+            memset(chunk, 0xff, length);
+        }
+        
+        for(index = 0; index < length; ++index) {
+            LCN lcn = (offset + index) * 8;
+            
+            if (chunk[index] != 0)
+                plan->clusters[lcn / 64] |= (uint64_t)chunk[index] << (lcn % 64);
+        }
+    }
+    
+    /* $Bitmap pads its last byte with set bits past the end of the volume */
+    if (plan->cluster_count % 64 != 0)
+        plan->clusters[plan->cluster_count / 64] &= ((uint64_t)1 << (plan->cluster_count % 64)) - 1;
+    
+    free(chunk);
+}
+
+static void ntfsrec_image_mark_attribute(struct ntfsrec_image_plan *plan, ntfs_attr *attribute) {
+    runlist_element *run;
+    
+    if (attribute == NULL)
+        return;
+    
+    ntfs_attr_map_whole_runlist(attribute);
+    
+    for(run = attribute->rl; run != NULL && run->length != 0; ++run) {
+        if (run->lcn >= 0)
+            ntfsrec_image_mark(plan, run->lcn, run->length);
+    }
+}
+
+static void ntfsrec_image_mark_file(struct ntfsrec_copy *state, struct ntfsrec_image_plan *plan, MFT_REF mref) {
+    ntfs_inode *inode = ntfs_inode_open(state->volume, mref);
+    ntfs_attr *data_attribute;
+    
+    if (inode == NULL)
+        return;
+    
+    data_attribute = ntfs_attr_open(inode, AT_DATA, AT_UNNAMED, 0);
+    
+    if (data_attribute != NULL) {
+        ntfsrec_image_mark_attribute(plan, data_attribute);
+        ntfs_attr_close(data_attribute);
+    }
+    
+    ntfs_inode_close(inode);
+}
+
+static void ntfsrec_image_mark(struct ntfsrec_image_plan *plan, LCN lcn, s64 length) {
+    LCN end = lcn + length;
+    
+    if (end > plan->cluster_count)
+        end = plan->cluster_count;
+    
+    for(; lcn < end; ++lcn)
+        plan->clusters[lcn / 64] |= (uint64_t)1 << (lcn % 64);
+}
+
+/* Returns the first cluster from lcn that is marked, or isn't, else the cluster count */
+static LCN ntfsrec_image_find(const struct ntfsrec_image_plan *plan, LCN lcn, unsigned int marked) {
+    const uint64_t skip = marked ? 0 : ~(uint64_t)0;
+    
+    while(lcn < plan->cluster_count) {
+        uint64_t word = plan->clusters[lcn / 64];
+        
+        if (lcn % 64 == 0 && word == skip) {
+            lcn += 64;
+            continue;
+        }
+        
+        if (((word >> (lcn % 64)) & 1) == marked)
+            return lcn;
+        
+        ++lcn;
+    }
+    
+    return plan->cluster_count;
+}
+
+/* Copies length bytes at offset of the device to the same offset of the image, deferring what can't be read */
+static void ntfsrec_image_copy(struct ntfsrec_copy *state, int fd, const char *path, s64 offset, s64 length, s64 *skip_until) {
+    unsigned int retries = 0;
+    
+    if (offset + length <= *skip_until) {
+        ntfsrec_badmap_add(state->map, NR_BADMAP_VOLUME, offset, length, path);
+        return;
+    }
+    
+    if (offset < *skip_until) {
+        ntfsrec_badmap_add(state->map, NR_BADMAP_VOLUME, offset, *skip_until - offset, path);
+        length -= *skip_until - offset;
+        offset = *skip_until;
+    }
+    
+    for(;;) {
+        uint64_t started = ntfsrec_progress_clock();
+        s64 bytes_read = ntfs_pread(state->volume->dev, offset, length, state->file_buffer);
+        unsigned int slow = state->opt.deadline > 0 && (ntfsrec_progress_clock() - started) / 1000 > state->opt.deadline;
+        
+        ntfsrec_progress_read(state->progress, bytes_read == length ? bytes_read : -1, started);
+        
+        if (bytes_read == length) {
+            if (!(state->opt.zero_holes && ntfsrec_is_zero(state->file_buffer, length)) &&
+                pwrite(fd, state->file_buffer, length, offset) != length) {
+                printf("Error: unable to write to the image %s: %s\n", path, strerror(errno));
+                state->stats.errors++;
+                return;
+            }
+            
+            ntfsrec_progress_write(state->progress, length);
+            
+            if (!slow) {
+                state->skip = 0;
+                return;
+            }
+        } else if (retries++ < state->opt.retries) {
+            state->stats.retries++;
+            ntfsrec_progress_retry(state->progress);
+            continue;
+        } else {
+            printf("Warning: unable to read %lld bytes at %lld, deferring them\n", (long long)length, (long long)offset);
+            ntfsrec_badmap_add(state->map, NR_BADMAP_VOLUME, offset, length, path);
+        }
+        
+        /* Like a file copy, a slow or failing area is jumped over and picked up by the retry passes */
+        if (state->opt.deadline > 0) {
+            *skip_until = offset + length + ntfsrec_copy_backoff(state);
+            printf("Warning: slow or failed read at %lld, skipping to %lld\n", (long long)offset, (long long)*skip_until);
+        }
+        
+        return;
+    }
+}
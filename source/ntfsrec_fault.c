@@ -0,0 +1,193 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_fault.h"
+#include <ntfs-3g/device.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * The device is the library's own unix device with read and pread wrapped. The operations table
+ * sits at the start of the plan so the wrappers can find the plan from dev->d_ops, which leaves
+ * d_private to the unix device.
+ */
+
+#define NR_FAULT_LINE_LENGTH 256
+
+enum ntfsrec_fault_type {
+    NR_FAULT_ERROR = 0,
+    NR_FAULT_DELAY
+};
+
+struct ntfsrec_fault {
+    enum ntfsrec_fault_type type;
+    s64 offset;
+    s64 length;
+    
+    /* Milliseconds for a delay, failures left for an error or 0 to fail every time */
+    unsigned int value;
+    unsigned int limited;
+};
+
+struct ntfsrec_fault_plan {
+    struct ntfs_device_operations ops;
+    
+    pthread_mutex_t lock;
+    struct ntfsrec_fault *faults;
+    size_t count;
+};
+
+static s64 ntfsrec_fault_read(struct ntfs_device *dev, void *buffer, s64 count);
+static s64 ntfsrec_fault_pread(struct ntfs_device *dev, void *buffer, s64 count, s64 offset);
+static s64 ntfsrec_fault_apply(struct ntfsrec_fault_plan *plan, s64 offset, s64 count);
+
+struct ntfsrec_fault_plan *ntfsrec_fault_load(const char *file_name, FILE *log) {
+    struct ntfsrec_fault_plan *plan;
+    char line[NR_FAULT_LINE_LENGTH];
+    unsigned int line_number = 0;
+    FILE *file;
+    
+    file = fopen(file_name, "r");
+    
+    if (file == NULL) {
+        fprintf(log, "Error: unable to open fault plan %s: %s\n", file_name, strerror(errno));
+        return NULL;
+    }
+    
+    plan = ntfsrec_allocate(sizeof *plan);
+    memset(plan, 0, sizeof *plan);
+    
+    plan->ops = ntfs_device_unix_io_ops;
+    plan->ops.read = &ntfsrec_fault_read;
+    plan->ops.pread = &ntfsrec_fault_pread;
+    pthread_mutex_init(&plan->lock, NULL);
+    
+    while(fgets(line, sizeof line, file) != NULL) {
+        struct ntfsrec_fault fault;
+        char type[16];
+        long long offset, length;
+        int fields;
+        
+        ++line_number;
+        
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        
+        memset(&fault, 0, sizeof fault);
+        fields = sscanf(line, "%15s %lli %lli %u", type, &offset, &length, &fault.value);
+        
+        if (fields >= 3 && strcmp(type, "error") == 0) {
+            fault.type = NR_FAULT_ERROR;
+            fault.limited = fields == 4 && fault.value > 0;
+        } else if (fields == 4 && strcmp(type, "delay") == 0) {
+            fault.type = NR_FAULT_DELAY;
+        } else {
+            fprintf(log, "Error: %s:%u isn't a valid fault\n", file_name, line_number);
+            fclose(file);
+            ntfsrec_fault_free(plan);
+            return NULL;
+        }
+        
+        fault.offset = offset;
+        fault.length = length;
+        
+        plan->faults = ntfsrec_reallocate(plan->faults, (plan->count + 1) * sizeof *plan->faults);
+        plan->faults[plan->count++] = fault;
+    }
+    
+    fclose(file);
+    return plan;
+}
+
+void ntfsrec_fault_free(struct ntfsrec_fault_plan *plan) {
+    pthread_mutex_destroy(&plan->lock);
+    free(plan->faults);
+    free(plan);
+}
+
+ntfs_volume *ntfsrec_fault_mount(struct ntfsrec_fault_plan *plan, const char *device_name, unsigned long flags) {
+    struct ntfs_device *dev;
+    ntfs_volume *volume;
+    
+    dev = ntfs_device_alloc(device_name, 0, &plan->ops, NULL);
+    
+    if (dev == NULL)
+        return NULL;
+    
+    /* A mounted volume frees its device when unmounted, a failed mount leaves that to us */
+    volume = ntfs_device_mount(dev, flags);
+    
+    if (volume == NULL)
+        ntfs_device_free(dev);
+    
+    return volume;
+}
+
+static s64 ntfsrec_fault_read(struct ntfs_device *dev, void *buffer, s64 count) {
+    struct ntfsrec_fault_plan *plan = (struct ntfsrec_fault_plan *)dev->d_ops;
+    s64 offset = ntfs_device_unix_io_ops.seek(dev, 0, SEEK_CUR), allowed;
+    
+    allowed = ntfsrec_fault_apply(plan, offset, count);
+    
+    if (allowed == 0) {
+        errno = EIO;
+        return -1;
+    }
+    
+    return ntfs_device_unix_io_ops.read(dev, buffer, allowed);
+}
+
+static s64 ntfsrec_fault_pread(struct ntfs_device *dev, void *buffer, s64 count, s64 offset) {
+    return ntfsrec_fault_device_pread((struct ntfsrec_fault_plan *)dev->d_ops, dev, buffer, count, offset);
+}
+
+s64 ntfsrec_fault_device_pread(struct ntfsrec_fault_plan *plan, struct ntfs_device *dev, void *buffer, s64 count, s64 offset) {
+    s64 allowed = ntfsrec_fault_apply(plan, offset, count);
+    
+    if (allowed == 0) {
+        errno = EIO;
+        return -1;
+    }
+    
+    return ntfs_device_unix_io_ops.pread(dev, buffer, allowed, offset);
+}
+
+/* Sleeps for any delays the read runs into and returns how much of it can be read before the first error */
+static s64 ntfsrec_fault_apply(struct ntfsrec_fault_plan *plan, s64 offset, s64 count) {
+    unsigned int delay = 0;
+    s64 allowed = count;
+    size_t index;
+    
+    pthread_mutex_lock(&plan->lock);
+    
+    for(index = 0; index < plan->count; ++index) {
+        struct ntfsrec_fault *fault = &plan->faults[index];
+        
+        if (fault->offset >= offset + count || fault->offset + fault->length <= offset)
+            continue;
+        
+        if (fault->type == NR_FAULT_DELAY) {
+            delay += fault->value;
+            continue;
+        }
+        
+        /* Like a real disk, the sectors before the bad ones still come back */
+        if (fault->offset - offset < allowed && (!fault->limited || fault->value > 0)) {
+            allowed = fault->offset > offset ? fault->offset - offset : 0;
+            
+            if (allowed == 0 && fault->limited)
+                fault->value--;
+        }
+    }
+    
+    pthread_mutex_unlock(&plan->lock);
+    
+    if (delay > 0)
+        usleep(delay * 1000);
+    
+    return allowed;
+}
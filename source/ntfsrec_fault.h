@@ -0,0 +1,29 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_FAULT_H
+#define _NTFSREC_FAULT_H
+
+struct ntfsrec_fault_plan;
+struct ntfs_device;
+
+/*
+ * Loads a list of simulated faults, one per line:
+ *
+ *   error <offset> <length> [times]    reads touching the range fail with EIO, only the first times reads if given
+ *   delay <offset> <length> <ms>       reads touching the range take ms longer
+ *
+ * Offsets and lengths are device bytes and may be given in hex.
+ */
+struct ntfsrec_fault_plan *ntfsrec_fault_load(const char *file_name, FILE *log);
+void ntfsrec_fault_free(struct ntfsrec_fault_plan *plan);
+
+/* Mounts device_name through a device layer that applies the plan to every read; the plan must outlive the volume */
+ntfs_volume *ntfsrec_fault_mount(struct ntfsrec_fault_plan *plan, const char *device_name, unsigned long flags);
+
+/* Reads from a unix device as though the plan applied to it, for device layers stacked on top of this one */
+s64 ntfsrec_fault_device_pread(struct ntfsrec_fault_plan *plan, struct ntfs_device *dev, void *buffer, s64 count, s64 offset);
+
+#endif
@@ -0,0 +1,308 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfs_reader.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_filter.h"
+#include <fnmatch.h>
+#include <ctype.h>
+
+struct ntfsrec_filter_attribute {
+    const char *name;
+    FILE_ATTR_FLAGS flag;
+};
+
+static const struct ntfsrec_filter_attribute ntfsrec_filter_attributes[] = {
+    { "readonly",   FILE_ATTR_READONLY },
+    { "hidden",     FILE_ATTR_HIDDEN },
+    { "system",     FILE_ATTR_SYSTEM },
+    { "archive",    FILE_ATTR_ARCHIVE },
+    { "temporary",  FILE_ATTR_TEMPORARY },
+    { "sparse",     FILE_ATTR_SPARSE_FILE },
+    { "reparse",    FILE_ATTR_REPARSE_POINT },
+    { "compressed", FILE_ATTR_COMPRESSED },
+    { "offline",    FILE_ATTR_OFFLINE },
+    { "notindexed", FILE_ATTR_NOT_CONTENT_INDEXED },
+    { "encrypted",  FILE_ATTR_ENCRYPTED },
+    { NULL,         0 }
+};
+
+static int ntfsrec_filter_parse_size(const char *text, int64_t *size);
+static int ntfsrec_filter_parse_time(const char *text, unsigned int upper, time_t *time_value);
+static int ntfsrec_filter_parse_range(char *text, const char **from, const char **to);
+static int ntfsrec_filter_test(const struct ntfsrec_filter *filter, uint64_t record, const char *name, const struct ntfsrec_file_meta *meta, unsigned int test_size);
+static int ntfsrec_filter_parse_attributes(struct ntfsrec_filter *filter, char *list);
+static int ntfsrec_filter_in_range(time_t value, time_t from, time_t to);
+
+void ntfsrec_filter_init(struct ntfsrec_filter *filter) {
+    memset(filter, 0, sizeof *filter);
+    filter->max_size = -1;
+}
+
+int ntfsrec_filter_is_option(const char *option) {
+    return strcmp(option, "--name") == 0 || strcmp(option, "--size") == 0 || strcmp(option, "--mtime") == 0 ||
+           strcmp(option, "--ctime") == 0 || strcmp(option, "--attr") == 0 || strcmp(option, "--selected") == 0;
+}
+
+int ntfsrec_filter_parse(struct ntfsrec_filter *filter, const char *option, char **arguments) {
+    const char *from, *to;
+    char *value;
+    
+    if (strcmp(option, "--selected") == 0) {
+        filter->selected = NR_TRUE;
+        return NR_TRUE;
+    }
+    
+    value = ntfsrec_next_argument(arguments);
+    
+    if (value == NULL) {
+        printf("Error: %s expects a value\n", option);
+        return NR_FALSE;
+    }
+    
+    if (strcmp(option, "--name") == 0) {
+        if (filter->name_count == NR_FILTER_MAX_NAMES) {
+            printf("Error: at most %u --name patterns can be given\n", NR_FILTER_MAX_NAMES);
+            return NR_FALSE;
+        }
+        
+        filter->names[filter->name_count++] = value;
+        return NR_TRUE;
+    }
+    
+    if (strcmp(option, "--attr") == 0)
+        return ntfsrec_filter_parse_attributes(filter, value);
+    
+    if (ntfsrec_filter_parse_range(value, &from, &to) == NR_FALSE) {
+        printf("Error: %s expects a range like from..to, from.. or ..to\n", option);
+        return NR_FALSE;
+    }
+    
+    if (strcmp(option, "--size") == 0) {
+        if ((*from != '\0' && ntfsrec_filter_parse_size(from, &filter->min_size) == NR_FALSE) ||
+            (*to != '\0' && ntfsrec_filter_parse_size(to, &filter->max_size) == NR_FALSE)) {
+            puts("Error: --size expects sizes in bytes, optionally followed by K, M, G or T");
+            return NR_FALSE;
+        }
+        
+        return NR_TRUE;
+    }
+    
+    if ((*from != '\0' && ntfsrec_filter_parse_time(from, NR_FALSE, strcmp(option, "--mtime") == 0 ? &filter->modified_from : &filter->created_from) == NR_FALSE) ||
+        (*to != '\0' && ntfsrec_filter_parse_time(to, NR_TRUE, strcmp(option, "--mtime") == 0 ? &filter->modified_to : &filter->created_to) == NR_FALSE)) {
+        printf("Error: %s expects times as YYYY-MM-DD, YYYY-MM-DDTHH:MM, or an age like 30d or 12h\n", option);
+        return NR_FALSE;
+    }
+    
+    return NR_TRUE;
+}
+
+int ntfsrec_filter_bind(struct ntfsrec_filter *filter, const struct ntfsrec_selection *selection) {
+    if (!filter->selected)
+        return NR_TRUE;
+    
+    if (selection == NULL) {
+        puts("Error: --selected picks what the last find matched, and there hasn't been one");
+        return NR_FALSE;
+    }
+    
+    filter->selection = selection;
+    return NR_TRUE;
+}
+
+int ntfsrec_filter_active(const struct ntfsrec_filter *filter) {
+    return filter->name_count > 0 || filter->selection != NULL || ntfsrec_filter_needs_meta(filter);
+}
+
+int ntfsrec_filter_needs_meta(const struct ntfsrec_filter *filter) {
+    return filter->min_size > 0 || filter->max_size >= 0 || filter->modified_from != 0 || filter->modified_to != 0 ||
+           filter->created_from != 0 || filter->created_to != 0 || filter->attributes_set != 0 || filter->attributes_clear != 0;
+}
+
+int ntfsrec_filter_match(const struct ntfsrec_filter *filter, uint64_t record, const char *name, const struct ntfsrec_file_meta *meta) {
+    return ntfsrec_filter_test(filter, record, name, meta, NR_TRUE);
+}
+
+int ntfsrec_filter_walks(const struct ntfsrec_filter *filter, uint64_t record) {
+    return filter == NULL || filter->selection == NULL || ntfsrec_selection_leads(filter->selection, record);
+}
+
+int ntfsrec_filter_match_index(const struct ntfsrec_filter *filter, uint64_t record, const char *name, const FILE_NAME_ATTR *file_name) {
+    struct ntfsrec_file_meta meta;
+    
+    meta.size = sle64_to_cpu(file_name->data_size);
+    meta.flags = file_name->file_attributes;
+    meta.created = ntfs2timespec(file_name->creation_time);
+    meta.modified = ntfs2timespec(file_name->last_data_change_time);
+    
+    /* The same test ls -v uses: files that grew often still show zero, or more than is allocated */
+    return ntfsrec_filter_test(filter, record, name, &meta, meta.size != 0 && meta.size <= sle64_to_cpu(file_name->allocated_size));
+}
+
+int ntfsrec_selection_has(const struct ntfsrec_selection *selection, uint64_t record) {
+    return record < selection->count && (selection->selected[record / 8] & (1 << (record % 8))) != 0;
+}
+
+int ntfsrec_selection_leads(const struct ntfsrec_selection *selection, uint64_t record) {
+    return ntfsrec_selection_has(selection, record) || (record < selection->count && (selection->on_the_way[record / 8] & (1 << (record % 8))) != 0);
+}
+
+void ntfsrec_selection_free(struct ntfsrec_selection *selection) {
+    if (selection == NULL)
+        return;
+    
+    free(selection->selected);
+    free(selection->on_the_way);
+    free(selection);
+}
+
+static int ntfsrec_filter_test(const struct ntfsrec_filter *filter, uint64_t record, const char *name, const struct ntfsrec_file_meta *meta, unsigned int test_size) {
+    if (filter->selection != NULL && !ntfsrec_selection_has(filter->selection, record))
+        return NR_FALSE;
+    
+    if (filter->name_count > 0) {
+        unsigned int index;
+        
+        for(index = 0; index < filter->name_count; ++index) {
+            if (fnmatch(filter->names[index], name, FNM_CASEFOLD) == 0)
+                break;
+        }
+        
+        if (index == filter->name_count)
+            return NR_FALSE;
+    }
+    
+    if (meta == NULL)
+        return NR_TRUE;
+    
+    if (test_size && (meta->size < filter->min_size || (filter->max_size >= 0 && meta->size > filter->max_size)))
+        return NR_FALSE;
+    
+    if ((meta->flags & filter->attributes_set) != filter->attributes_set || (meta->flags & filter->attributes_clear) != 0)
+        return NR_FALSE;
+    
+    return ntfsrec_filter_in_range(meta->modified.tv_sec, filter->modified_from, filter->modified_to) &&
+           ntfsrec_filter_in_range(meta->created.tv_sec, filter->created_from, filter->created_to);
+}
+
+static int ntfsrec_filter_parse_size(const char *text, int64_t *size) {
+    static const char units[] = "KMGT";
+    unsigned long long value;
+    char unit = '\0', extra;
+    const char *found;
+    int shift = 0, fields;
+    
+    /* sscanf would take a sign or leading spaces, and reads nothing at all from K or abc */
+    if (!isdigit((unsigned char)text[0]))
+        return NR_FALSE;
+    
+    fields = sscanf(text, "%llu%c%c", &value, &unit, &extra);
+    
+    if (fields < 1 || fields > 2)
+        return NR_FALSE;
+    
+    if (unit != '\0') {
+        found = strchr(units, toupper((unsigned char)unit));
+        
+        if (found == NULL)
+            return NR_FALSE;
+        
+        shift = 10 * (int)(found - units + 1);
+    }
+    
+    if (value > (unsigned long long)INT64_MAX >> shift)
+        return NR_FALSE;
+    
+    *size = (int64_t)(value << shift);
+    return NR_TRUE;
+}
+
+static int ntfsrec_filter_parse_time(const char *text, unsigned int upper, time_t *time_value) {
+    unsigned long age;
+    char unit, extra;
+    struct tm parsed;
+    const char *end;
+    unsigned int whole_day = NR_FALSE;
+    
+    /* An age counts back from now, so 365d is a year ago */
+    if (sscanf(text, "%lu%c%c", &age, &unit, &extra) == 2 && (unit == 'd' || unit == 'h')) {
+        *time_value = time(NULL) - (time_t)age * (unit == 'd' ? 86400 : 3600);
+        return NR_TRUE;
+    }
+    
+    memset(&parsed, 0, sizeof parsed);
+    end = strptime(text, "%Y-%m-%dT%H:%M", &parsed);
+    
+    if (end == NULL) {
+        memset(&parsed, 0, sizeof parsed);
+        end = strptime(text, "%Y-%m-%d", &parsed);
+        whole_day = NR_TRUE;
+    }
+    
+    if (end == NULL || *end != '\0')
+        return NR_FALSE;
+    
+    /* Like the times ls shows, dates are local, and a date as the upper bound takes in all of that day */
+    parsed.tm_isdst = -1;
+    
+    if (whole_day && upper) {
+        parsed.tm_hour = 23;
+        parsed.tm_min = 59;
+        parsed.tm_sec = 59;
+    }
+    
+    *time_value = mktime(&parsed);
+    return *time_value != (time_t)-1;
+}
+
+/* Splits from..to in place; a value without .. is a lower bound */
+static int ntfsrec_filter_parse_range(char *text, const char **from, const char **to) {
+    char *separator = strstr(text, "..");
+    
+    *from = text;
+    *to = "";
+    
+    if (separator != NULL) {
+        *separator = '\0';
+        *to = separator + 2;
+    }
+    
+    return **from != '\0' || **to != '\0';
+}
+
+static int ntfsrec_filter_parse_attributes(struct ntfsrec_filter *filter, char *list) {
+    char *name;
+    
+    for(name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        unsigned int clear = *name == '!';
+        const struct ntfsrec_filter_attribute *attribute;
+        
+        if (clear)
+            ++name;
+        
+        for(attribute = ntfsrec_filter_attributes; attribute->name != NULL; ++attribute) {
+            if (strcmp(attribute->name, name) == 0)
+                break;
+        }
+        
+        if (attribute->name == NULL) {
+            printf("Error: unknown attribute %s, expected one of readonly, hidden, system, archive, temporary, "
+                   "sparse, reparse, compressed, offline, notindexed or encrypted\n", name);
+            return NR_FALSE;
+        }
+        
+        if (clear)
+            filter->attributes_clear |= attribute->flag;
+        else
+            filter->attributes_set |= attribute->flag;
+    }
+    
+    return NR_TRUE;
+}
+
+static int ntfsrec_filter_in_range(time_t value, time_t from, time_t to) {
+    return (from == 0 || value >= from) && (to == 0 || value <= to);
+}
@@ -0,0 +1,87 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_FILTER_H
+#define _NTFSREC_FILTER_H
+
+#define NR_FILTER_MAX_NAMES 16
+
+struct ntfsrec_file_meta;
+
+/*
+ * The records a find picked, a bit each: its matches and everything under the folders it matched.
+ * The folders on the way to them get a bit of their own, so a walk can skip the ones that lead nowhere.
+ */
+struct ntfsrec_selection {
+    uint8_t *selected;
+    uint8_t *on_the_way;
+    uint64_t count;
+};
+
+/*
+ * Selects files by what their directory entry or the file table already says about them, so the
+ * ones left out never have their data opened. Directories aren't filtered, they're always walked unless
+ * a selection has nothing under them.
+ */
+struct ntfsrec_filter {
+    /* Globs matched against the name without case, any one of them will do */
+    const char *names[NR_FILTER_MAX_NAMES];
+    unsigned int name_count;
+    
+    /* Inclusive bounds, a maximum of -1 is unbounded */
+    int64_t min_size;
+    int64_t max_size;
+    
+    /* Inclusive bounds in seconds since the epoch, 0 is unbounded */
+    time_t modified_from;
+    time_t modified_to;
+    time_t created_from;
+    time_t created_to;
+    
+    /* Attributes that must all be set, and ones that must all be clear */
+    FILE_ATTR_FLAGS attributes_set;
+    FILE_ATTR_FLAGS attributes_clear;
+    
+    /* Set by --selected, then bound to the session's selection by ntfsrec_filter_bind */
+    unsigned int selected;
+    const struct ntfsrec_selection *selection;
+};
+
+void ntfsrec_filter_init(struct ntfsrec_filter *filter);
+
+/* Returns whether option is one of the filter options, --name, --size, --mtime, --ctime, --attr or --selected */
+int ntfsrec_filter_is_option(const char *option);
+
+/* Reads the value of a filter option from arguments, printing what's wrong with it if it can't be used */
+int ntfsrec_filter_parse(struct ntfsrec_filter *filter, const char *option, char **arguments);
+
+/* Gives a filter that was parsed with --selected the selection to use, which fails if there's none yet */
+int ntfsrec_filter_bind(struct ntfsrec_filter *filter, const struct ntfsrec_selection *selection);
+
+/* Returns whether any test was given */
+int ntfsrec_filter_active(const struct ntfsrec_filter *filter);
+
+/* Returns whether the tests need more than the name, that is the size, times or attributes */
+int ntfsrec_filter_needs_meta(const struct ntfsrec_filter *filter);
+
+/* Tests a file by its record number, name and metadata; meta may be NULL when only names are filtered */
+int ntfsrec_filter_match(const struct ntfsrec_filter *filter, uint64_t record, const char *name, const struct ntfsrec_file_meta *meta);
+
+/* Returns whether a folder is worth walking, which is always unless a selection has nothing under it */
+int ntfsrec_filter_walks(const struct ntfsrec_filter *filter, uint64_t record);
+
+/*
+ * Tests a file by its $I30 index entry. Windows refreshes the size kept there lazily, so an entry
+ * whose size looks stale passes, and is tested again against its own record before it's copied.
+ */
+int ntfsrec_filter_match_index(const struct ntfsrec_filter *filter, uint64_t record, const char *name, const FILE_NAME_ATTR *file_name);
+
+int ntfsrec_selection_has(const struct ntfsrec_selection *selection, uint64_t record);
+int ntfsrec_selection_leads(const struct ntfsrec_selection *selection, uint64_t record);
+void ntfsrec_selection_free(struct ntfsrec_selection *selection);
+
+#define NR_FILTER_USAGE "[--name glob] [--size min..max] [--mtime from..to] [--ctime from..to] [--attr [!]name,...] [--selected]"
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_index.h"
+
+/* Index blocks are read in batches of this many to keep the reads large */
+#define NR_INDEX_BATCH_BLOCKS 64
+
+enum ntfsrec_index_walk_result {
+    NR_INDEX_DAMAGED = 0,
+    NR_INDEX_CONTINUE,
+    NR_INDEX_STOPPED
+};
+
+static enum ntfsrec_index_walk_result ntfsrec_index_walk_entries(const INDEX_HEADER *header, size_t available, void *context, ntfsrec_index_visitor visitor);
+static enum ntfsrec_index_walk_result ntfsrec_index_walk_allocation(ntfs_inode *directory, u32 block_size, void *context, ntfsrec_index_visitor visitor);
+
+int ntfsrec_index_walk(ntfs_inode *directory, void *context, ntfsrec_index_visitor visitor) {
+    INDEX_ROOT *root;
+    s64 root_size = 0;
+    enum ntfsrec_index_walk_result result;
+    
+    root = ntfs_attr_readall(directory, AT_INDEX_ROOT, NTFS_INDEX_I30, 4, &root_size);
+    
+    if (root == NULL)
+        return NR_FALSE;
+    
+    if ((size_t)root_size < sizeof *root) {
+        free(root);
+        return NR_FALSE;
+    }
+    
+    result = ntfsrec_index_walk_entries(&root->index, root_size - offsetof(INDEX_ROOT, index), context, visitor);
+    
+    if (result == NR_INDEX_CONTINUE)
+        result = ntfsrec_index_walk_allocation(directory, le32_to_cpu(root->index_block_size), context, visitor);
+    
+    free(root);
+    return result != NR_INDEX_DAMAGED;
+}
+
+static enum ntfsrec_index_walk_result ntfsrec_index_walk_entries(const INDEX_HEADER *header, size_t available, void *context, ntfsrec_index_visitor visitor) {
+    const char *base = (const char *)header;
+    size_t offset = le32_to_cpu(header->entries_offset);
+    size_t end = le32_to_cpu(header->index_length);
+    
+    if (end > available)
+        end = available;
+    
+    while(offset + offsetof(INDEX_ENTRY, key) <= end) {
+        const INDEX_ENTRY *entry = (const INDEX_ENTRY *)(base + offset);
+        const size_t length = le16_to_cpu(entry->length);
+        const size_t key_length = le16_to_cpu(entry->key_length);
+        const FILE_NAME_ATTR *file_name = &entry->key.file_name;
+        
+        if (entry->ie_flags & INDEX_ENTRY_END)
+            break;
+        
+        if (length < offsetof(INDEX_ENTRY, key) || offset + length > end)
+            return NR_INDEX_DAMAGED;
+        
+        /* Entries whose key doesn't hold a whole name are skipped rather than trusted */
+        if (key_length >= sizeof(FILE_NAME_ATTR) && offsetof(INDEX_ENTRY, key) + key_length <= length &&
+            sizeof(FILE_NAME_ATTR) + file_name->file_name_length * sizeof(ntfschar) <= key_length) {
+            if (visitor(context, le64_to_cpu(entry->indexed_file), file_name) != 0)
+                return NR_INDEX_STOPPED;
+        }
+        
+        offset += length;
+    }
+    
+    return NR_INDEX_CONTINUE;
+}
+
+static enum ntfsrec_index_walk_result ntfsrec_index_walk_allocation(ntfs_inode *directory, u32 block_size, void *context, ntfsrec_index_visitor visitor) {
+    ntfs_attr *allocation;
+    u8 *bitmap;
+    char *blocks;
+    s64 bitmap_size = 0, block_count, block;
+    enum ntfsrec_index_walk_result result = NR_INDEX_CONTINUE;
+    
+    allocation = ntfs_attr_open(directory, AT_INDEX_ALLOCATION, NTFS_INDEX_I30, 4);
+    
+    /* Small directories keep everything in the root */
+    if (allocation == NULL)
+        return errno == ENOENT ? NR_INDEX_CONTINUE : NR_INDEX_DAMAGED;
+    
+    if (block_size < NTFS_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        ntfs_attr_close(allocation);
+        return NR_INDEX_DAMAGED;
+    }
+    
+    bitmap = ntfs_attr_readall(directory, AT_BITMAP, NTFS_INDEX_I30, 4, &bitmap_size);
+    block_count = allocation->initialized_size / block_size;
+    blocks = ntfsrec_allocate((size_t)block_size * NR_INDEX_BATCH_BLOCKS);
+    
+    for(block = 0; block < block_count && result == NR_INDEX_CONTINUE; block += NR_INDEX_BATCH_BLOCKS) {
+        s64 wanted = block_count - block < NR_INDEX_BATCH_BLOCKS ? block_count - block : NR_INDEX_BATCH_BLOCKS;
+        s64 index, got;
+        
+        got = ntfs_attr_mst_pread(allocation, block * block_size, wanted, block_size, blocks);
+        
+        for(index = 0; index < wanted && result == NR_INDEX_CONTINUE; ++index) {
+            const INDEX_BLOCK *index_block = (const INDEX_BLOCK *)&blocks[index * block_size];
+            s64 number = block + index;
+            
+            /* Blocks the bitmap marks free hold stale entries of deleted files */
+            if (bitmap != NULL && (number >> 3 >= bitmap_size || (bitmap[number >> 3] & (1 << (number & 7))) == 0))
+                continue;
+            
+            /* Retry blocks past a failed batch read on their own */
+            if (index >= got && ntfs_attr_mst_pread(allocation, number * block_size, 1, block_size, (void *)index_block) != 1)
+                continue;
+            
+            if (index_block->magic != magic_INDX)
+                continue;
+            
+            /* A damaged block only loses its own entries */
+            if (ntfsrec_index_walk_entries(&index_block->index, block_size - offsetof(INDEX_BLOCK, index), context, visitor) == NR_INDEX_STOPPED)
+                result = NR_INDEX_STOPPED;
+        }
+    }
+    
+    free(blocks);
+    free(bitmap);
+    ntfs_attr_close(allocation);
+    
+    return result;
+}
@@ -0,0 +1,18 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_INDEX_H
+#define _NTFSREC_INDEX_H
+
+/*
+ * Called for each entry of a directory's $I30 index. The $FILE_NAME key is the copy kept in the index,
+ * whose times and sizes can lag behind the file's own record. Returning non-zero stops the walk.
+ */
+typedef int (*ntfsrec_index_visitor)(void *context, MFT_REF mref, const FILE_NAME_ATTR *file_name);
+
+/* Visits every entry of the directory in storage order, returns NR_FALSE if the index couldn't be read */
+int ntfsrec_index_walk(ntfs_inode *directory, void *context, ntfsrec_index_visitor visitor);
+
+#endif
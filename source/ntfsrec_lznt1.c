@@ -0,0 +1,134 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_lznt1.h"
+
+/*
+ * A chunk starts with a 16 bit header: the chunk's length less three in the low 12 bits and whether
+ * it's compressed in the top one. A compressed chunk is a tag byte followed by up to eight tokens,
+ * a literal byte for each clear bit and a 16 bit back reference for each set one. How the reference
+ * splits into distance and length depends on how far into the chunk it is, so distances can reach
+ * back to its start.
+ *
+ * Unlike libntfs-3g this decodes a whole tag of literals with one copy, keeps the split up to date
+ * as the output grows instead of working it out for every reference, and copies matches eight bytes
+ * at a time whenever they don't overlap within that.
+ */
+
+#define NR_LZNT1_COMPRESSED 0x8000
+#define NR_LZNT1_LENGTH_MASK 0x0FFF
+#define NR_LZNT1_MIN_MATCH 3
+
+static int ntfsrec_lznt1_chunk(const unsigned char *input, const unsigned char *input_end, unsigned char *start, unsigned char *end);
+
+int ntfsrec_lznt1_decompress(const unsigned char *input, size_t input_length, unsigned char *output, size_t output_length) {
+    const unsigned char *input_end = input + input_length;
+    unsigned char *out = output, *output_end = output + output_length;
+    
+    while(out < output_end && input_end - input >= 2) {
+        unsigned int header = input[0] | input[1] << 8;
+        size_t chunk_length = (header & NR_LZNT1_LENGTH_MASK) + 1;
+        unsigned char *chunk_end = out + NR_LZNT1_CHUNK_SIZE;
+        
+        /* A zero header ends the unit early, the rest of it reads as zeros */
+        if (header == 0)
+            break;
+        
+        input += 2;
+        
+        if (chunk_length > (size_t)(input_end - input) || chunk_end > output_end)
+            return NR_FALSE;
+        
+        if (header & NR_LZNT1_COMPRESSED) {
+            if (ntfsrec_lznt1_chunk(input, input + chunk_length, out, chunk_end) == NR_FALSE)
+                return NR_FALSE;
+        } else {
+            if (chunk_length > NR_LZNT1_CHUNK_SIZE)
+                return NR_FALSE;
+            
+            memcpy(out, input, chunk_length);
+            memset(out + chunk_length, 0, NR_LZNT1_CHUNK_SIZE - chunk_length);
+        }
+        
+        input += chunk_length;
+        out = chunk_end;
+    }
+    
+    memset(out, 0, output_end - out);
+    return NR_TRUE;
+}
+
+/* Decodes one compressed chunk into start..end, zero filling whatever it doesn't reach */
+static int ntfsrec_lznt1_chunk(const unsigned char *input, const unsigned char *input_end, unsigned char *start, unsigned char *end) {
+    unsigned char *out = start;
+    unsigned int shift = 12, limit = 16;
+    
+    while(input < input_end && out < end) {
+        unsigned int tag = *input++, token;
+        
+        /* Eight literals in a row are common in anything that compresses poorly */
+        if (tag == 0 && input_end - input >= 8 && end - out >= 8) {
+            memcpy(out, input, 8);
+            out += 8;
+            input += 8;
+            continue;
+        }
+        
+        for(token = 0; token < 8 && input < input_end && out < end; ++token, tag >>= 1) {
+            size_t distance, length;
+            const unsigned char *source;
+            unsigned int reference;
+            
+            if (!(tag & 1)) {
+                *out++ = *input++;
+                continue;
+            }
+            
+            if (input_end - input < 2)
+                return NR_FALSE;
+            
+            reference = input[0] | input[1] << 8;
+            input += 2;
+            
+            /* Distances get another bit, and lengths lose one, each time the chunk grows past a power of two */
+            while((size_t)(out - start) > limit) {
+                limit <<= 1;
+                --shift;
+            }
+            
+            distance = (reference >> shift) + 1;
+            length = (reference & ((1U << shift) - 1)) + NR_LZNT1_MIN_MATCH;
+            
+            if (distance > (size_t)(out - start) || length > (size_t)(end - out))
+                return NR_FALSE;
+            
+            source = out - distance;
+            
+            if (distance >= 8 && (size_t)(end - out) >= length + 7) {
+                /* Each eight bytes only read ones written before them, and the overrun is rewritten later */
+                unsigned char *match_end = out + length;
+                
+                for(; out < match_end; out += 8, source += 8)
+                    memcpy(out, source, 8);
+                
+                out = match_end;
+            } else if (distance >= length) {
+                memcpy(out, source, length);
+                out += length;
+            } else if (distance == 1) {
+                memset(out, *source, length);
+                out += length;
+            } else {
+                /* An overlapping match repeats the last distance bytes */
+                while(length-- > 0)
+                    *out++ = *source++;
+            }
+        }
+    }
+    
+    memset(out, 0, end - out);
+    return NR_TRUE;
+}
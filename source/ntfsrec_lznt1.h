@@ -0,0 +1,19 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_LZNT1_H
+#define _NTFSREC_LZNT1_H
+
+/* Each chunk of a compression unit decodes to this much, the last one possibly to less */
+#define NR_LZNT1_CHUNK_SIZE 4096
+
+/*
+ * Decodes the LZNT1 data of one compression unit into output, which is filled completely: chunks
+ * that end early and everything after the last chunk read as zeros, as they do through libntfs-3g.
+ * Returns NR_FALSE for data that can't be LZNT1, leaving output partly written.
+ */
+int ntfsrec_lznt1_decompress(const unsigned char *input, size_t input_length, unsigned char *output, size_t output_length);
+
+#endif
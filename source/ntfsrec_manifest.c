@@ -0,0 +1,352 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_manifest.h"
+#include "ntfsrec_badmap.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/*
+ * Both hashes come from libraries that pick SIMD code for the CPU at run time: xxHash is used
+ * header-only, and OpenSSL's SHA-256 uses the SHA extensions where the CPU has them.
+ */
+
+#ifdef NTFSREC_HAVE_XXHASH
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+#endif
+
+#ifdef NTFSREC_HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#define NR_MANIFEST_ZERO_BLOCK (64 * 1024)
+#define NR_MANIFEST_READ_BLOCK (1024 * 1024)
+
+/* What the regions of a deferred file are written out with */
+struct ntfsrec_manifest_settling {
+    struct ntfsrec_manifest *manifest;
+    const char *path;
+};
+
+struct ntfsrec_manifest_deferred {
+    MFT_REF mref;
+    s64 size;
+    size_t path;
+};
+
+struct ntfsrec_manifest {
+    FILE *file;
+    pthread_mutex_t lock;
+    unsigned int algorithms;
+    
+    /* Files waiting on the retry passes, with their paths packed one after another */
+    struct ntfsrec_manifest_deferred *deferred;
+    size_t deferred_count;
+    size_t deferred_capacity;
+    char *paths;
+    size_t paths_length;
+    size_t paths_capacity;
+};
+
+struct ntfsrec_file_hash {
+    s64 position;
+    
+#ifdef NTFSREC_HAVE_XXHASH
+    XXH3_state_t *xxh3;
+#endif
+    
+#ifdef NTFSREC_HAVE_OPENSSL
+    EVP_MD_CTX *sha256;
+#endif
+};
+
+static const char ntfsrec_manifest_zeros[NR_MANIFEST_ZERO_BLOCK];
+
+static void ntfsrec_file_hash_feed(struct ntfsrec_file_hash *hash, const void *data, size_t length);
+static void ntfsrec_file_hash_free(struct ntfsrec_file_hash *hash);
+static void ntfsrec_manifest_settle_zeroed(void *context, s64 offset, s64 length);
+
+int ntfsrec_manifest_parse_algorithms(const char *list, unsigned int *algorithms) {
+    *algorithms = 0;
+    
+    while(*list != '\0') {
+        size_t length = strcspn(list, ",");
+        
+        if (length == 4 && strncmp(list, "xxh3", 4) == 0) {
+#ifdef NTFSREC_HAVE_XXHASH
+            *algorithms |= NR_HASH_XXH3;
+#else
+            puts("Error: this build has no xxh3, it needs xxhash.h");
+            return NR_FALSE;
+#endif
+        } else if (length == 6 && strncmp(list, "sha256", 6) == 0) {
+#ifdef NTFSREC_HAVE_OPENSSL
+            *algorithms |= NR_HASH_SHA256;
+#else
+            puts("Error: this build has no sha256, it needs OpenSSL");
+            return NR_FALSE;
+#endif
+        } else {
+            printf("Error: unknown hash %.*s, expected xxh3 or sha256\n", (int)length, list);
+            return NR_FALSE;
+        }
+        
+        list += length;
+        
+        if (*list == ',')
+            ++list;
+    }
+    
+    return *algorithms != 0;
+}
+
+unsigned int ntfsrec_manifest_default_algorithms(void) {
+#if defined(NTFSREC_HAVE_XXHASH)
+    return NR_HASH_XXH3;
+#elif defined(NTFSREC_HAVE_OPENSSL)
+    return NR_HASH_SHA256;
+#else
+    return 0;
+#endif
+}
+
+struct ntfsrec_manifest *ntfsrec_manifest_open(const char *file_name, unsigned int algorithms) {
+    struct ntfsrec_manifest *manifest;
+    FILE *file;
+    
+    if (algorithms == 0) {
+        puts("Error: a manifest needs xxh3 or sha256, and this build has neither");
+        return NULL;
+    }
+    
+    file = fopen(file_name, "w");
+    
+    if (file == NULL) {
+        printf("Error: unable to create manifest %s: %s\n", file_name, strerror(errno));
+        return NULL;
+    }
+    
+    manifest = ntfsrec_allocate(sizeof *manifest);
+    memset(manifest, 0, sizeof *manifest);
+    manifest->file = file;
+    manifest->algorithms = algorithms;
+    pthread_mutex_init(&manifest->lock, NULL);
+    
+    fputs("# ntfsrec manifest\n"
+          "# F <size> <xxh3|-> <sha256|-> <path>\n"
+          "# Z <offset> <length> <path>  unreadable, zeros in the copy\n", file);
+    
+    return manifest;
+}
+
+void ntfsrec_manifest_close(struct ntfsrec_manifest *manifest) {
+    fclose(manifest->file);
+    pthread_mutex_destroy(&manifest->lock);
+    
+    free(manifest->deferred);
+    free(manifest->paths);
+    free(manifest);
+}
+
+struct ntfsrec_file_hash *ntfsrec_manifest_begin(struct ntfsrec_manifest *manifest) {
+    struct ntfsrec_file_hash *hash = ntfsrec_allocate(sizeof *hash);
+    
+    memset(hash, 0, sizeof *hash);
+    
+#ifdef NTFSREC_HAVE_XXHASH
+    if (manifest->algorithms & NR_HASH_XXH3) {
+        hash->xxh3 = XXH3_createState();
+        XXH3_64bits_reset(hash->xxh3);
+    }
+#endif
+    
+#ifdef NTFSREC_HAVE_OPENSSL
+    if (manifest->algorithms & NR_HASH_SHA256) {
+        hash->sha256 = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(hash->sha256, EVP_sha256(), NULL);
+    }
+#endif
+    
+    NR_UNUSED(manifest);
+    return hash;
+}
+
+void ntfsrec_file_hash_update(struct ntfsrec_file_hash *hash, s64 offset, const void *data, s64 length) {
+    /* A repeated write after a failed one brings the same data again */
+    if (offset < hash->position) {
+        if (offset + length <= hash->position)
+            return;
+        
+        data = (const char *)data + (hash->position - offset);
+        length -= hash->position - offset;
+        offset = hash->position;
+    }
+    
+    /* Holes and unreadable ranges are zeros in the copy, so they're hashed as zeros */
+    while(hash->position < offset) {
+        s64 gap = offset - hash->position;
+        
+        ntfsrec_file_hash_feed(hash, ntfsrec_manifest_zeros, gap < NR_MANIFEST_ZERO_BLOCK ? gap : NR_MANIFEST_ZERO_BLOCK);
+    }
+    
+    ntfsrec_file_hash_feed(hash, data, length);
+}
+
+void ntfsrec_manifest_zeroed(struct ntfsrec_manifest *manifest, s64 offset, s64 length, const char *path) {
+    pthread_mutex_lock(&manifest->lock);
+    fprintf(manifest->file, "Z %lld %lld %s\n", (long long)offset, (long long)length, path);
+    pthread_mutex_unlock(&manifest->lock);
+}
+
+void ntfsrec_manifest_finish(struct ntfsrec_manifest *manifest, struct ntfsrec_file_hash *hash, s64 size, const char *path) {
+    char xxh3_text[17] = "-", sha256_text[65] = "-";
+    
+    if (hash->position < size)
+        ntfsrec_file_hash_update(hash, size, NULL, 0);
+    
+#ifdef NTFSREC_HAVE_XXHASH
+    if (hash->xxh3 != NULL)
+        snprintf(xxh3_text, sizeof xxh3_text, "%016llx", (unsigned long long)XXH3_64bits_digest(hash->xxh3));
+#endif
+    
+#ifdef NTFSREC_HAVE_OPENSSL
+    if (hash->sha256 != NULL) {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_length = 0, index;
+        
+        EVP_DigestFinal_ex(hash->sha256, digest, &digest_length);
+        
+        for(index = 0; index < digest_length && index < 32; ++index)
+            sprintf(&sha256_text[index * 2], "%02x", digest[index]);
+    }
+#endif
+    
+    pthread_mutex_lock(&manifest->lock);
+    fprintf(manifest->file, "F %lld %s %s %s\n", (long long)size, xxh3_text, sha256_text, path);
+    pthread_mutex_unlock(&manifest->lock);
+    
+    ntfsrec_file_hash_free(hash);
+}
+
+void ntfsrec_manifest_defer(struct ntfsrec_manifest *manifest, struct ntfsrec_file_hash *hash, s64 size, MFT_REF mref, const char *path) {
+    const size_t length = strlen(path);
+    struct ntfsrec_manifest_deferred *file;
+    
+    /* The passes may write anywhere in the file, so what was hashed so far can't be carried on from */
+    ntfsrec_file_hash_free(hash);
+    
+    pthread_mutex_lock(&manifest->lock);
+    
+    if (manifest->deferred_count == manifest->deferred_capacity) {
+        manifest->deferred_capacity = manifest->deferred_capacity ? manifest->deferred_capacity * 2 : 256;
+        manifest->deferred = ntfsrec_reallocate(manifest->deferred, manifest->deferred_capacity * sizeof *manifest->deferred);
+    }
+    
+    while(manifest->paths_capacity - manifest->paths_length < length + 1) {
+        manifest->paths_capacity = manifest->paths_capacity ? manifest->paths_capacity * 2 : 16384;
+        manifest->paths = ntfsrec_reallocate(manifest->paths, manifest->paths_capacity);
+    }
+    
+    file = &manifest->deferred[manifest->deferred_count++];
+    file->mref = mref;
+    file->size = size;
+    file->path = manifest->paths_length;
+    
+    memcpy(&manifest->paths[manifest->paths_length], path, length + 1);
+    manifest->paths_length += length + 1;
+    
+    pthread_mutex_unlock(&manifest->lock);
+}
+
+void ntfsrec_manifest_settle(struct ntfsrec_manifest *manifest, struct ntfsrec_badmap *map) {
+    char *buffer = ntfsrec_allocate(NR_MANIFEST_READ_BLOCK);
+    size_t index;
+    
+    for(index = 0; index < manifest->deferred_count; ++index) {
+        const struct ntfsrec_manifest_deferred *file = &manifest->deferred[index];
+        struct ntfsrec_manifest_settling settling;
+        struct ntfsrec_file_hash *hash;
+        s64 offset = 0;
+        int fd;
+        
+        settling.manifest = manifest;
+        settling.path = &manifest->paths[file->path];
+        fd = ntfsrec_open_path(AT_FDCWD, settling.path, O_RDONLY, 0);
+        
+        if (fd == -1) {
+            printf("Error: unable to read back %s for the manifest\n", settling.path);
+            continue;
+        }
+        
+        hash = ntfsrec_manifest_begin(manifest);
+        
+        while(offset < file->size) {
+            s64 request = file->size - offset < NR_MANIFEST_READ_BLOCK ? file->size - offset : NR_MANIFEST_READ_BLOCK;
+            ssize_t bytes_read = pread(fd, buffer, request, offset);
+            
+            if (bytes_read <= 0)
+                break;
+            
+            ntfsrec_file_hash_update(hash, offset, buffer, bytes_read);
+            offset += bytes_read;
+        }
+        
+        close(fd);
+        
+        /* The output is sized when it's closed, so coming up short means it couldn't be read */
+        if (offset < file->size) {
+            printf("Error: unable to read back %s for the manifest\n", settling.path);
+            ntfsrec_file_hash_free(hash);
+            continue;
+        }
+        
+        ntfsrec_badmap_regions(map, file->mref, &settling, &ntfsrec_manifest_settle_zeroed);
+        ntfsrec_manifest_finish(manifest, hash, file->size, settling.path);
+    }
+    
+    manifest->deferred_count = 0;
+    manifest->paths_length = 0;
+    
+    free(buffer);
+}
+
+static void ntfsrec_file_hash_free(struct ntfsrec_file_hash *hash) {
+#ifdef NTFSREC_HAVE_XXHASH
+    if (hash->xxh3 != NULL)
+        XXH3_freeState(hash->xxh3);
+#endif
+    
+#ifdef NTFSREC_HAVE_OPENSSL
+    if (hash->sha256 != NULL)
+        EVP_MD_CTX_free(hash->sha256);
+#endif
+    
+    free(hash);
+}
+
+static void ntfsrec_manifest_settle_zeroed(void *context, s64 offset, s64 length) {
+    struct ntfsrec_manifest_settling *settling = context;
+    
+    ntfsrec_manifest_zeroed(settling->manifest, offset, length, settling->path);
+}
+
+static void ntfsrec_file_hash_feed(struct ntfsrec_file_hash *hash, const void *data, size_t length) {
+#ifdef NTFSREC_HAVE_XXHASH
+    if (hash->xxh3 != NULL)
+        XXH3_64bits_update(hash->xxh3, data, length);
+#endif
+    
+#ifdef NTFSREC_HAVE_OPENSSL
+    if (hash->sha256 != NULL)
+        EVP_DigestUpdate(hash->sha256, data, length);
+#endif
+    
+    NR_UNUSED(data);
+    hash->position += length;
+}
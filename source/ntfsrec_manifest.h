@@ -0,0 +1,57 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_MANIFEST_H
+#define _NTFSREC_MANIFEST_H
+
+enum ntfsrec_hash_algorithm {
+    NR_HASH_XXH3 = 1,
+    NR_HASH_SHA256 = 2
+};
+
+struct ntfsrec_manifest;
+struct ntfsrec_file_hash;
+struct ntfsrec_badmap;
+
+/* Parses a comma separated list like "xxh3,sha256" into algorithm flags, failing for ones this build lacks */
+int ntfsrec_manifest_parse_algorithms(const char *list, unsigned int *algorithms);
+
+/* Returns the algorithms used when none are given: xxh3 if this build has it, else sha256, else none */
+unsigned int ntfsrec_manifest_default_algorithms(void);
+
+/*
+ * A manifest lists every copied file with its hashes, computed from the buffers as they're copied,
+ * so the output never has to be read back. It's a text file with one record per line:
+ *
+ *   F <size> <xxh3|-> <sha256|-> <path>   a copied file
+ *   Z <offset> <length> <path>            a range that couldn't be read and is zeros in the copy
+ *
+ * Z records come before their file's F record. A file with ranges left to the retry passes gets its
+ * records once they're done with it, so they describe the copy as it was finally left.
+ */
+struct ntfsrec_manifest *ntfsrec_manifest_open(const char *file_name, unsigned int algorithms);
+void ntfsrec_manifest_close(struct ntfsrec_manifest *manifest);
+
+/* Starts hashing a file, which is fed through ntfsrec_file_hash_update in offset order */
+struct ntfsrec_file_hash *ntfsrec_manifest_begin(struct ntfsrec_manifest *manifest);
+
+/* Hashes length bytes at offset; any gap since the last update hashes as zeros and data already hashed is ignored */
+void ntfsrec_file_hash_update(struct ntfsrec_file_hash *hash, s64 offset, const void *data, s64 length);
+
+void ntfsrec_manifest_zeroed(struct ntfsrec_manifest *manifest, s64 offset, s64 length, const char *path);
+
+/* Hashes zeros up to size and writes the file's record, freeing hash */
+void ntfsrec_manifest_finish(struct ntfsrec_manifest *manifest, struct ntfsrec_file_hash *hash, s64 size, const char *path);
+
+/* Like ntfsrec_manifest_finish for a file with ranges in a bad-region map, whose records wait for ntfsrec_manifest_settle */
+void ntfsrec_manifest_defer(struct ntfsrec_manifest *manifest, struct ntfsrec_file_hash *hash, s64 size, MFT_REF mref, const char *path);
+
+/*
+ * Writes the records of every deferred file, once the retry passes are done: Z records for the ranges
+ * still in map, and hashes read back from the output, which the passes wrote into after the first one.
+ */
+void ntfsrec_manifest_settle(struct ntfsrec_manifest *manifest, struct ntfsrec_badmap *map);
+
+#endif
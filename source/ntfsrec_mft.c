@@ -0,0 +1,610 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_mft.h"
+#include <ntfs-3g/mst.h>
+#include <sys/mman.h>
+#include <strings.h>
+
+#define NR_MFT_SCAN_CHUNK (1024 * 1024)
+#define NR_MFT_MAX_DEPTH 1024
+#define NR_MFT_NAME_LENGTH 1024
+
+/* Name namespaces in order of preference, DOS 8.3 names are only used when nothing else exists */
+enum ntfsrec_mft_name_rank {
+    NR_MFT_NAME_NONE = 0,
+    NR_MFT_NAME_DOS,
+    NR_MFT_NAME_POSIX,
+    NR_MFT_NAME_WIN32
+};
+
+struct ntfsrec_mft_owned_run {
+    uint64_t record;
+    struct ntfsrec_mft_run run;
+};
+
+struct ntfsrec_mft_scanner {
+    struct ntfsrec_mft_table *table;
+    
+    uint8_t *name_rank;
+    uint64_t names_capacity;
+    
+    /* Runs are gathered with their owner since extension records can appear before their base record */
+    struct ntfsrec_mft_owned_run *runs;
+    uint64_t run_count;
+    uint64_t run_capacity;
+    
+    uint64_t in_use;
+    uint64_t damaged;
+};
+
+static void *ntfsrec_mft_array(uint64_t count, size_t size);
+static void ntfsrec_mft_parse_record(struct ntfsrec_mft_scanner *scanner, uint64_t number, MFT_RECORD *record, u32 record_size);
+static void ntfsrec_mft_parse_name(struct ntfsrec_mft_scanner *scanner, uint64_t owner, const FILE_NAME_ATTR *file_name);
+static void ntfsrec_mft_parse_data(struct ntfsrec_mft_scanner *scanner, uint64_t owner, const ATTR_RECORD *attr);
+static int ntfsrec_mft_decode_runs(struct ntfsrec_mft_scanner *scanner, uint64_t owner, const ATTR_RECORD *attr);
+static void ntfsrec_mft_finish_runs(struct ntfsrec_mft_scanner *scanner);
+static int ntfsrec_mft_run_compare(const void *left, const void *right);
+static void ntfsrec_mft_link_children(struct ntfsrec_mft_table *table);
+static int ntfsrec_mft_child_compare(const void *left, const void *right, void *context);
+static int ntfsrec_mft_parent_valid(const struct ntfsrec_mft_table *table, uint64_t record);
+static uint64_t ntfsrec_mft_volume_serial(ntfs_volume *volume);
+
+struct ntfsrec_mft_table *ntfsrec_mft_scan(ntfs_volume *volume, FILE *log) {
+    struct ntfsrec_mft_scanner scanner;
+    struct ntfsrec_mft_table *table;
+    const u32 record_size = volume->mft_record_size;
+    const uint64_t chunk_records = NR_MFT_SCAN_CHUNK / record_size;
+    uint64_t position;
+    char *buffer;
+    
+    memset(&scanner, 0, sizeof scanner);
+    
+    table = ntfsrec_allocate(sizeof *table);
+    memset(table, 0, sizeof *table);
+    
+    table->count = volume->mft_na->initialized_size >> volume->mft_record_size_bits;
+    table->volume_serial = ntfsrec_mft_volume_serial(volume);
+    table->volume_clusters = volume->nr_clusters;
+    table->flags = ntfsrec_mft_array(table->count, sizeof *table->flags);
+    table->sequence = ntfsrec_mft_array(table->count, sizeof *table->sequence);
+    table->parent = ntfsrec_mft_array(table->count, sizeof *table->parent);
+    table->attributes = ntfsrec_mft_array(table->count, sizeof *table->attributes);
+    table->size = ntfsrec_mft_array(table->count, sizeof *table->size);
+    table->allocated_size = ntfsrec_mft_array(table->count, sizeof *table->allocated_size);
+    table->created = ntfsrec_mft_array(table->count, sizeof *table->created);
+    table->modified = ntfsrec_mft_array(table->count, sizeof *table->modified);
+    table->name_offset = ntfsrec_mft_array(table->count, sizeof *table->name_offset);
+    
+    scanner.table = table;
+    scanner.name_rank = ntfsrec_mft_array(table->count, sizeof *scanner.name_rank);
+    
+    buffer = ntfsrec_allocate(chunk_records * record_size);
+    
+    for(position = 0; position < table->count; position += chunk_records) {
+        uint64_t records = table->count - position < chunk_records ? table->count - position : chunk_records;
+        uint64_t index;
+        
+        if (ntfs_attr_pread(volume->mft_na, position * record_size, records * record_size, buffer) != (s64)(records * record_size)) {
+            /* Reread the chunk one record at a time so a bad sector only costs the records on it */
+            for(index = 0; index < records; ++index) {
+                char *record = &buffer[index * record_size];
+                
+                if (ntfs_attr_pread(volume->mft_na, (position + index) * record_size, record_size, record) != record_size) {
+                    memset(record, 0, record_size);
+                    
+                    table->flags[position + index] |= NR_MFT_DAMAGED;
+                    scanner.damaged++;
+                }
+            }
+        }
+        
+        for(index = 0; index < records; ++index)
+            ntfsrec_mft_parse_record(&scanner, position + index, (MFT_RECORD *)&buffer[index * record_size], record_size);
+    }
+    
+    free(buffer);
+    free(scanner.name_rank);
+    
+    ntfsrec_mft_finish_runs(&scanner);
+    ntfsrec_mft_link_children(table);
+    
+    if (log != NULL) {
+        fprintf(log, "Scanned %llu MFT records: %llu in use, %llu damaged, %llu data runs\n",
+                (unsigned long long)table->count, (unsigned long long)scanner.in_use,
+                (unsigned long long)scanner.damaged, (unsigned long long)table->run_count);
+    }
+    
+    return table;
+}
+
+void ntfsrec_mft_table_free(struct ntfsrec_mft_table *table) {
+    if (table->mapping != NULL) {
+        munmap(table->mapping, table->mapping_length);
+        free(table);
+        return;
+    }
+    
+    free(table->flags);
+    free(table->sequence);
+    free(table->parent);
+    free(table->attributes);
+    free(table->size);
+    free(table->allocated_size);
+    free(table->created);
+    free(table->modified);
+    free(table->name_offset);
+    free(table->run_start);
+    free(table->child_start);
+    free(table->names);
+    free(table->runs);
+    free(table->children);
+    free(table);
+}
+
+int ntfsrec_mft_table_matches(const struct ntfsrec_mft_table *table, ntfs_volume *volume) {
+    uint64_t serial;
+    
+    if (table->volume_clusters != volume->nr_clusters)
+        return NR_FALSE;
+    
+    /* A boot sector that can't be read on either side leaves the size as the only thing to go on */
+    serial = ntfsrec_mft_volume_serial(volume);
+    
+    return table->volume_serial == 0 || serial == 0 || table->volume_serial == serial;
+}
+
+int ntfsrec_mft_table_lookup(const struct ntfsrec_mft_table *table, const char *path, uint64_t *record) {
+    uint64_t current = NR_MFT_ROOT_RECORD;
+    
+    while(*path != '\0') {
+        const char *end;
+        size_t length;
+        uint64_t index, found = table->count;
+        
+        while(*path == '/')
+            ++path;
+        
+        for(end = path; *end != '\0' && *end != '/'; ++end);
+        
+        length = end - path;
+        
+        if (length == 0 || (length == 1 && *path == '.')) {
+            path = end;
+            continue;
+        }
+        
+        if (length == 2 && path[0] == '.' && path[1] == '.') {
+            if (current != NR_MFT_ROOT_RECORD)
+                current = MREF(table->parent[current]);
+            
+            path = end;
+            continue;
+        }
+        
+        /* Windows names are case insensitive, an exact match wins over a folded one */
+        for(index = table->child_start[current]; index < table->child_start[current + 1]; ++index) {
+            const char *name = &table->names[table->name_offset[table->children[index]]];
+            
+            if (strncmp(name, path, length) == 0 && name[length] == '\0') {
+                found = table->children[index];
+                break;
+            }
+            
+            if (found == table->count && strncasecmp(name, path, length) == 0 && name[length] == '\0')
+                found = table->children[index];
+        }
+        
+        if (found == table->count)
+            return NR_FALSE;
+        
+        current = found;
+        path = end;
+    }
+    
+    *record = current;
+    return NR_TRUE;
+}
+
+int ntfsrec_mft_table_path(const struct ntfsrec_mft_table *table, uint64_t record, char *output, size_t max_length) {
+    static const char orphan_prefix[] = "<orphan>";
+    size_t position = max_length;
+    unsigned int depth = 0;
+    int result = NR_TRUE;
+    
+    if (max_length < sizeof orphan_prefix + 1) {
+        if (max_length > 0)
+            output[0] = '\0';
+        
+        return NR_FALSE;
+    }
+    
+    output[--position] = '\0';
+    
+    while(record != NR_MFT_ROOT_RECORD) {
+        const char *name;
+        size_t length;
+        uint64_t parent;
+        
+        if (record >= table->count || (table->flags[record] & NR_MFT_HAS_NAME) == 0 || ++depth > NR_MFT_MAX_DEPTH) {
+            result = NR_FALSE;
+            break;
+        }
+        
+        name = &table->names[table->name_offset[record]];
+        length = strlen(name);
+        
+        if (length + 1 + sizeof orphan_prefix > position) {
+            output[0] = '\0';
+            return NR_FALSE;
+        }
+        
+        position -= length;
+        memcpy(&output[position], name, length);
+        output[--position] = '/';
+        
+        /* A parent that was reused since the name was written doesn't lead anywhere useful */
+        parent = table->parent[record];
+        record = MREF(parent);
+        
+        if (record >= table->count || (table->flags[record] & NR_MFT_IN_USE) == 0 ||
+            (MSEQNO(parent) != 0 && MSEQNO(parent) != table->sequence[record])) {
+            result = NR_FALSE;
+            break;
+        }
+    }
+    
+    if (result == NR_FALSE) {
+        position -= sizeof orphan_prefix - 1;
+        memcpy(&output[position], orphan_prefix, sizeof orphan_prefix - 1);
+    } else if (output[position] == '\0') {
+        output[--position] = '/';
+    }
+    
+    memmove(output, &output[position], max_length - position);
+    return result;
+}
+
+static void *ntfsrec_mft_array(uint64_t count, size_t size) {
+    void *array = ntfsrec_allocate(count * size);
+    
+    memset(array, 0, count * size);
+    return array;
+}
+
+static void ntfsrec_mft_parse_record(struct ntfsrec_mft_scanner *scanner, uint64_t number, MFT_RECORD *record, u32 record_size) {
+    struct ntfsrec_mft_table *table = scanner->table;
+    uint64_t owner = number;
+    u32 offset, used;
+    
+    if (record->magic != magic_FILE) {
+        /* Records that were never used are left zeroed, anything else is damage */
+        if (record->magic != 0 && (table->flags[number] & NR_MFT_DAMAGED) == 0) {
+            table->flags[number] |= NR_MFT_DAMAGED;
+            scanner->damaged++;
+        }
+        
+        return;
+    }
+    
+    if (ntfs_mst_post_read_fixup((NTFS_RECORD *)record, record_size) != 0) {
+        table->flags[number] |= NR_MFT_DAMAGED;
+        scanner->damaged++;
+        return;
+    }
+    
+    if ((record->flags & MFT_RECORD_IN_USE) == 0)
+        return;
+    
+    if (MREF(le64_to_cpu(record->base_mft_record)) != 0) {
+        owner = MREF(le64_to_cpu(record->base_mft_record));
+        
+        if (owner >= table->count)
+            return;
+    } else {
+        table->flags[number] |= NR_MFT_IN_USE;
+        table->sequence[number] = le16_to_cpu(record->sequence_number);
+        
+        if (record->flags & MFT_RECORD_IS_DIRECTORY)
+            table->flags[number] |= NR_MFT_DIRECTORY;
+        
+        scanner->in_use++;
+    }
+    
+    offset = le16_to_cpu(record->attrs_offset);
+    used = le32_to_cpu(record->bytes_in_use);
+    
+    if (used > record_size)
+        used = record_size;
+    
+    while(offset + offsetof(ATTR_RECORD, length) + sizeof(le32) <= used) {
+        const ATTR_RECORD *attr = (const ATTR_RECORD *)((const char *)record + offset);
+        const u32 length = le32_to_cpu(attr->length);
+        const char *value;
+        
+        if (attr->type == AT_END)
+            break;
+        
+        /* Only the type and length are known to be inside the record until the length has been checked */
+        if (length < offsetof(ATTR_RECORD, resident_flags) || offset + length > used) {
+            table->flags[owner] |= NR_MFT_DAMAGED;
+            scanner->damaged++;
+            break;
+        }
+        
+        value = (const char *)attr + le16_to_cpu(attr->value_offset);
+        
+        if (!attr->non_resident && le16_to_cpu(attr->value_offset) + le32_to_cpu(attr->value_length) > length) {
+            offset += length;
+            continue;
+        }
+        
+        if (attr->type == AT_STANDARD_INFORMATION && !attr->non_resident && owner == number &&
+            le32_to_cpu(attr->value_length) >= offsetof(STANDARD_INFORMATION, file_attributes) + sizeof(FILE_ATTR_FLAGS)) {
+            const STANDARD_INFORMATION *information = (const STANDARD_INFORMATION *)value;
+            
+            table->created[owner] = sle64_to_cpu(information->creation_time);
+            table->modified[owner] = sle64_to_cpu(information->last_data_change_time);
+            table->attributes[owner] = le32_to_cpu(information->file_attributes);
+        } else if (attr->type == AT_FILE_NAME && !attr->non_resident &&
+                   le32_to_cpu(attr->value_length) >= sizeof(FILE_NAME_ATTR)) {
+            const FILE_NAME_ATTR *file_name = (const FILE_NAME_ATTR *)value;
+            
+            if (sizeof(FILE_NAME_ATTR) + file_name->file_name_length * sizeof(ntfschar) <= le32_to_cpu(attr->value_length))
+                ntfsrec_mft_parse_name(scanner, owner, file_name);
+        } else if (attr->type == AT_DATA && attr->name_length == 0) {
+            ntfsrec_mft_parse_data(scanner, owner, attr);
+        }
+        
+        offset += length;
+    }
+}
+
+static void ntfsrec_mft_parse_name(struct ntfsrec_mft_scanner *scanner, uint64_t owner, const FILE_NAME_ATTR *file_name) {
+    struct ntfsrec_mft_table *table = scanner->table;
+    char name[NR_MFT_NAME_LENGTH];
+    uint8_t rank;
+    int length;
+    
+    switch(file_name->file_name_type) {
+        case FILE_NAME_DOS:
+            rank = NR_MFT_NAME_DOS;
+            break;
+        
+        case FILE_NAME_POSIX:
+            rank = NR_MFT_NAME_POSIX;
+            break;
+        
+        default:
+            rank = NR_MFT_NAME_WIN32;
+            break;
+    }
+    
+    if (rank <= scanner->name_rank[owner])
+        return;
+    
+    length = ntfsrec_utf16_to_utf8(name, sizeof name, (const ntfschar *)(file_name + 1), file_name->file_name_length);
+    
+    if (length < 0)
+        return;
+    
+    if (scanner->names_capacity - table->names_length < (uint64_t)length + 1) {
+        uint64_t capacity = scanner->names_capacity;
+        
+        /* Offsets are 32 bits, so a name that would end past that is left out */
+        if (table->names_length + length + 1 > UINT32_MAX) {
+            scanner->damaged++;
+            return;
+        }
+        
+        while(capacity - table->names_length < (uint64_t)length + 1)
+            capacity = capacity ? capacity * 2 : 1024 * 1024;
+        
+        if (capacity > UINT32_MAX)
+            capacity = UINT32_MAX;
+        
+        table->names = ntfsrec_reallocate(table->names, capacity);
+        scanner->names_capacity = capacity;
+    }
+    
+    memcpy(&table->names[table->names_length], name, length + 1);
+    
+    table->name_offset[owner] = (uint32_t)table->names_length;
+    table->names_length += length + 1;
+    
+    table->parent[owner] = le64_to_cpu(file_name->parent_directory);
+    table->flags[owner] |= NR_MFT_HAS_NAME;
+    scanner->name_rank[owner] = rank;
+}
+
+static void ntfsrec_mft_parse_data(struct ntfsrec_mft_scanner *scanner, uint64_t owner, const ATTR_RECORD *attr) {
+    struct ntfsrec_mft_table *table = scanner->table;
+    
+    if (!attr->non_resident) {
+        table->size[owner] = le32_to_cpu(attr->value_length);
+        table->allocated_size[owner] = 0;
+        table->flags[owner] |= NR_MFT_RESIDENT;
+        
+        return;
+    }
+    
+    /* Compressed and sparse attributes carry their compressed size past the end of the usual header */
+    if (le32_to_cpu(attr->length) < offsetof(ATTR_RECORD, compressed_size) ||
+        ((attr->flags & (ATTR_IS_COMPRESSED | ATTR_IS_SPARSE)) &&
+         le32_to_cpu(attr->length) < offsetof(ATTR_RECORD, compressed_size) + sizeof attr->compressed_size)) {
+        table->flags[owner] |= NR_MFT_DAMAGED;
+        scanner->damaged++;
+        return;
+    }
+    
+    /* Sizes are only valid in the first extent of an attribute spread over several records */
+    if (sle64_to_cpu(attr->lowest_vcn) == 0) {
+        table->size[owner] = sle64_to_cpu(attr->data_size);
+        
+        if (attr->flags & (ATTR_IS_COMPRESSED | ATTR_IS_SPARSE))
+            table->allocated_size[owner] = sle64_to_cpu(attr->compressed_size);
+        else
+            table->allocated_size[owner] = sle64_to_cpu(attr->allocated_size);
+    }
+    
+    if (ntfsrec_mft_decode_runs(scanner, owner, attr) == NR_FALSE) {
+        table->flags[owner] |= NR_MFT_DAMAGED;
+        scanner->damaged++;
+    }
+}
+
+static int ntfsrec_mft_decode_runs(struct ntfsrec_mft_scanner *scanner, uint64_t owner, const ATTR_RECORD *attr) {
+    const u8 *pairs = (const u8 *)attr + le16_to_cpu(attr->mapping_pairs_offset);
+    const u8 *end = (const u8 *)attr + le32_to_cpu(attr->length);
+    int64_t vcn = sle64_to_cpu(attr->lowest_vcn), lcn = 0;
+    
+    if (le16_to_cpu(attr->mapping_pairs_offset) >= le32_to_cpu(attr->length))
+        return NR_FALSE;
+    
+    while(pairs < end && *pairs != 0) {
+        const unsigned int length_size = *pairs & 0x0F, offset_size = *pairs >> 4;
+        struct ntfsrec_mft_owned_run *owned;
+        uint64_t length = 0, delta = 0;
+        unsigned int index;
+        
+        if (length_size == 0 || length_size > 8 || offset_size > 8 || pairs + 1 + length_size + offset_size > end)
+            return NR_FALSE;
+        
+        for(index = 0; index < length_size; ++index)
+            length |= (uint64_t)pairs[1 + index] << (8 * index);
+        
+        for(index = 0; index < offset_size; ++index)
+            delta |= (uint64_t)pairs[1 + length_size + index] << (8 * index);
+        
+        /* The LCN delta is signed, sign extend it from its stored width */
+        if (offset_size > 0 && offset_size < 8 && (pairs[length_size + offset_size] & 0x80))
+            delta |= ~(uint64_t)0 << (8 * offset_size);
+        
+        if (scanner->run_count == scanner->run_capacity) {
+            scanner->run_capacity = scanner->run_capacity ? scanner->run_capacity * 2 : 65536;
+            scanner->runs = ntfsrec_reallocate(scanner->runs, scanner->run_capacity * sizeof *scanner->runs);
+        }
+        
+        owned = &scanner->runs[scanner->run_count++];
+        owned->record = owner;
+        owned->run.vcn = vcn;
+        owned->run.length = (int64_t)length;
+        
+        /* Runs without an offset are sparse */
+        if (offset_size == 0) {
+            owned->run.lcn = LCN_HOLE;
+        } else {
+            lcn += (int64_t)delta;
+            owned->run.lcn = lcn;
+        }
+        
+        vcn += (int64_t)length;
+        pairs += 1 + length_size + offset_size;
+    }
+    
+    return NR_TRUE;
+}
+
+static void ntfsrec_mft_finish_runs(struct ntfsrec_mft_scanner *scanner) {
+    struct ntfsrec_mft_table *table = scanner->table;
+    uint64_t record = 0, index;
+    
+    qsort(scanner->runs, scanner->run_count, sizeof *scanner->runs, &ntfsrec_mft_run_compare);
+    
+    table->run_count = scanner->run_count;
+    table->runs = ntfsrec_allocate((scanner->run_count ? scanner->run_count : 1) * sizeof *table->runs);
+    table->run_start = ntfsrec_allocate((table->count + 1) * sizeof *table->run_start);
+    
+    for(index = 0; index < scanner->run_count; ++index) {
+        while(record <= scanner->runs[index].record)
+            table->run_start[record++] = index;
+        
+        table->runs[index] = scanner->runs[index].run;
+    }
+    
+    while(record <= table->count)
+        table->run_start[record++] = scanner->run_count;
+    
+    free(scanner->runs);
+}
+
+static int ntfsrec_mft_run_compare(const void *left, const void *right) {
+    const struct ntfsrec_mft_owned_run *a = left, *b = right;
+    
+    if (a->record != b->record)
+        return a->record < b->record ? -1 : 1;
+    
+    if (a->run.vcn != b->run.vcn)
+        return a->run.vcn < b->run.vcn ? -1 : 1;
+    
+    return 0;
+}
+
+static void ntfsrec_mft_link_children(struct ntfsrec_mft_table *table) {
+    uint64_t record, parent, *fill;
+    
+    table->child_start = ntfsrec_mft_array(table->count + 1, sizeof *table->child_start);
+    table->child_count = 0;
+    
+    /* Counting sort of every linked record by its parent */
+    for(record = 0; record < table->count; ++record) {
+        if (ntfsrec_mft_parent_valid(table, record)) {
+            table->child_start[MREF(table->parent[record]) + 1]++;
+            table->child_count++;
+        }
+    }
+    
+    for(parent = 0; parent < table->count; ++parent)
+        table->child_start[parent + 1] += table->child_start[parent];
+    
+    table->children = ntfsrec_allocate((table->child_count ? table->child_count : 1) * sizeof *table->children);
+    fill = ntfsrec_allocate((table->count ? table->count : 1) * sizeof *fill);
+    memcpy(fill, table->child_start, table->count * sizeof *fill);
+    
+    for(record = 0; record < table->count; ++record) {
+        if (ntfsrec_mft_parent_valid(table, record))
+            table->children[fill[MREF(table->parent[record])]++] = record;
+    }
+    
+    free(fill);
+    
+    for(parent = 0; parent < table->count; ++parent) {
+        uint64_t first = table->child_start[parent], count = table->child_start[parent + 1] - first;
+        
+        if (count > 1)
+            qsort_r(&table->children[first], count, sizeof *table->children, &ntfsrec_mft_child_compare, table);
+    }
+}
+
+static int ntfsrec_mft_child_compare(const void *left, const void *right, void *context) {
+    const struct ntfsrec_mft_table *table = context;
+    
+    return strcmp(&table->names[table->name_offset[*(const uint64_t *)left]],
+                  &table->names[table->name_offset[*(const uint64_t *)right]]);
+}
+
+static int ntfsrec_mft_parent_valid(const struct ntfsrec_mft_table *table, uint64_t record) {
+    uint64_t parent = MREF(table->parent[record]);
+    
+    if ((table->flags[record] & (NR_MFT_IN_USE | NR_MFT_HAS_NAME)) != (NR_MFT_IN_USE | NR_MFT_HAS_NAME) || record == parent)
+        return NR_FALSE;
+    
+    if (parent >= table->count || (table->flags[parent] & (NR_MFT_IN_USE | NR_MFT_DIRECTORY)) != (NR_MFT_IN_USE | NR_MFT_DIRECTORY))
+        return NR_FALSE;
+    
+    return MSEQNO(table->parent[record]) == 0 || MSEQNO(table->parent[record]) == table->sequence[parent];
+}
+
+/* The serial number isn't kept by the library, so it's read from the boot sector the volume was mounted with */
+static uint64_t ntfsrec_mft_volume_serial(ntfs_volume *volume) {
+    NTFS_BOOT_SECTOR boot;
+    
+    if (ntfs_pread(volume->dev, 0, sizeof boot, &boot) != sizeof boot)
+        return 0;
+    
+    return le64_to_cpu(boot.volume_serial_number);
+}
@@ -0,0 +1,86 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_MFT_H
+#define _NTFSREC_MFT_H
+
+#define NR_MFT_ROOT_RECORD 5
+
+enum ntfsrec_mft_flags {
+    NR_MFT_IN_USE = 1,
+    NR_MFT_DIRECTORY = 2,
+    /* The unnamed $DATA attribute is stored inside the record itself */
+    NR_MFT_RESIDENT = 4,
+    /* The record failed its fixups or couldn't be parsed */
+    NR_MFT_DAMAGED = 8,
+    NR_MFT_HAS_NAME = 16
+};
+
+struct ntfsrec_mft_run {
+    int64_t vcn;
+    int64_t lcn;
+    int64_t length;
+};
+
+/* Everything a scan of $MFT recovers, stored as parallel arrays indexed by MFT record number */
+struct ntfsrec_mft_table {
+    uint64_t count;
+    
+    uint16_t *flags;
+    uint16_t *sequence;
+    /* MFT_REF of the parent directory from the record's $FILE_NAME */
+    uint64_t *parent;
+    /* FILE_ATTR_FLAGS from $STANDARD_INFORMATION */
+    uint32_t *attributes;
+    int64_t *size;
+    int64_t *allocated_size;
+    /* NTFS times from $STANDARD_INFORMATION */
+    int64_t *created;
+    int64_t *modified;
+    /* Offset of the NUL terminated UTF-8 name in names */
+    uint32_t *name_offset;
+    /* Data runs of record n are runs[run_start[n]] up to runs[run_start[n + 1]] */
+    uint64_t *run_start;
+    /* Entries of directory n are children[child_start[n]] up to children[child_start[n + 1]], sorted by name */
+    uint64_t *child_start;
+    
+    char *names;
+    uint64_t names_length;
+    
+    struct ntfsrec_mft_run *runs;
+    uint64_t run_count;
+    
+    uint64_t *children;
+    uint64_t child_count;
+    
+    /* The volume the table was scanned from, a serial number of 0 if its boot sector couldn't be read */
+    uint64_t volume_serial;
+    int64_t volume_clusters;
+    
+    /* Set when the arrays point into a mapped index file rather than owned memory */
+    void *mapping;
+    size_t mapping_length;
+};
+
+struct ntfsrec_mft_table *ntfsrec_mft_scan(ntfs_volume *volume, FILE *log);
+void ntfsrec_mft_table_free(struct ntfsrec_mft_table *table);
+
+/* Writes the table to a versioned file laid out so it can be mapped straight back in */
+int ntfsrec_mft_table_save(const struct ntfsrec_mft_table *table, const char *path, FILE *log);
+struct ntfsrec_mft_table *ntfsrec_mft_table_map(const char *path, FILE *log);
+
+/* Returns NR_FALSE if the table was scanned from a different volume than this one */
+int ntfsrec_mft_table_matches(const struct ntfsrec_mft_table *table, ntfs_volume *volume);
+
+/* Resolves an absolute path to a record number, returns NR_FALSE if any component is missing */
+int ntfsrec_mft_table_lookup(const struct ntfsrec_mft_table *table, const char *path, uint64_t *record);
+
+/*
+ * Builds /path/to/record from the parent references. Returns NR_FALSE with <orphan>/... in output if the
+ * chain doesn't reach the root, or with an empty output if the path doesn't fit.
+ */
+int ntfsrec_mft_table_path(const struct ntfsrec_mft_table *table, uint64_t record, char *output, size_t max_length);
+
+#endif
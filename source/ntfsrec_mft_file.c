@@ -0,0 +1,333 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_mft.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+ * An index file is a fixed header followed by each of the table's arrays, in native little endian
+ * byte order and aligned so that mapping the file gives directly usable arrays.
+ */
+
+#define NR_MFT_FILE_MAGIC "NTFSRECI"
+#define NR_MFT_FILE_VERSION 2
+#define NR_MFT_FILE_ALIGNMENT 64
+
+enum ntfsrec_mft_file_section {
+    NR_MFT_SECTION_FLAGS = 0,
+    NR_MFT_SECTION_SEQUENCE,
+    NR_MFT_SECTION_PARENT,
+    NR_MFT_SECTION_ATTRIBUTES,
+    NR_MFT_SECTION_SIZE,
+    NR_MFT_SECTION_ALLOCATED_SIZE,
+    NR_MFT_SECTION_CREATED,
+    NR_MFT_SECTION_MODIFIED,
+    NR_MFT_SECTION_NAME_OFFSET,
+    NR_MFT_SECTION_RUN_START,
+    NR_MFT_SECTION_CHILD_START,
+    NR_MFT_SECTION_NAMES,
+    NR_MFT_SECTION_RUNS,
+    NR_MFT_SECTION_CHILDREN,
+    NR_MFT_SECTION_COUNT
+};
+
+struct ntfsrec_mft_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    
+    uint64_t count;
+    uint64_t names_length;
+    uint64_t run_count;
+    uint64_t child_count;
+    
+    /* Which volume the index describes, so it isn't used to read file data from another */
+    uint64_t volume_serial;
+    int64_t volume_clusters;
+    
+    struct {
+        uint64_t offset;
+        uint64_t length;
+    } sections[NR_MFT_SECTION_COUNT];
+};
+
+static void ntfsrec_mft_file_layout(const struct ntfsrec_mft_table *table, struct ntfsrec_mft_file_header *header,
+                                    const void **data);
+static uint64_t ntfsrec_mft_file_expected(const struct ntfsrec_mft_file_header *header, unsigned int section);
+static int ntfsrec_mft_file_check(const struct ntfsrec_mft_table *table);
+
+int ntfsrec_mft_table_save(const struct ntfsrec_mft_table *table, const char *path, FILE *log) {
+    static const char padding[NR_MFT_FILE_ALIGNMENT];
+    struct ntfsrec_mft_file_header header;
+    const void *data[NR_MFT_SECTION_COUNT];
+    char *temporary_path;
+    uint64_t position = sizeof header;
+    unsigned int section;
+    FILE *output;
+    
+    ntfsrec_mft_file_layout(table, &header, data);
+    
+    /* Written beside the destination and renamed so a crash never leaves a truncated index */
+    temporary_path = ntfsrec_allocate(strlen(path) + 5);
+    sprintf(temporary_path, "%s.tmp", path);
+    
+    output = fopen(temporary_path, "wb");
+    
+    if (output == NULL) {
+        fprintf(log, "Error: unable to create index file %s\n", temporary_path);
+        free(temporary_path);
+        return NR_FALSE;
+    }
+    
+    if (fwrite(&header, sizeof header, 1, output) != 1)
+        goto write_error;
+    
+    for(section = 0; section < NR_MFT_SECTION_COUNT; ++section) {
+        if (fwrite(padding, 1, header.sections[section].offset - position, output) != header.sections[section].offset - position)
+            goto write_error;
+        
+        if (header.sections[section].length > 0 && fwrite(data[section], 1, header.sections[section].length, output) != header.sections[section].length)
+            goto write_error;
+        
+        position = header.sections[section].offset + header.sections[section].length;
+    }
+    
+    if (fclose(output) != 0) {
+        output = NULL;
+        goto write_error;
+    }
+    
+    if (rename(temporary_path, path) != 0) {
+        fprintf(log, "Error: unable to move index file into place at %s\n", path);
+        unlink(temporary_path);
+        free(temporary_path);
+        return NR_FALSE;
+    }
+    
+    free(temporary_path);
+    return NR_TRUE;
+    
+write_error:
+    fprintf(log, "Error: unable to write index file %s\n", temporary_path);
+    
+    if (output != NULL)
+        fclose(output);
+    
+    unlink(temporary_path);
+    free(temporary_path);
+    return NR_FALSE;
+}
+
+struct ntfsrec_mft_table *ntfsrec_mft_table_map(const char *path, FILE *log) {
+    const struct ntfsrec_mft_file_header *header;
+    struct ntfsrec_mft_table *table;
+    struct stat file_stat;
+    unsigned int section;
+    void *mapping;
+    char *base;
+    int fd;
+    
+    fd = open(path, O_RDONLY);
+    
+    if (fd == -1) {
+        fprintf(log, "Error: unable to open index file %s\n", path);
+        return NULL;
+    }
+    
+    if (fstat(fd, &file_stat) != 0 || (size_t)file_stat.st_size < sizeof *header) {
+        fprintf(log, "Error: %s is too small to be an index file\n", path);
+        close(fd);
+        return NULL;
+    }
+    
+    mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    
+    if (mapping == MAP_FAILED) {
+        fprintf(log, "Error: unable to map index file %s\n", path);
+        return NULL;
+    }
+    
+    header = mapping;
+    base = mapping;
+    
+    if (memcmp(header->magic, NR_MFT_FILE_MAGIC, sizeof header->magic) != 0 || header->header_size != sizeof *header) {
+        fprintf(log, "Error: %s isn't an ntfsrec index file\n", path);
+        munmap(mapping, file_stat.st_size);
+        return NULL;
+    }
+    
+    if (header->version != NR_MFT_FILE_VERSION) {
+        fprintf(log, "Error: index file %s is version %u, this build reads version %u\n", path, header->version, NR_MFT_FILE_VERSION);
+        munmap(mapping, file_stat.st_size);
+        return NULL;
+    }
+    
+    for(section = 0; section < NR_MFT_SECTION_COUNT; ++section) {
+        uint64_t offset = header->sections[section].offset, length = header->sections[section].length;
+        
+        if (offset % NR_MFT_FILE_ALIGNMENT != 0 || offset > (uint64_t)file_stat.st_size || length > (uint64_t)file_stat.st_size - offset ||
+            length != ntfsrec_mft_file_expected(header, section)) {
+            fprintf(log, "Error: index file %s is damaged or truncated\n", path);
+            munmap(mapping, file_stat.st_size);
+            return NULL;
+        }
+    }
+    
+    if (header->names_length > 0 && base[header->sections[NR_MFT_SECTION_NAMES].offset + header->names_length - 1] != '\0') {
+        fprintf(log, "Error: index file %s is damaged or truncated\n", path);
+        munmap(mapping, file_stat.st_size);
+        return NULL;
+    }
+    
+    table = ntfsrec_allocate(sizeof *table);
+    memset(table, 0, sizeof *table);
+    
+    table->count = header->count;
+    table->names_length = header->names_length;
+    table->run_count = header->run_count;
+    table->child_count = header->child_count;
+    table->volume_serial = header->volume_serial;
+    table->volume_clusters = header->volume_clusters;
+    
+    table->flags = (uint16_t *)(base + header->sections[NR_MFT_SECTION_FLAGS].offset);
+    table->sequence = (uint16_t *)(base + header->sections[NR_MFT_SECTION_SEQUENCE].offset);
+    table->parent = (uint64_t *)(base + header->sections[NR_MFT_SECTION_PARENT].offset);
+    table->attributes = (uint32_t *)(base + header->sections[NR_MFT_SECTION_ATTRIBUTES].offset);
+    table->size = (int64_t *)(base + header->sections[NR_MFT_SECTION_SIZE].offset);
+    table->allocated_size = (int64_t *)(base + header->sections[NR_MFT_SECTION_ALLOCATED_SIZE].offset);
+    table->created = (int64_t *)(base + header->sections[NR_MFT_SECTION_CREATED].offset);
+    table->modified = (int64_t *)(base + header->sections[NR_MFT_SECTION_MODIFIED].offset);
+    table->name_offset = (uint32_t *)(base + header->sections[NR_MFT_SECTION_NAME_OFFSET].offset);
+    table->run_start = (uint64_t *)(base + header->sections[NR_MFT_SECTION_RUN_START].offset);
+    table->child_start = (uint64_t *)(base + header->sections[NR_MFT_SECTION_CHILD_START].offset);
+    table->names = base + header->sections[NR_MFT_SECTION_NAMES].offset;
+    table->runs = (struct ntfsrec_mft_run *)(base + header->sections[NR_MFT_SECTION_RUNS].offset);
+    table->children = (uint64_t *)(base + header->sections[NR_MFT_SECTION_CHILDREN].offset);
+    
+    table->mapping = mapping;
+    table->mapping_length = file_stat.st_size;
+    
+    if (ntfsrec_mft_file_check(table) == NR_FALSE) {
+        fprintf(log, "Error: index file %s is damaged or truncated\n", path);
+        ntfsrec_mft_table_free(table);
+        return NULL;
+    }
+    
+    return table;
+}
+
+static void ntfsrec_mft_file_layout(const struct ntfsrec_mft_table *table, struct ntfsrec_mft_file_header *header,
+                                    const void **data) {
+    uint64_t position = sizeof *header;
+    unsigned int section;
+    
+    memset(header, 0, sizeof *header);
+    memcpy(header->magic, NR_MFT_FILE_MAGIC, sizeof header->magic);
+    
+    header->version = NR_MFT_FILE_VERSION;
+    header->header_size = sizeof *header;
+    header->count = table->count;
+    header->names_length = table->names_length;
+    header->run_count = table->run_count;
+    header->child_count = table->child_count;
+    header->volume_serial = table->volume_serial;
+    header->volume_clusters = table->volume_clusters;
+    
+    data[NR_MFT_SECTION_FLAGS] = table->flags;
+    data[NR_MFT_SECTION_SEQUENCE] = table->sequence;
+    data[NR_MFT_SECTION_PARENT] = table->parent;
+    data[NR_MFT_SECTION_ATTRIBUTES] = table->attributes;
+    data[NR_MFT_SECTION_SIZE] = table->size;
+    data[NR_MFT_SECTION_ALLOCATED_SIZE] = table->allocated_size;
+    data[NR_MFT_SECTION_CREATED] = table->created;
+    data[NR_MFT_SECTION_MODIFIED] = table->modified;
+    data[NR_MFT_SECTION_NAME_OFFSET] = table->name_offset;
+    data[NR_MFT_SECTION_RUN_START] = table->run_start;
+    data[NR_MFT_SECTION_CHILD_START] = table->child_start;
+    data[NR_MFT_SECTION_NAMES] = table->names;
+    data[NR_MFT_SECTION_RUNS] = table->runs;
+    data[NR_MFT_SECTION_CHILDREN] = table->children;
+    
+    for(section = 0; section < NR_MFT_SECTION_COUNT; ++section) {
+        position = (position + NR_MFT_FILE_ALIGNMENT - 1) & ~(uint64_t)(NR_MFT_FILE_ALIGNMENT - 1);
+        
+        header->sections[section].offset = position;
+        header->sections[section].length = ntfsrec_mft_file_expected(header, section);
+        
+        position += header->sections[section].length;
+    }
+}
+
+static uint64_t ntfsrec_mft_file_expected(const struct ntfsrec_mft_file_header *header, unsigned int section) {
+    switch(section) {
+        case NR_MFT_SECTION_FLAGS:
+        case NR_MFT_SECTION_SEQUENCE:
+            return header->count * sizeof(uint16_t);
+        
+        case NR_MFT_SECTION_ATTRIBUTES:
+        case NR_MFT_SECTION_NAME_OFFSET:
+            return header->count * sizeof(uint32_t);
+        
+        case NR_MFT_SECTION_PARENT:
+        case NR_MFT_SECTION_SIZE:
+        case NR_MFT_SECTION_ALLOCATED_SIZE:
+        case NR_MFT_SECTION_CREATED:
+        case NR_MFT_SECTION_MODIFIED:
+            return header->count * sizeof(uint64_t);
+        
+        case NR_MFT_SECTION_RUN_START:
+        case NR_MFT_SECTION_CHILD_START:
+            return (header->count + 1) * sizeof(uint64_t);
+        
+        case NR_MFT_SECTION_NAMES:
+            return header->names_length;
+        
+        case NR_MFT_SECTION_RUNS:
+            return header->run_count * sizeof(struct ntfsrec_mft_run);
+        
+        case NR_MFT_SECTION_CHILDREN:
+            return header->child_count * sizeof(uint64_t);
+    }
+    
+    return 0;
+}
+
+/*
+ * Everything the browsing code indexes with is checked once here, so a damaged file can't send it
+ * outside the mapping. Children have to point back at their directory, which also keeps the root
+ * from being listed below itself.
+ */
+static int ntfsrec_mft_file_check(const struct ntfsrec_mft_table *table) {
+    uint64_t record, index;
+    
+    if (table->run_start[0] != 0 || table->run_start[table->count] > table->run_count ||
+        table->child_start[0] != 0 || table->child_start[table->count] > table->child_count)
+        return NR_FALSE;
+    
+    for(record = 0; record < table->count; ++record) {
+        if (table->run_start[record] > table->run_start[record + 1] || table->child_start[record] > table->child_start[record + 1])
+            return NR_FALSE;
+        
+        /* Records without a name are left at offset 0, which only exists if some record has one */
+        if (table->name_offset[record] >= table->names_length && (table->flags[record] & NR_MFT_HAS_NAME || table->name_offset[record] != 0))
+            return NR_FALSE;
+        
+        for(index = table->child_start[record]; index < table->child_start[record + 1]; ++index) {
+            uint64_t child = table->children[index];
+            
+            if (child >= table->count || child == NR_MFT_ROOT_RECORD || MREF(table->parent[child]) != record ||
+                (table->flags[child] & NR_MFT_HAS_NAME) == 0)
+                return NR_FALSE;
+        }
+    }
+    
+    return NR_TRUE;
+}
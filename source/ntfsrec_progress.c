@@ -0,0 +1,265 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_progress.h"
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * Counters are bumped with relaxed atomics by the copying threads and only ever read by the status
+ * thread and the final report, so a snapshot may be a read or two out of step with itself.
+ */
+
+#define NR_PROGRESS_ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#define NR_PROGRESS_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+struct ntfsrec_progress {
+    uint64_t total_bytes;
+    uint64_t total_files;
+    
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t files;
+    uint64_t reads;
+    uint64_t failed_reads;
+    uint64_t retries;
+    uint64_t skipped;
+    uint64_t latency[NR_PROGRESS_BUCKETS];
+    
+    uint64_t started;
+    
+    /* The status thread, which only runs once ntfsrec_progress_display is called */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    unsigned int displaying;
+    unsigned int stopping;
+    
+    FILE *output;
+    unsigned int interval;
+    unsigned int json;
+    unsigned int terminal;
+    
+    /* Counters at the previous status line, for the current rates */
+    uint64_t last_time;
+    uint64_t last_bytes;
+    uint64_t last_files;
+};
+
+static void *ntfsrec_progress_main(void *argument);
+static void ntfsrec_progress_status(struct ntfsrec_progress *progress);
+static uint64_t ntfsrec_progress_percentile(struct ntfsrec_progress *progress, unsigned int percent);
+
+struct ntfsrec_progress *ntfsrec_progress_create(void) {
+    struct ntfsrec_progress *progress = ntfsrec_allocate(sizeof *progress);
+    
+    memset(progress, 0, sizeof *progress);
+    
+    pthread_mutex_init(&progress->lock, NULL);
+    pthread_cond_init(&progress->wake, NULL);
+    
+    progress->started = ntfsrec_progress_clock();
+    progress->last_time = progress->started;
+    
+    return progress;
+}
+
+void ntfsrec_progress_destroy(struct ntfsrec_progress *progress) {
+    ntfsrec_progress_stop(progress);
+    
+    pthread_cond_destroy(&progress->wake);
+    pthread_mutex_destroy(&progress->lock);
+    free(progress);
+}
+
+void ntfsrec_progress_stop(struct ntfsrec_progress *progress) {
+    if (progress->displaying) {
+        pthread_mutex_lock(&progress->lock);
+        progress->stopping = NR_TRUE;
+        pthread_cond_signal(&progress->wake);
+        pthread_mutex_unlock(&progress->lock);
+        
+        pthread_join(progress->thread, NULL);
+        
+        /* A status line left on the terminal would run into whatever is printed next */
+        if (progress->terminal) {
+            fputs("\r\033[K", progress->output);
+            fflush(progress->output);
+        }
+        
+        progress->displaying = NR_FALSE;
+    }
+}
+
+void ntfsrec_progress_set_total(struct ntfsrec_progress *progress, uint64_t bytes, uint64_t files) {
+    progress->total_bytes = bytes;
+    progress->total_files = files;
+}
+
+void ntfsrec_progress_display(struct ntfsrec_progress *progress, FILE *output, unsigned int interval, unsigned int json) {
+    progress->output = output;
+    progress->interval = interval;
+    progress->json = json;
+    progress->terminal = !json && isatty(fileno(output));
+    
+    if (pthread_create(&progress->thread, NULL, &ntfsrec_progress_main, progress) == 0)
+        progress->displaying = NR_TRUE;
+    else
+        puts("Error: unable to start the status thread, progress won't be shown");
+}
+
+uint64_t ntfsrec_progress_clock(void) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void ntfsrec_progress_read(struct ntfsrec_progress *progress, s64 length, uint64_t started) {
+    uint64_t elapsed = ntfsrec_progress_clock() - started;
+    unsigned int bucket = 0;
+    
+    while(bucket < NR_PROGRESS_BUCKETS - 1 && elapsed >= (1ULL << bucket))
+        ++bucket;
+    
+    NR_PROGRESS_ADD(progress->latency[bucket], 1);
+    NR_PROGRESS_ADD(progress->reads, 1);
+    
+    if (length < 0)
+        NR_PROGRESS_ADD(progress->failed_reads, 1);
+    else
+        NR_PROGRESS_ADD(progress->bytes_read, (uint64_t)length);
+}
+
+void ntfsrec_progress_write(struct ntfsrec_progress *progress, s64 length) {
+    if (length > 0)
+        NR_PROGRESS_ADD(progress->bytes_written, (uint64_t)length);
+}
+
+void ntfsrec_progress_file(struct ntfsrec_progress *progress) {
+    NR_PROGRESS_ADD(progress->files, 1);
+}
+
+void ntfsrec_progress_retry(struct ntfsrec_progress *progress) {
+    NR_PROGRESS_ADD(progress->retries, 1);
+}
+
+void ntfsrec_progress_skip(struct ntfsrec_progress *progress) {
+    NR_PROGRESS_ADD(progress->skipped, 1);
+}
+
+void ntfsrec_progress_json(struct ntfsrec_progress *progress, FILE *output) {
+    uint64_t elapsed = ntfsrec_progress_clock() - progress->started;
+    unsigned int bucket;
+    
+    fprintf(output, "{\"elapsed_ms\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu,\"files\":%llu,"
+            "\"reads\":%llu,\"failed_reads\":%llu,\"retries\":%llu,\"skipped\":%llu,\"total_bytes\":%llu,\"total_files\":%llu,\"read_latency_us\":[",
+            (unsigned long long)(elapsed / 1000), (unsigned long long)NR_PROGRESS_GET(progress->bytes_read),
+            (unsigned long long)NR_PROGRESS_GET(progress->bytes_written), (unsigned long long)NR_PROGRESS_GET(progress->files),
+            (unsigned long long)NR_PROGRESS_GET(progress->reads), (unsigned long long)NR_PROGRESS_GET(progress->failed_reads),
+            (unsigned long long)NR_PROGRESS_GET(progress->retries), (unsigned long long)NR_PROGRESS_GET(progress->skipped),
+            (unsigned long long)progress->total_bytes, (unsigned long long)progress->total_files);
+    
+    /* Each bucket counts the reads faster than its bound and slower than the one before */
+    for(bucket = 0; bucket < NR_PROGRESS_BUCKETS; ++bucket) {
+        if (bucket < NR_PROGRESS_BUCKETS - 1)
+            fprintf(output, "%s{\"below\":%llu,", bucket > 0 ? "," : "", 1ULL << bucket);
+        else
+            fputs(",{\"below\":null,", output);
+        
+        fprintf(output, "\"count\":%llu}", (unsigned long long)NR_PROGRESS_GET(progress->latency[bucket]));
+    }
+    
+    fputs("]}", output);
+}
+
+static void *ntfsrec_progress_main(void *argument) {
+    struct ntfsrec_progress *progress = argument;
+    
+    pthread_mutex_lock(&progress->lock);
+    
+    while(!progress->stopping) {
+        struct timespec deadline;
+        
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += progress->interval / 1000;
+        deadline.tv_nsec += (progress->interval % 1000) * 1000000L;
+        
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        
+        if (pthread_cond_timedwait(&progress->wake, &progress->lock, &deadline) == 0 && progress->stopping)
+            break;
+        
+        ntfsrec_progress_status(progress);
+    }
+    
+    pthread_mutex_unlock(&progress->lock);
+    return NULL;
+}
+
+static void ntfsrec_progress_status(struct ntfsrec_progress *progress) {
+    uint64_t now = ntfsrec_progress_clock(), bytes = NR_PROGRESS_GET(progress->bytes_read);
+    uint64_t files = NR_PROGRESS_GET(progress->files), interval = now - progress->last_time;
+    double rate = interval > 0 ? (bytes - progress->last_bytes) * 1e6 / interval : 0;
+    double file_rate = interval > 0 ? (files - progress->last_files) * 1e6 / interval : 0;
+    double average = now > progress->started ? bytes * 1e6 / (now - progress->started) : 0;
+    char done_text[8], total_text[8], rate_text[8], eta_text[32] = "--:--:--";
+    
+    progress->last_time = now;
+    progress->last_bytes = bytes;
+    progress->last_files = files;
+    
+    if (progress->json) {
+        fputs("{\"progress\":", progress->output);
+        ntfsrec_progress_json(progress, progress->output);
+        fputs("}\n", progress->output);
+        fflush(progress->output);
+        return;
+    }
+    
+    /* The ETA uses the average so far, the current rate swings too much around bad areas */
+    if (progress->total_bytes > bytes && average > 0) {
+        uint64_t seconds = (progress->total_bytes - bytes) / average;
+        
+        snprintf(eta_text, sizeof eta_text, "%llu:%02u:%02u", (unsigned long long)(seconds / 3600),
+                 (unsigned int)(seconds / 60 % 60), (unsigned int)(seconds % 60));
+    }
+    
+    ntfsrec_utility_format_size(done_text, sizeof done_text, bytes);
+    ntfsrec_utility_format_size(total_text, sizeof total_text, progress->total_bytes);
+    ntfsrec_utility_format_size(rate_text, sizeof rate_text, rate);
+    
+    fprintf(progress->output, "%s%s/%s %s/s, %llu/%llu files %.0f/s, %llu skipped, %llu failed reads, %llu retries, p50 %llu p99 %llu us, ETA %s%s",
+            progress->terminal ? "\r" : "", done_text, total_text, rate_text,
+            (unsigned long long)files, (unsigned long long)progress->total_files, file_rate,
+            (unsigned long long)NR_PROGRESS_GET(progress->skipped), (unsigned long long)NR_PROGRESS_GET(progress->failed_reads),
+            (unsigned long long)NR_PROGRESS_GET(progress->retries),
+            (unsigned long long)ntfsrec_progress_percentile(progress, 50),
+            (unsigned long long)ntfsrec_progress_percentile(progress, 99),
+            eta_text, progress->terminal ? "\033[K" : "\n");
+    
+    fflush(progress->output);
+}
+
+/* Returns the upper bound of the bucket holding the given percentile of reads */
+static uint64_t ntfsrec_progress_percentile(struct ntfsrec_progress *progress, unsigned int percent) {
+    uint64_t reads = NR_PROGRESS_GET(progress->reads), seen = 0;
+    unsigned int bucket;
+    
+    for(bucket = 0; bucket < NR_PROGRESS_BUCKETS - 1; ++bucket) {
+        seen += NR_PROGRESS_GET(progress->latency[bucket]);
+        
+        if (seen * 100 >= reads * percent)
+            break;
+    }
+    
+    return 1ULL << bucket;
+}
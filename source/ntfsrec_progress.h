@@ -0,0 +1,39 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_PROGRESS_H
+#define _NTFSREC_PROGRESS_H
+
+/* Read latencies are counted in power of two buckets of microseconds, the last one is open ended */
+#define NR_PROGRESS_BUCKETS 24
+
+struct ntfsrec_progress;
+
+struct ntfsrec_progress *ntfsrec_progress_create(void);
+void ntfsrec_progress_destroy(struct ntfsrec_progress *progress);
+
+/* Sets the expected totals, which turn the rates into an ETA */
+void ntfsrec_progress_set_total(struct ntfsrec_progress *progress, uint64_t bytes, uint64_t files);
+
+/* Prints a status line to output every interval milliseconds until destroyed, as JSON lines if json is set */
+void ntfsrec_progress_display(struct ntfsrec_progress *progress, FILE *output, unsigned int interval, unsigned int json);
+
+/* Stops and clears the status line early, for when output is about to change hands */
+void ntfsrec_progress_stop(struct ntfsrec_progress *progress);
+
+/* Microseconds from a monotonic clock, for timing the reads passed to ntfsrec_progress_read */
+uint64_t ntfsrec_progress_clock(void);
+
+/* These are safe to call from any number of threads at once; a negative length records a failed read */
+void ntfsrec_progress_read(struct ntfsrec_progress *progress, s64 length, uint64_t started);
+void ntfsrec_progress_write(struct ntfsrec_progress *progress, s64 length);
+void ntfsrec_progress_file(struct ntfsrec_progress *progress);
+void ntfsrec_progress_retry(struct ntfsrec_progress *progress);
+void ntfsrec_progress_skip(struct ntfsrec_progress *progress);
+
+/* Writes the counters and the latency histogram as a JSON object */
+void ntfsrec_progress_json(struct ntfsrec_progress *progress, FILE *output);
+
+#endif
@@ -0,0 +1,339 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfs_reader.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_tar.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/*
+ * Every entry is a ustar header preceded by a pax extended header, which carries the full path,
+ * sizes past the 8 GB ustar limit and the modification time at full NTFS resolution.
+ */
+
+#define NR_TAR_BLOCK_SIZE 512
+#define NR_TAR_BUFFER_SIZE (64 * 1024)
+#define NR_TAR_RECORDS_SIZE 4096
+#define NR_TAR_NAME_SIZE 100
+#define NR_TAR_MAX_OCTAL_SIZE 077777777777LL
+
+struct ntfsrec_tar {
+    int fd;
+    unsigned int failed;
+    
+    /* Splicing needs a pipe on one side, a regular file output goes through one of our own */
+    unsigned int output_is_pipe;
+    unsigned int splice_disabled;
+    int pipe[2];
+    
+    s64 file_size;
+    s64 remaining;
+    
+    size_t buffered;
+    char buffer[NR_TAR_BUFFER_SIZE];
+};
+
+static const char ntfsrec_tar_zero_block[NR_TAR_BUFFER_SIZE];
+
+static int ntfsrec_tar_entry(struct ntfsrec_tar *tar, const char *name, char type, s64 size, const struct ntfsrec_file_meta *meta);
+static void ntfsrec_tar_header(char *header, const char *name, char type, s64 size, unsigned int mode, time_t modified);
+static void ntfsrec_tar_record(char *records, size_t *length, const char *key, const char *value);
+static void ntfsrec_tar_output(struct ntfsrec_tar *tar, const void *data, size_t length);
+static void ntfsrec_tar_flush(struct ntfsrec_tar *tar);
+static int ntfsrec_tar_write_all(int fd, const char *data, size_t length);
+static int ntfsrec_tar_drain_pipe(struct ntfsrec_tar *tar, size_t length);
+
+struct ntfsrec_tar *ntfsrec_tar_open(int fd) {
+    struct ntfsrec_tar *tar = ntfsrec_allocate(sizeof *tar);
+    struct stat stat_result;
+    
+    memset(tar, 0, sizeof *tar);
+    
+    tar->fd = fd;
+    tar->pipe[0] = tar->pipe[1] = -1;
+    
+    if (fstat(fd, &stat_result) == 0 && S_ISFIFO(stat_result.st_mode))
+        tar->output_is_pipe = NR_TRUE;
+    else if (pipe(tar->pipe) != 0)
+        tar->splice_disabled = NR_TRUE;
+    
+    return tar;
+}
+
+int ntfsrec_tar_close(struct ntfsrec_tar *tar) {
+    int result;
+    
+    /* The archive ends with two empty blocks */
+    ntfsrec_tar_output(tar, ntfsrec_tar_zero_block, NR_TAR_BLOCK_SIZE * 2);
+    ntfsrec_tar_flush(tar);
+    
+    if (tar->pipe[0] != -1) {
+        close(tar->pipe[0]);
+        close(tar->pipe[1]);
+    }
+    
+    result = !tar->failed;
+    free(tar);
+    
+    return result;
+}
+
+int ntfsrec_tar_add_directory(struct ntfsrec_tar *tar, const char *name, const struct ntfsrec_file_meta *meta) {
+    return ntfsrec_tar_entry(tar, name, '5', 0, meta);
+}
+
+int ntfsrec_tar_begin_file(struct ntfsrec_tar *tar, const char *name, const struct ntfsrec_file_meta *meta) {
+    tar->file_size = meta->size;
+    tar->remaining = meta->size;
+    
+    return ntfsrec_tar_entry(tar, name, '0', meta->size, meta);
+}
+
+int ntfsrec_tar_write(struct ntfsrec_tar *tar, const void *data, size_t length) {
+    if ((s64)length > tar->remaining)
+        length = tar->remaining;
+    
+    ntfsrec_tar_output(tar, data, length);
+    tar->remaining -= length;
+    
+    return !tar->failed;
+}
+
+int ntfsrec_tar_write_zeros(struct ntfsrec_tar *tar, s64 length) {
+    if (length > tar->remaining)
+        length = tar->remaining;
+    
+    tar->remaining -= length;
+    
+    while(length > 0 && !tar->failed) {
+        size_t chunk = length < NR_TAR_BUFFER_SIZE ? (size_t)length : NR_TAR_BUFFER_SIZE;
+        
+        /* The zero block is never written to, so a pipe can map it instead of copying it */
+        if (tar->output_is_pipe && !tar->splice_disabled) {
+            struct iovec vector;
+            ssize_t result;
+            
+            ntfsrec_tar_flush(tar);
+            
+            vector.iov_base = (void *)ntfsrec_tar_zero_block;
+            vector.iov_len = chunk;
+            result = vmsplice(tar->fd, &vector, 1, 0);
+            
+            if (result > 0) {
+                length -= result;
+                continue;
+            }
+        }
+        
+        ntfsrec_tar_output(tar, ntfsrec_tar_zero_block, chunk);
+        length -= chunk;
+    }
+    
+    return !tar->failed;
+}
+
+s64 ntfsrec_tar_splice(struct ntfsrec_tar *tar, int in_fd, s64 offset, s64 length) {
+    loff_t in_offset = offset;
+    s64 moved = 0;
+    
+    if (tar->splice_disabled || tar->failed)
+        return 0;
+    
+    if (length > tar->remaining)
+        length = tar->remaining;
+    
+    ntfsrec_tar_flush(tar);
+    
+    while(moved < length) {
+        size_t chunk = length - moved < NR_TAR_BUFFER_SIZE ? (size_t)(length - moved) : NR_TAR_BUFFER_SIZE;
+        ssize_t result;
+        
+        if (tar->output_is_pipe)
+            result = splice(in_fd, &in_offset, tar->fd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        else
+            result = splice(in_fd, &in_offset, tar->pipe[1], NULL, chunk, SPLICE_F_MOVE);
+        
+        if (result <= 0) {
+            /* Inputs or outputs that can't be spliced turn it off for good, a read error only ends this run */
+            if (result < 0 && (errno == EINVAL || errno == ENOSYS || errno == EBADF))
+                tar->splice_disabled = NR_TRUE;
+            
+            break;
+        }
+        
+        if (!tar->output_is_pipe && ntfsrec_tar_drain_pipe(tar, result) == NR_FALSE)
+            break;
+        
+        moved += result;
+    }
+    
+    tar->remaining -= moved;
+    return moved;
+}
+
+int ntfsrec_tar_end_file(struct ntfsrec_tar *tar) {
+    s64 padding = (NR_TAR_BLOCK_SIZE - tar->file_size % NR_TAR_BLOCK_SIZE) % NR_TAR_BLOCK_SIZE;
+    
+    if (tar->remaining > 0)
+        ntfsrec_tar_write_zeros(tar, tar->remaining);
+    
+    ntfsrec_tar_output(tar, ntfsrec_tar_zero_block, padding);
+    
+    return !tar->failed;
+}
+
+static int ntfsrec_tar_entry(struct ntfsrec_tar *tar, const char *name, char type, s64 size, const struct ntfsrec_file_meta *meta) {
+    char header[NR_TAR_BLOCK_SIZE], records[NR_TAR_RECORDS_SIZE], value[64], pax_name[NR_TAR_NAME_SIZE];
+    const char *base_name = strrchr(name, '/');
+    unsigned int mode = type == '5' ? 0755 : 0644;
+    size_t length = 0;
+    
+    if (strlen(name) + 64 > sizeof records) {
+        printf("Error: path %s is too long for the archive\n", name);
+        return NR_FALSE;
+    }
+    
+    /* Directory names end in a slash, the pax header is named after the last component either way */
+    if (base_name != NULL && base_name[1] == '\0') {
+        while(base_name > name && base_name[-1] != '/')
+            --base_name;
+    } else {
+        base_name = base_name != NULL ? base_name + 1 : name;
+    }
+    
+    if (type != '5' && (meta->flags & FILE_ATTR_READONLY))
+        mode = 0444;
+    
+    ntfsrec_tar_record(records, &length, "path", name);
+    
+    if (size > NR_TAR_MAX_OCTAL_SIZE) {
+        snprintf(value, sizeof value, "%lld", (long long)size);
+        ntfsrec_tar_record(records, &length, "size", value);
+    }
+    
+    if (meta->modified.tv_sec >= 0) {
+        snprintf(value, sizeof value, "%lld.%09ld", (long long)meta->modified.tv_sec, meta->modified.tv_nsec);
+        ntfsrec_tar_record(records, &length, "mtime", value);
+    }
+    
+    snprintf(pax_name, sizeof pax_name, "PaxHeaders/%.80s", base_name);
+    ntfsrec_tar_header(header, pax_name, 'x', length, 0644, meta->modified.tv_sec);
+    
+    ntfsrec_tar_output(tar, header, sizeof header);
+    ntfsrec_tar_output(tar, records, length);
+    ntfsrec_tar_output(tar, ntfsrec_tar_zero_block, (NR_TAR_BLOCK_SIZE - length % NR_TAR_BLOCK_SIZE) % NR_TAR_BLOCK_SIZE);
+    
+    ntfsrec_tar_header(header, name, type, size > NR_TAR_MAX_OCTAL_SIZE ? 0 : size, mode, meta->modified.tv_sec);
+    ntfsrec_tar_output(tar, header, sizeof header);
+    
+    return !tar->failed;
+}
+
+static void ntfsrec_tar_header(char *header, const char *name, char type, s64 size, unsigned int mode, time_t modified) {
+    unsigned int checksum = 0, index;
+    
+    memset(header, 0, NR_TAR_BLOCK_SIZE);
+    
+    /* Longer names are cut short here, the pax path record holds the whole name */
+    strncpy(header, name, NR_TAR_NAME_SIZE);
+    
+    snprintf(&header[100], 8, "%07o", mode);
+    snprintf(&header[108], 8, "%07o", 0);
+    snprintf(&header[116], 8, "%07o", 0);
+    snprintf(&header[124], 12, "%011llo", (unsigned long long)(size & NR_TAR_MAX_OCTAL_SIZE));
+    snprintf(&header[136], 12, "%011llo", (unsigned long long)(modified > 0 ? modified & NR_TAR_MAX_OCTAL_SIZE : 0));
+    
+    header[156] = type;
+    memcpy(&header[257], "ustar", 6);
+    memcpy(&header[263], "00", 2);
+    
+    memset(&header[148], ' ', 8);
+    
+    for(index = 0; index < NR_TAR_BLOCK_SIZE; ++index)
+        checksum += (unsigned char)header[index];
+    
+    snprintf(&header[148], 8, "%06o", checksum);
+    header[155] = ' ';
+}
+
+static void ntfsrec_tar_record(char *records, size_t *length, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3, total = body + 1;
+    char digits[24];
+    
+    /* The length prefix counts its own digits */
+    while((size_t)snprintf(digits, sizeof digits, "%lu", (unsigned long)total) + body != total)
+        total = body + strlen(digits);
+    
+    *length += snprintf(&records[*length], NR_TAR_RECORDS_SIZE - *length, "%lu %s=%s\n", (unsigned long)total, key, value);
+}
+
+static void ntfsrec_tar_output(struct ntfsrec_tar *tar, const void *data, size_t length) {
+    if (tar->failed || length == 0)
+        return;
+    
+    if (tar->buffered + length > sizeof tar->buffer)
+        ntfsrec_tar_flush(tar);
+    
+    if (length >= sizeof tar->buffer) {
+        if (ntfsrec_tar_write_all(tar->fd, data, length) == NR_FALSE)
+            tar->failed = NR_TRUE;
+        
+        return;
+    }
+    
+    memcpy(&tar->buffer[tar->buffered], data, length);
+    tar->buffered += length;
+}
+
+static void ntfsrec_tar_flush(struct ntfsrec_tar *tar) {
+    if (tar->buffered > 0 && !tar->failed && ntfsrec_tar_write_all(tar->fd, tar->buffer, tar->buffered) == NR_FALSE)
+        tar->failed = NR_TRUE;
+    
+    tar->buffered = 0;
+}
+
+static int ntfsrec_tar_write_all(int fd, const char *data, size_t length) {
+    while(length > 0) {
+        ssize_t result = write(fd, data, length);
+        
+        if (result < 0 && errno == EINTR)
+            continue;
+        
+        if (result <= 0) {
+            printf("Error: unable to write the archive: %s\n", strerror(errno));
+            return NR_FALSE;
+        }
+        
+        data += result;
+        length -= result;
+    }
+    
+    return NR_TRUE;
+}
+
+static int ntfsrec_tar_drain_pipe(struct ntfsrec_tar *tar, size_t length) {
+    while(length > 0) {
+        ssize_t result = splice(tar->pipe[0], NULL, tar->fd, NULL, length, SPLICE_F_MOVE);
+        
+        if (result < 0 && errno == EINTR)
+            continue;
+        
+        /* Data already in the pipe can't be put back, so the archive is lost at this point */
+        if (result <= 0) {
+            printf("Error: unable to write the archive: %s\n", strerror(errno));
+            tar->failed = NR_TRUE;
+            return NR_FALSE;
+        }
+        
+        length -= result;
+    }
+    
+    return NR_TRUE;
+}
@@ -0,0 +1,34 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_TAR_H
+#define _NTFSREC_TAR_H
+
+struct ntfsrec_file_meta;
+struct ntfsrec_tar;
+
+/* Writes a POSIX pax archive to fd, which can be a pipe, a terminal or a regular file */
+struct ntfsrec_tar *ntfsrec_tar_open(int fd);
+
+/* Ends the archive and frees the writer without closing fd, returns NR_FALSE if any write failed */
+int ntfsrec_tar_close(struct ntfsrec_tar *tar);
+
+int ntfsrec_tar_add_directory(struct ntfsrec_tar *tar, const char *name, const struct ntfsrec_file_meta *meta);
+
+/* Starts a file of meta->size bytes, which must then be supplied in order before ntfsrec_tar_end_file */
+int ntfsrec_tar_begin_file(struct ntfsrec_tar *tar, const char *name, const struct ntfsrec_file_meta *meta);
+int ntfsrec_tar_write(struct ntfsrec_tar *tar, const void *data, size_t length);
+int ntfsrec_tar_write_zeros(struct ntfsrec_tar *tar, s64 length);
+
+/*
+ * Moves length bytes at offset of in_fd into the archive inside the kernel. Returns how many bytes
+ * were moved, the rest has to be supplied with ntfsrec_tar_write.
+ */
+s64 ntfsrec_tar_splice(struct ntfsrec_tar *tar, int in_fd, s64 offset, s64 length);
+
+/* Pads the file with zeros if less than its size was supplied, then to the next block */
+int ntfsrec_tar_end_file(struct ntfsrec_tar *tar);
+
+#endif
@@ -0,0 +1,273 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_mft.h"
+#include "ntfsrec_trigram.h"
+#include <fnmatch.h>
+
+/* Three seven bit letters make the key, so every run of ASCII has a list of its own */
+#define NR_TRIGRAM_KEYS (1U << 21)
+
+struct ntfsrec_trigram_index {
+    const struct ntfsrec_mft_table *table;
+    
+    /* Records whose names contain run k are records[start[k]] up to records[start[k + 1]], ascending */
+    uint64_t *start;
+    uint32_t *records;
+    
+    /* Every indexed record, checked in turn when a pattern has no run to look up */
+    uint32_t *named;
+    uint64_t named_count;
+};
+
+static size_t ntfsrec_trigram_keys(const char *text, size_t length, uint32_t *keys);
+static size_t ntfsrec_trigram_unique(uint32_t *keys, size_t count);
+static size_t ntfsrec_trigram_pattern_keys(const char *pattern, unsigned int glob, uint32_t *keys);
+static int ntfsrec_trigram_key_compare(const void *left, const void *right);
+static int ntfsrec_trigram_length_compare(const void *left, const void *right, void *context);
+static uint64_t ntfsrec_trigram_seek(const uint32_t *records, uint64_t position, uint64_t end, uint32_t record);
+static int ntfsrec_trigram_check(const struct ntfsrec_trigram_index *index, uint32_t record, const char *pattern, unsigned int glob);
+
+struct ntfsrec_trigram_index *ntfsrec_trigram_build(const struct ntfsrec_mft_table *table) {
+    const uint64_t limit = table->count < UINT32_MAX ? table->count : UINT32_MAX;
+    struct ntfsrec_trigram_index *index = ntfsrec_allocate(sizeof *index);
+    uint32_t keys[NR_NAME_LENGTH];
+    uint64_t record, key, *fill;
+    size_t count, position;
+    
+    index->table = table;
+    index->start = ntfsrec_allocate((NR_TRIGRAM_KEYS + 1) * sizeof *index->start);
+    index->named = ntfsrec_allocate((limit ? limit : 1) * sizeof *index->named);
+    index->named_count = 0;
+    
+    memset(index->start, 0, (NR_TRIGRAM_KEYS + 1) * sizeof *index->start);
+    
+    /* Counting sort by key: one pass sizes the lists and a second fills them in record order */
+    for(record = 0; record < limit; ++record) {
+        const char *name;
+        
+        if ((table->flags[record] & (NR_MFT_IN_USE | NR_MFT_HAS_NAME)) != (NR_MFT_IN_USE | NR_MFT_HAS_NAME))
+            continue;
+        
+        name = &table->names[table->name_offset[record]];
+        index->named[index->named_count++] = (uint32_t)record;
+        count = ntfsrec_trigram_unique(keys, ntfsrec_trigram_keys(name, strnlen(name, NR_NAME_LENGTH), keys));
+        
+        for(position = 0; position < count; ++position)
+            index->start[keys[position] + 1]++;
+    }
+    
+    for(key = 0; key < NR_TRIGRAM_KEYS; ++key)
+        index->start[key + 1] += index->start[key];
+    
+    index->records = ntfsrec_allocate((index->start[NR_TRIGRAM_KEYS] ? index->start[NR_TRIGRAM_KEYS] : 1) * sizeof *index->records);
+    fill = ntfsrec_allocate(NR_TRIGRAM_KEYS * sizeof *fill);
+    memcpy(fill, index->start, NR_TRIGRAM_KEYS * sizeof *fill);
+    
+    for(record = 0; record < index->named_count; ++record) {
+        const char *name = &table->names[table->name_offset[index->named[record]]];
+        
+        count = ntfsrec_trigram_unique(keys, ntfsrec_trigram_keys(name, strnlen(name, NR_NAME_LENGTH), keys));
+        
+        for(position = 0; position < count; ++position)
+            index->records[fill[keys[position]]++] = index->named[record];
+    }
+    
+    free(fill);
+    return index;
+}
+
+void ntfsrec_trigram_free(struct ntfsrec_trigram_index *index) {
+    free(index->start);
+    free(index->records);
+    free(index->named);
+    free(index);
+}
+
+uint64_t ntfsrec_trigram_names(const struct ntfsrec_trigram_index *index) {
+    return index->named_count;
+}
+
+uint64_t ntfsrec_trigram_search(const struct ntfsrec_trigram_index *index, const char *pattern,
+                                void *context, ntfsrec_trigram_visitor visitor) {
+    const unsigned int glob = strpbrk(pattern, "*?[") != NULL;
+    uint32_t *keys = ntfsrec_allocate((strlen(pattern) + 1) * sizeof *keys);
+    uint64_t *positions, position, checked = 0;
+    size_t count, list;
+    
+    count = ntfsrec_trigram_pattern_keys(pattern, glob, keys);
+    
+    if (count == 0) {
+        for(position = 0; position < index->named_count; ++position, ++checked) {
+            if (ntfsrec_trigram_check(index, index->named[position], pattern, glob) && visitor(context, index->named[position]) != 0)
+                break;
+        }
+        
+        free(keys);
+        return checked;
+    }
+    
+    /* The shortest list leads, and each of its records is looked for in the others, shortest first */
+    qsort_r(keys, count, sizeof *keys, &ntfsrec_trigram_length_compare, (void *)index);
+    
+    positions = ntfsrec_allocate(count * sizeof *positions);
+    
+    for(list = 0; list < count; ++list)
+        positions[list] = index->start[keys[list]];
+    
+    for(position = index->start[keys[0]]; position < index->start[keys[0] + 1]; ++position) {
+        const uint32_t record = index->records[position];
+        
+        for(list = 1; list < count; ++list) {
+            positions[list] = ntfsrec_trigram_seek(index->records, positions[list], index->start[keys[list] + 1], record);
+            
+            if (positions[list] == index->start[keys[list] + 1] || index->records[positions[list]] != record)
+                break;
+        }
+        
+        if (list < count)
+            continue;
+        
+        ++checked;
+        
+        if (ntfsrec_trigram_check(index, record, pattern, glob) && visitor(context, record) != 0)
+            break;
+    }
+    
+    free(positions);
+    free(keys);
+    return checked;
+}
+
+static size_t ntfsrec_trigram_keys(const char *text, size_t length, uint32_t *keys) {
+    size_t position, count = 0;
+    
+    for(position = 0; position + 3 <= length; ++position) {
+        unsigned char a = text[position], b = text[position + 1], c = text[position + 2];
+        
+        if ((a | b | c) & 0x80)
+            continue;
+        
+        a = a >= 'A' && a <= 'Z' ? a + ('a' - 'A') : a;
+        b = b >= 'A' && b <= 'Z' ? b + ('a' - 'A') : b;
+        c = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+        
+        keys[count++] = ((uint32_t)a << 14) | ((uint32_t)b << 7) | c;
+    }
+    
+    return count;
+}
+
+static size_t ntfsrec_trigram_unique(uint32_t *keys, size_t count) {
+    size_t position, unique = 0;
+    
+    qsort(keys, count, sizeof *keys, &ntfsrec_trigram_key_compare);
+    
+    for(position = 0; position < count; ++position) {
+        if (unique == 0 || keys[unique - 1] != keys[position])
+            keys[unique++] = keys[position];
+    }
+    
+    return unique;
+}
+
+/* Only the literal text between a glob's wildcards and bracket expressions has to be in a match */
+static size_t ntfsrec_trigram_pattern_keys(const char *pattern, unsigned int glob, uint32_t *keys) {
+    const size_t length = strlen(pattern);
+    char *run = ntfsrec_allocate(length + 1);
+    size_t position, run_length = 0, count = 0;
+    
+    for(position = 0; position < length; ++position) {
+        char letter = pattern[position];
+        
+        if (glob && letter == '\\' && position + 1 < length) {
+            run[run_length++] = pattern[++position];
+            continue;
+        }
+        
+        /* A bracket that's never closed is matched as itself */
+        if (glob && letter == '[') {
+            size_t close = position + 1;
+            
+            if (pattern[close] == '!' || pattern[close] == '^')
+                ++close;
+            
+            if (pattern[close] == ']')
+                ++close;
+            
+            while(close < length && pattern[close] != ']')
+                ++close;
+            
+            if (close < length) {
+                count += ntfsrec_trigram_keys(run, run_length, &keys[count]);
+                run_length = 0;
+                position = close;
+                continue;
+            }
+        }
+        
+        if (glob && (letter == '*' || letter == '?')) {
+            count += ntfsrec_trigram_keys(run, run_length, &keys[count]);
+            run_length = 0;
+            continue;
+        }
+        
+        run[run_length++] = letter;
+    }
+    
+    count += ntfsrec_trigram_keys(run, run_length, &keys[count]);
+    
+    free(run);
+    return ntfsrec_trigram_unique(keys, count);
+}
+
+static int ntfsrec_trigram_key_compare(const void *left, const void *right) {
+    const uint32_t a = *(const uint32_t *)left, b = *(const uint32_t *)right;
+    
+    return a < b ? -1 : a > b;
+}
+
+static int ntfsrec_trigram_length_compare(const void *left, const void *right, void *context) {
+    const struct ntfsrec_trigram_index *index = context;
+    const uint32_t a = *(const uint32_t *)left, b = *(const uint32_t *)right;
+    const uint64_t a_length = index->start[a + 1] - index->start[a], b_length = index->start[b + 1] - index->start[b];
+    
+    return a_length < b_length ? -1 : a_length > b_length;
+}
+
+/* Finds the first position holding record or a later one, galloping ahead as the lists are read in order */
+static uint64_t ntfsrec_trigram_seek(const uint32_t *records, uint64_t position, uint64_t end, uint32_t record) {
+    uint64_t step = 1, high;
+    
+    if (position >= end || records[position] >= record)
+        return position;
+    
+    while(position + step < end && records[position + step] < record) {
+        position += step;
+        step *= 2;
+    }
+    
+    high = position + step < end ? position + step : end;
+    
+    /* records[position] is before record, and high is at it or past it */
+    while(high - position > 1) {
+        uint64_t middle = position + (high - position) / 2;
+        
+        if (records[middle] < record)
+            position = middle;
+        else
+            high = middle;
+    }
+    
+    return high;
+}
+
+static int ntfsrec_trigram_check(const struct ntfsrec_trigram_index *index, uint32_t record, const char *pattern, unsigned int glob) {
+    const char *name = &index->table->names[index->table->name_offset[record]];
+    
+    return glob ? fnmatch(pattern, name, FNM_CASEFOLD) == 0 : strcasestr(name, pattern) != NULL;
+}
@@ -0,0 +1,35 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_TRIGRAM_H
+#define _NTFSREC_TRIGRAM_H
+
+struct ntfsrec_mft_table;
+
+/*
+ * Lists, for every run of three letters, the records whose names contain it, so a search only
+ * checks the names that have every run of its pattern. Letters are folded to lower case. Runs with a
+ * byte outside ASCII aren't indexed, and a pattern with no other run checks every name.
+ */
+struct ntfsrec_trigram_index;
+
+/* Called with each record whose name matches, returning non-zero stops the search */
+typedef int (*ntfsrec_trigram_visitor)(void *context, uint64_t record);
+
+/* Indexes the name of every record in use, the table has to outlive the index */
+struct ntfsrec_trigram_index *ntfsrec_trigram_build(const struct ntfsrec_mft_table *table);
+void ntfsrec_trigram_free(struct ntfsrec_trigram_index *index);
+
+/* Returns how many names were indexed */
+uint64_t ntfsrec_trigram_names(const struct ntfsrec_trigram_index *index);
+
+/*
+ * Visits the records whose names match pattern without regard to case: as a glob over the whole
+ * name if it has any of * ? [, else as a substring anywhere in it. Returns how many names were checked.
+ */
+uint64_t ntfsrec_trigram_search(const struct ntfsrec_trigram_index *index, const char *pattern,
+                                void *context, ntfsrec_trigram_visitor visitor);
+
+#endif
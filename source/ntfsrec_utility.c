@@ -6,6 +6,34 @@
 #include "ntfsrec.h"
 #include "ntfsrec_utility.h"
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+char *ntfsrec_next_argument(char **arguments) {
+    char *start = *arguments, *end;
+    
+    while(*start == ' ')
+        ++start;
+    
+    if (*start == '\0') {
+        *arguments = start;
+        return NULL;
+    }
+    
+    for(end = start; *end != '\0' && *end != ' '; ++end);
+    
+    if (*end == ' ')
+        *end++ = '\0';
+    
+    *arguments = end;
+    return start;
+}
+
 static int ntfsrec_calculate_up_path(char *buffer, size_t max_length, const char *base, const char *path);
 static void ntfsrec_move_up_one(char *base, char **pend);
 
@@ -20,6 +48,17 @@ void *ntfsrec_allocate(size_t length) {
     return result;
 }
 
+void *ntfsrec_reallocate(void *pointer, size_t length) {
+    void *result = realloc(pointer, length);
+    
+    if (result == NULL) {
+        perror("Error (ntfsrec_reallocate): out of memory!");
+        abort();
+    }
+    
+    return result;
+}
+
 void ntfsrec_utility_format_size(char *buffer, size_t maxsize, int64_t size_value) {
     static const char *prefixes[] = { "B", "K", "M", "G", "T", "P", "E" };
     int prefix = 0;
@@ -49,6 +88,94 @@ int ntfsrec_calculate_path(char* output, size_t max_length, const char* base, co
     return (size_t)snprintf(output, max_length, "%s%s", base, path) < max_length ? NR_TRUE : NR_FALSE;
 }
 
+int ntfsrec_is_zero(const void *buffer, size_t length) {
+    const unsigned char *bytes = buffer;
+    
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    
+    for(; length >= 64; bytes += 64, length -= 64) {
+        __m128i combined = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)bytes),
+                                                     _mm_loadu_si128((const __m128i *)(bytes + 16))),
+                                        _mm_or_si128(_mm_loadu_si128((const __m128i *)(bytes + 32)),
+                                                     _mm_loadu_si128((const __m128i *)(bytes + 48))));
+        
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(combined, zero)) != 0xFFFF)
+            return NR_FALSE;
+    }
+#endif
+    
+    for(; length > 0; ++bytes, --length) {
+        if (*bytes != 0)
+            return NR_FALSE;
+    }
+    
+    return NR_TRUE;
+}
+
+int ntfsrec_utf16_to_utf8(char *output, size_t max_length, const ntfschar *name, int name_length) {
+    size_t length = 0;
+    int index = 0;
+    
+    while(index < name_length) {
+        uint32_t code;
+    
+#ifdef __SSE2__
+        /* Names are mostly ASCII, so eight units at a time narrow straight to bytes up to the first that isn't */
+        if (index + 8 <= name_length && length + 9 <= max_length) {
+            const __m128i units = _mm_loadu_si128((const __m128i *)&name[index]);
+            const unsigned int ascii = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16((short)0xFF80)),
+                                                                        _mm_setzero_si128()));
+            
+            _mm_storel_epi64((__m128i *)&output[length], _mm_packus_epi16(units, units));
+            
+            if (ascii == 0xFFFF) {
+                index += 8;
+                length += 8;
+                continue;
+            }
+            
+            index += __builtin_ctz(~ascii) / 2;
+            length += __builtin_ctz(~ascii) / 2;
+        }
+#endif
+        
+        code = le16_to_cpu(name[index++]);
+        
+        /* An unpaired surrogate is kept as its own three bytes, as WTF-8 does, rather than lost */
+        if (code >= 0xD800 && code < 0xDC00 && index < name_length) {
+            uint32_t low = le16_to_cpu(name[index]);
+            
+            if (low >= 0xDC00 && low < 0xE000) {
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                ++index;
+            }
+        }
+        
+        if (length + 5 > max_length)
+            return -1;
+        
+        if (code < 0x80) {
+            output[length++] = (char)code;
+        } else if (code < 0x800) {
+            output[length++] = (char)(0xC0 | (code >> 6));
+            output[length++] = (char)(0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+            output[length++] = (char)(0xE0 | (code >> 12));
+            output[length++] = (char)(0x80 | ((code >> 6) & 0x3F));
+            output[length++] = (char)(0x80 | (code & 0x3F));
+        } else {
+            output[length++] = (char)(0xF0 | (code >> 18));
+            output[length++] = (char)(0x80 | ((code >> 12) & 0x3F));
+            output[length++] = (char)(0x80 | ((code >> 6) & 0x3F));
+            output[length++] = (char)(0x80 | (code & 0x3F));
+        }
+    }
+    
+    output[length] = '\0';
+    return (int)length;
+}
+
 static int ntfsrec_calculate_up_path(char *buffer, size_t max_length, const char *base, const char *path) {
     char *end;
     size_t path_length, length = (size_t)snprintf(buffer, max_length, "%s", base);
@@ -94,4 +221,79 @@ static void ntfsrec_move_up_one(char *base, char **pend) {
     
     *pend = base;
     return;
-}
\ No newline at end of file
+}
+
+uint64_t ntfsrec_monotonic_ms(void) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int ntfsrec_open_path(int directory_fd, const char *path, int flags, mode_t mode) {
+    char part[PATH_MAX];
+    int fd, result = openat(directory_fd, path, flags, mode), saved;
+    
+    if (result != -1 || errno != ENAMETOOLONG)
+        return result;
+    
+    /* Each step opens as many whole directories as fit, and the last one holds the rest */
+    fd = directory_fd;
+    
+    while(strlen(path) >= PATH_MAX) {
+        size_t length = PATH_MAX - 1;
+        int next;
+        
+        while(length > 0 && path[length - 1] != '/')
+            --length;
+        
+        if (length == 0) {
+            errno = ENAMETOOLONG;
+            next = -1;
+        } else {
+            memcpy(part, path, length);
+            part[length] = '\0';
+            next = openat(fd, part, O_RDONLY | O_DIRECTORY);
+        }
+        
+        saved = errno;
+        
+        if (fd != directory_fd)
+            close(fd);
+        
+        if (next == -1) {
+            errno = saved;
+            return -1;
+        }
+        
+        fd = next;
+        path += length;
+    }
+    
+    result = openat(fd, path, flags, mode);
+    saved = errno;
+    
+    if (fd != directory_fd)
+        close(fd);
+    
+    errno = saved;
+    return result;
+}
+
+void ntfsrec_json_string(FILE *output, const char *string) {
+    const unsigned char *character = (const unsigned char *)string;
+    
+    fputc('"', output);
+    
+    for(; *character != '\0'; ++character) {
+        if (*character == '"' || *character == '\\')
+            fprintf(output, "\\%c", *character);
+        else if (*character < 0x20)
+            fprintf(output, "\\u%04x", *character);
+        else
+            fputc(*character, output);
+    }
+    
+    fputc('"', output);
+}
@@ -7,7 +7,29 @@
 #define _NTFSREC_UTILITY_H
 
 void *ntfsrec_allocate(size_t length);
+void *ntfsrec_reallocate(void *pointer, size_t length);
 void ntfsrec_utility_format_size(char *buffer, size_t maxsize, int64_t size_value);
 int ntfsrec_calculate_path(char *output, size_t max_length, const char *base, const char *path);
+char *ntfsrec_next_argument(char **arguments);
+int ntfsrec_is_zero(const void *buffer, size_t length);
+/* Room for the longest NTFS name, 255 UTF-16 units of up to three bytes each in UTF-8, and what the conversion keeps spare */
+#define NR_NAME_LENGTH (256 * 3)
+
+/*
+ * Converts an NTFS name to UTF-8 in output, returning its length, or -1 if it doesn't fit. Windows
+ * allows unpaired surrogates in names; those are written as the three bytes their value would
+ * have in UTF-8 (WTF-8), so every name converts and no two names convert to the same one.
+ */
+int ntfsrec_utf16_to_utf8(char *output, size_t max_length, const ntfschar *name, int name_length);
+uint64_t ntfsrec_monotonic_ms(void);
+
+/*
+ * Opens path as openat would, but one longer than the kernel takes in a single call is walked down a
+ * directory at a time. Returns -1 with errno set if it fails.
+ */
+int ntfsrec_open_path(int directory_fd, const char *path, int flags, mode_t mode);
+
+/* Writes string as a quoted JSON string, UTF-8 passes through untouched */
+void ntfsrec_json_string(FILE *output, const char *string);
 
 #endif
\ No newline at end of file
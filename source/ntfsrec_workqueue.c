@@ -0,0 +1,194 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_workqueue.h"
+#include <pthread.h>
+
+#define NR_DEQUE_INITIAL_CAPACITY 64
+
+struct ntfsrec_deque {
+    pthread_mutex_t lock;
+    
+    void **items;
+    size_t capacity;
+    size_t top;
+    size_t bottom;
+};
+
+struct ntfsrec_workqueue {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    
+    /* Items sitting in deques that haven't been reserved by a worker */
+    size_t available;
+    /* Items pushed but not yet completed, including ones being processed */
+    size_t pending;
+    
+    unsigned int workers;
+    struct ntfsrec_deque *deques;
+};
+
+static void ntfsrec_deque_push_bottom(struct ntfsrec_deque *deque, void *item);
+static void *ntfsrec_deque_pop_bottom(struct ntfsrec_deque *deque);
+static void *ntfsrec_deque_pop_top(struct ntfsrec_deque *deque);
+
+struct ntfsrec_workqueue *ntfsrec_workqueue_create(unsigned int workers) {
+    struct ntfsrec_workqueue *queue;
+    unsigned int index;
+    
+    queue = ntfsrec_allocate(sizeof *queue);
+    memset(queue, 0, sizeof *queue);
+    
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->wake, NULL);
+    
+    queue->workers = workers;
+    queue->deques = ntfsrec_allocate(workers * sizeof *queue->deques);
+    
+    for(index = 0; index < workers; ++index) {
+        struct ntfsrec_deque *deque = &queue->deques[index];
+        
+        pthread_mutex_init(&deque->lock, NULL);
+        
+        deque->capacity = NR_DEQUE_INITIAL_CAPACITY;
+        deque->items = ntfsrec_allocate(deque->capacity * sizeof *deque->items);
+        deque->top = 0;
+        deque->bottom = 0;
+    }
+    
+    return queue;
+}
+
+void ntfsrec_workqueue_destroy(struct ntfsrec_workqueue *queue) {
+    unsigned int index;
+    
+    for(index = 0; index < queue->workers; ++index) {
+        pthread_mutex_destroy(&queue->deques[index].lock);
+        free(queue->deques[index].items);
+    }
+    
+    pthread_cond_destroy(&queue->wake);
+    pthread_mutex_destroy(&queue->lock);
+    
+    free(queue->deques);
+    free(queue);
+}
+
+void ntfsrec_workqueue_push(struct ntfsrec_workqueue *queue, unsigned int worker, void *item) {
+    ntfsrec_deque_push_bottom(&queue->deques[worker], item);
+    
+    pthread_mutex_lock(&queue->lock);
+    queue->available++;
+    queue->pending++;
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void *ntfsrec_workqueue_pop(struct ntfsrec_workqueue *queue, unsigned int worker) {
+    unsigned int victim;
+    void *item;
+    
+    pthread_mutex_lock(&queue->lock);
+    
+    while(queue->available == 0 && queue->pending > 0)
+        pthread_cond_wait(&queue->wake, &queue->lock);
+    
+    if (queue->available == 0) {
+        pthread_cond_broadcast(&queue->wake);
+        pthread_mutex_unlock(&queue->lock);
+        
+        return NULL;
+    }
+    
+    /* Having reserved an item it's guaranteed to be in one of the deques */
+    queue->available--;
+    pthread_mutex_unlock(&queue->lock);
+    
+    for(;;) {
+        item = ntfsrec_deque_pop_bottom(&queue->deques[worker]);
+        
+        if (item != NULL)
+            return item;
+        
+        for(victim = (worker + 1) % queue->workers; victim != worker; victim = (victim + 1) % queue->workers) {
+            item = ntfsrec_deque_pop_top(&queue->deques[victim]);
+            
+            if (item != NULL)
+                return item;
+        }
+    }
+}
+
+void ntfsrec_workqueue_complete(struct ntfsrec_workqueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    
+    if (--queue->pending == 0)
+        pthread_cond_broadcast(&queue->wake);
+    
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void ntfsrec_deque_push_bottom(struct ntfsrec_deque *deque, void *item) {
+    pthread_mutex_lock(&deque->lock);
+    
+    if (deque->bottom == deque->capacity) {
+        size_t used = deque->bottom - deque->top;
+        
+        if (deque->top > 0 && used < deque->capacity / 2) {
+            memmove(deque->items, &deque->items[deque->top], used * sizeof *deque->items);
+        } else {
+            void **items = ntfsrec_allocate(deque->capacity * 2 * sizeof *items);
+            
+            memcpy(items, &deque->items[deque->top], used * sizeof *items);
+            free(deque->items);
+            
+            deque->items = items;
+            deque->capacity *= 2;
+        }
+        
+        deque->top = 0;
+        deque->bottom = used;
+    }
+    
+    deque->items[deque->bottom++] = item;
+    
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static void *ntfsrec_deque_pop_bottom(struct ntfsrec_deque *deque) {
+    void *item = NULL;
+    
+    pthread_mutex_lock(&deque->lock);
+    
+    if (deque->bottom > deque->top) {
+        item = deque->items[--deque->bottom];
+        
+        if (deque->bottom == deque->top)
+            deque->top = deque->bottom = 0;
+    }
+    
+    pthread_mutex_unlock(&deque->lock);
+    
+    return item;
+}
+
+static void *ntfsrec_deque_pop_top(struct ntfsrec_deque *deque) {
+    void *item = NULL;
+    
+    pthread_mutex_lock(&deque->lock);
+    
+    if (deque->bottom > deque->top) {
+        item = deque->items[deque->top++];
+        
+        if (deque->bottom == deque->top)
+            deque->top = deque->bottom = 0;
+    }
+    
+    pthread_mutex_unlock(&deque->lock);
+    
+    return item;
+}
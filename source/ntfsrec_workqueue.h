@@ -0,0 +1,26 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_WORKQUEUE_H
+#define _NTFSREC_WORKQUEUE_H
+
+struct ntfsrec_workqueue;
+
+struct ntfsrec_workqueue *ntfsrec_workqueue_create(unsigned int workers);
+void ntfsrec_workqueue_destroy(struct ntfsrec_workqueue *queue);
+
+/* Pushes an item onto the deque owned by worker */
+void ntfsrec_workqueue_push(struct ntfsrec_workqueue *queue, unsigned int worker, void *item);
+
+/*
+ * Takes the newest item from worker's own deque, or steals the oldest item from another worker.
+ * Blocks while other workers may still produce items and returns NULL once everything is complete.
+ */
+void *ntfsrec_workqueue_pop(struct ntfsrec_workqueue *queue, unsigned int worker);
+
+/* Marks an item returned by ntfsrec_workqueue_pop as finished */
+void ntfsrec_workqueue_complete(struct ntfsrec_workqueue *queue);
+
+#endif
@@ -0,0 +1,466 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_badmap.h"
+#include "ntfsrec_writer.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#ifdef NTFSREC_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define NR_WRITER_ALIGNMENT 4096
+
+/* Each file holds a descriptor until it's closed, so only so many can be queued at once */
+#define NR_WRITER_MAX_FILES 128
+
+struct ntfsrec_writer_file {
+    /* -1 until the writer thread creates the file, for ones from ntfsrec_writer_create_file */
+    int fd;
+    unsigned int failed;
+    
+    /* Where a file from ntfsrec_writer_create_file is created, the directory is closed once it is */
+    int directory_fd;
+    size_t name;
+    
+    /* Writes submitted to the ring that haven't completed yet */
+    unsigned int pending;
+    
+    struct ntfsrec_badmap *map;
+    MFT_REF mref;
+    s64 size;
+    
+    /* Set on the file once it's complete, unless tv_nsec is UTIME_OMIT */
+    struct timespec modified;
+    char path[];
+};
+
+struct ntfsrec_writer_op {
+    struct ntfsrec_writer_op *next;
+    struct ntfsrec_writer_file *file;
+    
+    /* NULL for the operation that closes the file */
+    char *buffer;
+    size_t length;
+    s64 offset;
+};
+
+struct ntfsrec_writer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t space;
+    pthread_cond_t closed;
+    
+    struct ntfsrec_writer_op *head;
+    struct ntfsrec_writer_op *tail;
+    unsigned int stop;
+    unsigned int errors;
+    
+    char *memory;
+    size_t buffer_size;
+    char **free_buffers;
+    unsigned int free_count;
+    
+    /* Files opened or created that haven't been closed yet */
+    unsigned int open_files;
+    
+    /* Only touched by the writer thread */
+    unsigned int inflight;
+    
+#ifdef NTFSREC_HAVE_LIBURING
+    unsigned int use_ring;
+    struct io_uring ring;
+#endif
+};
+
+static void *ntfsrec_writer_main(void *argument);
+static void ntfsrec_writer_queue(struct ntfsrec_writer *writer, struct ntfsrec_writer_op *op);
+static void ntfsrec_writer_issue(struct ntfsrec_writer *writer, struct ntfsrec_writer_op *op);
+static void ntfsrec_writer_reap(struct ntfsrec_writer *writer);
+static void ntfsrec_writer_complete(struct ntfsrec_writer *writer, struct ntfsrec_writer_op *op, int success);
+static void ntfsrec_writer_finish(struct ntfsrec_writer *writer, struct ntfsrec_writer_file *file);
+
+struct ntfsrec_writer *ntfsrec_writer_create(size_t buffer_size, unsigned int depth) {
+    struct ntfsrec_writer *writer = ntfsrec_allocate(sizeof *writer);
+    unsigned int index;
+    void *memory;
+    
+    memset(writer, 0, sizeof *writer);
+    
+    writer->buffer_size = (buffer_size + NR_WRITER_ALIGNMENT - 1) & ~(size_t)(NR_WRITER_ALIGNMENT - 1);
+    
+    if (posix_memalign(&memory, NR_WRITER_ALIGNMENT, writer->buffer_size * depth) != 0) {
+        printf("Error: unable to allocate %u output buffers\n", depth);
+        free(writer);
+        return NULL;
+    }
+    
+    writer->memory = memory;
+    writer->free_buffers = ntfsrec_allocate(depth * sizeof *writer->free_buffers);
+    
+    for(index = 0; index < depth; ++index)
+        writer->free_buffers[writer->free_count++] = &writer->memory[index * writer->buffer_size];
+    
+#ifdef NTFSREC_HAVE_LIBURING
+    /* Kernels without io_uring, or with it disabled, get the plain thread instead */
+    writer->use_ring = io_uring_queue_init(depth, &writer->ring, 0) == 0;
+#endif
+    
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->work, NULL);
+    pthread_cond_init(&writer->space, NULL);
+    pthread_cond_init(&writer->closed, NULL);
+    
+    if (pthread_create(&writer->thread, NULL, &ntfsrec_writer_main, writer) != 0) {
+        puts("Error: unable to start the output writer");
+        writer->stop = NR_TRUE;
+        ntfsrec_writer_destroy(writer);
+        return NULL;
+    }
+    
+    return writer;
+}
+
+void ntfsrec_writer_destroy(struct ntfsrec_writer *writer) {
+    pthread_mutex_lock(&writer->lock);
+    
+    if (!writer->stop) {
+        writer->stop = NR_TRUE;
+        pthread_cond_signal(&writer->work);
+        pthread_mutex_unlock(&writer->lock);
+        
+        pthread_join(writer->thread, NULL);
+    } else {
+        pthread_mutex_unlock(&writer->lock);
+    }
+    
+#ifdef NTFSREC_HAVE_LIBURING
+    if (writer->use_ring)
+        io_uring_queue_exit(&writer->ring);
+#endif
+    
+    pthread_cond_destroy(&writer->closed);
+    pthread_cond_destroy(&writer->space);
+    pthread_cond_destroy(&writer->work);
+    pthread_mutex_destroy(&writer->lock);
+    
+    free(writer->free_buffers);
+    free(writer->memory);
+    free(writer);
+}
+
+size_t ntfsrec_writer_buffer_size(const struct ntfsrec_writer *writer) {
+    return writer->buffer_size;
+}
+
+char *ntfsrec_writer_get_buffer(struct ntfsrec_writer *writer) {
+    char *buffer;
+    
+    pthread_mutex_lock(&writer->lock);
+    
+    while(writer->free_count == 0)
+        pthread_cond_wait(&writer->space, &writer->lock);
+    
+    buffer = writer->free_buffers[--writer->free_count];
+    
+    pthread_mutex_unlock(&writer->lock);
+    return buffer;
+}
+
+void ntfsrec_writer_put_buffer(struct ntfsrec_writer *writer, char *buffer) {
+    pthread_mutex_lock(&writer->lock);
+    
+    writer->free_buffers[writer->free_count++] = buffer;
+    pthread_cond_signal(&writer->space);
+    
+    pthread_mutex_unlock(&writer->lock);
+}
+
+struct ntfsrec_writer_file *ntfsrec_writer_open(struct ntfsrec_writer *writer, int fd, const char *path,
+                                                struct ntfsrec_badmap *map, MFT_REF mref) {
+    size_t path_length = strlen(path);
+    struct ntfsrec_writer_file *file = ntfsrec_allocate(sizeof *file + path_length + 1);
+    
+    pthread_mutex_lock(&writer->lock);
+    
+    while(writer->open_files >= NR_WRITER_MAX_FILES)
+        pthread_cond_wait(&writer->closed, &writer->lock);
+    
+    writer->open_files++;
+    
+    pthread_mutex_unlock(&writer->lock);
+    
+    file->fd = fd;
+    file->failed = NR_FALSE;
+    file->directory_fd = -1;
+    file->name = 0;
+    file->pending = 0;
+    file->map = map;
+    file->mref = mref;
+    file->size = 0;
+    memcpy(file->path, path, path_length + 1);
+    
+    return file;
+}
+
+struct ntfsrec_writer_file *ntfsrec_writer_create_file(struct ntfsrec_writer *writer, int directory_fd, const char *path,
+                                                       size_t name, struct ntfsrec_badmap *map, MFT_REF mref) {
+    struct ntfsrec_writer_file *file = ntfsrec_writer_open(writer, -1, path, map, mref);
+    
+    /* The caller closes its directory as soon as it's done with it, and one that can't be kept means creating the file now */
+    file->directory_fd = directory_fd == AT_FDCWD ? AT_FDCWD : fcntl(directory_fd, F_DUPFD_CLOEXEC, 0);
+    file->name = name;
+    
+    if (file->directory_fd == -1) {
+        file->fd = ntfsrec_open_path(directory_fd, &path[name], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        file->failed = file->fd == -1;
+    }
+    
+    return file;
+}
+
+void ntfsrec_writer_write(struct ntfsrec_writer *writer, struct ntfsrec_writer_file *file, char *buffer,
+                          size_t length, s64 offset) {
+    struct ntfsrec_writer_op *op = ntfsrec_allocate(sizeof *op);
+    
+    op->file = file;
+    op->buffer = buffer;
+    op->length = length;
+    op->offset = offset;
+    
+    ntfsrec_writer_queue(writer, op);
+}
+
+void ntfsrec_writer_close(struct ntfsrec_writer *writer, struct ntfsrec_writer_file *file, s64 size, const struct timespec *modified) {
+    struct ntfsrec_writer_op *op = ntfsrec_allocate(sizeof *op);
+    
+    file->size = size;
+    file->modified.tv_sec = 0;
+    file->modified.tv_nsec = UTIME_OMIT;
+    
+    if (modified != NULL)
+        file->modified = *modified;
+    
+    op->file = file;
+    op->buffer = NULL;
+    op->length = 0;
+    op->offset = 0;
+    
+    ntfsrec_writer_queue(writer, op);
+}
+
+unsigned int ntfsrec_writer_errors(struct ntfsrec_writer *writer) {
+    unsigned int errors;
+    
+    pthread_mutex_lock(&writer->lock);
+    errors = writer->errors;
+    pthread_mutex_unlock(&writer->lock);
+    
+    return errors;
+}
+
+static void ntfsrec_writer_queue(struct ntfsrec_writer *writer, struct ntfsrec_writer_op *op) {
+    op->next = NULL;
+    
+    pthread_mutex_lock(&writer->lock);
+    
+    if (writer->tail != NULL)
+        writer->tail->next = op;
+    else
+        writer->head = op;
+    
+    writer->tail = op;
+    pthread_cond_signal(&writer->work);
+    
+    pthread_mutex_unlock(&writer->lock);
+}
+
+static void *ntfsrec_writer_main(void *argument) {
+    struct ntfsrec_writer *writer = argument;
+    
+    for(;;) {
+        struct ntfsrec_writer_op *op;
+        
+        pthread_mutex_lock(&writer->lock);
+        
+        while(writer->head == NULL && writer->inflight == 0 && !writer->stop)
+            pthread_cond_wait(&writer->work, &writer->lock);
+        
+        op = writer->head;
+        
+        if (op != NULL) {
+            writer->head = op->next;
+            
+            if (writer->head == NULL)
+                writer->tail = NULL;
+        }
+        
+        pthread_mutex_unlock(&writer->lock);
+        
+        /* With nothing new queued, wait for a write in flight, or stop once there are none */
+        if (op == NULL) {
+            if (writer->inflight == 0)
+                break;
+            
+            ntfsrec_writer_reap(writer);
+            continue;
+        }
+        
+        /* A file that failed to be created fails each of its writes, and is reported when it's closed */
+        if (op->file->fd == -1 && !op->file->failed) {
+            op->file->fd = ntfsrec_open_path(op->file->directory_fd, &op->file->path[op->file->name], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            
+            if (op->file->fd == -1)
+                op->file->failed = NR_TRUE;
+            
+            if (op->file->directory_fd >= 0)
+                close(op->file->directory_fd);
+            
+            op->file->directory_fd = -1;
+        }
+        
+        if (op->buffer == NULL) {
+            while(op->file->pending > 0)
+                ntfsrec_writer_reap(writer);
+            
+            ntfsrec_writer_finish(writer, op->file);
+            free(op);
+            continue;
+        }
+        
+        ntfsrec_writer_issue(writer, op);
+    }
+    
+    return NULL;
+}
+
+static void ntfsrec_writer_issue(struct ntfsrec_writer *writer, struct ntfsrec_writer_op *op) {
+    size_t written = 0;
+    
+#ifdef NTFSREC_HAVE_LIBURING
+    if (writer->use_ring) {
+        struct io_uring_sqe *sqe;
+        
+        /* The ring holds as many entries as there are buffers, so this only waits if it's being drained */
+        while((sqe = io_uring_get_sqe(&writer->ring)) == NULL)
+            ntfsrec_writer_reap(writer);
+        
+        io_uring_prep_write(sqe, op->file->fd, op->buffer, op->length, op->offset);
+        io_uring_sqe_set_data(sqe, op);
+        
+        /* The entry stays queued until a submit takes it, so it's only ever sent once */
+        for(;;) {
+            int result = io_uring_submit(&writer->ring);
+            
+            if (result > 0) {
+                op->file->pending++;
+                writer->inflight++;
+                return;
+            }
+            
+            /* A full completion queue clears as writes are reaped */
+            if ((result == 0 || result == -EBUSY || result == -EAGAIN) && writer->inflight > 0) {
+                ntfsrec_writer_reap(writer);
+                continue;
+            }
+            
+            if (result == -EINTR)
+                continue;
+            
+            break;
+        }
+        
+        /* Otherwise the ring is given up, once what it has taken is done, and the entry goes with it */
+        while(writer->inflight > 0)
+            ntfsrec_writer_reap(writer);
+        
+        io_uring_queue_exit(&writer->ring);
+        writer->use_ring = NR_FALSE;
+    }
+#endif
+    
+    while(written < op->length) {
+        ssize_t result = pwrite(op->file->fd, &op->buffer[written], op->length - written, op->offset + written);
+        
+        if (result <= 0)
+            break;
+        
+        written += result;
+    }
+    
+    ntfsrec_writer_complete(writer, op, written == op->length);
+}
+
+static void ntfsrec_writer_reap(struct ntfsrec_writer *writer) {
+#ifdef NTFSREC_HAVE_LIBURING
+    struct io_uring_cqe *cqe;
+    struct ntfsrec_writer_op *op;
+    int result;
+    
+    if (io_uring_wait_cqe(&writer->ring, &cqe) != 0)
+        return;
+    
+    op = io_uring_cqe_get_data(cqe);
+    result = cqe->res;
+    io_uring_cqe_seen(&writer->ring, cqe);
+    
+    op->file->pending--;
+    writer->inflight--;
+    
+    /* Regular files only come up short when the disk is full, which is reported as a failure */
+    ntfsrec_writer_complete(writer, op, result >= 0 && (size_t)result == op->length);
+#else
+    NR_UNUSED(writer);
+#endif
+}
+
+static void ntfsrec_writer_complete(struct ntfsrec_writer *writer, struct ntfsrec_writer_op *op, int success) {
+    if (!success)
+        op->file->failed = NR_TRUE;
+    
+    ntfsrec_writer_put_buffer(writer, op->buffer);
+    free(op);
+}
+
+static void ntfsrec_writer_finish(struct ntfsrec_writer *writer, struct ntfsrec_writer_file *file) {
+    /* Skipped holes, zero blocks and unreadable ranges stay unallocated in the output */
+    if (ftruncate(file->fd, file->size) != 0)
+        file->failed = NR_TRUE;
+    
+    /* The time marks the file as finished, so one that failed to write is left without it */
+    if (!file->failed) {
+        struct timespec times[2] = { { 0, UTIME_OMIT }, file->modified };
+        
+        futimens(file->fd, times);
+    }
+    
+    if (file->fd == -1 || close(file->fd) != 0)
+        file->failed = NR_TRUE;
+    
+    if (file->failed)
+        printf("Error: unable to write to output file %s\n", file->path);
+    
+    pthread_mutex_lock(&writer->lock);
+    
+    if (file->failed)
+        writer->errors++;
+    
+    writer->open_files--;
+    pthread_cond_signal(&writer->closed);
+    
+    pthread_mutex_unlock(&writer->lock);
+    
+    if (file->map != NULL)
+        ntfsrec_badmap_mark_done(file->map, file->mref);
+    
+    free(file);
+}
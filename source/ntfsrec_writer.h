@@ -0,0 +1,53 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_WRITER_H
+#define _NTFSREC_WRITER_H
+
+struct ntfsrec_badmap;
+struct ntfsrec_writer;
+struct ntfsrec_writer_file;
+
+/*
+ * A writer owns a pool of depth page aligned buffers and drains the ones handed to it on a thread
+ * of its own, through io_uring when it's available, so output writes overlap with the next read.
+ */
+struct ntfsrec_writer *ntfsrec_writer_create(size_t buffer_size, unsigned int depth);
+
+/* Waits for every queued write and file to finish, then releases the writer */
+void ntfsrec_writer_destroy(struct ntfsrec_writer *writer);
+
+/* Returns the size of each buffer, rounded up to a whole number of pages */
+size_t ntfsrec_writer_buffer_size(const struct ntfsrec_writer *writer);
+
+/* Blocks until a buffer is free */
+char *ntfsrec_writer_get_buffer(struct ntfsrec_writer *writer);
+void ntfsrec_writer_put_buffer(struct ntfsrec_writer *writer, char *buffer);
+
+/*
+ * Takes over the output descriptor; the file is marked done in map, if given, once it's closed.
+ * Blocks while too many files are waiting to be closed, as each holds a descriptor until then.
+ */
+struct ntfsrec_writer_file *ntfsrec_writer_open(struct ntfsrec_writer *writer, int fd, const char *path,
+                                                struct ntfsrec_badmap *map, MFT_REF mref);
+
+/*
+ * Like ntfsrec_writer_open, but the file is created on the writer's thread so a run of small files doesn't
+ * wait on it. It's created at &path[name] under directory_fd, which the writer keeps a duplicate of.
+ */
+struct ntfsrec_writer_file *ntfsrec_writer_create_file(struct ntfsrec_writer *writer, int directory_fd, const char *path,
+                                                       size_t name, struct ntfsrec_badmap *map, MFT_REF mref);
+
+/* Queues length bytes of buffer for offset, the buffer returns to the pool once written */
+void ntfsrec_writer_write(struct ntfsrec_writer *writer, struct ntfsrec_writer_file *file, char *buffer,
+                          size_t length, s64 offset);
+
+/* Queues truncating the file to size, setting its modification time if given and closing it, after all of its writes */
+void ntfsrec_writer_close(struct ntfsrec_writer *writer, struct ntfsrec_writer_file *file, s64 size, const struct timespec *modified);
+
+/* Returns the number of files that had a write fail */
+unsigned int ntfsrec_writer_errors(struct ntfsrec_writer *writer);
+
+#endif
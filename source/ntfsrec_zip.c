@@ -0,0 +1,624 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#include "ntfsrec.h"
+#include "ntfsrec_utility.h"
+#include "ntfsrec_zip.h"
+#include <pthread.h>
+#include <strings.h>
+#include <zlib.h>
+
+/*
+ * Entries are written with a data descriptor, since sizes and checksums are only known at the end,
+ * and always in ZIP64 form so nothing has to be known about their size up front.
+ *
+ * Each chunk of a file is deflated on its own, ending in a sync flush so the pieces concatenate
+ * into a single deflate stream. The last 32 KB of the previous chunk are set as the dictionary,
+ * which keeps the ratio within a fraction of a percent of one continuous stream.
+ */
+
+#define NR_ZIP_CHUNK_SIZE (256 * 1024)
+#define NR_ZIP_DICTIONARY_SIZE 32768
+#define NR_ZIP_VERSION 45
+#define NR_ZIP_FLAGS 0x0808
+#define NR_ZIP_STORED 0
+#define NR_ZIP_DEFLATED 8
+#define NR_ZIP_MAX_16 0xFFFF
+#define NR_ZIP_MAX_32 0xFFFFFFFFULL
+
+struct ntfsrec_zip_entry {
+    size_t name;
+    uint32_t crc;
+    uint64_t size;
+    uint64_t compressed_size;
+    uint64_t offset;
+    uint16_t method;
+    uint16_t dos_time;
+    uint16_t dos_date;
+    unsigned int is_dir;
+};
+
+struct ntfsrec_zip_chunk {
+    unsigned char *input;
+    size_t input_length;
+    
+    unsigned char *output;
+    size_t output_length;
+    
+    unsigned char dictionary[NR_ZIP_DICTIONARY_SIZE];
+    size_t dictionary_length;
+    
+    unsigned int last;
+    unsigned int done;
+    unsigned int failed;
+};
+
+struct ntfsrec_zip {
+    FILE *file;
+    uint64_t offset;
+    unsigned int failed;
+    int level;
+    
+    struct ntfsrec_zip_entry *entries;
+    size_t entry_count;
+    size_t entry_capacity;
+    
+    char *names;
+    size_t names_length;
+    size_t names_capacity;
+    
+    /* The entry being written and the tail of its data, kept as the next chunk's dictionary */
+    struct ntfsrec_zip_entry *current;
+    unsigned int header_written;
+    unsigned char tail[NR_ZIP_DICTIONARY_SIZE];
+    size_t tail_length;
+    
+    /* Chunks are used in ring order, head is the oldest one still being compressed */
+    struct ntfsrec_zip_chunk *chunks;
+    unsigned int chunk_count;
+    unsigned int head;
+    unsigned int in_flight;
+    size_t output_capacity;
+    
+    pthread_t *threads;
+    unsigned int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t finished;
+    unsigned int next_job;
+    unsigned int job_count;
+    unsigned int stop;
+};
+
+static void *ntfsrec_zip_worker_main(void *argument);
+static struct ntfsrec_zip_chunk *ntfsrec_zip_filling(struct ntfsrec_zip *zip);
+static void ntfsrec_zip_submit(struct ntfsrec_zip *zip, unsigned int last);
+static void ntfsrec_zip_drain(struct ntfsrec_zip *zip);
+static void ntfsrec_zip_write_local_header(struct ntfsrec_zip *zip);
+static void ntfsrec_zip_write_central_directory(struct ntfsrec_zip *zip);
+static struct ntfsrec_zip_entry *ntfsrec_zip_add_entry(struct ntfsrec_zip *zip, const char *name, time_t modified);
+static int ntfsrec_zip_is_compressed(const char *name, const unsigned char *data, size_t length);
+static void ntfsrec_zip_output(struct ntfsrec_zip *zip, const void *data, size_t length);
+static unsigned char *ntfsrec_zip_put16(unsigned char *out, uint16_t value);
+static unsigned char *ntfsrec_zip_put32(unsigned char *out, uint32_t value);
+static unsigned char *ntfsrec_zip_put64(unsigned char *out, uint64_t value);
+
+struct ntfsrec_zip *ntfsrec_zip_create(const char *file_name, unsigned int threads, int level) {
+    struct ntfsrec_zip *zip = ntfsrec_allocate(sizeof *zip);
+    unsigned int index;
+    
+    memset(zip, 0, sizeof *zip);
+    
+    zip->file = fopen(file_name, "wb");
+    
+    if (zip->file == NULL) {
+        printf("Error: unable to create archive %s\n", file_name);
+        free(zip);
+        return NULL;
+    }
+    
+    setvbuf(zip->file, NULL, _IOFBF, 1024 * 1024);
+    
+    if (threads == 0)
+        threads = 1;
+    
+    zip->level = level;
+    zip->thread_count = threads;
+    
+    /* Two chunks per thread keeps every thread busy while the oldest chunk is being written out */
+    zip->chunk_count = threads * 2;
+    zip->chunks = ntfsrec_allocate(zip->chunk_count * sizeof *zip->chunks);
+    zip->output_capacity = compressBound(NR_ZIP_CHUNK_SIZE) + 64;
+    
+    for(index = 0; index < zip->chunk_count; ++index) {
+        zip->chunks[index].input = ntfsrec_allocate(NR_ZIP_CHUNK_SIZE);
+        zip->chunks[index].output = ntfsrec_allocate(zip->output_capacity);
+        zip->chunks[index].input_length = 0;
+    }
+    
+    pthread_mutex_init(&zip->lock, NULL);
+    pthread_cond_init(&zip->work, NULL);
+    pthread_cond_init(&zip->finished, NULL);
+    
+    zip->threads = ntfsrec_allocate(threads * sizeof *zip->threads);
+    
+    for(index = 0; index < threads; ++index) {
+        if (pthread_create(&zip->threads[index], NULL, &ntfsrec_zip_worker_main, zip) != 0)
+            break;
+    }
+    
+    zip->thread_count = index;
+    
+    if (zip->thread_count == 0) {
+        puts("Error: unable to start any compression threads");
+        zip->failed = NR_TRUE;
+        ntfsrec_zip_close(zip);
+        return NULL;
+    }
+    
+    return zip;
+}
+
+int ntfsrec_zip_close(struct ntfsrec_zip *zip) {
+    unsigned int index;
+    int result;
+    
+    if (zip->current != NULL)
+        ntfsrec_zip_end_file(zip);
+    
+    if (!zip->failed)
+        ntfsrec_zip_write_central_directory(zip);
+    
+    pthread_mutex_lock(&zip->lock);
+    zip->stop = NR_TRUE;
+    pthread_cond_broadcast(&zip->work);
+    pthread_mutex_unlock(&zip->lock);
+    
+    for(index = 0; index < zip->thread_count; ++index)
+        pthread_join(zip->threads[index], NULL);
+    
+    if (fclose(zip->file) != 0)
+        zip->failed = NR_TRUE;
+    
+    for(index = 0; index < zip->chunk_count; ++index) {
+        free(zip->chunks[index].input);
+        free(zip->chunks[index].output);
+    }
+    
+    pthread_cond_destroy(&zip->finished);
+    pthread_cond_destroy(&zip->work);
+    pthread_mutex_destroy(&zip->lock);
+    
+    result = !zip->failed;
+    
+    free(zip->threads);
+    free(zip->chunks);
+    free(zip->entries);
+    free(zip->names);
+    free(zip);
+    
+    return result;
+}
+
+int ntfsrec_zip_add_directory(struct ntfsrec_zip *zip, const char *name, time_t modified) {
+    struct ntfsrec_zip_entry *entry = ntfsrec_zip_add_entry(zip, name, modified);
+    
+    entry->is_dir = NR_TRUE;
+    entry->method = NR_ZIP_STORED;
+    
+    zip->current = entry;
+    ntfsrec_zip_write_local_header(zip);
+    
+    return ntfsrec_zip_end_file(zip);
+}
+
+int ntfsrec_zip_begin_file(struct ntfsrec_zip *zip, const char *name, time_t modified) {
+    zip->current = ntfsrec_zip_add_entry(zip, name, modified);
+    zip->header_written = NR_FALSE;
+    zip->tail_length = 0;
+    
+    return !zip->failed;
+}
+
+int ntfsrec_zip_write(struct ntfsrec_zip *zip, const void *data, size_t length) {
+    const unsigned char *input = data;
+    
+    zip->current->crc = crc32(zip->current->crc, input, length);
+    zip->current->size += length;
+    
+    while(length > 0) {
+        struct ntfsrec_zip_chunk *chunk = ntfsrec_zip_filling(zip);
+        size_t space = NR_ZIP_CHUNK_SIZE - chunk->input_length;
+        
+        if (space > length)
+            space = length;
+        
+        memcpy(&chunk->input[chunk->input_length], input, space);
+        chunk->input_length += space;
+        input += space;
+        length -= space;
+        
+        if (chunk->input_length == NR_ZIP_CHUNK_SIZE)
+            ntfsrec_zip_submit(zip, NR_FALSE);
+    }
+    
+    return !zip->failed;
+}
+
+int ntfsrec_zip_end_file(struct ntfsrec_zip *zip) {
+    struct ntfsrec_zip_entry *entry = zip->current;
+    unsigned char descriptor[24], *out = descriptor;
+    
+    if (!entry->is_dir)
+        ntfsrec_zip_submit(zip, NR_TRUE);
+    
+    while(zip->in_flight > 0)
+        ntfsrec_zip_drain(zip);
+    
+    out = ntfsrec_zip_put32(out, 0x08074b50);
+    out = ntfsrec_zip_put32(out, entry->crc);
+    out = ntfsrec_zip_put64(out, entry->compressed_size);
+    out = ntfsrec_zip_put64(out, entry->size);
+    
+    ntfsrec_zip_output(zip, descriptor, out - descriptor);
+    
+    zip->current = NULL;
+    return !zip->failed;
+}
+
+static void *ntfsrec_zip_worker_main(void *argument) {
+    struct ntfsrec_zip *zip = argument;
+    z_stream stream;
+    
+    memset(&stream, 0, sizeof stream);
+    
+    /* Raw deflate, the ZIP entry carries its own checksum */
+    if (deflateInit2(&stream, zip->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    
+    for(;;) {
+        struct ntfsrec_zip_chunk *chunk;
+        int result;
+        
+        pthread_mutex_lock(&zip->lock);
+        
+        while(zip->job_count == 0 && !zip->stop)
+            pthread_cond_wait(&zip->work, &zip->lock);
+        
+        if (zip->job_count == 0) {
+            pthread_mutex_unlock(&zip->lock);
+            break;
+        }
+        
+        chunk = &zip->chunks[zip->next_job];
+        zip->next_job = (zip->next_job + 1) % zip->chunk_count;
+        zip->job_count--;
+        
+        pthread_mutex_unlock(&zip->lock);
+        
+        deflateReset(&stream);
+        
+        if (chunk->dictionary_length > 0)
+            deflateSetDictionary(&stream, chunk->dictionary, chunk->dictionary_length);
+        
+        stream.next_in = chunk->input;
+        stream.avail_in = chunk->input_length;
+        stream.next_out = chunk->output;
+        stream.avail_out = zip->output_capacity;
+        
+        result = deflate(&stream, chunk->last ? Z_FINISH : Z_SYNC_FLUSH);
+        
+        pthread_mutex_lock(&zip->lock);
+        
+        chunk->output_length = zip->output_capacity - stream.avail_out;
+        chunk->failed = stream.avail_in != 0 || (chunk->last ? result != Z_STREAM_END : result != Z_OK);
+        chunk->done = NR_TRUE;
+        pthread_cond_broadcast(&zip->finished);
+        
+        pthread_mutex_unlock(&zip->lock);
+    }
+    
+    deflateEnd(&stream);
+    return NULL;
+}
+
+static struct ntfsrec_zip_chunk *ntfsrec_zip_filling(struct ntfsrec_zip *zip) {
+    if (zip->in_flight == zip->chunk_count)
+        ntfsrec_zip_drain(zip);
+    
+    return &zip->chunks[(zip->head + zip->in_flight) % zip->chunk_count];
+}
+
+static void ntfsrec_zip_submit(struct ntfsrec_zip *zip, unsigned int last) {
+    struct ntfsrec_zip_chunk *chunk = ntfsrec_zip_filling(zip);
+    
+    /* The method is picked from the first chunk, which is when the local header goes out */
+    if (!zip->header_written) {
+        if (zip->level == 0 || ntfsrec_zip_is_compressed(&zip->names[zip->current->name], chunk->input, chunk->input_length))
+            zip->current->method = NR_ZIP_STORED;
+        else
+            zip->current->method = NR_ZIP_DEFLATED;
+        
+        ntfsrec_zip_write_local_header(zip);
+    }
+    
+    if (zip->current->method == NR_ZIP_STORED) {
+        ntfsrec_zip_output(zip, chunk->input, chunk->input_length);
+        zip->current->compressed_size += chunk->input_length;
+        chunk->input_length = 0;
+        return;
+    }
+    
+    memcpy(chunk->dictionary, zip->tail, zip->tail_length);
+    chunk->dictionary_length = zip->tail_length;
+    chunk->last = last;
+    chunk->done = NR_FALSE;
+    
+    if (chunk->input_length >= NR_ZIP_DICTIONARY_SIZE) {
+        memcpy(zip->tail, &chunk->input[chunk->input_length - NR_ZIP_DICTIONARY_SIZE], NR_ZIP_DICTIONARY_SIZE);
+        zip->tail_length = NR_ZIP_DICTIONARY_SIZE;
+    } else {
+        size_t keep = NR_ZIP_DICTIONARY_SIZE - chunk->input_length;
+        
+        if (keep > zip->tail_length)
+            keep = zip->tail_length;
+        
+        memmove(zip->tail, &zip->tail[zip->tail_length - keep], keep);
+        memcpy(&zip->tail[keep], chunk->input, chunk->input_length);
+        zip->tail_length = keep + chunk->input_length;
+    }
+    
+    pthread_mutex_lock(&zip->lock);
+    
+    zip->in_flight++;
+    zip->job_count++;
+    pthread_cond_signal(&zip->work);
+    
+    pthread_mutex_unlock(&zip->lock);
+}
+
+static void ntfsrec_zip_drain(struct ntfsrec_zip *zip) {
+    struct ntfsrec_zip_chunk *chunk = &zip->chunks[zip->head];
+    
+    pthread_mutex_lock(&zip->lock);
+    
+    while(!chunk->done)
+        pthread_cond_wait(&zip->finished, &zip->lock);
+    
+    pthread_mutex_unlock(&zip->lock);
+    
+    if (chunk->failed) {
+        printf("Error: compression failed for %s\n", &zip->names[zip->current->name]);
+        zip->failed = NR_TRUE;
+    }
+    
+    ntfsrec_zip_output(zip, chunk->output, chunk->output_length);
+    zip->current->compressed_size += chunk->output_length;
+    
+    chunk->input_length = 0;
+    zip->head = (zip->head + 1) % zip->chunk_count;
+    zip->in_flight--;
+}
+
+static void ntfsrec_zip_write_local_header(struct ntfsrec_zip *zip) {
+    struct ntfsrec_zip_entry *entry = zip->current;
+    const char *name = &zip->names[entry->name];
+    unsigned char header[30 + 20], *out = header;
+    
+    entry->offset = zip->offset;
+    zip->header_written = NR_TRUE;
+    
+    out = ntfsrec_zip_put32(out, 0x04034b50);
+    out = ntfsrec_zip_put16(out, NR_ZIP_VERSION);
+    out = ntfsrec_zip_put16(out, NR_ZIP_FLAGS);
+    out = ntfsrec_zip_put16(out, entry->method);
+    out = ntfsrec_zip_put16(out, entry->dos_time);
+    out = ntfsrec_zip_put16(out, entry->dos_date);
+    out = ntfsrec_zip_put32(out, 0);
+    out = ntfsrec_zip_put32(out, (uint32_t)NR_ZIP_MAX_32);
+    out = ntfsrec_zip_put32(out, (uint32_t)NR_ZIP_MAX_32);
+    out = ntfsrec_zip_put16(out, strlen(name));
+    out = ntfsrec_zip_put16(out, 20);
+    
+    ntfsrec_zip_output(zip, header, out - header);
+    ntfsrec_zip_output(zip, name, strlen(name));
+    
+    /* The ZIP64 extra field tells readers the data descriptor holds 64 bit sizes */
+    out = header;
+    out = ntfsrec_zip_put16(out, 0x0001);
+    out = ntfsrec_zip_put16(out, 16);
+    out = ntfsrec_zip_put64(out, 0);
+    out = ntfsrec_zip_put64(out, 0);
+    
+    ntfsrec_zip_output(zip, header, out - header);
+}
+
+static void ntfsrec_zip_write_central_directory(struct ntfsrec_zip *zip) {
+    const uint64_t directory_offset = zip->offset;
+    uint64_t directory_size, end_offset;
+    unsigned char record[56 + 28], *out;
+    size_t index;
+    
+    for(index = 0; index < zip->entry_count; ++index) {
+        const struct ntfsrec_zip_entry *entry = &zip->entries[index];
+        const char *name = &zip->names[entry->name];
+        unsigned char extra[28], *extra_out = extra + 4;
+        
+        /* Only the values that don't fit in 32 bits go in the ZIP64 extra field, in this order */
+        if (entry->size >= NR_ZIP_MAX_32)
+            extra_out = ntfsrec_zip_put64(extra_out, entry->size);
+        
+        if (entry->compressed_size >= NR_ZIP_MAX_32)
+            extra_out = ntfsrec_zip_put64(extra_out, entry->compressed_size);
+        
+        if (entry->offset >= NR_ZIP_MAX_32)
+            extra_out = ntfsrec_zip_put64(extra_out, entry->offset);
+        
+        ntfsrec_zip_put16(extra, 0x0001);
+        ntfsrec_zip_put16(extra + 2, extra_out - extra - 4);
+        
+        out = record;
+        out = ntfsrec_zip_put32(out, 0x02014b50);
+        out = ntfsrec_zip_put16(out, (3 << 8) | NR_ZIP_VERSION);
+        out = ntfsrec_zip_put16(out, NR_ZIP_VERSION);
+        out = ntfsrec_zip_put16(out, NR_ZIP_FLAGS);
+        out = ntfsrec_zip_put16(out, entry->method);
+        out = ntfsrec_zip_put16(out, entry->dos_time);
+        out = ntfsrec_zip_put16(out, entry->dos_date);
+        out = ntfsrec_zip_put32(out, entry->crc);
+        out = ntfsrec_zip_put32(out, entry->compressed_size >= NR_ZIP_MAX_32 ? NR_ZIP_MAX_32 : entry->compressed_size);
+        out = ntfsrec_zip_put32(out, entry->size >= NR_ZIP_MAX_32 ? NR_ZIP_MAX_32 : entry->size);
+        out = ntfsrec_zip_put16(out, strlen(name));
+        out = ntfsrec_zip_put16(out, extra_out - extra > 4 ? extra_out - extra : 0);
+        out = ntfsrec_zip_put16(out, 0);
+        out = ntfsrec_zip_put16(out, 0);
+        out = ntfsrec_zip_put16(out, 0);
+        
+        /* Unix permissions in the high half, the MS-DOS directory bit in the low one */
+        out = ntfsrec_zip_put32(out, entry->is_dir ? (040755U << 16) | 0x10 : 0100644U << 16);
+        out = ntfsrec_zip_put32(out, entry->offset >= NR_ZIP_MAX_32 ? NR_ZIP_MAX_32 : entry->offset);
+        
+        ntfsrec_zip_output(zip, record, out - record);
+        ntfsrec_zip_output(zip, name, strlen(name));
+        
+        if (extra_out - extra > 4)
+            ntfsrec_zip_output(zip, extra, extra_out - extra);
+    }
+    
+    directory_size = zip->offset - directory_offset;
+    end_offset = zip->offset;
+    
+    out = record;
+    out = ntfsrec_zip_put32(out, 0x06064b50);
+    out = ntfsrec_zip_put64(out, 44);
+    out = ntfsrec_zip_put16(out, (3 << 8) | NR_ZIP_VERSION);
+    out = ntfsrec_zip_put16(out, NR_ZIP_VERSION);
+    out = ntfsrec_zip_put32(out, 0);
+    out = ntfsrec_zip_put32(out, 0);
+    out = ntfsrec_zip_put64(out, zip->entry_count);
+    out = ntfsrec_zip_put64(out, zip->entry_count);
+    out = ntfsrec_zip_put64(out, directory_size);
+    out = ntfsrec_zip_put64(out, directory_offset);
+    
+    out = ntfsrec_zip_put32(out, 0x07064b50);
+    out = ntfsrec_zip_put32(out, 0);
+    out = ntfsrec_zip_put64(out, end_offset);
+    out = ntfsrec_zip_put32(out, 1);
+    
+    ntfsrec_zip_output(zip, record, out - record);
+    
+    out = record;
+    out = ntfsrec_zip_put32(out, 0x06054b50);
+    out = ntfsrec_zip_put16(out, 0);
+    out = ntfsrec_zip_put16(out, 0);
+    out = ntfsrec_zip_put16(out, zip->entry_count >= NR_ZIP_MAX_16 ? NR_ZIP_MAX_16 : zip->entry_count);
+    out = ntfsrec_zip_put16(out, zip->entry_count >= NR_ZIP_MAX_16 ? NR_ZIP_MAX_16 : zip->entry_count);
+    out = ntfsrec_zip_put32(out, directory_size >= NR_ZIP_MAX_32 ? NR_ZIP_MAX_32 : directory_size);
+    out = ntfsrec_zip_put32(out, directory_offset >= NR_ZIP_MAX_32 ? NR_ZIP_MAX_32 : directory_offset);
+    out = ntfsrec_zip_put16(out, 0);
+    
+    ntfsrec_zip_output(zip, record, out - record);
+}
+
+static struct ntfsrec_zip_entry *ntfsrec_zip_add_entry(struct ntfsrec_zip *zip, const char *name, time_t modified) {
+    struct ntfsrec_zip_entry *entry;
+    size_t name_length = strlen(name);
+    struct tm *local = localtime(&modified);
+    
+    if (zip->entry_count == zip->entry_capacity) {
+        zip->entry_capacity = zip->entry_capacity ? zip->entry_capacity * 2 : 1024;
+        zip->entries = ntfsrec_reallocate(zip->entries, zip->entry_capacity * sizeof *zip->entries);
+    }
+    
+    while(zip->names_capacity - zip->names_length < name_length + 1) {
+        zip->names_capacity = zip->names_capacity ? zip->names_capacity * 2 : 65536;
+        zip->names = ntfsrec_reallocate(zip->names, zip->names_capacity);
+    }
+    
+    entry = &zip->entries[zip->entry_count++];
+    memset(entry, 0, sizeof *entry);
+    
+    entry->name = zip->names_length;
+    memcpy(&zip->names[zip->names_length], name, name_length + 1);
+    zip->names_length += name_length + 1;
+    
+    entry->crc = crc32(0, NULL, 0);
+    
+    /* MS-DOS timestamps start in 1980 and have two second resolution */
+    if (local != NULL && local->tm_year >= 80) {
+        entry->dos_time = (local->tm_hour << 11) | (local->tm_min << 5) | (local->tm_sec / 2);
+        entry->dos_date = ((local->tm_year - 80) << 9) | ((local->tm_mon + 1) << 5) | local->tm_mday;
+    } else {
+        entry->dos_time = 0;
+        entry->dos_date = (1 << 5) | 1;
+    }
+    
+    return entry;
+}
+
+static int ntfsrec_zip_is_compressed(const char *name, const unsigned char *data, size_t length) {
+    static const char *extensions[] = {
+        "zip", "gz", "tgz", "bz2", "xz", "7z", "rar", "zst", "lz4", "cab", "jar", "apk",
+        "docx", "xlsx", "pptx", "odt", "ods", "odp", "epub",
+        "jpg", "jpeg", "png", "gif", "webp", "heic",
+        "mp3", "m4a", "aac", "ogg", "flac", "opus", "wma",
+        "mp4", "m4v", "mov", "mkv", "avi", "webm", "wmv",
+        NULL
+    };
+    const char *extension = strrchr(name, '.');
+    unsigned int index;
+    
+    if (extension != NULL && strchr(extension, '/') == NULL) {
+        for(index = 0; extensions[index] != NULL; ++index) {
+            if (strcasecmp(extension + 1, extensions[index]) == 0)
+                return NR_TRUE;
+        }
+    }
+    
+    /* Renamed or extensionless files are caught by the signature of the common formats */
+    if (length >= 6) {
+        if (memcmp(data, "PK\3\4", 4) == 0 || memcmp(data, "\x1f\x8b", 2) == 0 || memcmp(data, "BZh", 3) == 0 ||
+            memcmp(data, "\xfd" "7zXZ", 5) == 0 || memcmp(data, "7z\xbc\xaf", 4) == 0 ||
+            memcmp(data, "Rar!", 4) == 0 || memcmp(data, "\x28\xb5\x2f\xfd", 4) == 0 ||
+            memcmp(data, "\xff\xd8\xff", 3) == 0 || memcmp(data, "\x89PNG", 4) == 0 || memcmp(data, "GIF8", 4) == 0 ||
+            memcmp(data, "OggS", 4) == 0 || memcmp(data, "fLaC", 4) == 0)
+            return NR_TRUE;
+    }
+    
+    if (length >= 12 && (memcmp(&data[4], "ftyp", 4) == 0 || (memcmp(data, "RIFF", 4) == 0 && memcmp(&data[8], "WEBP", 4) == 0)))
+        return NR_TRUE;
+    
+    return NR_FALSE;
+}
+
+static void ntfsrec_zip_output(struct ntfsrec_zip *zip, const void *data, size_t length) {
+    if (length > 0 && fwrite(data, 1, length, zip->file) != length) {
+        if (!zip->failed)
+            puts("Error: unable to write to the archive");
+        
+        zip->failed = NR_TRUE;
+    }
+    
+    zip->offset += length;
+}
+
+static unsigned char *ntfsrec_zip_put16(unsigned char *out, uint16_t value) {
+    out[0] = value & 0xFF;
+    out[1] = value >> 8;
+    
+    return out + 2;
+}
+
+static unsigned char *ntfsrec_zip_put32(unsigned char *out, uint32_t value) {
+    out = ntfsrec_zip_put16(out, value & 0xFFFF);
+    
+    return ntfsrec_zip_put16(out, value >> 16);
+}
+
+static unsigned char *ntfsrec_zip_put64(unsigned char *out, uint64_t value) {
+    out = ntfsrec_zip_put32(out, value & 0xFFFFFFFF);
+    
+    return ntfsrec_zip_put32(out, value >> 32);
+}
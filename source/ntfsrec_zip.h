@@ -0,0 +1,30 @@
+/*
+ * ntfsrec - Recovery utility for damaged NTFS filesystems
+ * Andrew Watts - 2015 <andrew@andrewwatts.info>
+ */
+
+#ifndef _NTFSREC_ZIP_H
+#define _NTFSREC_ZIP_H
+
+#include <time.h>
+
+struct ntfsrec_zip;
+
+/*
+ * Streams a ZIP64 archive to file_name. File data is cut into chunks that are deflated on threads
+ * worker threads and written back in order, so nothing is staged on disk and sizes needn't be known.
+ */
+struct ntfsrec_zip *ntfsrec_zip_create(const char *file_name, unsigned int threads, int level);
+
+/* Writes the central directory and closes the archive, returns NR_FALSE if any write failed */
+int ntfsrec_zip_close(struct ntfsrec_zip *zip);
+
+/* Adds an empty directory entry, name is relative to the archive root and ends in / */
+int ntfsrec_zip_add_directory(struct ntfsrec_zip *zip, const char *name, time_t modified);
+
+/* Starts a file entry, its data is passed to ntfsrec_zip_write and finished by ntfsrec_zip_end_file */
+int ntfsrec_zip_begin_file(struct ntfsrec_zip *zip, const char *name, time_t modified);
+int ntfsrec_zip_write(struct ntfsrec_zip *zip, const void *data, size_t length);
+int ntfsrec_zip_end_file(struct ntfsrec_zip *zip);
+
+#endif